@@ -4,24 +4,81 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 CPP_SRCS += \
+../src/allocaudit.cpp \
+../src/amplifier.cpp \
+../src/capture.cpp \
+../src/clientsession-atm.cpp \
 ../src/clientsession-cmdline.cpp \
+../src/clientsession-profile.cpp \
 ../src/clientsession.cpp \
+../src/framepool.cpp \
+../src/handoff.cpp \
+../src/impairment.cpp \
+../src/listeners.cpp \
+../src/loopmonitor.cpp \
+../src/overload.cpp \
+../src/partitionedrepo.cpp \
+../src/profiler.cpp \
+../src/reconcile.cpp \
 ../src/reportwriter.cpp \
 ../src/resultsrepo.cpp \
+../src/rxtimestamp.cpp \
+../src/scriptedsession.cpp \
+../src/telemetry.cpp \
+../src/timerqueue.cpp \
+../src/toptalkers.cpp \
 ../src/xm2m-server.cpp 
 
 OBJS += \
+./src/allocaudit.o \
+./src/amplifier.o \
+./src/capture.o \
+./src/clientsession-atm.o \
 ./src/clientsession-cmdline.o \
+./src/clientsession-profile.o \
 ./src/clientsession.o \
+./src/framepool.o \
+./src/handoff.o \
+./src/impairment.o \
+./src/listeners.o \
+./src/loopmonitor.o \
+./src/overload.o \
+./src/partitionedrepo.o \
+./src/profiler.o \
+./src/reconcile.o \
 ./src/reportwriter.o \
 ./src/resultsrepo.o \
+./src/rxtimestamp.o \
+./src/scriptedsession.o \
+./src/telemetry.o \
+./src/timerqueue.o \
+./src/toptalkers.o \
 ./src/xm2m-server.o 
 
 CPP_DEPS += \
+./src/allocaudit.d \
+./src/amplifier.d \
+./src/capture.d \
+./src/clientsession-atm.d \
 ./src/clientsession-cmdline.d \
+./src/clientsession-profile.d \
 ./src/clientsession.d \
+./src/framepool.d \
+./src/handoff.d \
+./src/impairment.d \
+./src/listeners.d \
+./src/loopmonitor.d \
+./src/overload.d \
+./src/partitionedrepo.d \
+./src/profiler.d \
+./src/reconcile.d \
 ./src/reportwriter.d \
 ./src/resultsrepo.d \
+./src/rxtimestamp.d \
+./src/scriptedsession.d \
+./src/telemetry.d \
+./src/timerqueue.d \
+./src/toptalkers.d \
 ./src/xm2m-server.d 
 
 
@@ -29,7 +86,7 @@ CPP_DEPS += \
 src/%.o: ../src/%.cpp
 	@echo 'Building file: $<'
 	@echo 'Invoking: GCC C++ Compiler'
-	g++ -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@)" -o "$@" "$<"
+	g++ -DXM2M_ALLOC_AUDIT=1 -O0 -g3 -Wall -c -fmessage-length=0 -std=c++20 -pthread -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@)" -o "$@" "$<"
 	@echo 'Finished building: $<'
 	@echo ' '
 
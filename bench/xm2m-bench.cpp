@@ -0,0 +1,1377 @@
+//============================================================================
+// Name        : xm2m-bench.cpp
+// Author      : Jonathan Somers
+// Version     : 0.0
+// Copyright   : Copyright (C) 2019 by Jonathan Somers
+// Description : Microbenchmarks for xm2m-server's hot paths
+//============================================================================
+
+/*
+ * Each benchmark is timed by first doubling its iteration count until one run takes a
+ * measurable amount of time, then repeating the calibrated run several times and keeping
+ * the median. Results are written to stdout as one JSON object per line, so two builds
+ * can be compared with nothing fancier than diff, jq or a spreadsheet:
+ *
+ *   {"benchmark":"StoreRecord","param":"repoSize=1000","iterations":...,"nsPerOp":...,"opsPerSec":...}
+ *
+ * Anything else (progress, warnings) goes to stderr. The server's own chatter on cout is
+ * discarded while benchmarks run, since it would otherwise dominate every measurement.
+ *
+ * usage: xm2m-bench [filter]   - only runs benchmarks whose name contains filter
+ *
+ * AmplifiedReply measures reply amplification throughput over TCP loopback, with and without
+ * MSG_ZEROCOPY, for replies from 1 KB to 10 MB. Its "ops" are bytes, so opsPerSec is bytes/sec.
+ * (Loopback always ends up copying zero-copy sends, so expect the real gain on a NIC to be larger.)
+ *
+ * ScriptStep measures one request/reply step of a coroutine-scripted session, round-robin
+ * across many concurrent sessions, and checks that the steps never allocate a coroutine frame.
+ *
+ * TopTalkers measures one Space-Saving update (requests and bytes) per transaction, for a few
+ * busy clients, for a skewed mix of busy and one-off clients, and for a flood of distinct
+ * clients in which nearly every transaction evicts somebody.
+ *
+ * ListenerLookup measures finding which listener a ready descriptor belongs to, among 2 to 20000
+ * listeners: through the listener table's descriptor index, and (for comparison) by scanning
+ * the listeners in turn, as the event loop would without the index.
+ *
+ * ProfileScope measures what one hot-path profiling scope costs, with profiling off (what every
+ * server pays) and on.
+ *
+ * PartitionedRepository measures storing records from many clients into a repository partitioned
+ * by client, and visiting one client's records with and without partitions (without, it's a
+ * scan of the whole repository). It also checks that a flooding client can't evict a quiet
+ * client's records, nor take anybody below the minimum, and that each client's records come
+ * back oldest first, even after a crowd of clients far bigger than the pool has churned it.
+ *
+ * Reconcile measures the sort-merge join of a client's batch against a full repository, per
+ * batch entry, for batches of 10,000 and 100,000 (most of them matching a record, some not),
+ * and checks every entry comes out as it should.
+ *
+ * AllocationAudit is a check rather than a benchmark: after a warm-up, it drives thousands of
+ * transactions through UDP, stream and scripted sessions with the allocation audit on, and fails
+ * if any of them touched the heap. (It first makes sure the audit can see an allocation at all.)
+ * It needs the counting allocator, so only xm2m-bench-audit runs it; xm2m-bench skips it.
+ *
+ * RepositoryStress is a correctness check as much as a benchmark: one thread stores records
+ * as fast as it can while several others read the repository, and every record read is checked
+ * for consistency. xm2m-bench exits non-zero if a torn record ever gets through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+#include <streambuf>
+#include <atomic>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include "../src/allocaudit.h"
+#include "../src/amplifier.h"
+#include "../src/clientsession.h"
+#include "../src/framepool.h"
+#include "../src/listeners.h"
+#include "../src/partitionedrepo.h"
+#include "../src/profiler.h"
+#include "../src/reconcile.h"
+#include "../src/reportwriter.h"
+#include "../src/resultsrepo.h"
+#include "../src/scriptedsession.h"
+#include "../src/rxtimestamp.h"
+#include "../src/timeutil.h"
+#include "../src/toptalkers.h"
+
+/*
+ * Globals the server's modules expect xm2m-server.cpp to define
+ */
+
+int transactionPort = 9900;
+bool stopServer = false;
+ScriptedSession *scriptedSession = NULL;
+
+#define TRIALS				5
+#define TARGET_TRIAL_NS		(200 * NANOS_PER_MSEC)
+#define MIN_CALIBRATE_NS	(10 * NANOS_PER_MSEC)
+
+/*
+ * A streambuf that throws everything away, for silencing cout and for giving the report
+ * writers somewhere to write that costs (almost) nothing.
+ */
+
+class NullBuffer : public streambuf
+{
+protected:
+	int overflow(int c) { return c; }
+	streamsize xsputn(const char *, streamsize n) { return n; }
+};
+
+static NullBuffer nullBuffer;
+static ostream nullStream(&nullBuffer);
+
+/*
+ * The harness. A benchmark body performs 'iterations' operations; opsPerIteration lets a
+ * body that handles many items per call (a whole report, say) be reported per item.
+ */
+
+typedef void (*BenchmarkBody)(void *context, uint64_t iterations);
+
+static const char *filter = NULL;
+
+static uint64_t TimeRun(BenchmarkBody body, void *context, uint64_t iterations)
+{
+	uint64_t start = MonotonicNanoseconds();
+	body(context, iterations);
+	return MonotonicNanoseconds() - start;
+}
+
+static int CompareUint64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static void RunBenchmark(
+	const char *name,
+	const char *param,
+	BenchmarkBody body,
+	void *context,
+	uint64_t opsPerIteration
+){
+	if ((filter != NULL) && (strstr(name, filter) == NULL))
+	{
+		return;
+	}
+	cerr << "Running " << name << " (" << param << ")..." << endl;
+
+	// calibrate: double until a run is long enough to time, then scale up to the target
+
+	uint64_t iterations = 1;
+	uint64_t elapsed = TimeRun(body, context, iterations);
+	while (elapsed < MIN_CALIBRATE_NS)
+	{
+		iterations *= 2;
+		elapsed = TimeRun(body, context, iterations);
+	}
+	iterations = (iterations * TARGET_TRIAL_NS) / ((elapsed > 0) ? elapsed : 1);
+	if (iterations == 0)
+	{
+		iterations = 1;
+	}
+
+	uint64_t trials[TRIALS];
+	for (int i = 0; i < TRIALS; i++)
+	{
+		trials[i] = TimeRun(body, context, iterations);
+	}
+	qsort(trials, TRIALS, sizeof(trials[0]), CompareUint64);
+
+	uint64_t ops = iterations * opsPerIteration;
+	double nsPerOp = (double)trials[TRIALS / 2] / (double)ops;
+	double bestNsPerOp = (double)trials[0] / (double)ops;
+
+	printf("{\"benchmark\":\"%s\",\"param\":\"%s\",\"iterations\":%llu,\"ops\":%llu,"
+		"\"nsPerOp\":%.2f,\"bestNsPerOp\":%.2f,\"opsPerSec\":%.0f}\n",
+		name, param, (unsigned long long)iterations, (unsigned long long)ops,
+		nsPerOp, bestNsPerOp, 1e9 / nsPerOp);
+	fflush(stdout);
+}
+
+static void FillRecord(TestRecord &record, unsigned int transactionNumber)
+{
+	memset(&record, 0, sizeof(record));
+	record.transactionNumber = transactionNumber;
+	gettimeofday(&record.startTime, NULL);
+	record.queueNs = 12345;
+	record.receivedNs = MonotonicNanoseconds();
+	record.sentNs = record.receivedNs + 20000;
+	record.ipAddress.s_addr = htonl(0x7f000001);
+	record.port = htons(40000 + (transactionNumber % 1000));
+	snprintf(record.dataReceived, sizeof(record.dataReceived), "transaction request %u", transactionNumber);
+	snprintf(record.dataSent, sizeof(record.dataSent), "TRANSACTION REQUEST %u", transactionNumber);
+	record.replyBytes = strlen(record.dataSent);
+}
+
+/*
+ * ResultsRepository::StoreRecord
+ */
+
+typedef struct _RepoContext
+{
+	ResultsRepository *repo;
+	TestRecord record;
+} RepoContext;
+
+static void StoreRecordBody(void *context, uint64_t iterations)
+{
+	RepoContext *c = (RepoContext *)context;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		c->record.transactionNumber++;
+		c->repo->StoreRecord(c->record);
+	}
+}
+
+/*
+ * ResultsRepository::WriteReport, once per report format
+ */
+
+typedef struct _ReportContext
+{
+	ResultsRepository *repo;
+	ReportWriter *writer;
+} ReportContext;
+
+static void WriteReportBody(void *context, uint64_t iterations)
+{
+	ReportContext *c = (ReportContext *)context;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		c->repo->WriteReport(*(c->writer));
+	}
+}
+
+typedef struct _ReportFormat
+{
+	const char *name;
+	ReportWriter *(*create)(ostream &of);
+} ReportFormat;
+
+static ReportWriter *CreateHtmlWriter(ostream &of) { return new ReportWriter(of); }
+
+static const ReportFormat reportFormats[] = {
+	{ "html",	CreateHtmlWriter },
+	{ NULL,		NULL }
+};
+
+/*
+ * ClientSession::TransformPayload
+ */
+
+typedef struct _TransformContext
+{
+	ClientSession *session;
+	char request[RX_BUFFER_SIZE];
+	char reply[RX_BUFFER_SIZE];
+	int length;
+} TransformContext;
+
+static void TransformBody(void *context, uint64_t iterations)
+{
+	TransformContext *c = (TransformContext *)context;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		c->session->TransformPayload(c->request, c->reply, c->length);
+	}
+}
+
+/*
+ * ClientSession::MessageReceived end to end: a client socket sends a request, the session
+ * receives, transforms, replies and records it, and the client reads the reply. No real
+ * network or clients are involved - just loopback UDP, or a Unix stream socketpair standing
+ * in for an accepted TCP session.
+ */
+
+typedef struct _SessionContext
+{
+	ClientSession *session;
+	int serverSocket;
+	int clientSocket;
+	struct sockaddr_in serverAddress;	// only used for UDP
+	bool udp;
+} SessionContext;
+
+static void MessageReceivedBody(void *context, uint64_t iterations)
+{
+	SessionContext *c = (SessionContext *)context;
+	char request[64];
+	char reply[RX_BUFFER_SIZE];
+	int length = snprintf(request, sizeof(request), "benchmark transaction request");
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		if (c->udp)
+		{
+			sendto(c->clientSocket, request, length, 0, (struct sockaddr *)&c->serverAddress, sizeof(c->serverAddress));
+		}
+		else
+		{
+			send(c->clientSocket, request, length, 0);
+		}
+		c->session->MessageReceived(c->serverSocket);
+		recv(c->clientSocket, reply, sizeof(reply), 0);
+	}
+}
+
+/*
+ * ReplyAmplifier over a TCP loopback connection: a reader thread drains the client end as fast
+ * as it can while we drive the server end the way the main loop would, waiting for POLLOUT
+ * when the socket buffer is full and reaping zero-copy completions on POLLERR.
+ */
+
+typedef struct _AmplifyContext
+{
+	int serverSocket;
+	int clientSocket;
+	size_t bytes;
+} AmplifyContext;
+
+static void AmplifiedReplyBody(void *context, uint64_t iterations)
+{
+	AmplifyContext *c = (AmplifyContext *)context;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		if (amplifier.Start(c->serverSocket, false, NULL, 0, c->bytes, PATTERN_RANDOM) < 0)
+		{
+			return;
+		}
+		while (amplifier.IsSending(c->serverSocket))
+		{
+			struct pollfd pfd;
+			pfd.fd = c->serverSocket;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			poll(&pfd, 1, 1000);
+			if (pfd.revents & POLLERR)
+			{
+				amplifier.ReapCompletions(c->serverSocket);
+			}
+			if ((pfd.revents & POLLOUT) && (amplifier.Continue(c->serverSocket) < 0))
+			{
+				return;
+			}
+		}
+		amplifier.ReapCompletions(c->serverSocket);
+	}
+}
+
+static void DrainSocket(int socket)
+{
+	static char sink[1 << 20];
+	while (recv(socket, sink, sizeof(sink), 0) > 0)
+	{
+	}
+}
+
+static bool OpenTcpPair(AmplifyContext &c)
+{
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener < 0)
+	{
+		return false;
+	}
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	socklen_t size = sizeof(address);
+	if (
+		(bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+		(listen(listener, 1) < 0) ||
+		(getsockname(listener, (struct sockaddr *)&address, &size) < 0)
+	){
+		close(listener);
+		return false;
+	}
+	c.clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+	if ((c.clientSocket < 0) || (connect(c.clientSocket, (struct sockaddr *)&address, sizeof(address)) < 0))
+	{
+		close(listener);
+		return false;
+	}
+	c.serverSocket = accept(listener, NULL, NULL);
+	close(listener);
+	return c.serverSocket >= 0;
+}
+
+static void RunAmplifiedReplies(bool zeroCopy)
+{
+	static const size_t replySizes[] = { 1024, 16 * 1024, 64 * 1024, 1024 * 1024, 10 * 1024 * 1024, 0 };
+	char param[64];
+
+	amplifier.config.zeroCopy = zeroCopy;
+	for (int i = 0; replySizes[i] != 0; i++)
+	{
+		AmplifyContext context;
+		context.bytes = replySizes[i];
+		if (!OpenTcpPair(context))
+		{
+			cerr << "Skipping AmplifiedReply: unable to open a loopback TCP connection" << endl;
+			return;
+		}
+		thread reader(DrainSocket, context.clientSocket);
+		snprintf(param, sizeof(param), "bytes=%zu,zeroCopy=%s", replySizes[i], zeroCopy ? "on" : "off");
+		RunBenchmark("AmplifiedReply", param, AmplifiedReplyBody, &context, replySizes[i]);
+		shutdown(context.serverSocket, SHUT_RDWR);
+		reader.join();
+		amplifier.ForgetSocket(context.serverSocket);
+		close(context.serverSocket);
+		close(context.clientSocket);
+	}
+}
+
+/*
+ * TopTalkers::Record, over a precomputed stream of client addresses
+ */
+
+#define TALKER_STREAM_LENGTH	65536	// a power of two
+
+typedef struct _TalkerContext
+{
+	TopTalkers *talkers;
+	uint32_t *addresses;
+	unsigned int next;
+} TalkerContext;
+
+static void TopTalkersBody(void *context, uint64_t iterations)
+{
+	TalkerContext *c = (TalkerContext *)context;
+	uint64_t now = MonotonicNanoseconds();
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		c->talkers->Record(c->addresses[c->next], 64 + (c->next & 127), now);
+		c->next = (c->next + 1) & (TALKER_STREAM_LENGTH - 1);
+	}
+}
+
+static void RunTopTalkers()
+{
+	static const struct
+	{
+		const char *param;
+		unsigned int busyClients;
+		unsigned int busyPercent;	// the rest come from a pool of oneOffClients
+		unsigned int oneOffClients;
+	} mixes[] = {
+		{ "clients=16",						16,	100,	0 },
+		{ "clients=16+100000,busy=50%",		16,	50,		100000 },
+		{ "clients=1000000",				0,	0,		1000000 },
+		{ NULL,								0,	0,		0 }
+	};
+
+	uint32_t *addresses = (uint32_t *)malloc(TALKER_STREAM_LENGTH * sizeof(uint32_t));
+	srand(29);
+	for (int m = 0; mixes[m].param != NULL; m++)
+	{
+		for (unsigned int i = 0; i < TALKER_STREAM_LENGTH; i++)
+		{
+			unsigned int host;
+			if ((unsigned int)(rand() % 100) < mixes[m].busyPercent)
+			{
+				host = rand() % mixes[m].busyClients;
+			}
+			else
+			{
+				host = mixes[m].busyClients + (rand() % mixes[m].oneOffClients);
+			}
+			addresses[i] = htonl(0x0a000000 + host);
+		}
+
+		TopTalkers talkers;
+		talkers.Init();
+		TalkerContext context;
+		context.talkers = &talkers;
+		context.addresses = addresses;
+		context.next = 0;
+		RunBenchmark("TopTalkers", mixes[m].param, TopTalkersBody, &context, 1);
+	}
+	free(addresses);
+}
+
+/*
+ * ListenerTable: fake descriptors (nothing is opened), looked up in a shuffled order
+ */
+
+#define LOOKUP_STREAM_LENGTH	4096	// a power of two
+
+typedef struct _LookupContext
+{
+	ListenerTable *table;
+	int *sockets;
+	unsigned int next;
+	uint64_t found;
+} LookupContext;
+
+static void LookupIndexBody(void *context, uint64_t iterations)
+{
+	LookupContext *c = (LookupContext *)context;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		Listener *listener = c->table->Find(c->sockets[c->next]);
+		c->found += (listener != NULL) ? listener->port : 0;
+		c->next = (c->next + 1) & (LOOKUP_STREAM_LENGTH - 1);
+	}
+}
+
+static void LookupScanBody(void *context, uint64_t iterations)
+{
+	LookupContext *c = (LookupContext *)context;
+	int count = c->table->Count();
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		int socket = c->sockets[c->next];
+		for (int l = 0; l < count; l++)
+		{
+			if (c->table->At(l).socket == socket)
+			{
+				c->found += c->table->At(l).port;
+				break;
+			}
+		}
+		c->next = (c->next + 1) & (LOOKUP_STREAM_LENGTH - 1);
+	}
+}
+
+static void RunListenerLookups()
+{
+	static const char *portSpecs[] = { "9900", "10000-10099", "10000-19999", NULL };
+	char param[64];
+
+	int *sockets = (int *)malloc(LOOKUP_STREAM_LENGTH * sizeof(int));
+	srand(31);
+	for (int p = 0; portSpecs[p] != NULL; p++)
+	{
+		ListenerTable table;
+		table.AddPorts(portSpecs[p]);
+		if (!table.Init(0))
+		{
+			continue;
+		}
+		for (int l = 0; l < table.Count(); l++)
+		{
+			table.SetSocket(l, 100 + l);
+		}
+		for (unsigned int i = 0; i < LOOKUP_STREAM_LENGTH; i++)
+		{
+			sockets[i] = 100 + (rand() % table.Count());
+		}
+
+		LookupContext context;
+		context.table = &table;
+		context.sockets = sockets;
+		context.next = 0;
+		context.found = 0;
+		snprintf(param, sizeof(param), "listeners=%d,lookup=index", table.Count());
+		RunBenchmark("ListenerLookup", param, LookupIndexBody, &context, 1);
+		snprintf(param, sizeof(param), "listeners=%d,lookup=scan", table.Count());
+		RunBenchmark("ListenerLookup", param, LookupScanBody, &context, 1);
+	}
+	free(sockets);
+}
+
+/*
+ * HotPathProfiler: an empty scope, so all that's measured is the scope itself
+ */
+
+static void ProfileScopeBody(void *context, uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		PROFILE_SCOPE(PHASE_TRANSFORM);
+		__asm__ __volatile__("" ::: "memory");	// keep the loop (and the scope) from being optimized away
+	}
+}
+
+static void RunProfileScopes()
+{
+	profiler.Enable(false);
+	RunBenchmark("ProfileScope", "profiling=off", ProfileScopeBody, NULL, 1);
+	profiler.Enable(true);
+	RunBenchmark("ProfileScope", "profiling=on", ProfileScopeBody, NULL, 1);
+	profiler.Enable(false);
+	profiler.Reset();
+}
+
+/*
+ * PartitionedRepository: clients are 10.0.x.y, numbered from 1
+ */
+
+#define PARTITION_REPO_SIZE		100000
+#define PARTITION_CLIENTS		1000
+
+static in_addr_t ClientAddress(unsigned int client)
+{
+	return htonl(0x0a000000 + client);
+}
+
+typedef struct _PartitionContext
+{
+	ResultsRepository *repo;
+	TestRecord record;
+	unsigned int client;
+	unsigned int visited;
+} PartitionContext;
+
+static void PartitionedStoreBody(void *context, uint64_t iterations)
+{
+	PartitionContext *c = (PartitionContext *)context;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		c->record.transactionNumber++;
+		c->record.ipAddress.s_addr = ClientAddress(1 + (c->record.transactionNumber % PARTITION_CLIENTS));
+		c->repo->StoreRecord(c->record);
+	}
+}
+
+static bool CountVisitor(TestRecord &record, void *context)
+{
+	(*(unsigned int *)context)++;
+	return true;
+}
+
+static void VisitClientBody(void *context, uint64_t iterations)
+{
+	PartitionContext *c = (PartitionContext *)context;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		struct in_addr client;
+		client.s_addr = ClientAddress(1 + (c->client++ % PARTITION_CLIENTS));
+		c->repo->VisitClient(client, CountVisitor, &c->visited);
+	}
+}
+
+typedef struct _OrderCheck
+{
+	unsigned int last;
+	bool ordered;
+} OrderCheck;
+
+static bool OrderVisitor(TestRecord &record, void *context)
+{
+	OrderCheck *check = (OrderCheck *)context;
+	if (record.transactionNumber <= check->last)
+	{
+		check->ordered = false;
+	}
+	check->last = record.transactionNumber;
+	return true;
+}
+
+static bool CheckFairness()
+{
+	static const unsigned int poolSize = 1000;
+	static const unsigned int minimum = 10;
+	static const unsigned int quietClients = 50;
+	static const unsigned int quietRecords = 15;
+	static const unsigned int newClients = 40;		// so every client can have its minimum
+	static const unsigned int newRecords = 12;
+	bool fair = true;
+
+	PartitionedRepository repo;
+	repo.config.enabled = true;
+	repo.config.minPerClient = minimum;
+	repo.Init(poolSize);
+
+	// quiet clients first, then a flood from client 0, then a crowd of newcomers
+
+	TestRecord record;
+	unsigned int transaction = 0;
+	FillRecord(record, 0);
+	for (unsigned int r = 0; r < quietRecords; r++)
+	{
+		for (unsigned int c = 1; c <= quietClients; c++)
+		{
+			record.transactionNumber = ++transaction;
+			record.ipAddress.s_addr = ClientAddress(c);
+			repo.StoreRecord(record);
+		}
+	}
+	record.ipAddress.s_addr = ClientAddress(0);
+	for (unsigned int r = 0; r < 100 * poolSize; r++)
+	{
+		record.transactionNumber = ++transaction;
+		repo.StoreRecord(record);
+	}
+	for (unsigned int c = 1; c <= quietClients; c++)
+	{
+		struct in_addr client;
+		client.s_addr = ClientAddress(c);
+		if (repo.ClientRecords(client) != quietRecords)
+		{
+			cerr << "PartitionedRepository: a flood took quiet client " << c << " down to "
+				 << repo.ClientRecords(client) << " records" << endl;
+			fair = false;
+		}
+	}
+
+	for (unsigned int r = 0; r < newRecords; r++)
+	{
+		for (unsigned int c = quietClients + 1; c <= quietClients + newClients; c++)
+		{
+			record.transactionNumber = ++transaction;
+			record.ipAddress.s_addr = ClientAddress(c);
+			repo.StoreRecord(record);
+		}
+	}
+
+	unsigned int total = 0;
+	for (unsigned int c = 0; c <= quietClients + newClients; c++)
+	{
+		struct in_addr client;
+		client.s_addr = ClientAddress(c);
+		unsigned int stored = (c == 0) ? 100 * poolSize : ((c <= quietClients) ? quietRecords : newRecords);
+		unsigned int held = repo.ClientRecords(client);
+		OrderCheck check;
+		check.last = 0;
+		check.ordered = true;
+		unsigned int visited = repo.VisitClient(client, OrderVisitor, &check);
+		if ((held < ((stored < minimum) ? stored : minimum)) || (visited != held) || !check.ordered)
+		{
+			cerr << "PartitionedRepository: client " << c << " holds " << held << " records (" << visited
+				 << " visited" << (check.ordered ? "" : ", out of order") << ")" << endl;
+			fair = false;
+		}
+		total += held;
+	}
+	if (total != poolSize)
+	{
+		cerr << "PartitionedRepository: clients hold " << total << " records, not " << poolSize << endl;
+		fair = false;
+	}
+
+	// finally, far more clients than there's room for, to churn the partitions
+
+	static const unsigned int crowd = 5000;
+	srand(47);
+	for (unsigned int r = 0; r < 20 * poolSize; r++)
+	{
+		record.transactionNumber = ++transaction;
+		record.ipAddress.s_addr = ClientAddress(rand() % crowd);
+		repo.StoreRecord(record);
+	}
+	total = 0;
+	for (unsigned int c = 0; c < crowd; c++)
+	{
+		struct in_addr client;
+		client.s_addr = ClientAddress(c);
+		OrderCheck check;
+		check.last = 0;
+		check.ordered = true;
+		unsigned int held = repo.ClientRecords(client);
+		if ((repo.VisitClient(client, OrderVisitor, &check) != held) || !check.ordered)
+		{
+			cerr << "PartitionedRepository: client " << c << "'s records are linked wrongly" << endl;
+			fair = false;
+		}
+		total += held;
+	}
+	if (total != poolSize)
+	{
+		cerr << "PartitionedRepository: after the churn, clients hold " << total << " records, not " << poolSize << endl;
+		fair = false;
+	}
+	return fair;
+}
+
+static bool RunPartitionedRepository()
+{
+	if ((filter != NULL) && (strstr("PartitionedRepository", filter) == NULL))
+	{
+		return true;
+	}
+	char param[64];
+
+	PartitionedRepository partitioned;
+	partitioned.config.enabled = true;
+	partitioned.config.minPerClient = 10;
+	partitioned.Init(PARTITION_REPO_SIZE);
+	ResultsRepository fifo;
+	fifo.Init(PARTITION_REPO_SIZE);
+
+	ResultsRepository *repos[] = { &partitioned, &fifo };
+	const char *names[] = { "partitioned", "fifo" };
+	for (int r = 0; r < 2; r++)
+	{
+		PartitionContext context;
+		context.repo = repos[r];
+		FillRecord(context.record, 0);
+		context.client = 0;
+		context.visited = 0;
+		snprintf(param, sizeof(param), "store,repoSize=%u,clients=%u,repo=%s", PARTITION_REPO_SIZE, PARTITION_CLIENTS, names[r]);
+		RunBenchmark("PartitionedRepository", param, PartitionedStoreBody, &context, 1);
+		snprintf(param, sizeof(param), "visitClient,repoSize=%u,clients=%u,repo=%s", PARTITION_REPO_SIZE, PARTITION_CLIENTS, names[r]);
+		RunBenchmark("PartitionedRepository", param, VisitClientBody, &context, 1);
+	}
+
+	bool fair = CheckFairness();
+	if (!fair)
+	{
+		cerr << "PartitionedRepository: FAILED" << endl;
+	}
+	return fair;
+}
+
+/*
+ * Reconciler::Join: a batch in which nine entries in ten match a record in the repository, and
+ * the rest were never seen (which, the ring being full, may come out as unknown rather than
+ * missing). Each run joins a fresh copy of the batch, since the join sorts it.
+ */
+
+#define RECONCILE_REPO_SIZE		100000
+
+typedef struct _ReconcileContext
+{
+	ResultsRepository *repo;
+	Reconciler::Entry *batch;
+	Reconciler::Entry *work;
+	unsigned int count;
+	unsigned int expectedReplied;
+	bool correct;
+} ReconcileContext;
+
+static void ReconcileBody(void *context, uint64_t iterations)
+{
+	ReconcileContext *c = (ReconcileContext *)context;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		memcpy(c->work, c->batch, c->count * sizeof(Reconciler::Entry));
+		unsigned int outcomes[RECONCILE_OUTCOMES];
+		struct in_addr client;
+		client.s_addr = htonl(0x7f000001);
+		Reconciler::Join(*c->repo, client, c->work, c->count, 2000000, outcomes);
+		if ((outcomes[RECONCILE_REPLIED] != c->expectedReplied)
+			|| (outcomes[RECONCILE_MISSING] + outcomes[RECONCILE_UNKNOWN] != c->count - c->expectedReplied))
+		{
+			c->correct = false;
+		}
+	}
+}
+
+static bool RunReconciles()
+{
+	if ((filter != NULL) && (strstr("Reconcile", filter) == NULL))
+	{
+		return true;
+	}
+	static const unsigned int batchSizes[] = { 10000, 100000, 0 };
+	char param[64];
+	bool correct = true;
+
+	ResultsRepository repo;
+	repo.Init(RECONCILE_REPO_SIZE);
+	TestRecord *records = (TestRecord *)malloc(RECONCILE_REPO_SIZE * sizeof(TestRecord));
+	for (unsigned int r = 0; r < RECONCILE_REPO_SIZE; r++)
+	{
+		FillRecord(records[r], r + 1);
+		repo.StoreRecord(records[r]);
+	}
+
+	srand(43);
+	for (int b = 0; batchSizes[b] != 0; b++)
+	{
+		ReconcileContext context;
+		context.repo = &repo;
+		context.count = batchSizes[b];
+		context.batch = (Reconciler::Entry *)malloc(context.count * sizeof(Reconciler::Entry));
+		context.work = (Reconciler::Entry *)malloc(context.count * sizeof(Reconciler::Entry));
+		context.expectedReplied = 0;
+		context.correct = true;
+		for (unsigned int e = 0; e < context.count; e++)
+		{
+			Reconciler::Entry &entry = context.batch[e];
+			TestRecord &record = records[(e * 7) % RECONCILE_REPO_SIZE];	// each record at most once
+			entry.timeUs = (int64_t)record.startTime.tv_sec * 1000000 + record.startTime.tv_usec;
+			if ((rand() % 10) != 0)
+			{
+				entry.hash = ReconcileHash(record.dataReceived, RX_BUFFER_SIZE);
+				context.expectedReplied++;
+			}
+			else
+			{
+				entry.hash = ReconcileHash("never sent", 10) + e;
+			}
+			entry.index = e;
+		}
+		snprintf(param, sizeof(param), "entries=%u,records=%u", context.count, RECONCILE_REPO_SIZE);
+		RunBenchmark("Reconcile", param, ReconcileBody, &context, context.count);
+		if (!context.correct)
+		{
+			cerr << "Reconcile: FAILED - entries were matched wrongly" << endl;
+			correct = false;
+		}
+		free(context.batch);
+		free(context.work);
+	}
+	free(records);
+	return correct;
+}
+
+/*
+ * ScriptedSession: a trivial line-echo script, many sessions at once, each on a socketpair.
+ */
+
+class EchoScriptSession : public ScriptedSession
+{
+public:
+	EchoScriptSession() : ScriptedSession("Benchmark script") {}
+
+protected:
+	ScriptTask Run(ScriptConnection &connection)
+	{
+		char line[RX_BUFFER_SIZE];
+		while (1)
+		{
+			int n = co_await connection.RecvLine(line, sizeof(line));
+			if (n <= 0)
+			{
+				co_return;
+			}
+			line[n++] = '\n';
+			if (co_await connection.Send(line, n) < 0)
+			{
+				co_return;
+			}
+		}
+	}
+};
+
+#define SCRIPT_SESSIONS		256
+
+typedef struct _ScriptContext
+{
+	EchoScriptSession *session;
+	int serverSockets[SCRIPT_SESSIONS];
+	int clientSockets[SCRIPT_SESSIONS];
+	int sessions;
+	uint64_t next;
+} ScriptContext;
+
+static void ScriptStepBody(void *context, uint64_t iterations)
+{
+	ScriptContext *c = (ScriptContext *)context;
+	static const char request[] = "benchmark script step\n";
+	char reply[RX_BUFFER_SIZE];
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		int k = (c->next++) % c->sessions;
+		send(c->clientSockets[k], request, sizeof(request) - 1, 0);
+		c->session->MessageReceived(c->serverSockets[k]);
+		recv(c->clientSockets[k], reply, sizeof(reply), 0);
+	}
+}
+
+static bool RunScriptSteps()
+{
+	EchoScriptSession session;
+	if (!session.Init(SCRIPT_SESSIONS))
+	{
+		cerr << "Skipping ScriptStep: unable to set up scripted sessions" << endl;
+		return true;
+	}
+	ScriptContext context;
+	context.session = &session;
+	context.sessions = 0;
+	context.next = 0;
+	for (int i = 0; i < SCRIPT_SESSIONS; i++)
+	{
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		{
+			break;
+		}
+		context.serverSockets[i] = pair[0];
+		context.clientSockets[i] = pair[1];
+		session.ConnectionEstablished(pair[0]);
+		context.sessions++;
+	}
+	if (context.sessions == 0)
+	{
+		cerr << "Skipping ScriptStep: unable to create socketpairs" << endl;
+		return true;
+	}
+
+	uint64_t framesBefore = framePool.Stats().allocations;
+	char param[64];
+	snprintf(param, sizeof(param), "sessions=%d", context.sessions);
+	RunBenchmark("ScriptStep", param, ScriptStepBody, &context, 1);
+	uint64_t framesDuring = framePool.Stats().allocations - framesBefore;
+
+	for (int i = 0; i < context.sessions; i++)
+	{
+		session.ConnectionTerminated(context.serverSockets[i]);
+		close(context.serverSockets[i]);
+		close(context.clientSockets[i]);
+	}
+	if (framesDuring != 0)
+	{
+		cerr << "ScriptStep FAILED: " << framesDuring << " coroutine frames were allocated by script steps" << endl;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * ResultsRepository under concurrent heavy writes and reads. Every field of a stress record is
+ * derived from its transaction number, so a reader can tell whether what it got is one whole
+ * record or a mixture of two.
+ */
+
+#define STRESS_READERS		4
+#define STRESS_REPO_SIZE	64		// small, so the writer laps the readers constantly
+#define STRESS_SECONDS		2
+
+static void FillStressRecord(TestRecord &record, unsigned int transactionNumber)
+{
+	memset(&record, 0, sizeof(record));		// padding too, since records are compared with memcmp()
+	record.transactionNumber = transactionNumber;
+	record.startTime.tv_sec = transactionNumber;
+	record.startTime.tv_usec = transactionNumber % 1000000;
+	record.queueNs = transactionNumber * 3;
+	record.receivedNs = (uint64_t)transactionNumber * 7;
+	record.sentNs = ((uint64_t)transactionNumber * 7) + 5;
+	record.ipAddress.s_addr = transactionNumber;
+	record.port = transactionNumber & 0xffff;
+	memset(record.dataReceived, transactionNumber & 0xff, sizeof(record.dataReceived));
+	memset(record.dataSent, ~transactionNumber & 0xff, sizeof(record.dataSent));
+}
+
+static bool StressRecordIsWhole(TestRecord &record)
+{
+	TestRecord expected;
+	FillStressRecord(expected, record.transactionNumber);
+	return memcmp(&expected, &record, sizeof(TestRecord)) == 0;
+}
+
+typedef struct _StressCounters
+{
+	uint64_t recordsRead;
+	uint64_t corrupt;
+} StressCounters;
+
+static bool StressVisitor(TestRecord &record, void *context)
+{
+	StressCounters *counters = (StressCounters *)context;
+	counters->recordsRead++;
+	if (!StressRecordIsWhole(record))
+	{
+		counters->corrupt++;
+	}
+	return true;
+}
+
+static bool RunRepositoryStress()
+{
+	if ((filter != NULL) && (strstr("RepositoryStress", filter) == NULL))
+	{
+		return true;
+	}
+	cerr << "Running RepositoryStress (" << STRESS_READERS << " readers, " << STRESS_SECONDS << "s)..." << endl;
+
+	ResultsRepository repo;
+	repo.Init(STRESS_REPO_SIZE);
+
+	atomic<bool> stop(false);
+	uint64_t writes = 0;
+	StressCounters counters[STRESS_READERS];
+	memset(counters, 0, sizeof(counters));
+
+	vector<thread> readers;
+	for (int i = 0; i < STRESS_READERS; i++)
+	{
+		readers.push_back(thread([&repo, &stop, &counters, i]() {
+			while (!stop)
+			{
+				repo.VisitRecords(StressVisitor, &counters[i]);
+			}
+		}));
+	}
+
+	uint64_t start = MonotonicNanoseconds();
+	uint64_t end = start + (STRESS_SECONDS * NANOS_PER_SEC);
+	TestRecord record;
+	while (MonotonicNanoseconds() < end)
+	{
+		for (int i = 0; i < 1000; i++)
+		{
+			FillStressRecord(record, (unsigned int)++writes);
+			repo.StoreRecord(record);
+		}
+	}
+	uint64_t elapsed = MonotonicNanoseconds() - start;
+	stop = true;
+	for (size_t i = 0; i < readers.size(); i++)
+	{
+		readers[i].join();
+	}
+
+	StressCounters total;
+	memset(&total, 0, sizeof(total));
+	for (int i = 0; i < STRESS_READERS; i++)
+	{
+		total.recordsRead += counters[i].recordsRead;
+		total.corrupt += counters[i].corrupt;
+	}
+
+	printf("{\"benchmark\":\"RepositoryStress\",\"param\":\"readers=%d,repoSize=%d\",\"writes\":%llu,"
+		"\"nsPerWrite\":%.2f,\"recordsRead\":%llu,\"tornSkipped\":%llu,\"corrupt\":%llu}\n",
+		STRESS_READERS, STRESS_REPO_SIZE, (unsigned long long)writes,
+		(double)elapsed / (double)writes, (unsigned long long)total.recordsRead,
+		(unsigned long long)repo.TornReads(), (unsigned long long)total.corrupt);
+	fflush(stdout);
+
+	if (total.corrupt > 0)
+	{
+		cerr << "RepositoryStress FAILED: " << total.corrupt << " torn records reached a reader" << endl;
+		return false;
+	}
+	return true;
+}
+
+static bool OpenUdpPair(SessionContext &c)
+{
+	c.udp = true;
+	c.serverSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	c.clientSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((c.serverSocket < 0) || (c.clientSocket < 0))
+	{
+		return false;
+	}
+	memset(&c.serverAddress, 0, sizeof(c.serverAddress));
+	c.serverAddress.sin_family = AF_INET;
+	c.serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	c.serverAddress.sin_port = 0;	// let the kernel pick
+	if (bind(c.serverSocket, (struct sockaddr *)&c.serverAddress, sizeof(c.serverAddress)) < 0)
+	{
+		return false;
+	}
+	socklen_t size = sizeof(c.serverAddress);
+	getsockname(c.serverSocket, (struct sockaddr *)&c.serverAddress, &size);
+	EnableReceiveTimestamps(c.serverSocket);	// just as the server would
+	return true;
+}
+
+static bool OpenStreamPair(SessionContext &c)
+{
+	int pair[2];
+	c.udp = false;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+	{
+		return false;
+	}
+	c.serverSocket = pair[0];
+	c.clientSocket = pair[1];
+	EnableReceiveTimestamps(c.serverSocket);
+	return true;
+}
+
+/*
+ * AllocationAudit: the steady state mustn't allocate.
+ */
+
+#define AUDIT_WARMUP			100
+#define AUDIT_TRANSACTIONS		5000
+#define AUDIT_SCRIPT_SESSIONS	16
+
+static bool RunAllocationAudit()
+{
+	if ((filter != NULL) && (strstr("AllocationAudit", filter) == NULL))
+	{
+		return true;
+	}
+	if (!allocAudit.IsAvailable())
+	{
+		cerr << "Skipping AllocationAudit: this build can't audit allocations" << endl;
+		return true;
+	}
+	cerr << "Running AllocationAudit..." << endl;
+
+	// an allocation made on purpose must be seen (through a volatile pointer, so it isn't optimized away)
+
+	void *(*volatile allocate)(size_t) = malloc;
+	allocAudit.Enable(true, 0);
+	{
+		ALLOC_AUDIT_SCOPE();
+		free(allocate(64));
+	}
+	uint64_t seen = allocAudit.Stats().allocations;
+	allocAudit.Enable(false, 0);
+	if (seen != 1)
+	{
+		cerr << "AllocationAudit FAILED: an allocation on the transaction path was counted " << seen << " times" << endl;
+		return false;
+	}
+
+	ClientSession udpSession("Audited session", true);
+	SessionContext udpContext;
+	udpContext.session = &udpSession;
+	ClientSession streamSession("Audited stream session", false);
+	SessionContext streamContext;
+	streamContext.session = &streamSession;
+	if (!OpenUdpPair(udpContext) || !OpenStreamPair(streamContext))
+	{
+		cerr << "Skipping AllocationAudit: unable to open sockets" << endl;
+		return true;
+	}
+
+	EchoScriptSession scriptSession;
+	ScriptContext scriptContext;
+	scriptContext.session = &scriptSession;
+	scriptContext.sessions = 0;
+	scriptContext.next = 0;
+	if (scriptSession.Init(AUDIT_SCRIPT_SESSIONS))
+	{
+		for (int i = 0; i < AUDIT_SCRIPT_SESSIONS; i++)
+		{
+			int pair[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+			{
+				break;
+			}
+			scriptContext.serverSockets[i] = pair[0];
+			scriptContext.clientSockets[i] = pair[1];
+			scriptSession.ConnectionEstablished(pair[0]);
+			scriptContext.sessions++;
+		}
+	}
+
+	allocAudit.Enable(true, AUDIT_WARMUP);
+	MessageReceivedBody(&udpContext, AUDIT_WARMUP + AUDIT_TRANSACTIONS);
+	MessageReceivedBody(&streamContext, AUDIT_TRANSACTIONS);
+	if (scriptContext.sessions > 0)
+	{
+		ScriptStepBody(&scriptContext, AUDIT_TRANSACTIONS);
+	}
+	AllocAuditStats stats = allocAudit.Stats();
+	allocAudit.Enable(false, 0);
+
+	for (int i = 0; i < scriptContext.sessions; i++)
+	{
+		scriptSession.ConnectionTerminated(scriptContext.serverSockets[i]);
+		close(scriptContext.serverSockets[i]);
+		close(scriptContext.clientSockets[i]);
+	}
+	close(udpContext.serverSocket);
+	close(udpContext.clientSocket);
+	close(streamContext.serverSocket);
+	close(streamContext.clientSocket);
+
+	printf("{\"benchmark\":\"AllocationAudit\",\"param\":\"warmup=%d\",\"passes\":%llu,"
+		"\"warmupAllocations\":%llu,\"allocations\":%llu,\"bytes\":%llu}\n",
+		AUDIT_WARMUP, (unsigned long long)stats.passes, (unsigned long long)stats.warmupAllocations,
+		(unsigned long long)stats.allocations, (unsigned long long)stats.bytes);
+	fflush(stdout);
+
+	if (stats.allocations > 0)
+	{
+		char report[1024];
+		allocAudit.Format(report, sizeof(report), MonotonicNanoseconds());
+		cerr << "AllocationAudit FAILED: the transaction path allocated after warm-up\n" << report;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+	{
+		filter = argv[1];
+	}
+
+	streambuf *savedCout = cout.rdbuf(&nullBuffer);	// silence the server's per-message logging
+
+	char param[64];
+	static const unsigned int repoSizes[] = { 1000, 10000, 100000, 0 };
+
+	for (int i = 0; repoSizes[i] != 0; i++)
+	{
+		ResultsRepository repo;
+		repo.Init(repoSizes[i]);
+
+		RepoContext repoContext;
+		repoContext.repo = &repo;
+		FillRecord(repoContext.record, 1);
+		snprintf(param, sizeof(param), "repoSize=%u", repoSizes[i]);
+		RunBenchmark("StoreRecord", param, StoreRecordBody, &repoContext, 1);
+
+		// by now the ring has wrapped, so every report covers the whole repository
+
+		for (int f = 0; reportFormats[f].name != NULL; f++)
+		{
+			ReportContext reportContext;
+			reportContext.repo = &repo;
+			reportContext.writer = reportFormats[f].create(nullStream);
+			snprintf(param, sizeof(param), "format=%s,repoSize=%u", reportFormats[f].name, repoSizes[i]);
+			RunBenchmark("WriteReport", param, WriteReportBody, &reportContext, repoSizes[i]);
+			delete reportContext.writer;
+		}
+	}
+
+	ClientSession session("Benchmark session", true);
+
+	static const int payloadSizes[] = { 16, 64, RX_BUFFER_SIZE, 0 };
+	for (int i = 0; payloadSizes[i] != 0; i++)
+	{
+		TransformContext transformContext;
+		transformContext.session = &session;
+		transformContext.length = payloadSizes[i];
+		for (int j = 0; j < payloadSizes[i]; j++)
+		{
+			transformContext.request[j] = 'a' + (j % 26);
+		}
+		snprintf(param, sizeof(param), "bytes=%d", payloadSizes[i]);
+		RunBenchmark("TransformPayload", param, TransformBody, &transformContext, 1);
+	}
+
+	resultsRepo.Init(1000);
+
+	SessionContext udpContext;
+	udpContext.session = &session;
+	if (OpenUdpPair(udpContext))
+	{
+		RunBenchmark("MessageReceived", "transport=udp-loopback", MessageReceivedBody, &udpContext, 1);
+		close(udpContext.serverSocket);
+		close(udpContext.clientSocket);
+	}
+	else
+	{
+		cerr << "Skipping MessageReceived over UDP: unable to open loopback sockets" << endl;
+	}
+
+	ClientSession streamSession("Benchmark stream session", false);
+	SessionContext streamContext;
+	streamContext.session = &streamSession;
+	if (OpenStreamPair(streamContext))
+	{
+		RunBenchmark("MessageReceived", "transport=stream-socketpair", MessageReceivedBody, &streamContext, 1);
+		close(streamContext.serverSocket);
+		close(streamContext.clientSocket);
+	}
+	else
+	{
+		cerr << "Skipping MessageReceived over a socketpair: unable to create one" << endl;
+	}
+
+	amplifier.config.maxReplyBytes = 10 * 1024 * 1024;
+	if (amplifier.Init())
+	{
+		RunAmplifiedReplies(false);
+		RunAmplifiedReplies(true);
+	}
+	else
+	{
+		cerr << "Skipping AmplifiedReply: unable to set up the amplifier" << endl;
+	}
+
+	RunTopTalkers();
+	RunListenerLookups();
+	RunProfileScopes();
+
+	bool passed = RunScriptSteps();
+	passed = RunRepositoryStress() && passed;
+	passed = RunPartitionedRepository() && passed;
+	passed = RunReconciles() && passed;
+	passed = RunAllocationAudit() && passed;
+
+	cout.rdbuf(savedCout);
+	return passed ? 0 : 1;
+}
+
+// end of xm2m-bench.cpp
@@ -0,0 +1,190 @@
+/*
+ * allocaudit.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "allocaudit.h"
+
+__thread int allocAuditDepth = 0;
+
+AllocationAudit::AllocationAudit()
+{
+	enabled = false;
+	warmup = ALLOC_AUDIT_DEFAULT_WARMUP;
+	Reset();
+}
+
+AllocationAudit::~AllocationAudit()
+{
+}
+
+void AllocationAudit::Enable(bool on, uint64_t warmupPasses)
+{
+	if (on && !enabled)
+	{
+		warmup = warmupPasses;
+		Reset();
+	}
+	enabled = on && IsAvailable();
+}
+
+void AllocationAudit::Reset()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+/*
+ * Called from inside malloc(), so it mustn't allocate - or do much of anything else.
+ */
+
+void AllocationAudit::Allocated(void *caller, size_t size)
+{
+	if (!IsWarm())
+	{
+		stats.warmupAllocations++;
+		return;
+	}
+	stats.allocations++;
+	stats.bytes += size;
+	for (unsigned int c = 0; c < stats.callerCount; c++)
+	{
+		if (stats.callers[c] == caller)
+		{
+			stats.callerAllocations[c]++;
+			return;
+		}
+	}
+	if (stats.callerCount < ALLOC_AUDIT_CALLERS)
+	{
+		stats.callers[stats.callerCount] = caller;
+		stats.callerAllocations[stats.callerCount++] = 1;
+	}
+}
+
+int AllocationAudit::Format(char *buffer, size_t size, uint64_t now)
+{
+	if (!IsAvailable())
+	{
+		return snprintf(buffer, size, "Allocation auditing isn't in this build (it needs XM2M_ALLOC_AUDIT=1 and glibc)\n");
+	}
+
+	int used = snprintf(buffer, size, "Allocation audit is %s; %llu passes along the transaction path (%llu of warm-up)\n"
+		" %llu allocations during warm-up, %llu (%llu bytes) since%s\n",
+		enabled ? "on" : "off", (unsigned long long)stats.passes, (unsigned long long)warmup,
+		(unsigned long long)stats.warmupAllocations, (unsigned long long)stats.allocations,
+		(unsigned long long)stats.bytes, IsWarm() ? "" : " (still warming up)");
+	for (unsigned int c = 0; (c < stats.callerCount) && (used < (int)size); c++)
+	{
+		used += snprintf(buffer + used, size - used, " %10llu from %p\n",
+			(unsigned long long)stats.callerAllocations[c], stats.callers[c]);
+	}
+	return (used < (int)size) ? used : (int)size - 1;
+}
+
+// the sole global instance
+
+AllocationAudit allocAudit;
+
+/*
+ * The replacement allocator: the C library's own, counting calls made on the transaction path.
+ * glibc routes every allocation - its own, and the C++ runtime's - through these, so long as
+ * malloc(), free(), calloc() and realloc() are all replaced together.
+ */
+
+#if ALLOC_AUDIT_AVAILABLE
+
+extern "C"
+{
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *block, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+void __libc_free(void *block);
+
+static inline void Audit(void *caller, size_t size)
+{
+	if (__builtin_expect(allocAuditDepth > 0, 0) && allocAudit.enabled)
+	{
+		allocAudit.Allocated(caller, size);
+	}
+}
+
+void *malloc(size_t size) noexcept
+{
+	Audit(__builtin_return_address(0), size);
+	return __libc_malloc(size);
+}
+
+void free(void *block) noexcept
+{
+	__libc_free(block);
+}
+
+void *calloc(size_t count, size_t size) noexcept
+{
+	Audit(__builtin_return_address(0), count * size);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *block, size_t size) noexcept
+{
+	Audit(__builtin_return_address(0), size);
+	return __libc_realloc(block, size);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept
+{
+	Audit(__builtin_return_address(0), size);
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept
+{
+	Audit(__builtin_return_address(0), size);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **block, size_t alignment, size_t size) noexcept
+{
+	if ((alignment % sizeof(void *)) || (alignment & (alignment - 1)) || (alignment == 0))
+	{
+		return EINVAL;
+	}
+	Audit(__builtin_return_address(0), size);
+	void *aligned = __libc_memalign(alignment, size);
+	if (aligned == NULL)
+	{
+		return ENOMEM;
+	}
+	*block = aligned;
+	return 0;
+}
+
+void *valloc(size_t size) noexcept
+{
+	Audit(__builtin_return_address(0), size);
+	return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size) noexcept
+{
+	Audit(__builtin_return_address(0), size);
+	return __libc_pvalloc(size);
+}
+
+}
+
+#endif
+
+// end of allocaudit.cpp
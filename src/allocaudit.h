@@ -0,0 +1,133 @@
+/*
+ * allocaudit.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * AllocationAudit checks that the server has stopped allocating once it's warmed up. Everything a
+ * transaction needs - session state, pending replies, timers, records, capture buffers, routes -
+ * is meant to come from pools and tables sized from the command line at startup, so that a server
+ * left running for weeks on a small board doesn't fragment its heap or stall in malloc(). Nothing
+ * enforces that, though, and it's easy for a strdup() or a growing table to creep back in. So:
+ *
+ * Builds with XM2M_ALLOC_AUDIT defined as 1 (the Debug build, and bench's xm2m-bench-audit) replace malloc()
+ * and its relatives - and so operator new, strdup() and everything else that allocates - with
+ * thin wrappers around the C library's own, which count every allocation made while the event
+ * loop is on the transaction path: receiving, transforming and answering a request, accepting a
+ * connection, or sending a delayed reply. Those parts of the code are marked with
+ * ALLOC_AUDIT_SCOPE(), which, like PROFILE_SCOPE(), covers the rest of the enclosing block.
+ *
+ * The first warmup passes along the path are allowed to allocate (stdio's buffers, the C library's
+ * first use of this or that); after that, every allocation is a finding. The console's M command
+ * shows how many there have been, and where the first few came from (the address that called
+ * malloc(), for addr2line):
+ *
+ *   M         the counts, and the callers of the allocations after warm-up
+ *   M on [n]  start auditing, allowing n passes of warm-up (or start with --allocAudit n)
+ *   M off     stop
+ *   M reset   start again, with a fresh warm-up
+ *
+ * and an audited server that has allocated after warm-up says so, and exits with
+ * ALLOC_AUDIT_EXIT_CODE, when it stops. xm2m-bench-audit's AllocationAudit check drives a few thousand
+ * transactions through the sessions and fails if any of them allocated.
+ *
+ * Only the event loop's own thread is audited: reconciliation's joins, the C library's asynchronous
+ * I/O threads and so on allocate as they please. So do reconciliation batches on the event loop -
+ * a batch is bulk work, sized by what the client uploads, not a transaction.
+ *
+ * Auditing needs the GNU C library, whose allocator can be replaced this way. Elsewhere, and in
+ * builds without XM2M_ALLOC_AUDIT, the scopes compile to nothing and M just says so.
+ */
+
+#ifndef ALLOCAUDIT_H_
+#define ALLOCAUDIT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef XM2M_ALLOC_AUDIT
+#define XM2M_ALLOC_AUDIT	0
+#endif
+
+#if XM2M_ALLOC_AUDIT && defined(__GLIBC__)
+#define ALLOC_AUDIT_AVAILABLE	1
+#else
+#define ALLOC_AUDIT_AVAILABLE	0
+#endif
+
+#define ALLOC_AUDIT_CALLERS			8		// distinct callers remembered after warm-up
+#define ALLOC_AUDIT_DEFAULT_WARMUP	1000
+#define ALLOC_AUDIT_EXIT_CODE		3
+
+typedef struct _AllocAuditStats
+{
+	uint64_t passes;				// along the transaction path, warm-up included
+	uint64_t warmupAllocations;
+	uint64_t allocations;			// after warm-up
+	uint64_t bytes;
+	unsigned int callerCount;
+	void *callers[ALLOC_AUDIT_CALLERS];
+	uint64_t callerAllocations[ALLOC_AUDIT_CALLERS];
+} AllocAuditStats;
+
+class AllocationAudit
+{
+public:
+	AllocationAudit();
+	virtual ~AllocationAudit();
+
+	bool IsAvailable() { return ALLOC_AUDIT_AVAILABLE; }
+	void Enable(bool on, uint64_t warmupPasses);
+	void Reset();
+	bool IsEnabled() { return enabled; }
+	bool IsWarm() { return stats.passes > warmup; }
+
+	void Allocated(void *caller, size_t size);	// from the allocator, on the transaction path
+
+	int Format(char *buffer, size_t size, uint64_t now);
+	const AllocAuditStats& Stats() { return stats; }
+
+	bool enabled;		// public so that scopes test it inline
+	uint64_t warmup;
+	AllocAuditStats stats;
+
+protected:
+
+private:
+};
+
+extern AllocationAudit allocAudit;
+extern __thread int allocAuditDepth;	// how deep this thread is in the transaction path
+
+/*
+ * Marks the rest of the enclosing block as on the transaction path. Scopes can nest; each
+ * outermost one is a pass.
+ */
+
+class AllocAuditScope
+{
+public:
+#if ALLOC_AUDIT_AVAILABLE
+	inline AllocAuditScope()
+	{
+		if ((allocAuditDepth++ == 0) && __builtin_expect(allocAudit.enabled, 0))
+		{
+			allocAudit.stats.passes++;
+		}
+	}
+	inline ~AllocAuditScope()
+	{
+		allocAuditDepth--;
+	}
+#else
+	inline AllocAuditScope() {}
+#endif
+};
+
+#define ALLOC_AUDIT_CONCAT_(a, b)	a##b
+#define ALLOC_AUDIT_CONCAT(a, b)	ALLOC_AUDIT_CONCAT_(a, b)
+#define ALLOC_AUDIT_SCOPE()			AllocAuditScope ALLOC_AUDIT_CONCAT(allocAuditScope, __LINE__)
+
+#endif /* ALLOCAUDIT_H_ */
+
+// end of allocaudit.h
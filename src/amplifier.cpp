@@ -0,0 +1,482 @@
+/*
+ * amplifier.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <iostream>
+using namespace std;
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#include "amplifier.h"
+
+/*
+ * MSG_ZEROCOPY arrived in Linux 4.14; older headers don't know about it, but the kernel we end
+ * up running on may. If it doesn't, setsockopt(SO_ZEROCOPY) fails and we just copy.
+ */
+
+#ifdef __linux__
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY					60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY				0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY		5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+#endif
+
+static const char * const patternNames[PATTERN_COUNT] = { "ZERO", "SEQUENCE", "ASCII", "RANDOM" };
+
+ReplyAmplifier::ReplyAmplifier()
+{
+	config.maxReplyBytes = 0;
+	config.zeroCopy = true;
+	config.zeroCopyMinimum = 16384;
+	config.udp = false;
+	enabled = false;
+	memset(&stats, 0, sizeof(stats));
+	memset(patterns, 0, sizeof(patterns));
+	patternSize = 0;
+	sends = NULL;
+	maxSockets = 0;
+}
+
+ReplyAmplifier::~ReplyAmplifier()
+{
+	for (int i = 0; i < PATTERN_COUNT; i++)
+	{
+		if (patterns[i])
+		{
+			munmap(patterns[i], patternSize);
+			patterns[i] = NULL;
+		}
+	}
+	if (sends)
+	{
+		free(sends);
+		sends = NULL;
+	}
+}
+
+bool ReplyAmplifier::Init()
+{
+	if (config.maxReplyBytes == 0)
+	{
+		return true;	// nothing to do; replies stay the size of their requests
+	}
+
+	long pageSize = sysconf(_SC_PAGESIZE);
+	patternSize = ((config.maxReplyBytes + pageSize - 1) / pageSize) * pageSize;
+
+	// mmap() hands out page-aligned memory, which is what the kernel pins for MSG_ZEROCOPY
+
+	for (int i = 0; i < PATTERN_COUNT; i++)
+	{
+		void *buffer = mmap(NULL, patternSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buffer == MAP_FAILED)
+		{
+			cerr << "ReplyAmplifier: unable to allocate " << patternSize << " bytes for reply patterns" << endl;
+			return false;
+		}
+		patterns[i] = (char *)buffer;
+	}
+
+	// fill every page now, so no reply ever waits on a page fault
+
+	memset(patterns[PATTERN_ZERO], 0, patternSize);
+	for (size_t i = 0; i < patternSize; i++)
+	{
+		patterns[PATTERN_SEQUENCE][i] = (char)(i & 0xff);
+	}
+	static const char line[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz\r\n";
+	for (size_t i = 0; i < patternSize; i++)
+	{
+		patterns[PATTERN_ASCII][i] = line[i % (sizeof(line) - 1)];
+	}
+	uint64_t state = 0x9e3779b97f4a7c15ULL;	// fixed seed, so every run (and every replay) sends the same bytes
+	for (size_t i = 0; i < patternSize; i += sizeof(uint64_t))
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		uint64_t value = state * 0x2545f4914f6cdd1dULL;
+		memcpy(patterns[PATTERN_RANDOM] + i, &value, sizeof(value));	// patternSize is a whole number of pages
+	}
+
+	maxSockets = getdtablesize();
+	sends = (AmplifiedSend *)calloc(maxSockets, sizeof(AmplifiedSend));
+	if (sends == NULL)
+	{
+		cerr << "ReplyAmplifier: unable to allocate socket table" << endl;
+		return false;
+	}
+
+	enabled = true;
+	cout << "Reply amplification enabled: up to " << config.maxReplyBytes << " bytes per reply, zero-copy "
+		<< (config.zeroCopy ? "on" : "off") << ", over " << (config.udp ? "TCP and UDP" : "TCP only") << endl;
+	return true;
+}
+
+const char *ReplyAmplifier::PatternName(AmplifyPattern pattern)
+{
+	return ((pattern >= 0) && (pattern < PATTERN_COUNT)) ? patternNames[pattern] : "?";
+}
+
+/*
+ * ParseSize() understands plain byte counts and K or M (binary) suffixes: 4096, 64K, 10M.
+ */
+
+bool ReplyAmplifier::ParseSize(const char *text, size_t &bytes)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long long value = strtoull(text, &end, 10);
+	if ((end == text) || (errno != 0))
+	{
+		return false;
+	}
+	if ((*end == 'K') || (*end == 'k'))
+	{
+		value *= 1024;
+		end++;
+	}
+	else if ((*end == 'M') || (*end == 'm'))
+	{
+		value *= 1024 * 1024;
+		end++;
+	}
+	if ((*end != '\0') && !isspace((unsigned char)*end))
+	{
+		return false;
+	}
+	bytes = (size_t)value;
+	return true;
+}
+
+bool ReplyAmplifier::ParseRequest(const char *request, int length, size_t &bytes, AmplifyPattern &pattern)
+{
+	static const char keyword[] = "AMPLIFY ";
+	if ((length < (int)sizeof(keyword)) || (strncasecmp(request, keyword, sizeof(keyword) - 1) != 0))
+	{
+		return false;
+	}
+
+	// the request isn't NUL-terminated, so work on a bounded copy
+
+	char text[64];
+	int n = length < (int)sizeof(text) - 1 ? length : (int)sizeof(text) - 1;
+	memcpy(text, request, n);
+	text[n] = '\0';
+
+	char *size = text + sizeof(keyword) - 1;
+	while (isspace((unsigned char)*size))
+	{
+		size++;
+	}
+	if (!ParseSize(size, bytes) || (bytes == 0))
+	{
+		return false;
+	}
+	if (bytes > config.maxReplyBytes)
+	{
+		bytes = config.maxReplyBytes;
+	}
+
+	pattern = PATTERN_ASCII;
+	char *name = size;
+	while ((*name != '\0') && !isspace((unsigned char)*name))
+	{
+		name++;
+	}
+	while (isspace((unsigned char)*name))
+	{
+		name++;
+	}
+	if (*name != '\0')
+	{
+		int nameLength = 0;
+		while ((name[nameLength] != '\0') && !isspace((unsigned char)name[nameLength]))
+		{
+			nameLength++;
+		}
+		int i;
+		for (i = 0; i < PATTERN_COUNT; i++)
+		{
+			if (((int)strlen(patternNames[i]) == nameLength) && (strncasecmp(name, patternNames[i], nameLength) == 0))
+			{
+				pattern = (AmplifyPattern)i;
+				break;
+			}
+		}
+		if (i == PATTERN_COUNT)
+		{
+			return false;	// not a pattern we know; treat it as an ordinary request
+		}
+	}
+	return true;
+}
+
+/*
+ * Allows() is asked once a request has parsed as AMPLIFY: over UDP, unless --amplifyUdp was given,
+ * the answer is no, and the session echoes the request as usual.
+ */
+
+bool ReplyAmplifier::Allows(bool udp)
+{
+	if (udp && !config.udp)
+	{
+		stats.udpRefused++;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Start() begins sending an amplified reply, returning its length (which for UDP may be less
+ * than asked for) or -1 if the session should be closed. A TCP reply may not be finished when
+ * this returns; see IsSending().
+ */
+
+ssize_t ReplyAmplifier::Start(
+	int socket,
+	bool udp,
+	struct sockaddr *clientAddress,
+	int addrLength,
+	size_t bytes,
+	AmplifyPattern pattern
+){
+	stats.replies++;
+
+	if (udp)
+	{
+		if (bytes > AMPLIFY_MAX_UDP_REPLY)
+		{
+			bytes = AMPLIFY_MAX_UDP_REPLY;
+			stats.udpTruncated++;
+		}
+		stats.bytesRequested += bytes;
+		ssize_t rc = sendto(socket, patterns[pattern], bytes, 0, clientAddress, addrLength);
+		if (rc < 0)
+		{
+			cerr << "Unable to send amplified reply: " << rc << " (" << errno << ")" << endl;
+			return 0;	// a UDP send failure isn't a reason to stop serving everyone else
+		}
+		stats.bytesSent += rc;
+		return rc;
+	}
+
+	if ((socket < 0) || (socket >= maxSockets))
+	{
+		return -1;
+	}
+	AmplifiedSend &send = sends[socket];
+	if (send.active)
+	{
+		cerr << "ReplyAmplifier: a reply is already in progress on socket " << socket << endl;
+		return -1;
+	}
+	if ((send.zeroCopy == 0) && config.zeroCopy && (bytes >= config.zeroCopyMinimum))
+	{
+		send.zeroCopy = EnableZeroCopy(socket) ? 1 : -1;
+		if (send.zeroCopy < 0)
+		{
+			stats.zeroCopyUnavailable++;
+		}
+	}
+	send.data = patterns[pattern];
+	send.length = bytes;
+	send.offset = 0;
+	send.active = true;
+	stats.bytesRequested += bytes;
+
+	if (Push(socket) < 0)
+	{
+		return -1;
+	}
+	return bytes;
+}
+
+/*
+ * Continue() is called when poll() says a socket with a reply in progress is writable again.
+ * It returns -1 if the session should be closed.
+ */
+
+int ReplyAmplifier::Continue(int socket)
+{
+	if ((socket < 0) || (socket >= maxSockets) || !sends[socket].active)
+	{
+		return 1;	// nothing in progress; nothing wrong
+	}
+	return Push(socket);
+}
+
+bool ReplyAmplifier::IsSending(int socket)
+{
+	return enabled && (socket >= 0) && (socket < maxSockets) && sends[socket].active;
+}
+
+/*
+ * Hand the kernel as much of the reply as it'll take without blocking.
+ */
+
+int ReplyAmplifier::Push(int socket)
+{
+	AmplifiedSend &send = sends[socket];
+	bool allowZeroCopy = true;
+	while (send.offset < send.length)
+	{
+		size_t chunk = send.length - send.offset;
+		int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+		bool zeroCopy = allowZeroCopy && (send.zeroCopy > 0) && (chunk >= config.zeroCopyMinimum);
+#ifdef __linux__
+		if (zeroCopy)
+		{
+			flags |= MSG_ZEROCOPY;
+		}
+#endif
+		ssize_t rc = ::send(socket, send.data + send.offset, chunk, flags);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				stats.blocked++;
+				return 1;	// the rest goes out when poll() says there's room
+			}
+			if ((errno == ENOBUFS) && zeroCopy)
+			{
+				allowZeroCopy = false;	// too many notifications outstanding; copy this piece instead
+				continue;
+			}
+			cerr << "Unable to send amplified reply: " << rc << " (" << errno << ")" << endl;
+			send.active = false;
+			stats.aborted++;
+			return -1;
+		}
+		if (zeroCopy)
+		{
+			send.outstanding++;
+			stats.zeroCopySends++;
+		}
+		send.offset += rc;
+		stats.bytesSent += rc;
+	}
+	send.active = false;
+	cout << "Sent amplified reply of " << send.length << " bytes\n";	// flushed by the event loop
+	return 1;
+}
+
+bool ReplyAmplifier::EnableZeroCopy(int socket)
+{
+#ifdef __linux__
+	int one = 1;
+	return setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#else
+	return false;
+#endif
+}
+
+/*
+ * ReapCompletions() drains the kernel's MSG_ZEROCOPY completion notifications from a socket's
+ * error queue. It returns true if the POLLERR that woke us was nothing but those notifications,
+ * false if there's a genuine error for the caller to deal with.
+ */
+
+bool ReplyAmplifier::ReapCompletions(int socket)
+{
+#ifdef __linux__
+	if (!enabled || (socket < 0) || (socket >= maxSockets) || (sends[socket].zeroCopy <= 0))
+	{
+		return false;
+	}
+	AmplifiedSend &send = sends[socket];
+	bool reaped = false;
+	while (1)
+	{
+		char control[128];
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		if (recvmsg(socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			break;	// EAGAIN: the queue is empty
+		}
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+		{
+			if (
+				!((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) &&
+				!((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))
+			){
+				continue;
+			}
+			struct sock_extended_err *error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if ((error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || (error->ee_errno != 0))
+			{
+				return false;
+			}
+
+			// each notification covers a range of sends, numbered from 0 on this socket
+
+			unsigned int completed = error->ee_data - error->ee_info + 1;
+			send.outstanding -= (completed < send.outstanding) ? completed : send.outstanding;
+			stats.zeroCopyCompleted += completed;
+			if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			{
+				stats.zeroCopyCopied += completed;
+			}
+			reaped = true;
+		}
+	}
+	return reaped;
+#else
+	return false;
+#endif
+}
+
+/*
+ * A closed socket's number will be reused by the next session, which mustn't inherit its
+ * predecessor's half-sent reply or zero-copy setting.
+ */
+
+void ReplyAmplifier::ForgetSocket(int socket)
+{
+	if (!enabled || (socket < 0) || (socket >= maxSockets))
+	{
+		return;
+	}
+	if (sends[socket].active)
+	{
+		stats.aborted++;
+	}
+	memset(&sends[socket], 0, sizeof(AmplifiedSend));
+}
+
+// the sole global instance
+
+ReplyAmplifier amplifier;
+
+// end of amplifier.cpp
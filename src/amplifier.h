@@ -0,0 +1,143 @@
+/*
+ * amplifier.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * ReplyAmplifier lets a client ask for a reply much bigger than its request, so the downlink
+ * of a link under test can be loaded as hard as the uplink. A request of the form
+ *
+ *   AMPLIFY <size>[K|M] [ZERO|SEQUENCE|ASCII|RANDOM]
+ *
+ * (keyword and pattern in any case; pattern defaults to ASCII) is answered with <size> bytes of
+ * the named pattern instead of the usual uppercase echo.
+ *
+ * UDP source addresses can be spoofed, so over UDP a dozen-byte request could aim a reply
+ * thousands of times its size at somebody else - the server would be a reflection amplifier.
+ * So AMPLIFY is only honoured over TCP unless --amplifyUdp says otherwise; without it, a UDP
+ * AMPLIFY request just gets the usual echo. With it, a UDP reply is one datagram, capped at
+ * 65507 bytes, which is still up to about 5000 times the request: only use --amplifyUdp on a
+ * network where nobody can spoof addresses.
+ *
+ * Every pattern is generated once, at startup, into its own page-aligned buffer as big as the
+ * largest reply allowed, and replies are sent straight out of those buffers - nothing is copied
+ * per request. For TCP, large sends use MSG_ZEROCOPY where the kernel supports it, so the
+ * pages go to the NIC without even a kernel copy. The buffers never change, so we don't have to
+ * wait for the kernel to finish with them; we just reap its completion notifications (which
+ * arrive on the socket's error queue and wake poll() with POLLERR) to keep the statistics and
+ * the kernel's notification budget in order.
+ *
+ * TCP replies are sent non-blocking. When the socket buffer fills, the rest of the reply waits
+ * for POLLOUT (see IsSending() and Continue()); the main loop stops reading that session's
+ * requests until it's done, so replies never interleave.
+ *
+ * Amplification is off unless --amplify gives a maximum reply size. Amplified replies bypass
+ * reply impairment, whose queue only holds ordinary-sized replies, but on TCP they still keep
+ * their place in the stream: see impairment.h.
+ */
+
+#ifndef AMPLIFIER_H_
+#define AMPLIFIER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define AMPLIFY_MAX_UDP_REPLY	65507	// the most one IPv4 datagram can carry
+
+typedef enum _AmplifyPattern
+{
+	PATTERN_ZERO = 0,		// all zero bytes
+	PATTERN_SEQUENCE,		// byte i is i modulo 256
+	PATTERN_ASCII,			// printable lines, easy to eyeball in a packet capture
+	PATTERN_RANDOM,			// pseudo-random (always the same sequence), so it won't compress
+	PATTERN_COUNT
+} AmplifyPattern;
+
+typedef struct _AmplifierConfig
+{
+	size_t maxReplyBytes;		// largest reply a client may ask for (0 == amplification off)
+	bool zeroCopy;				// use MSG_ZEROCOPY for large TCP sends, where available
+	size_t zeroCopyMinimum;		// sends smaller than this are copied; pinning pages isn't free
+	bool udp;					// honour AMPLIFY over UDP too (see above for why that's risky)
+} AmplifierConfig;
+
+typedef struct _AmplifierStats
+{
+	uint64_t replies;				// amplified replies started
+	uint64_t bytesRequested;		// total size of those replies
+	uint64_t bytesSent;				// how much of that the kernel has accepted so far
+	uint64_t udpRefused;			// UDP requests echoed instead, without --amplifyUdp
+	uint64_t udpTruncated;			// UDP requests for more than one datagram's worth
+	uint64_t blocked;				// times a TCP reply had to wait for room in the socket buffer
+	uint64_t aborted;				// TCP replies cut short by an error or a closed session
+	uint64_t zeroCopySends;			// send() calls made with MSG_ZEROCOPY
+	uint64_t zeroCopyCompleted;		// ...which the kernel has since reported finished
+	uint64_t zeroCopyCopied;		// ...of which the kernel ended up copying after all (e.g. loopback)
+	uint64_t zeroCopyUnavailable;	// sockets on which SO_ZEROCOPY couldn't be turned on
+} AmplifierStats;
+
+class ReplyAmplifier
+{
+public:
+	ReplyAmplifier();
+	virtual ~ReplyAmplifier();
+
+	AmplifierConfig config;		// filled in by ParseCommandLine() before Init()
+
+	virtual bool Init();
+	bool IsEnabled() { return enabled; }
+
+	bool ParseRequest(const char *request, int length, size_t &bytes, AmplifyPattern &pattern);
+	bool Allows(bool udp);
+	const char *PatternData(AmplifyPattern pattern) { return patterns[pattern]; }
+	static const char *PatternName(AmplifyPattern pattern);
+	static bool ParseSize(const char *text, size_t &bytes);
+
+	ssize_t Start(
+		int socket,
+		bool udp,
+		struct sockaddr *clientAddress,
+		int addrLength,
+		size_t bytes,
+		AmplifyPattern pattern
+	);
+	int Continue(int socket);
+	bool IsSending(int socket);
+	bool ReapCompletions(int socket);
+	void ForgetSocket(int socket);
+
+	const AmplifierStats& Stats() { return stats; }
+
+protected:
+	typedef struct _AmplifiedSend
+	{
+		const char *data;
+		size_t length;
+		size_t offset;				// how much the kernel has accepted so far
+		bool active;
+		signed char zeroCopy;		// 0 == not tried yet on this socket, 1 == on, -1 == unavailable
+		unsigned int outstanding;	// MSG_ZEROCOPY sends the kernel hasn't reported on yet
+	} AmplifiedSend;
+
+	int Push(int socket);
+	bool EnableZeroCopy(int socket);
+
+	bool enabled;
+	AmplifierStats stats;
+
+	char *patterns[PATTERN_COUNT];
+	size_t patternSize;			// maxReplyBytes rounded up to whole pages
+
+	AmplifiedSend *sends;		// indexed by socket number
+	int maxSockets;
+
+private:
+};
+
+extern ReplyAmplifier amplifier;
+
+#endif /* AMPLIFIER_H_ */
+
+// end of amplifier.h
@@ -0,0 +1,330 @@
+/*
+ * capture.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <iostream>
+using namespace std;
+
+#include "capture.h"
+#include "captureformat.h"
+#include "timeutil.h"
+
+#define CAPTURE_FLUSH_NS	NANOS_PER_SEC	// push out a partly-filled buffer after it's been waiting this long
+
+TrafficCapture::TrafficCapture()
+{
+	fd = -1;
+	fileOffset = 0;
+	current = 0;
+	firstRecordAt = 0;
+	memset(&stats, 0, sizeof(stats));
+	memset(buffers, 0, sizeof(buffers));
+}
+
+TrafficCapture::~TrafficCapture()
+{
+	Close();
+	for (int i = 0; i < CAPTURE_BUFFERS; i++)
+	{
+		if (buffers[i].data)
+		{
+			free(buffers[i].data);
+			buffers[i].data = NULL;
+		}
+	}
+}
+
+/*
+ * With append, an existing capture is carried on with, as long as it's in the format we write;
+ * otherwise (or if there's nothing there yet) the file starts afresh.
+ */
+
+bool TrafficCapture::Open(const char *path, int serverPort, bool append)
+{
+	if (fd >= 0)
+	{
+		cerr << "TrafficCapture: already capturing" << endl;
+		return false;
+	}
+	for (int i = 0; i < CAPTURE_BUFFERS; i++)
+	{
+		buffers[i].data = (char *)malloc(CAPTURE_BUFFER_SIZE);
+		if (buffers[i].data == NULL)
+		{
+			cerr << "TrafficCapture: unable to allocate capture buffers" << endl;
+			return false;
+		}
+		buffers[i].used = 0;
+		buffers[i].inFlight = false;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND | (append ? 0 : O_TRUNC), 0644);
+	if (fd < 0)
+	{
+		cerr << "TrafficCapture: unable to open " << path << " (" << errno << ")" << endl;
+		return false;
+	}
+
+	CaptureFileHeader header;
+	off_t existing = append ? lseek(fd, 0, SEEK_END) : 0;
+	if (existing > 0)
+	{
+		if (
+			(pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) ||
+			(memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0) ||
+			(ntohl(header.version) != CAPTURE_VERSION)
+		){
+			cerr << "TrafficCapture: " << path << " isn't a version " << CAPTURE_VERSION
+				<< " capture, so it can't be added to; give a new --capture file" << endl;
+			close(fd);
+			fd = -1;
+			return false;
+		}
+		fileOffset = existing;	// O_APPEND puts every write at the end anyway
+		current = 0;
+		cout << "Adding to the traffic capture in " << path << endl;
+		return true;
+	}
+
+	// the file header is written synchronously - we're still starting up, so nobody's waiting
+
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = htonl(CAPTURE_VERSION);
+	header.headerLength = htonl(sizeof(header));
+	header.serverPort = htonl(serverPort);
+	if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+	{
+		cerr << "TrafficCapture: unable to write to " << path << endl;
+		close(fd);
+		fd = -1;
+		return false;
+	}
+	fileOffset = sizeof(header);
+	current = 0;
+
+	cout << "Capturing traffic to " << path << endl;
+	return true;
+}
+
+/*
+ * Close() is the one place we're willing to wait for the disk: the server is shutting down.
+ */
+
+void TrafficCapture::Close()
+{
+	if (fd < 0)
+	{
+		return;
+	}
+	if (buffers[current].used > 0)
+	{
+		Reap(true);		// make sure the buffer we're about to submit isn't still in flight
+		Submit();
+	}
+	Reap(true);
+	close(fd);
+	fd = -1;
+}
+
+void TrafficCapture::Record(
+	TestRecord &record,
+	bool udp,
+	unsigned short serverPort,
+	int requestLength,
+	int replyLength
+){
+	if (fd < 0)
+	{
+		return;
+	}
+	if (requestLength < 0)
+	{
+		requestLength = 0;
+	}
+	if (replyLength < 0)
+	{
+		replyLength = 0;
+	}
+	if (requestLength > (int)sizeof(record.dataReceived))
+	{
+		requestLength = sizeof(record.dataReceived);
+	}
+	if (replyLength > (int)sizeof(record.dataSent))
+	{
+		replyLength = sizeof(record.dataSent);
+	}
+
+	CaptureRecordHeader header;
+	size_t length = sizeof(header) + requestLength + replyLength;
+
+	// find room without ever waiting on the disk
+
+	if (buffers[current].inFlight)
+	{
+		Reap(false);
+	}
+	if (!buffers[current].inFlight && ((buffers[current].used + length) > CAPTURE_BUFFER_SIZE))
+	{
+		Submit();
+		Reap(false);
+	}
+	if (buffers[current].inFlight)
+	{
+		stats.dropped++;
+		return;
+	}
+
+	header.recordLength = htonl(length);
+	header.monotonicHigh = htonl((uint32_t)(record.receivedNs >> 32));
+	header.monotonicLow = htonl((uint32_t)(record.receivedNs & 0xffffffff));
+	header.wallSeconds = htonl((uint32_t)record.startTime.tv_sec);
+	header.wallNanoseconds = htonl((uint32_t)record.startTime.tv_usec * 1000);
+	header.ipAddress = record.ipAddress.s_addr;	// already in network order
+	header.port = record.port;					// so is this
+	header.protocol = udp ? CAPTURE_PROTOCOL_UDP : CAPTURE_PROTOCOL_TCP;
+	header.flags = 0;
+	header.requestLength = htons(requestLength);
+	header.replyLength = htons(replyLength);
+	header.serverPort = htons(serverPort);
+	header.reserved = 0;
+
+	if (buffers[current].used == 0)
+	{
+		firstRecordAt = record.receivedNs;
+	}
+	Append(&header, sizeof(header));
+	Append(record.dataReceived, requestLength);
+	Append(record.dataSent, replyLength);
+	stats.records++;
+}
+
+void TrafficCapture::Service(uint64_t now)
+{
+	if (fd < 0)
+	{
+		return;
+	}
+	Reap(false);
+	if (
+		(buffers[current].used > 0) &&
+		!buffers[current].inFlight &&
+		((now - firstRecordAt) > CAPTURE_FLUSH_NS)
+	){
+		Submit();
+	}
+}
+
+/*
+ * While records are waiting in a buffer, don't let the main loop sleep so long that Service()
+ * can't push them out on time.
+ */
+
+int TrafficCapture::PollTimeout(int timeout)
+{
+	int flushMs = CAPTURE_FLUSH_NS / NANOS_PER_MSEC;
+	if ((fd >= 0) && (buffers[current].used > 0) && ((timeout < 0) || (timeout > flushMs)))
+	{
+		return flushMs;
+	}
+	return timeout;
+}
+
+bool TrafficCapture::Append(const void *data, size_t length)
+{
+	CaptureBuffer &buffer = buffers[current];
+	memcpy(buffer.data + buffer.used, data, length);
+	buffer.used += length;
+	return true;
+}
+
+/*
+ * Hand the current buffer to the kernel and move on to the next one.
+ */
+
+void TrafficCapture::Submit()
+{
+	CaptureBuffer &buffer = buffers[current];
+	if (buffer.used == 0)
+	{
+		return;
+	}
+
+	memset(&buffer.control, 0, sizeof(buffer.control));
+	buffer.control.aio_fildes = fd;
+	buffer.control.aio_buf = buffer.data;
+	buffer.control.aio_nbytes = buffer.used;
+	buffer.control.aio_offset = fileOffset;
+	buffer.control.aio_sigevent.sigev_notify = SIGEV_NONE;
+
+	if (aio_write(&buffer.control) < 0)
+	{
+		cerr << "TrafficCapture: unable to queue write (" << errno << "); " << buffer.used << " bytes lost" << endl;
+		stats.writeErrors++;
+		buffer.used = 0;
+	}
+	else
+	{
+		fileOffset += buffer.used;
+		buffer.inFlight = true;
+	}
+	current = (current + 1) % CAPTURE_BUFFERS;
+}
+
+/*
+ * Collect the results of finished writes, freeing their buffers for reuse. Only Close() asks
+ * us to wait for writes that haven't finished.
+ */
+
+void TrafficCapture::Reap(bool wait)
+{
+	for (int i = 0; i < CAPTURE_BUFFERS; i++)
+	{
+		CaptureBuffer &buffer = buffers[i];
+		if (!buffer.inFlight)
+		{
+			continue;
+		}
+		int rc = aio_error(&buffer.control);
+		if (rc == EINPROGRESS)
+		{
+			if (!wait)
+			{
+				continue;
+			}
+			const struct aiocb *list[1] = { &buffer.control };
+			while (aio_error(&buffer.control) == EINPROGRESS)
+			{
+				aio_suspend(list, 1, NULL);
+			}
+		}
+		ssize_t written = aio_return(&buffer.control);
+		if (written != (ssize_t)buffer.used)
+		{
+			stats.writeErrors++;
+		}
+		else
+		{
+			stats.bytes += written;
+		}
+		buffer.used = 0;
+		buffer.inFlight = false;
+	}
+}
+
+// the sole global instance
+
+TrafficCapture capture;
+
+// end of capture.cpp
@@ -0,0 +1,95 @@
+/*
+ * capture.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * TrafficCapture records every transaction (request, reply, source, protocol and timing) to a
+ * compact binary file (see captureformat.h), so that xm2m-replay can later fire the same
+ * traffic back at a server with its original pacing.
+ *
+ * Disk writes can stall for milliseconds, which is unacceptable in the single-threaded event
+ * loop, so writes go through POSIX asynchronous I/O rather than write(). Records are appended
+ * to one of a few preallocated buffers; a full buffer is handed to aio_write() and filling
+ * moves on to the next one. If the disk falls so far behind that every buffer is still in
+ * flight, records are dropped (and counted) rather than making the server wait.
+ *
+ * Service() should be called regularly from the main loop - it reaps finished writes and
+ * pushes out a partly-filled buffer once it's been sitting for a while, so a quiet server's
+ * capture is never far behind.
+ *
+ * The file is opened with O_APPEND, so every buffer lands at the end of it, wherever the
+ * others have got to. That lets a server that has taken over from another (see handoff.h)
+ * carry on with the same capture, open for append, while its predecessor finishes its last
+ * sessions: their buffers interleave, but each holds whole records.
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <aio.h>
+
+#include "resultsrepo.h"	// for TestRecord
+
+#define CAPTURE_BUFFERS			4
+#define CAPTURE_BUFFER_SIZE		(1024 * 1024)
+
+typedef struct _CaptureStats
+{
+	uint64_t records;		// records accepted into a buffer
+	uint64_t bytes;			// bytes handed to the disk so far
+	uint64_t dropped;		// records lost because every buffer was busy
+	uint64_t writeErrors;	// asynchronous writes that failed or came up short
+} CaptureStats;
+
+class TrafficCapture
+{
+public:
+	TrafficCapture();
+	virtual ~TrafficCapture();
+
+	virtual bool Open(const char *path, int serverPort, bool append);
+	virtual void Close();
+	bool IsEnabled() { return fd >= 0; }
+
+	virtual void Record(
+		TestRecord &record,
+		bool udp,
+		unsigned short serverPort,
+		int requestLength,
+		int replyLength
+	);
+	virtual void Service(uint64_t now);
+	int PollTimeout(int timeout);
+
+	const CaptureStats& Stats() { return stats; }
+
+protected:
+	typedef struct _CaptureBuffer
+	{
+		char *data;
+		size_t used;
+		bool inFlight;		// handed to aio_write() and not yet reaped
+		struct aiocb control;
+	} CaptureBuffer;
+
+	bool Append(const void *data, size_t length);
+	void Submit();
+	void Reap(bool wait);
+
+	int fd;
+	off_t fileOffset;		// where the next buffer submitted will land
+	CaptureBuffer buffers[CAPTURE_BUFFERS];
+	int current;			// the buffer being filled
+	uint64_t firstRecordAt;	// when the current buffer got its first record
+	CaptureStats stats;
+
+private:
+};
+
+extern TrafficCapture capture;
+
+#endif /* CAPTURE_H_ */
+
+// end of capture.h
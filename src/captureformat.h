@@ -0,0 +1,62 @@
+/*
+ * captureformat.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * The on-disk layout of a traffic capture, shared by xm2m-server (which writes captures)
+ * and xm2m-replay (which plays them back). Like other code meant to be shared with the
+ * client side, this sticks to plain C types - no STL.
+ *
+ * A capture is one CaptureFileHeader followed by any number of records. Each record is a
+ * CaptureRecordHeader followed by the request bytes and then the reply bytes. Every multi-byte
+ * field is in network byte order, so captures move freely between big- and little-endian
+ * machines. All fields are naturally aligned, so neither struct has any padding.
+ *
+ * Version 2 added serverPort to the record header, since one server can listen on many ports
+ * (see listeners.h). Version 1 records end just before it (CAPTURE_V1_RECORD_HEADER bytes), and
+ * were all taken on the file header's serverPort.
+ */
+
+#ifndef CAPTUREFORMAT_H_
+#define CAPTUREFORMAT_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC		"XM2MCAP"	// seven characters plus the terminating NUL
+#define CAPTURE_VERSION		2
+
+#define CAPTURE_PROTOCOL_TCP	6		// same numbers as IPPROTO_TCP and IPPROTO_UDP
+#define CAPTURE_PROTOCOL_UDP	17
+
+typedef struct _CaptureFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t headerLength;		// sizeof(CaptureFileHeader) when written; skip anything beyond what you know
+	uint32_t serverPort;		// the server's first transaction port (see the records for the rest)
+	uint32_t reserved;
+} CaptureFileHeader;
+
+typedef struct _CaptureRecordHeader
+{
+	uint32_t recordLength;		// this header plus both payloads
+	uint32_t monotonicHigh;		// CLOCK_MONOTONIC nanoseconds at receive - use these for pacing
+	uint32_t monotonicLow;
+	uint32_t wallSeconds;		// wall-clock arrival time, for humans
+	uint32_t wallNanoseconds;
+	uint32_t ipAddress;			// the client's address and port, exactly as in sockaddr_in
+	uint16_t port;
+	uint8_t protocol;			// CAPTURE_PROTOCOL_TCP or CAPTURE_PROTOCOL_UDP
+	uint8_t flags;				// none defined yet
+	uint16_t requestLength;
+	uint16_t replyLength;
+	uint16_t serverPort;		// the transaction port the request arrived on (0 == the file header's)
+	uint16_t reserved;
+} CaptureRecordHeader;
+
+#define CAPTURE_V1_RECORD_HEADER	32	// sizeof(CaptureRecordHeader) before serverPort
+
+#endif /* CAPTUREFORMAT_H_ */
+
+// end of captureformat.h
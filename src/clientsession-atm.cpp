@@ -0,0 +1,186 @@
+/*
+ * clientsession-atm.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "clientsession-atm.h"
+
+AtmClientSession::AtmClientSession(
+	const char * description
+)
+: ScriptedSession(description)
+{
+}
+
+AtmClientSession::~AtmClientSession()
+{
+}
+
+/*
+ * snprintf() that returns how much actually went into the buffer, ready to Send()
+ */
+
+static int Format(char *buffer, int size, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(buffer, size, format, args);
+	va_end(args);
+	if (n < 0)
+	{
+		return 0;
+	}
+	return (n >= size) ? size - 1 : n;
+}
+
+static bool AllDigits(const char *text, int minimum, int maximum)
+{
+	int length = strlen(text);
+	if ((length < minimum) || (length > maximum))
+	{
+		return false;
+	}
+	for (int i = 0; i < length; i++)
+	{
+		if (!isdigit((unsigned char)text[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+ScriptTask AtmClientSession::Run(ScriptConnection &connection)
+{
+	char line[64];
+	char reply[128];
+	char card[24];
+	int n;
+
+	n = Format(reply, sizeof(reply), "XM2M SAVINGS AND LOAN\r\nCARD? ");
+	if (co_await connection.Send(reply, n) < 0)
+	{
+		co_return;
+	}
+	if (co_await connection.RecvLine(line, sizeof(line)) <= 0)
+	{
+		co_return;
+	}
+	if (!AllDigits(line, 12, 19))
+	{
+		n = Format(reply, sizeof(reply), "CARD NOT READABLE\r\n");
+		co_await connection.Send(reply, n);
+		co_return;
+	}
+	strncpy(card, line, sizeof(card) - 1);
+	card[sizeof(card) - 1] = '\0';
+
+	// the mock host: wrong PINs are 0000 or anything that isn't four digits
+
+	bool authorized = false;
+	for (int attempt = 0; (attempt < ATM_PIN_ATTEMPTS) && !authorized; attempt++)
+	{
+		n = Format(reply, sizeof(reply), "PIN? ");
+		if (co_await connection.Send(reply, n) < 0)
+		{
+			co_return;
+		}
+		if (co_await connection.RecvLine(line, sizeof(line)) <= 0)
+		{
+			co_return;
+		}
+		co_await connection.Sleep(ATM_AUTHORIZATION_MS);
+		authorized = AllDigits(line, 4, 4) && (strcmp(line, "0000") != 0);
+		if (!authorized)
+		{
+			n = Format(reply, sizeof(reply), "PIN INCORRECT\r\n");
+			if (co_await connection.Send(reply, n) < 0)
+			{
+				co_return;
+			}
+		}
+	}
+	if (!authorized)
+	{
+		n = Format(reply, sizeof(reply), "CARD RETAINED. PLEASE CONTACT YOUR BRANCH\r\n");
+		co_await connection.Send(reply, n);
+		co_return;
+	}
+
+	// same card, same balance: somewhere from $500 to $1980, in twenties
+
+	unsigned int hash = 0;
+	for (int i = 0; card[i] != '\0'; i++)
+	{
+		hash = (hash * 31) + (card[i] - '0');
+	}
+	long balance = 500 + ((hash % 75) * 20);
+
+	while (1)
+	{
+		n = Format(reply, sizeof(reply), "AMOUNT? (or BALANCE, or QUIT) ");
+		if (co_await connection.Send(reply, n) < 0)
+		{
+			co_return;
+		}
+		if (co_await connection.RecvLine(line, sizeof(line)) <= 0)
+		{
+			co_return;
+		}
+		if ((strcasecmp(line, "QUIT") == 0) || (line[0] == '\0'))
+		{
+			break;
+		}
+		if (strcasecmp(line, "BALANCE") == 0)
+		{
+			co_await connection.Sleep(ATM_AUTHORIZATION_MS);
+			n = Format(reply, sizeof(reply), "BALANCE %ld.00\r\n", balance);
+		}
+		else if (!AllDigits(line, 1, 6))
+		{
+			n = Format(reply, sizeof(reply), "PLEASE ENTER AN AMOUNT\r\n");
+		}
+		else
+		{
+			long amount = atol(line);
+			if ((amount == 0) || ((amount % 20) != 0))
+			{
+				n = Format(reply, sizeof(reply), "AMOUNTS MUST BE MULTIPLES OF 20\r\n");
+			}
+			else
+			{
+				co_await connection.Sleep(ATM_AUTHORIZATION_MS);
+				if (amount > balance)
+				{
+					n = Format(reply, sizeof(reply), "DECLINED: INSUFFICIENT FUNDS\r\n");
+				}
+				else
+				{
+					co_await connection.Sleep(ATM_DISPENSE_MS);
+					balance -= amount;
+					n = Format(reply, sizeof(reply), "DISPENSED %ld.00. BALANCE %ld.00\r\n", amount, balance);
+				}
+			}
+		}
+		if (co_await connection.Send(reply, n) < 0)
+		{
+			co_return;
+		}
+	}
+
+	n = Format(reply, sizeof(reply), "THANK YOU\r\n");
+	co_await connection.Send(reply, n);
+}
+
+// end of clientsession-atm.cpp
@@ -0,0 +1,45 @@
+/*
+ * clientsession-atm.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * AtmClientSession is the ATM simulator the ClientSession header has always promised: a
+ * scripted session (see scriptedsession.h) that walks a client through a cash withdrawal.
+ *
+ *   CARD? -> 12 to 19 digits
+ *   PIN?  -> 4 digits; 0000 is always wrong, three wrong PINs and the card is retained
+ *   AMOUNT? -> a multiple of 20, BALANCE, or QUIT; repeats until QUIT
+ *
+ * PIN checks and withdrawals are 'authorized' by a mock host that takes ATM_AUTHORIZATION_MS
+ * to answer, and dispensing takes ATM_DISPENSE_MS; both are coroutine sleeps, so hundreds of
+ * customers can be waiting on the host at once without holding up anybody else. Balances are
+ * made up from the card number, so the same card always has the same money.
+ *
+ * Everything is line-oriented plain text, so telnet makes a perfectly good ATM.
+ */
+
+#ifndef CLIENTSESSION_ATM_H_
+#define CLIENTSESSION_ATM_H_
+
+#include "scriptedsession.h"
+
+#define ATM_AUTHORIZATION_MS	200
+#define ATM_DISPENSE_MS			500
+#define ATM_PIN_ATTEMPTS		3
+
+class AtmClientSession : public ScriptedSession
+{
+public:
+	AtmClientSession(const char * description);
+	~AtmClientSession();
+
+protected:
+	ScriptTask Run(ScriptConnection &connection);
+
+private:
+};
+
+#endif /* CLIENTSESSION_ATM_H_ */
+
+// end of clientsession-atm.h
@@ -18,6 +18,20 @@ using namespace std;
 #include "clientsession-cmdline.h"
 #include "reportwriter.h"
 #include "resultsrepo.h"
+#include "partitionedrepo.h"
+#include "allocaudit.h"
+#include "amplifier.h"
+#include "capture.h"
+#include "framepool.h"
+#include "impairment.h"
+#include "listeners.h"
+#include "loopmonitor.h"
+#include "overload.h"
+#include "profiler.h"
+#include "reconcile.h"
+#include "scriptedsession.h"
+#include "toptalkers.h"
+#include "timeutil.h"
 
 /*
  * Most of the work done in the base class is useful here too, so the first few methods
@@ -42,7 +56,7 @@ void CommandLineClientSession::ConnectionEstablished(int sock)
 	connected = true;
 }
 
-void CommandLineClientSession::ConnectionTerminated()
+void CommandLineClientSession::ConnectionTerminated(int sock)
 {
 	connected = false;
 }
@@ -60,12 +74,14 @@ bool CommandLineClientSession::IsConnected()
 static ReportWriter writer(cout);
 
 extern bool stopServer;
+extern ScriptedSession *scriptedSession;
 
 int CommandLineClientSession::MessageReceived(int socket)
 {
+	PROFILE_SCOPE(PHASE_CONSOLE);
 	struct sockaddr clientAddress;
 	unsigned int size = sizeof(clientAddress);
-	int n = recvfrom(socket, (void *)rxbuffer, sizeof(rxbuffer), 0, &clientAddress, &size);
+	int n = recvfrom(socket, (void *)rxbuffer, sizeof(rxbuffer) - 1, 0, &clientAddress, &size);
 	if (n < 0)
 	{
 		if (errno != EWOULDBLOCK)
@@ -83,22 +99,259 @@ int CommandLineClientSession::MessageReceived(int socket)
 		switch (toupper(rxbuffer[0]))
 		{
 			case 'W':
-				resultsRepo.WriteReport(writer);
-				n = snprintf(rxbuffer, sizeof(rxbuffer), "Repository write is complete.\nxm2m]");
+			{
+				// W alone writes everything; W ip writes just that client's records
+
+				struct in_addr client;
+				char *address = rxbuffer + 1;
+				rxbuffer[n] = '\0';
+				while (isspace(*address))
+				{
+					address++;
+				}
+				address[strcspn(address, " \t\r\n")] = '\0';
+				if (*address == '\0')
+				{
+					resultsRepo.WriteReport(writer);
+					n = snprintf(txbuffer, sizeof(txbuffer), "Repository write is complete.\nxm2m]");
+				}
+				else if (inet_aton(address, &client))
+				{
+					resultsRepo.WriteClientReport(writer, client);
+					n = snprintf(txbuffer, sizeof(txbuffer), "Repository write for %s is complete.\nxm2m]", address);
+				}
+				else
+				{
+					n = snprintf(txbuffer, sizeof(txbuffer), "Expected W or W ip-address.\nxm2m]");
+				}
+				break;
+			}
+
+			case 'F':
+				n = partitionedRepo.Format(txbuffer, sizeof(txbuffer) - 6, MonotonicNanoseconds());
+				if (n > (int)sizeof(txbuffer) - 7)
+				{
+					n = sizeof(txbuffer) - 7;	// leave room for the prompt
+				}
+				n += snprintf(txbuffer + n, sizeof(txbuffer) - n, "xm2m]");
+				break;
+
+			case 'I':
+				if (impairment.IsEnabled())
+				{
+					const ImpairmentStats &stats = impairment.Stats();
+					n = snprintf(txbuffer, sizeof(txbuffer),
+						"Impairment: %u pending, %llu queued, %llu sent, %llu failed, %llu dropped, %llu duplicated, %llu overflowed, %llu orphaned, %llu link collisions\n"
+						" %llu AMPLIFY requests held behind queued replies, %llu replies deferred behind amplified ones\nxm2m]",
+						impairment.Pending(),
+						(unsigned long long)stats.queued,
+						(unsigned long long)stats.sent,
+						(unsigned long long)stats.failed,
+						(unsigned long long)stats.dropped,
+						(unsigned long long)stats.duplicated,
+						(unsigned long long)stats.overflowed,
+						(unsigned long long)stats.orphaned,
+						(unsigned long long)stats.linkCollisions,
+						(unsigned long long)stats.held,
+						(unsigned long long)stats.deferred);
+				}
+				else
+				{
+					n = snprintf(txbuffer, sizeof(txbuffer), "Reply impairment is not enabled.\nxm2m]");
+				}
+				break;
+
+			case 'C':
+				if (capture.IsEnabled())
+				{
+					const CaptureStats &stats = capture.Stats();
+					n = snprintf(txbuffer, sizeof(txbuffer),
+						"Capture: %llu records, %llu bytes written, %llu dropped, %llu write errors\nxm2m]",
+						(unsigned long long)stats.records,
+						(unsigned long long)stats.bytes,
+						(unsigned long long)stats.dropped,
+						(unsigned long long)stats.writeErrors);
+				}
+				else
+				{
+					n = snprintf(txbuffer, sizeof(txbuffer), "Traffic capture is not enabled.\nxm2m]");
+				}
+				break;
+
+			case 'A':
+				if (amplifier.IsEnabled())
+				{
+					const AmplifierStats &stats = amplifier.Stats();
+					n = snprintf(txbuffer, sizeof(txbuffer),
+						"Amplifier: %llu replies, %llu of %llu bytes sent, %llu UDP refused, %llu UDP truncated, %llu blocked, %llu aborted\n"
+						"Zero-copy: %llu sends, %llu completed, %llu copied by the kernel anyway, %llu sockets unable\nxm2m]",
+						(unsigned long long)stats.replies,
+						(unsigned long long)stats.bytesSent,
+						(unsigned long long)stats.bytesRequested,
+						(unsigned long long)stats.udpRefused,
+						(unsigned long long)stats.udpTruncated,
+						(unsigned long long)stats.blocked,
+						(unsigned long long)stats.aborted,
+						(unsigned long long)stats.zeroCopySends,
+						(unsigned long long)stats.zeroCopyCompleted,
+						(unsigned long long)stats.zeroCopyCopied,
+						(unsigned long long)stats.zeroCopyUnavailable);
+				}
+				else
+				{
+					n = snprintf(txbuffer, sizeof(txbuffer), "Reply amplification is not enabled.\nxm2m]");
+				}
+				break;
+
+			case 'S':
+				if (scriptedSession != NULL)
+				{
+					const ScriptStats &stats = scriptedSession->Stats();
+					const FramePoolStats &frames = framePool.Stats();
+					n = snprintf(txbuffer, sizeof(txbuffer),
+						"Scripts: %u active, %llu started, %llu finished, %llu abandoned, %llu refused, %llu resumes, %llu sleeps skipped\n"
+						"Frames: %u of %u in use (high water %u), %zu bytes each, %llu oversize, %llu refused\nxm2m]",
+						stats.active,
+						(unsigned long long)stats.started,
+						(unsigned long long)stats.finished,
+						(unsigned long long)stats.abandoned,
+						(unsigned long long)stats.refused,
+						(unsigned long long)stats.resumes,
+						(unsigned long long)stats.sleepsSkipped,
+						frames.inUse,
+						framePool.Blocks(),
+						frames.highWater,
+						framePool.BlockSize(),
+						(unsigned long long)frames.oversize,
+						(unsigned long long)frames.exhausted);
+				}
+				else
+				{
+					n = snprintf(txbuffer, sizeof(txbuffer), "Scripted sessions are not enabled.\nxm2m]");
+				}
+				break;
+
+			case 'L':
+				n = loopMonitor.Format(txbuffer, sizeof(txbuffer) - 6, MonotonicNanoseconds());
+				if (n > (int)sizeof(txbuffer) - 7)
+				{
+					n = sizeof(txbuffer) - 7;	// leave room for the prompt
+				}
+				n += snprintf(txbuffer + n, sizeof(txbuffer) - n, "xm2m]");
+				break;
+
+			case 'T':
+				n = topTalkers.Format(txbuffer, sizeof(txbuffer) - 6, MonotonicNanoseconds());
+				if (n > (int)sizeof(txbuffer) - 7)
+				{
+					n = sizeof(txbuffer) - 7;	// leave room for the prompt
+				}
+				n += snprintf(txbuffer + n, sizeof(txbuffer) - n, "xm2m]");
+				break;
+
+			case 'N':
+				n = listeners.Format(txbuffer, sizeof(txbuffer) - 6, MonotonicNanoseconds());
+				if (n > (int)sizeof(txbuffer) - 7)
+				{
+					n = sizeof(txbuffer) - 7;	// leave room for the prompt
+				}
+				n += snprintf(txbuffer + n, sizeof(txbuffer) - n, "xm2m]");
+				break;
+
+			case 'P':
+				rxbuffer[n] = '\0';
+				if (strstr(rxbuffer, "on") != NULL)
+				{
+					profiler.Enable(true);
+				}
+				else if (strstr(rxbuffer, "off") != NULL)
+				{
+					profiler.Enable(false);
+				}
+				else if (strstr(rxbuffer, "reset") != NULL)
+				{
+					profiler.Reset();
+				}
+				n = profiler.Format(txbuffer, sizeof(txbuffer) - 6, MonotonicNanoseconds());
+				if (n > (int)sizeof(txbuffer) - 7)
+				{
+					n = sizeof(txbuffer) - 7;	// leave room for the prompt
+				}
+				n += snprintf(txbuffer + n, sizeof(txbuffer) - n, "xm2m]");
+				break;
+
+			case 'M':
+				rxbuffer[n] = '\0';
+				if (strstr(rxbuffer, "on") != NULL)
+				{
+					char *warmup = strstr(rxbuffer, "on") + 2;
+					allocAudit.Enable(true, (strtol(warmup, NULL, 10) > 0) ? strtol(warmup, NULL, 10) : allocAudit.warmup);
+				}
+				else if (strstr(rxbuffer, "off") != NULL)
+				{
+					allocAudit.Enable(false, allocAudit.warmup);
+				}
+				else if (strstr(rxbuffer, "reset") != NULL)
+				{
+					allocAudit.Reset();
+				}
+				n = allocAudit.Format(txbuffer, sizeof(txbuffer) - 6, MonotonicNanoseconds());
+				if (n > (int)sizeof(txbuffer) - 7)
+				{
+					n = sizeof(txbuffer) - 7;	// leave room for the prompt
+				}
+				n += snprintf(txbuffer + n, sizeof(txbuffer) - n, "xm2m]");
+				break;
+
+			case 'R':
+				n = reconciler.Format(txbuffer, sizeof(txbuffer) - 6, MonotonicNanoseconds());
+				if (n > (int)sizeof(txbuffer) - 7)
+				{
+					n = sizeof(txbuffer) - 7;	// leave room for the prompt
+				}
+				n += snprintf(txbuffer + n, sizeof(txbuffer) - n, "xm2m]");
+				break;
+
+			case 'O':
+				n = overload.Format(txbuffer, sizeof(txbuffer) - 6, MonotonicNanoseconds());
+				if (n > (int)sizeof(txbuffer) - 7)
+				{
+					n = sizeof(txbuffer) - 7;	// leave room for the prompt
+				}
+				n += snprintf(txbuffer + n, sizeof(txbuffer) - n, "xm2m]");
 				break;
 
 			case 'Q':
 				stopServer = true;
-				n = snprintf(rxbuffer, sizeof(rxbuffer), "Terminating server operations.\nxm2m]");
+				n = snprintf(txbuffer, sizeof(txbuffer), "Terminating server operations.\nxm2m]");
 				break;
 
 			case '?':
 			case 'H':
 			default:
-				n = snprintf(rxbuffer, sizeof(rxbuffer), "Commands:\n W - write all test records\n Q - quit xm2m-server\nxm2m]");
+				n = snprintf(txbuffer, sizeof(txbuffer), "Commands:\n"
+					" W [ip] - write all test records (or just those of one client)\n"
+					" F - show how the repository is shared between clients\n"
+					" I - show reply impairment statistics\n"
+					" C - show traffic capture statistics\n"
+					" A - show reply amplification statistics\n"
+					" S - show scripted session statistics\n"
+					" T - show the top talkers by requests and bytes\n"
+					" N - show the transaction ports and their session profiles\n"
+					" O - show overload control levels and how much load has been shed\n"
+					" P [on|off|reset] - show (or start, stop or clear) hot-path phase timings\n"
+					" M [on [n]|off|reset] - show (or start, stop or clear) the audit of allocations after n passes of warm-up\n"
+					" R - show how client batches have reconciled against our records\n"
+					" L - show event loop busy/spinning/sleeping time\n"
+					" Q - quit xm2m-server\n"
+					"xm2m]");
 				break;
 		}
-		n = SendMessage(socket, &clientAddress, size, rxbuffer, n);
+		if (n >= (int)sizeof(txbuffer))
+		{
+			n = sizeof(txbuffer) - 1;	// snprintf truncated it
+		}
+		n = SendMessage(socket, &clientAddress, size, txbuffer, n);
 	}
 	return n;
 }
@@ -17,6 +17,8 @@
 
 #include "clientsession.h"
 
+#define CONSOLE_BUFFER_SIZE	4096	// replies to the console can be a lot longer than what we receive
+
 class CommandLineClientSession : public ClientSession
 {
 public:
@@ -24,7 +26,7 @@ public:
 	~CommandLineClientSession();
 
 	void ConnectionEstablished(int socket);
-	void ConnectionTerminated();
+	void ConnectionTerminated(int socket);
 	bool IsConnected();
 
 	int Socket() { return socket; }
@@ -35,6 +37,8 @@ protected:
 	bool connected;
 	int socket;
 
+	char txbuffer[CONSOLE_BUFFER_SIZE];
+
 private:
 };
 
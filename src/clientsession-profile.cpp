@@ -0,0 +1,139 @@
+/*
+ * clientsession-profile.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+
+#include "clientsession-profile.h"
+#include "listeners.h"
+#include "reconcile.h"
+
+ProfileClientSession::ProfileClientSession(
+	const char * description,
+	bool udp,
+	SessionProfile *sessionProfile
+)
+: ClientSession(description, udp)
+{
+	profile = sessionProfile;
+}
+
+ProfileClientSession::~ProfileClientSession()
+{
+}
+
+/*
+ * Connections that turn out to be reconciliation batches are the Reconciler's to deal with.
+ */
+
+void ProfileClientSession::ConnectionEstablished(int socket)
+{
+	reconciler.ConnectionOpened(socket);
+}
+
+void ProfileClientSession::ConnectionTerminated(int socket)
+{
+	reconciler.Forget(socket);
+}
+
+short ProfileClientSession::PollEvents(int socket)
+{
+	return (reconciler.Owns(socket) || reconciler.Claiming(socket)) ? reconciler.PollEvents(socket) : ClientSession::PollEvents(socket);
+}
+
+int ProfileClientSession::ReadyToWrite(int socket)
+{
+	return reconciler.Owns(socket) ? reconciler.ReadyToWrite(socket) : ClientSession::ReadyToWrite(socket);
+}
+
+int ProfileClientSession::MessageReceived(int socket)
+{
+	if (!useUDP && (reconciler.Owns(socket) || reconciler.Claim(socket)))
+	{
+		return reconciler.Receive(socket);
+	}
+	if (reconciler.Claiming(socket))
+	{
+		return 1;	// not enough of it yet to tell whether it's a batch
+	}
+	return ClientSession::MessageReceived(socket);
+}
+
+/*
+ * crlf profiles reply to the request without its line ending, and end the reply with CR/LF
+ * (one reply per read, as ever - see listeners.h). A request over the profile's limit gets an
+ * error instead of a reply.
+ */
+
+int ProfileClientSession::TransformPayload(
+	const char * request,
+	char * reply,
+	int length
+){
+	bool lines = (profile->framing == FRAMING_CRLF);
+	if (lines)
+	{
+		while ((length > 0) && ((request[length - 1] == '\n') || (request[length - 1] == '\r')))
+		{
+			length--;
+		}
+	}
+
+	int n;
+	if ((profile->maxRequest > 0) && (length > (int)profile->maxRequest))
+	{
+		n = snprintf(reply, RX_BUFFER_SIZE, "ERROR request longer than %u bytes", profile->maxRequest);
+	}
+	else
+	{
+		switch (profile->transform)
+		{
+			case TRANSFORM_ECHO:
+				for (int i = 0; i < length; i++)
+				{
+					reply[i] = request[i];
+				}
+				n = length;
+				break;
+
+			case TRANSFORM_LOWER:
+				for (int i = 0; i < length; i++)
+				{
+					reply[i] = tolower(request[i]);
+				}
+				n = length;
+				break;
+
+			case TRANSFORM_REVERSE:
+				for (int i = 0; i < length; i++)
+				{
+					reply[i] = request[length - 1 - i];
+				}
+				n = length;
+				break;
+
+			default:
+				n = ClientSession::TransformPayload(request, reply, length);
+				break;
+		}
+	}
+
+	if (lines)
+	{
+		if (n > RX_BUFFER_SIZE - 2)
+		{
+			n = RX_BUFFER_SIZE - 2;
+		}
+		reply[n++] = '\r';
+		reply[n++] = '\n';
+	}
+	return n;
+}
+
+// end of clientsession-profile.cpp
@@ -0,0 +1,55 @@
+/*
+ * clientsession-profile.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * ProfileClientSession is the echo-style session behind every transaction port, shaped by the
+ * port's session profile (see listeners.h): how a request is turned into its reply, whether
+ * replies are lines, and how long a request may be. One instance serves all the TCP ports of a
+ * profile, and another all its UDP ports, just as one ClientSession used to serve the one port.
+ *
+ * The default profile shouts requests back in uppercase, exactly as ClientSession always has.
+ *
+ * A TCP connection whose first request is a reconciliation batch is handed over to the
+ * Reconciler (see reconcile.h) for the rest of its life.
+ */
+
+#ifndef CLIENTSESSION_PROFILE_H_
+#define CLIENTSESSION_PROFILE_H_
+
+#include "clientsession.h"
+
+struct _SessionProfile;
+
+class ProfileClientSession : public ClientSession
+{
+public:
+	ProfileClientSession(
+		const char * description,
+		bool useUDP,
+		struct _SessionProfile *profile
+	);
+	~ProfileClientSession();
+
+	void ConnectionEstablished(int socket);
+	void ConnectionTerminated(int socket);
+	short PollEvents(int socket);
+	int ReadyToWrite(int socket);
+	int MessageReceived(int socket);
+
+	int TransformPayload(
+		const char * request,
+		char * reply,
+		int length
+	);
+
+protected:
+	struct _SessionProfile *profile;
+
+private:
+};
+
+#endif /* CLIENTSESSION_PROFILE_H_ */
+
+// end of clientsession-profile.h
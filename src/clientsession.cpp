@@ -6,14 +6,30 @@
  */
 
 #include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/poll.h>
+#include <arpa/inet.h>
 #include <iostream>
 using namespace std;
 
 #include "resultsrepo.h"
 #include "clientsession.h"
+#include "allocaudit.h"
+#include "amplifier.h"
+#include "capture.h"
+#include "handoff.h"
+#include "telemetry.h"
+#include "toptalkers.h"
+#include "impairment.h"
+#include "listeners.h"
+#include "overload.h"
+#include "profiler.h"
+#include "rxtimestamp.h"
+#include "timeutil.h"
 
 /*
  * We maintain a global transaction ID which increases monotonically
@@ -27,28 +43,74 @@ ClientSession::ClientSession(
 	const char * desc,
 	bool udp
 ){
-	description = strdup(desc);
+	strncpy(description, desc, sizeof(description) - 1);
+	description[sizeof(description) - 1] = '\0';
 	useUDP = udp;
+	record = (TestRecord *)calloc(1, sizeof(TestRecord));
+	if (record == NULL)
+	{
+		cerr << "Insufficient memory for " << description << endl;
+	}
 }
 
 ClientSession::~ClientSession()
 {
-	if (description)
+	if (record)
 	{
-		free(description);
-		description = NULL;
+		free(record);
+		record = NULL;
 	}
 }
 
 int ClientSession::MessageReceived(int socket)
 {
+	ALLOC_AUDIT_SCOPE();
+	if (record == NULL)
+	{
+		return -1;
+	}
+
+	// an amplified reply can't go through the impairment queue, so on TCP it mustn't start until
+	// the replies queued ahead of it have gone: leave the request where it is until then
+
+	if (!useUDP && amplifier.IsEnabled() && impairment.HasQueued(socket, MonotonicNanoseconds()))
+	{
+		char peek[64];
+		size_t amplifiedBytes;
+		AmplifyPattern pattern;
+		int peeked = recv(socket, peek, sizeof(peek), MSG_PEEK | MSG_DONTWAIT);
+		if ((peeked > 0) && amplifier.ParseRequest(peek, peeked, amplifiedBytes, pattern))
+		{
+			impairment.Hold(socket);
+			return 1;
+		}
+	}
+
 	struct sockaddr clientAddress;
 	struct sockaddr_in *inaddr = (sockaddr_in *)&clientAddress;
-	unsigned int size = sizeof(clientAddress);
-	getpeername(socket, &clientAddress, &size);
+	socklen_t size = sizeof(clientAddress);
+	{
+		PROFILE_SCOPE(PHASE_PEERNAME);
+		getpeername(socket, &clientAddress, &size);
+	}
+
+	// the request goes straight into the session's record, rather than via rxbuffer
+
+	TestRecord &testRecord = *record;
+	int n;
+	struct timespec kernelTime;
+	{
+		PROFILE_SCOPE(PHASE_RECEIVE);
+		size = sizeof(clientAddress);
+		n = ReceiveWithTimestamp(socket, testRecord.dataReceived, sizeof(testRecord.dataReceived), &clientAddress, &size, &kernelTime);
+	}
+
+	// take our own timestamps before anything else (like logging) can delay us
+
+	uint64_t receivedNs = MonotonicNanoseconds();
+	struct timespec receivedTime;
+	clock_gettime(CLOCK_REALTIME, &receivedTime);
 
-	memset(rxbuffer, 0, sizeof(rxbuffer));
-	int n = recvfrom(socket, (void *)rxbuffer, sizeof(rxbuffer), 0, &clientAddress, &size);
 	if (n < 0)
 	{
 		if (errno != EWOULDBLOCK)
@@ -58,44 +120,192 @@ int ClientSession::MessageReceived(int socket)
 	}
 	else if (n == 0)
 	{
-		cout << "Session ended normally (how polite)." << endl;
+		Log("Session ended normally (how polite).\n");
 	}
 	else // (n > 0)
 	{
-		cout << description << ": Message arrived"
-			 << " from " << inet_ntoa(inaddr->sin_addr)
-		     << ": " << rxbuffer
-			 << endl;
+		memset(testRecord.dataReceived + n, 0, sizeof(testRecord.dataReceived) - n);
+		{
+			PROFILE_SCOPE(PHASE_LOGGING);
+			char address[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &inaddr->sin_addr, address, sizeof(address));
+			Log("%s: Message arrived from %s: %.*s\n", description, address, n, testRecord.dataReceived);
+		}
 
 		// record info about the transaction
 
-		TestRecord testRecord;
-        testRecord.transactionNumber = transactionNumber++;
-        gettimeofday(&testRecord.startTime, NULL);
+        testRecord.transactionNumber = NextTransactionNumber();
+        testRecord.receivedNs = receivedNs;
+        if (kernelTime.tv_sec != 0)
+        {
+        	testRecord.startTime.tv_sec = kernelTime.tv_sec;
+        	testRecord.startTime.tv_usec = kernelTime.tv_nsec / 1000;
+        	testRecord.queueNs = ((int64_t)(receivedTime.tv_sec - kernelTime.tv_sec) * (int64_t)NANOS_PER_SEC)
+        		+ (receivedTime.tv_nsec - kernelTime.tv_nsec);
+        }
+        else
+        {
+        	testRecord.startTime.tv_sec = receivedTime.tv_sec;
+        	testRecord.startTime.tv_usec = receivedTime.tv_nsec / 1000;
+        	testRecord.queueNs = -1;
+        }
         testRecord.ipAddress = inaddr->sin_addr;
         testRecord.port = inaddr->sin_port;
 
-        memset(testRecord.dataReceived, 0, sizeof(testRecord.dataReceived));
-        memset(testRecord.dataSent, 0, sizeof(testRecord.dataSent));
-
-        memcpy(testRecord.dataReceived, rxbuffer, n);
-        memcpy(testRecord.dataSent, rxbuffer, n);
-
 		// process and send the packet
 
-		for (int i = 0; i < n; i++)
+		int requestLength = n;
+		int replyLength;
+		bool lost = false;	// by reply impairment, on purpose
+		size_t amplifiedBytes;
+		AmplifyPattern pattern;
+		if (amplifier.IsEnabled() && amplifier.ParseRequest(testRecord.dataReceived, n, amplifiedBytes, pattern)
+			&& amplifier.Allows(useUDP))
+		{
+			// far too big for the record (or the impairment queue), so it goes straight out
+
+			PROFILE_SCOPE(PHASE_SEND);
+			n = amplifier.Start(socket, useUDP, &clientAddress, size, amplifiedBytes, pattern);
+			replyLength = (n > 0) ? n : 0;
+			int kept = (replyLength < (int)sizeof(testRecord.dataSent)) ? replyLength : sizeof(testRecord.dataSent);
+			memcpy(testRecord.dataSent, amplifier.PatternData(pattern), kept);
+			memset(testRecord.dataSent + kept, 0, sizeof(testRecord.dataSent) - kept);
+		}
+		else
 		{
-			testRecord.dataSent[i] = toupper(testRecord.dataSent[i]);
+			{
+				PROFILE_SCOPE(PHASE_TRANSFORM);
+				n = TransformPayload(testRecord.dataReceived, testRecord.dataSent, n);
+			}
+			replyLength = n;
+			if ((n >= 0) && (n < (int)sizeof(testRecord.dataSent)))
+			{
+				memset(testRecord.dataSent + n, 0, sizeof(testRecord.dataSent) - n);
+			}
+			if (impairment.IsEnabled())
+			{
+				PROFILE_SCOPE(PHASE_SEND);
+				n = impairment.QueueReply(this, socket, &clientAddress, size, testRecord.dataSent, n, lost);
+			}
+			else
+			{
+				n = SendMessage(socket, &clientAddress, size, testRecord.dataSent, n);
+			}
 		}
-		n = SendMessage(socket, &clientAddress, size, testRecord.dataSent, n);
+		testRecord.sentNs = MonotonicNanoseconds();
+		testRecord.replyBytes = (n < 0) ? -1 : (lost ? 0 : n);
 
 		// record our information about the transaction
 
-		resultsRepo.StoreRecord(testRecord);
+		RecordTransaction(socket, testRecord, requestLength, replyLength);
 	}
 	return n;
 }
 
+/*
+ * The base class only needs POLLOUT while an amplified reply is still going out, and nothing at
+ * all while an AMPLIFY request waits for the session's impaired replies to go.
+ */
+
+short ClientSession::PollEvents(int socket)
+{
+	if (impairment.IsHolding(socket))
+	{
+		return 0;
+	}
+	return amplifier.IsSending(socket) ? POLLOUT : POLLIN;
+}
+
+int ClientSession::ReadyToWrite(int socket)
+{
+	ALLOC_AUDIT_SCOPE();
+	return amplifier.Continue(socket);
+}
+
+/*
+ * Logging a message used to take half a dozen trips through iostream formatting and a flush of
+ * stdout; now it's one vsnprintf() into a buffer on the stack and one write into stdout's buffer.
+ * The event loop flushes stdout once per pass, after all of that pass's messages are handled.
+ */
+
+void ClientSession::Log(const char *format, ...)
+{
+	char line[SESSION_LOG_LINE_SIZE];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length < 0)
+	{
+		return;
+	}
+	if (length >= (int)sizeof(line))
+	{
+		length = sizeof(line) - 1;
+		line[length - 1] = '\n';	// cut short, but still a line of its own
+	}
+	cout.write(line, length);
+}
+
+int ClientSession::NextTransactionNumber()
+{
+	return transactionNumber++;
+}
+
+int ClientSession::PeekTransactionNumber()
+{
+	return transactionNumber;
+}
+
+void ClientSession::ContinueTransactionNumbers(int next)
+{
+	transactionNumber = next;
+}
+
+/*
+ * Every completed transaction goes to the repository (or, once we've handed over to a restarted
+ * server, to that server's repository) and the top talkers, and to the capture and the telemetry
+ * segment if they're enabled. How long it queued in the kernel feeds overload control.
+ */
+
+void ClientSession::RecordTransaction(
+	int socket,
+	TestRecord &record,
+	int requestLength,
+	int replyLength
+){
+	PROFILE_SCOPE(PHASE_RECORD);
+	if (handoff.IsDraining())
+	{
+		handoff.ForwardRecord(record);
+	}
+	else
+	{
+		resultsRepo.StoreRecord(record);
+	}
+	capture.Record(record, useUDP, listeners.Port(socket), requestLength, replyLength);
+	telemetry.TransactionCompleted(socket, record, useUDP, requestLength, replyLength);
+	overload.RequestQueued(record.queueNs);
+	topTalkers.Record(record.ipAddress.s_addr, (uint64_t)requestLength + replyLength, record.receivedNs);
+}
+
+/*
+ * TransformPayload() turns a request into its reply, returning the reply's length (which must
+ * fit in RX_BUFFER_SIZE). The base class just shouts the request back in uppercase.
+ */
+
+int ClientSession::TransformPayload(
+	const char * request,
+	char * reply,
+	int length
+){
+	for (int i = 0; i < length; i++)
+	{
+		reply[i] = toupper(request[i]);
+	}
+	return length;
+}
+
 int ClientSession::SendMessage(
 	int socket,
 	struct sockaddr *clientAddress,
@@ -109,10 +319,14 @@ int ClientSession::SendMessage(
 	{
 		clientAddress = NULL;
 	}
-	rc = sendto(socket, (void *)buffer, bufferLength, 0, clientAddress, addrLength);
+	{
+		PROFILE_SCOPE(PHASE_SEND);
+		rc = sendto(socket, (void *)buffer, bufferLength, 0, clientAddress, addrLength);
+	}
+	PROFILE_SCOPE(PHASE_LOGGING);
 	if (rc > 0)
 	{
-		cout << "Sent " << rc << " bytes: " << buffer << endl;
+		Log("Sent %d bytes: %.*s\n", rc, rc, buffer);
 	}
 	else
 	{
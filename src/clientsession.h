@@ -24,6 +24,10 @@
 #define CLIENTSESSION_H_
 
 #define RX_BUFFER_SIZE	250	// TODO: this would be a great candidate for a command-line parameter as well
+#define SESSION_DESCRIPTION_SIZE	64
+#define SESSION_LOG_LINE_SIZE		(SESSION_DESCRIPTION_SIZE + (2 * RX_BUFFER_SIZE))
+
+struct _TestRecord;
 
 class ClientSession
 {
@@ -34,7 +38,23 @@ public:
 	);
 	virtual ~ClientSession();
 
+	// connection-oriented sessions get told when each connection starts and ends...
+
+	virtual void ConnectionEstablished(int socket) {}
+	virtual void ConnectionTerminated(int socket) {}
+
+	// ...and are asked what to poll() each one for: normally POLLIN, but POLLOUT while a reply is
+	// only partly sent (ReadyToWrite() is then called to carry on), or nothing at all
+
+	virtual short PollEvents(int socket);
+	virtual int ReadyToWrite(int socket);
+
 	virtual int MessageReceived(int socket);
+	virtual int TransformPayload(
+		const char * request,
+		char * reply,
+		int length
+	);
 	virtual int SendMessage(
 		int socket,
 		struct sockaddr *clientAddress,
@@ -43,11 +63,31 @@ public:
 		int bufferLength
 	);
 
+	// a restarted server carries on numbering where its predecessor left off
+
+	static int PeekTransactionNumber();
+	static void ContinueTransactionNumbers(int next);
+	static int NextTransactionNumber();
+
+	bool UsesUDP() { return useUDP; }
+
+	// per-message logging, formatted in one go and left for the event loop to flush
+
+	static void Log(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
 protected:
-	char * description;	// as friendly and plaintext-y a description as the available intel will allow
+	void RecordTransaction(
+		int socket,
+		struct _TestRecord &record,
+		int requestLength,
+		int replyLength
+	);
+
+	char description[SESSION_DESCRIPTION_SIZE];	// as friendly and plaintext-y a description as the available intel will allow
 	bool useUDP;
 
-	char rxbuffer[RX_BUFFER_SIZE];
+	char rxbuffer[RX_BUFFER_SIZE];	// for subclasses that read requests themselves
+	struct _TestRecord *record;	// the transaction under way, allocated with the session rather than for each message
 
 private:
 };
@@ -0,0 +1,109 @@
+/*
+ * framepool.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+using namespace std;
+
+#include "framepool.h"
+
+#define FRAME_ALIGNMENT	64		// a cache line; more than enough for anything a frame holds
+
+FramePool::FramePool()
+{
+	slab = NULL;
+	blockSize = 0;
+	blocks = 0;
+	freeList = NULL;
+	memset(&stats, 0, sizeof(stats));
+}
+
+FramePool::~FramePool()
+{
+	if (slab)
+	{
+		free(slab);
+		slab = NULL;
+	}
+}
+
+bool FramePool::Init(size_t size, unsigned int count)
+{
+	if (slab)
+	{
+		cerr << "FramePool: already initialized" << endl;
+		return false;
+	}
+	blockSize = ((size + FRAME_ALIGNMENT - 1) / FRAME_ALIGNMENT) * FRAME_ALIGNMENT;
+	blocks = count;
+	if (posix_memalign((void **)&slab, FRAME_ALIGNMENT, blockSize * blocks) != 0)
+	{
+		cerr << "FramePool: unable to allocate " << blocks << " frames of " << blockSize << " bytes" << endl;
+		slab = NULL;
+		return false;
+	}
+
+	// thread the free list through the blocks themselves, lowest address first
+
+	freeList = NULL;
+	for (unsigned int i = blocks; i > 0; i--)
+	{
+		FreeBlock *block = (FreeBlock *)(slab + ((i - 1) * blockSize));
+		block->next = freeList;
+		freeList = block;
+	}
+	return true;
+}
+
+void *FramePool::Allocate(size_t size)
+{
+	stats.allocations++;
+	if (size > blockSize)
+	{
+		stats.oversize++;
+		return malloc(size);
+	}
+	if (freeList == NULL)
+	{
+		stats.exhausted++;
+		return NULL;
+	}
+	FreeBlock *block = freeList;
+	freeList = block->next;
+	stats.inUse++;
+	if (stats.inUse > stats.highWater)
+	{
+		stats.highWater = stats.inUse;
+	}
+	return block;
+}
+
+void FramePool::Release(void *frame, size_t size)
+{
+	if (frame == NULL)
+	{
+		return;
+	}
+	if (size > blockSize)
+	{
+		free(frame);
+		return;
+	}
+	FreeBlock *block = (FreeBlock *)frame;
+	block->next = freeList;
+	freeList = block;
+	stats.inUse--;
+}
+
+// the sole global instance
+
+FramePool framePool;
+
+// end of framepool.cpp
@@ -0,0 +1,68 @@
+/*
+ * framepool.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * FramePool hands out fixed-size blocks for coroutine frames (see scriptedsession.h). Every
+ * scripted session needs exactly one frame for as long as it lives, so rather than going to the
+ * heap each time a connection arrives, we carve all the frames out of one slab at startup and
+ * keep the unused ones on a free list. Allocate() and Release() are a couple of pointer moves.
+ *
+ * A frame bigger than the block size (a script with unusually large local buffers) is still
+ * served, from malloc(), and counted in Stats().oversize - if that's ever non-zero, raise the
+ * block size. When every block is in use, Allocate() returns NULL rather than growing; the
+ * caller refuses the session, just as it would if it ran out of sockets.
+ */
+
+#ifndef FRAMEPOOL_H_
+#define FRAMEPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _FramePoolStats
+{
+	uint64_t allocations;
+	uint64_t oversize;		// frames too big for a block, served by malloc() instead
+	uint64_t exhausted;		// requests refused because every block was in use
+	unsigned int inUse;
+	unsigned int highWater;	// the most blocks ever in use at once
+} FramePoolStats;
+
+class FramePool
+{
+public:
+	FramePool();
+	virtual ~FramePool();
+
+	bool Init(size_t blockSize, unsigned int blocks);
+	bool IsInitialized() { return slab != NULL; }
+
+	void *Allocate(size_t size);
+	void Release(void *frame, size_t size);
+
+	size_t BlockSize() { return blockSize; }
+	unsigned int Blocks() { return blocks; }
+	const FramePoolStats& Stats() { return stats; }
+
+protected:
+	typedef struct _FreeBlock
+	{
+		struct _FreeBlock *next;
+	} FreeBlock;
+
+	char *slab;
+	size_t blockSize;
+	unsigned int blocks;
+	FreeBlock *freeList;
+	FramePoolStats stats;
+
+private:
+};
+
+extern FramePool framePool;
+
+#endif /* FRAMEPOOL_H_ */
+
+// end of framepool.h
@@ -0,0 +1,483 @@
+/*
+ * handoff.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <iostream>
+using namespace std;
+
+#include "handoff.h"
+#include "clientsession.h"
+
+#define HANDOFF_HAS_REPOSITORY	0x1
+#define HANDOFF_HAS_CONSOLE		0x2
+#define HANDOFF_MAX_FDS			HANDOFF_LISTENERS_PER_MESSAGE	// the most any one message carries
+
+RestartHandoff::RestartHandoff()
+{
+	path = NULL;
+	listenSocket = -1;
+	predecessor = -1;
+	successor = -1;
+	memset(&stats, 0, sizeof(stats));
+}
+
+RestartHandoff::~RestartHandoff()
+{
+	Close();
+}
+
+static bool MakeAddress(const char *path, struct sockaddr_un &address)
+{
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		cerr << "RestartHandoff: socket path is too long: " << path << endl;
+		return false;
+	}
+	strcpy(address.sun_path, path);
+	return true;
+}
+
+void RestartHandoff::SetTimeout(int socket, int milliseconds)
+{
+	struct timeval timeout;
+	timeout.tv_sec = milliseconds / 1000;
+	timeout.tv_usec = (milliseconds % 1000) * 1000;
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+void RestartHandoff::Prepare(HandoffMessage &message, HandoffMessageType type)
+{
+	memset(&message, 0, sizeof(message));
+	message.magic = HANDOFF_MAGIC;
+	message.version = HANDOFF_VERSION;
+	message.type = type;
+	message.pid = getpid();
+	message.recordSize = sizeof(TestRecord);
+}
+
+/*
+ * One message per SOCK_SEQPACKET packet, optionally with file descriptors riding along.
+ */
+
+bool RestartHandoff::Send(int socket, HandoffMessage &message, int *fds, int count)
+{
+	struct iovec iov;
+	iov.iov_base = &message;
+	iov.iov_len = sizeof(message);
+
+	char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+	struct msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+	if (count > 0)
+	{
+		memset(control, 0, sizeof(control));
+		header.msg_control = control;
+		header.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	}
+	if (sendmsg(socket, &header, MSG_NOSIGNAL) != (ssize_t)sizeof(message))
+	{
+		cerr << "RestartHandoff: unable to send to the other server (" << errno << ")" << endl;
+		return false;
+	}
+	return true;
+}
+
+bool RestartHandoff::Receive(int socket, HandoffMessage &message, HandoffMessageType type, int *fds, int &count)
+{
+	struct iovec iov;
+	iov.iov_base = &message;
+	iov.iov_len = sizeof(message);
+
+	char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+	struct msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+
+	count = 0;
+	ssize_t n = recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+
+	// take charge of any descriptors first, so that nothing leaks whatever else is wrong
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg))
+	{
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+		{
+			int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			int *data = (int *)CMSG_DATA(cmsg);
+			for (int i = 0; i < received; i++)
+			{
+				if ((fds != NULL) && (count < HANDOFF_MAX_FDS))
+				{
+					fds[count++] = data[i];
+				}
+				else
+				{
+					close(data[i]);
+				}
+			}
+		}
+	}
+
+	if (n != (ssize_t)sizeof(message))
+	{
+		cerr << "RestartHandoff: " << ((n < 0) ? "nothing" : "garbage") << " from the other server (" << errno << ")" << endl;
+		return false;
+	}
+	if ((message.magic != HANDOFF_MAGIC) || (message.version != HANDOFF_VERSION) || (message.recordSize != sizeof(TestRecord)))
+	{
+		cerr << "RestartHandoff: the other server is an incompatible version" << endl;
+		return false;
+	}
+	if (message.type != (uint32_t)type)
+	{
+		cerr << "RestartHandoff: expected message " << type << " but got " << message.type << endl;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Ask whoever is listening at path for its sockets and repository. Returns false if there was
+ * nobody to take over from (or the swap fell through), in which case we start from scratch.
+ */
+
+bool RestartHandoff::TakeOver(const char *socketPath, HandoffState &state)
+{
+	struct sockaddr_un address;
+	if (!MakeAddress(socketPath, address))
+	{
+		return false;
+	}
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+	{
+		cerr << "RestartHandoff: unable to create socket (" << errno << ")" << endl;
+		return false;
+	}
+	if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0)
+	{
+		if ((errno != ENOENT) && (errno != ECONNREFUSED))
+		{
+			cerr << "RestartHandoff: unable to reach " << socketPath << " (" << errno << ")" << endl;
+		}
+		close(sock);
+		return false;	// nobody home - an ordinary start
+	}
+	SetTimeout(sock, HANDOFF_TIMEOUT_MS);
+
+	HandoffMessage message;
+	int fds[HANDOFF_MAX_FDS];
+	int count = 0;
+	Prepare(message, HANDOFF_HELLO);
+	bool ok = Send(sock, message, NULL, 0) && Receive(sock, message, HANDOFF_STATE, fds, count);
+
+	int expected = 1;
+	expected += (message.flags & HANDOFF_HAS_REPOSITORY) ? 1 : 0;
+	expected += (message.flags & HANDOFF_HAS_CONSOLE) ? 1 : 0;
+	if (ok && (count != expected))
+	{
+		cerr << "RestartHandoff: expected " << expected << " sockets but got " << count << endl;
+		ok = false;
+	}
+	state.listeners = NULL;
+	state.listenerCount = 0;
+	if (ok)
+	{
+		int i = 0;
+		state.consoleListener = fds[i++];
+		state.repository = (message.flags & HANDOFF_HAS_REPOSITORY) ? fds[i++] : -1;
+		state.consoleSession = (message.flags & HANDOFF_HAS_CONSOLE) ? fds[i++] : -1;
+		state.repositoryCapacity = message.repositoryCapacity;
+		state.repositoryHead = message.repositoryHead;
+		state.recordsStored = message.recordsStored;
+		state.nextTransactionNumber = message.nextTransactionNumber;
+		state.pid = message.pid;
+
+		// then the transaction listeners, a batch at a time
+
+		int total = message.listenerCount;
+		state.listeners = (HandoffListener *)malloc(sizeof(HandoffListener) * ((total > 0) ? total : 1));
+		ok = (state.listeners != NULL);
+		int batch[HANDOFF_MAX_FDS];
+		while (ok && (state.listenerCount < total))
+		{
+			int received = 0;
+			ok = Receive(sock, message, HANDOFF_LISTENERS, batch, received);
+			if (ok && ((received != (int)message.listenerCount) || (state.listenerCount + received > total)))
+			{
+				cerr << "RestartHandoff: listener sockets don't match their descriptions" << endl;
+				ok = false;
+			}
+			if (!ok)
+			{
+				for (int b = 0; b < received; b++)
+				{
+					close(batch[b]);
+				}
+				break;
+			}
+			for (int b = 0; b < received; b++)
+			{
+				state.listeners[state.listenerCount] = message.listeners[b];
+				state.listeners[state.listenerCount].socket = batch[b];
+				state.listenerCount++;
+			}
+		}
+	}
+	if (ok)
+	{
+		Prepare(message, HANDOFF_READY);
+		ok = Send(sock, message, NULL, 0);
+	}
+	if (!ok)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			close(fds[i]);
+		}
+		for (int i = 0; i < state.listenerCount; i++)
+		{
+			close(state.listeners[i].socket);
+		}
+		free(state.listeners);
+		state.listeners = NULL;
+		state.listenerCount = 0;
+		close(sock);
+		return false;
+	}
+
+	// past READY the old server has let go, so it's ours even if RELEASED never comes
+
+	if (!Receive(sock, message, HANDOFF_RELEASED, NULL, count))
+	{
+		cerr << "RestartHandoff: Warning: the old server may still hold the capture file and telemetry segment" << endl;
+	}
+	SetTimeout(sock, 0);
+	predecessor = sock;
+	return true;
+}
+
+/*
+ * Records forwarded by our predecessor as its sessions drain. They're numbered as they arrive,
+ * so the repository's transaction numbers stay unique. Returns 0 once the predecessor is gone.
+ */
+
+int RestartHandoff::ReceiveRecords()
+{
+	if (predecessor < 0)
+	{
+		return 0;
+	}
+	while (1)
+	{
+		HandoffMessage message;
+		ssize_t n = recv(predecessor, &message, sizeof(message), MSG_DONTWAIT);
+		if (n < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			{
+				return 1;
+			}
+			cerr << "RestartHandoff: lost the link to the old server (" << errno << ")" << endl;
+		}
+		if (n <= 0)
+		{
+			close(predecessor);
+			predecessor = -1;
+			return 0;
+		}
+		if ((n != (ssize_t)sizeof(message)) || (message.magic != HANDOFF_MAGIC) || (message.type != HANDOFF_RECORD))
+		{
+			continue;
+		}
+		stats.received++;
+		message.record.transactionNumber = ClientSession::NextTransactionNumber();
+		if (IsDraining())
+		{
+			ForwardRecord(message.record);	// we've been replaced ourselves in the meantime
+		}
+		else
+		{
+			resultsRepo.StoreRecord(message.record);
+		}
+	}
+}
+
+/*
+ * Offer our sockets to a successor. Any stale socket file (from a server that didn't exit
+ * cleanly, or the predecessor we just took over from) is replaced.
+ */
+
+bool RestartHandoff::Listen(const char *socketPath)
+{
+	struct sockaddr_un address;
+	if (!MakeAddress(socketPath, address))
+	{
+		return false;
+	}
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+	{
+		cerr << "RestartHandoff: unable to create socket (" << errno << ")" << endl;
+		return false;
+	}
+	unlink(socketPath);
+	if ((bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0) || (listen(sock, 1) < 0))
+	{
+		cerr << "RestartHandoff: unable to listen on " << socketPath << " (" << errno << ")" << endl;
+		close(sock);
+		return false;
+	}
+	path = strdup(socketPath);
+	listenSocket = sock;
+	return true;
+}
+
+/*
+ * A successor is knocking. Once it says READY, we're committed: we stop listening for
+ * successors ourselves (it has the path now) and start forwarding records to it.
+ */
+
+bool RestartHandoff::HandOver(HandoffState &state)
+{
+	int sock = accept4(listenSocket, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0)
+	{
+		return false;
+	}
+	SetTimeout(sock, HANDOFF_TIMEOUT_MS);
+
+	HandoffMessage message;
+	int count;
+	if (!Receive(sock, message, HANDOFF_HELLO, NULL, count))
+	{
+		close(sock);
+		return false;
+	}
+	state.pid = message.pid;
+
+	int fds[HANDOFF_MAX_FDS];
+	count = 0;
+	fds[count++] = state.consoleListener;
+	Prepare(message, HANDOFF_STATE);
+	if (state.repository >= 0)
+	{
+		fds[count++] = state.repository;
+		message.flags |= HANDOFF_HAS_REPOSITORY;
+	}
+	if (state.consoleSession >= 0)
+	{
+		fds[count++] = state.consoleSession;
+		message.flags |= HANDOFF_HAS_CONSOLE;
+	}
+	message.nextTransactionNumber = state.nextTransactionNumber;
+	message.repositoryCapacity = state.repositoryCapacity;
+	message.repositoryHead = state.repositoryHead;
+	message.recordsStored = state.recordsStored;
+	message.listenerCount = state.listenerCount;
+	bool ok = Send(sock, message, fds, count);
+
+	for (int first = 0; ok && (first < state.listenerCount); first += HANDOFF_LISTENERS_PER_MESSAGE)
+	{
+		Prepare(message, HANDOFF_LISTENERS);
+		count = 0;
+		while ((count < HANDOFF_LISTENERS_PER_MESSAGE) && (first + count < state.listenerCount))
+		{
+			message.listeners[count] = state.listeners[first + count];
+			fds[count] = state.listeners[first + count].socket;
+			count++;
+		}
+		message.listenerCount = count;
+		ok = Send(sock, message, fds, count);
+	}
+
+	if (!ok || !Receive(sock, message, HANDOFF_READY, NULL, count))
+	{
+		cerr << "RestartHandoff: server " << state.pid << " didn't take over; carrying on" << endl;
+		close(sock);
+		return false;
+	}
+
+	close(listenSocket);	// not unlinked - the path is our successor's now
+	listenSocket = -1;
+	successor = sock;
+	return true;
+}
+
+void RestartHandoff::Released()
+{
+	HandoffMessage message;
+	Prepare(message, HANDOFF_RELEASED);
+	Send(successor, message, NULL, 0);
+}
+
+void RestartHandoff::ForwardRecord(TestRecord &record)
+{
+	HandoffMessage message;
+	Prepare(message, HANDOFF_RECORD);
+	memcpy(&message.record, &record, sizeof(TestRecord));
+	if (send(successor, &message, sizeof(message), MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)sizeof(message))
+	{
+		stats.forwarded++;
+	}
+	else
+	{
+		stats.forwardDropped++;
+	}
+}
+
+void RestartHandoff::Close()
+{
+	if (listenSocket >= 0)
+	{
+		close(listenSocket);
+		listenSocket = -1;
+		unlink(path);	// still ours, since nobody took over
+	}
+	if (predecessor >= 0)
+	{
+		close(predecessor);
+		predecessor = -1;
+	}
+	if (successor >= 0)
+	{
+		close(successor);
+		successor = -1;
+	}
+	if (path)
+	{
+		free(path);
+		path = NULL;
+	}
+}
+
+// the sole global instance
+
+RestartHandoff handoff;
+
+// end of handoff.cpp
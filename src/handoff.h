@@ -0,0 +1,164 @@
+/*
+ * handoff.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * RestartHandoff lets a new xm2m-server take over from a running one without anybody noticing:
+ * no refused connections, no lost repository, no gap in an availability profile.
+ *
+ * Every server started with --handoff path listens on a Unix socket at path. A new server given
+ * the same path connects to it first, and if somebody answers, the two swap over:
+ *
+ *   new -> old   HELLO
+ *   old -> new   STATE, with the console's listener, the repository's memfd and the console
+ *                connection (if there is one) attached as SCM_RIGHTS
+ *   old -> new   LISTENERS, as many as it takes, each with up to HANDOFF_LISTENERS_PER_MESSAGE of
+ *                the transaction listeners attached, and which port and transport each one is
+ *   new -> old   READY - it has everything; from here on there's no going back
+ *   old -> new   RELEASED - it has let go of the capture file and telemetry segment
+ *
+ * The listening sockets are the very same sockets, not new ones bound to the same ports, so
+ * connections and datagrams arriving mid-swap simply wait in their queues for the new server.
+ * The repository's ring is mapped by both (see ResultsRepository::Inherit()), and transaction
+ * numbers carry on from where the old server had got to.
+ *
+ * The old server then stops listening but keeps serving the sessions it already has until they
+ * finish (or HANDOFF_DRAIN_SEC passes), forwarding their transaction records down the same Unix
+ * socket so the repository keeps exactly one writer. When it's done it exits, closing the link.
+ *
+ * So a restart is just: start the new server with the same --handoff path. Its own settings
+ * (--sessions, --repoSize and so on) take effect - the repository is copied into a ring of the
+ * new size if that changed. Listeners for ports both servers want are the old server's; the new
+ * server opens any ports that are new, and closes any it no longer wants.
+ */
+
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "resultsrepo.h"		// for TestRecord
+
+#define HANDOFF_MAGIC		0x784d3248	// 'xM2H'
+#define HANDOFF_VERSION		2
+#define HANDOFF_TIMEOUT_MS	2000		// how long either side waits on the other mid-swap
+#define HANDOFF_DRAIN_SEC	60			// how long the old server keeps serving its sessions
+#define HANDOFF_LISTENERS_PER_MESSAGE	64	// well under the kernel's limit of descriptors per message
+
+typedef enum _HandoffMessageType
+{
+	HANDOFF_HELLO = 1,
+	HANDOFF_STATE,
+	HANDOFF_READY,
+	HANDOFF_RELEASED,
+	HANDOFF_RECORD,
+	HANDOFF_LISTENERS
+} HandoffMessageType;
+
+/*
+ * A transaction listener changing hands (socket is only meaningful on each side's own end).
+ */
+
+typedef struct _HandoffListener
+{
+	uint16_t port;
+	uint8_t udp;
+	uint8_t spare;
+	int32_t socket;
+} HandoffListener;
+
+/*
+ * Everything a server hands to its replacement. Sockets are -1 if there's nothing to pass.
+ */
+
+typedef struct _HandoffState
+{
+	int consoleListener;
+	HandoffListener *listeners;	// given: the caller's; taken over: allocated, for the caller to free()
+	int listenerCount;
+	int consoleSession;
+	int repository;
+	unsigned int repositoryCapacity;
+	unsigned int repositoryHead;
+	uint64_t recordsStored;
+	int nextTransactionNumber;
+	pid_t pid;					// of the other server
+} HandoffState;
+
+typedef struct _HandoffStats
+{
+	uint64_t forwarded;			// records sent on to our successor while draining
+	uint64_t forwardDropped;	// ...that didn't fit in the socket
+	uint64_t received;			// records our predecessor forwarded to us
+} HandoffStats;
+
+class RestartHandoff
+{
+public:
+	RestartHandoff();
+	virtual ~RestartHandoff();
+
+	// the new server's side
+
+	bool TakeOver(const char *path, HandoffState &state);
+	int ReceiveRecords();
+	int PredecessorSocket() { return predecessor; }
+
+	// the old server's side
+
+	bool Listen(const char *path);
+	int ListenSocket() { return listenSocket; }
+	bool HandOver(HandoffState &state);
+	void Released();
+	bool IsDraining() { return successor >= 0; }
+	void ForwardRecord(TestRecord &record);
+
+	void Close();
+	const HandoffStats& Stats() { return stats; }
+
+protected:
+	typedef struct _HandoffMessage
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t type;
+		int32_t pid;
+		uint32_t recordSize;		// both sides must agree on what a TestRecord is
+
+		// HANDOFF_STATE
+
+		uint32_t flags;
+		int32_t nextTransactionNumber;
+		uint32_t repositoryCapacity;
+		uint32_t repositoryHead;
+		uint64_t recordsStored;
+		uint32_t listenerCount;		// in STATE, all of them; in LISTENERS, how many are in this one
+
+		union
+		{
+			TestRecord record;		// HANDOFF_RECORD
+			HandoffListener listeners[HANDOFF_LISTENERS_PER_MESSAGE];	// HANDOFF_LISTENERS
+		};
+	} HandoffMessage;
+
+	void Prepare(HandoffMessage &message, HandoffMessageType type);
+	bool Send(int socket, HandoffMessage &message, int *fds, int count);
+	bool Receive(int socket, HandoffMessage &message, HandoffMessageType type, int *fds, int &count);
+	void SetTimeout(int socket, int milliseconds);
+
+	char *path;
+	int listenSocket;
+	int predecessor;	// the link to the server we took over from, until it exits
+	int successor;		// the link to the server that took over from us
+	HandoffStats stats;
+
+private:
+};
+
+extern RestartHandoff handoff;
+
+#endif /* HANDOFF_H_ */
+
+// end of handoff.h
@@ -0,0 +1,499 @@
+/*
+ * impairment.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <iostream>
+using namespace std;
+
+#include "impairment.h"
+#include "allocaudit.h"
+#include "amplifier.h"
+#include "timeutil.h"
+
+#define LINK_TABLE_MINIMUM	4096	// must be a power of two
+#define LINK_TABLE_PROBES	8		// how far we'll look for an idle entry to recycle
+#define DEFER_NS			1000000	// how long a reply waits for an amplified one to finish
+
+ReplyImpairment::ReplyImpairment()
+{
+	memset(&config, 0, sizeof(config));
+	config.distribution = DELAY_UNIFORM;
+	config.queueSize = 10000;
+
+	memset(&stats, 0, sizeof(stats));
+	enabled = false;
+	pool = NULL;
+	freeList = NULL;
+	freeCount = 0;
+	socketGenerations = NULL;
+	socketDepartures = NULL;
+	socketHeld = NULL;
+	maxSockets = 0;
+	links = NULL;
+	linkMask = 0;
+	randomState = 0;
+}
+
+ReplyImpairment::~ReplyImpairment()
+{
+	if (pool)
+	{
+		free(pool);
+		pool = NULL;
+	}
+	if (freeList)
+	{
+		free(freeList);
+		freeList = NULL;
+	}
+	if (socketGenerations)
+	{
+		free(socketGenerations);
+		socketGenerations = NULL;
+	}
+	if (socketDepartures)
+	{
+		free(socketDepartures);
+		socketDepartures = NULL;
+	}
+	if (socketHeld)
+	{
+		free(socketHeld);
+		socketHeld = NULL;
+	}
+	if (links)
+	{
+		free(links);
+		links = NULL;
+	}
+}
+
+/*
+ * Init() does all of the allocating, sized from the command line, so that queueing and
+ * sending replies later on never has to. If nothing was configured, it does nothing at all.
+ */
+
+bool ReplyImpairment::Init()
+{
+	if (
+		(config.delayMs <= 0.0) &&
+		(config.jitterMs <= 0.0) &&
+		(config.lossPercent <= 0.0) &&
+		(config.duplicatePercent <= 0.0) &&
+		(config.bandwidthBps == 0)
+	){
+		enabled = false;
+		return true;
+	}
+
+	if (!timers.Init(config.queueSize))
+	{
+		cerr << "ReplyImpairment: unable to allocate timer queue" << endl;
+		return false;
+	}
+	pool = (PendingReply *)malloc(sizeof(PendingReply) * config.queueSize);
+	freeList = (unsigned int *)malloc(sizeof(unsigned int) * config.queueSize);
+	if ((pool == NULL) || (freeList == NULL))
+	{
+		cerr << "ReplyImpairment: unable to allocate " << config.queueSize << " pending replies" << endl;
+		return false;
+	}
+	for (unsigned int i = 0; i < config.queueSize; i++)
+	{
+		freeList[i] = config.queueSize - 1 - i;	// hand out low indices first
+	}
+	freeCount = config.queueSize;
+
+	maxSockets = getdtablesize();
+	socketGenerations = (unsigned int *)calloc(maxSockets, sizeof(unsigned int));
+	socketDepartures = (uint64_t *)calloc(maxSockets, sizeof(uint64_t));
+	socketHeld = (unsigned char *)calloc(maxSockets, sizeof(unsigned char));
+	if ((socketGenerations == NULL) || (socketDepartures == NULL) || (socketHeld == NULL))
+	{
+		cerr << "ReplyImpairment: unable to allocate socket table" << endl;
+		return false;
+	}
+
+	if (config.bandwidthBps > 0)
+	{
+		// a link is only busy while a reply to its client is pending, or its session is open, so
+		// at least twice that many entries keeps the table no more than half full of busy links
+
+		uint64_t wanted = 2 * ((uint64_t)config.queueSize + config.sessions);
+		unsigned int size = LINK_TABLE_MINIMUM;
+		while ((size < wanted) && (size < 0x80000000U))
+		{
+			size *= 2;
+		}
+		links = (LinkState *)calloc(size, sizeof(LinkState));
+		if (links == NULL)
+		{
+			cerr << "ReplyImpairment: unable to allocate " << size << " links" << endl;
+			return false;
+		}
+		linkMask = size - 1;
+	}
+
+	randomState = MonotonicNanoseconds() | 1;	// xorshift state must never be zero
+	enabled = true;
+
+	cout << "Impairing replies: delay " << config.delayMs << "ms, jitter " << config.jitterMs
+		<< "ms, loss " << config.lossPercent << "%, duplicate " << config.duplicatePercent
+		<< "%, bandwidth " << config.bandwidthBps << "bps, queue " << config.queueSize << endl;
+	return true;
+}
+
+/*
+ * QueueReply() stands in for SendMessage() and returns what SendMessage() would have, so the
+ * caller carries on as if the reply went out. Dropped replies still 'succeed' - the emulated
+ * link lost them, not the session - but lost is set, so the transaction's record can say the
+ * client never got a reply (and reconciliation reports it as unreplied). So is a UDP reply that
+ * found the queue full; a TCP one can't be lost without breaking the stream, so QueueReply()
+ * returns -1 instead, and the session is closed.
+ *
+ * TCP replies are never dropped or duplicated, and each is held back until at least just after
+ * the session's previous one, so the stream stays in order whatever delays are drawn.
+ */
+
+int ReplyImpairment::QueueReply(
+	ClientSession *session,
+	int socket,
+	struct sockaddr *clientAddress,
+	int addrLength,
+	char * buffer,
+	int bufferLength,
+	bool &lost
+){
+	lost = false;
+	bool udp = session->UsesUDP();
+	if (udp && (config.lossPercent > 0.0) && ((RandomUniform() * 100.0) < config.lossPercent))
+	{
+		stats.dropped++;
+		lost = true;
+		return bufferLength;
+	}
+
+	int copies = 1;
+	if (udp && (config.duplicatePercent > 0.0) && ((RandomUniform() * 100.0) < config.duplicatePercent))
+	{
+		copies = 2;
+		stats.duplicated++;
+	}
+
+	uint64_t now = MonotonicNanoseconds();
+	int scheduled = 0;
+	for (int i = 0; i < copies; i++)
+	{
+		uint64_t departure = now;
+		if (links)
+		{
+			departure = LinkDeparture(clientAddress, addrLength, bufferLength, now);
+		}
+		departure += SampleDelay();
+		if (!udp && (socket >= 0) && (socket < maxSockets))
+		{
+			// strictly after the previous reply, so that equal deadlines can't swap in the timer heap
+
+			if (departure <= socketDepartures[socket])
+			{
+				departure = socketDepartures[socket] + 1;
+			}
+			socketDepartures[socket] = departure;
+		}
+		if (Schedule(session, socket, clientAddress, addrLength, buffer, bufferLength, departure))
+		{
+			scheduled++;
+		}
+	}
+	if (!udp && (scheduled == 0))
+	{
+		cerr << "Reply impairment queue is full (" << config.queueSize << " replies): closing TCP session " << socket << endl;
+		return -1;
+	}
+	lost = (scheduled == 0);
+	return bufferLength;
+}
+
+bool ReplyImpairment::Schedule(
+	ClientSession *session,
+	int socket,
+	struct sockaddr *clientAddress,
+	int addrLength,
+	char * buffer,
+	int bufferLength,
+	uint64_t departure
+){
+	if (freeCount == 0)
+	{
+		stats.overflowed++;
+		return false;
+	}
+	unsigned int index = freeList[--freeCount];
+	PendingReply &reply = pool[index];
+
+	reply.session = session;
+	reply.socket = socket;
+	reply.generation = ((socket >= 0) && (socket < maxSockets)) ? socketGenerations[socket] : 0;
+	if (addrLength > (int)sizeof(reply.address))
+	{
+		addrLength = sizeof(reply.address);
+	}
+	memcpy(&reply.address, clientAddress, addrLength);
+	reply.addrLength = addrLength;
+	if (bufferLength > (int)sizeof(reply.data))
+	{
+		bufferLength = sizeof(reply.data);
+	}
+	memcpy(reply.data, buffer, bufferLength);
+	reply.length = bufferLength;
+
+	timers.Push(departure, index);	// can't fail: the pool and the heap are the same size
+	stats.queued++;
+	return true;
+}
+
+/*
+ * Whether a TCP session still has replies in the queue - which an amplified reply mustn't
+ * overtake.
+ */
+
+bool ReplyImpairment::HasQueued(int socket, uint64_t now)
+{
+	return enabled && (socket >= 0) && (socket < maxSockets) && (socketDepartures[socket] > now);
+}
+
+void ReplyImpairment::Hold(int socket)
+{
+	if (enabled && (socket >= 0) && (socket < maxSockets) && !socketHeld[socket])
+	{
+		socketHeld[socket] = 1;
+		stats.held++;
+	}
+}
+
+/*
+ * Service() is called by the main loop after every poll() and sends everything that has come
+ * due. Replies for TCP sessions that have since closed are discarded - the socket number may
+ * already belong to somebody else.
+ *
+ * Returns how many held sessions have seen their last queued reply go, and can be polled for
+ * input again.
+ */
+
+int ReplyImpairment::Service(uint64_t now)
+{
+	if (!enabled)
+	{
+		return 0;
+	}
+	int released = 0;
+	uint64_t retry = now + DEFER_NS;
+	while (!timers.IsEmpty() && (timers.NextDeadline() <= now))
+	{
+		uint64_t deadline;
+		unsigned int index;
+		timers.Pop(deadline, index);
+
+		PendingReply &reply = pool[index];
+		bool tracked = (reply.socket >= 0) && (reply.socket < maxSockets);
+		unsigned int generation = tracked ? socketGenerations[reply.socket] : 0;
+		if (generation != reply.generation)
+		{
+			stats.orphaned++;
+		}
+		else if (!reply.session->UsesUDP() && amplifier.IsSending(reply.socket))
+		{
+			// still in order: each one put back this time round goes back a little later than the last
+
+			timers.Push(retry++, index);
+			stats.deferred++;
+			continue;
+		}
+		else
+		{
+			ALLOC_AUDIT_SCOPE();
+			int rc = reply.session->SendMessage(
+				reply.socket,
+				(struct sockaddr *)&reply.address,
+				reply.addrLength,
+				reply.data,
+				reply.length
+			);
+			if (rc < (int)reply.length)
+			{
+				stats.failed++;
+			}
+			else
+			{
+				stats.sent++;
+			}
+		}
+		if (tracked && socketHeld[reply.socket] && (socketDepartures[reply.socket] <= deadline))
+		{
+			socketHeld[reply.socket] = 0;	// that was the last of them
+			released++;
+		}
+		freeList[freeCount++] = index;
+	}
+	return released;
+}
+
+/*
+ * The main loop calls ForgetSocket() just before it closes a TCP session, so that any replies
+ * still queued for it are recognized as orphans when they come due.
+ */
+
+void ReplyImpairment::ForgetSocket(int socket)
+{
+	if (enabled && (socket >= 0) && (socket < maxSockets))
+	{
+		socketGenerations[socket]++;
+		socketDepartures[socket] = 0;	// whoever gets this descriptor next starts afresh
+		socketHeld[socket] = 0;
+	}
+}
+
+/*
+ * How long may the main loop sleep in poll()? No longer than its usual idle timeout, and no
+ * longer than it takes for the next pending reply to come due.
+ */
+
+int ReplyImpairment::PollTimeout(int idleTimeout, uint64_t now)
+{
+	if (!enabled || timers.IsEmpty())
+	{
+		return idleTimeout;
+	}
+	uint64_t next = timers.NextDeadline();
+	if (next <= now)
+	{
+		return 0;
+	}
+	uint64_t ms = ((next - now) + NANOS_PER_MSEC - 1) / NANOS_PER_MSEC;
+	if ((idleTimeout >= 0) && (ms > (uint64_t)idleTimeout))
+	{
+		return idleTimeout;
+	}
+	return (int)ms;
+}
+
+/*
+ * Each client gets its own emulated link. A reply can't start onto the link until the previous
+ * reply to the same client has finished, and then takes (bits / bandwidth) to serialize.
+ * Returns the time its last bit leaves the link.
+ *
+ * A new client takes over a nearby entry only if that entry's link has gone idle, so nobody's
+ * shaping is forgotten while their replies are still going out. If every entry in reach is busy
+ * (which a table sized as in Init() makes rare), the new client is counted as a collision and
+ * shares the link that will be free soonest - queueing behind it is the closest thing to right.
+ */
+
+uint64_t ReplyImpairment::LinkDeparture(struct sockaddr *clientAddress, int addrLength, int bytes, uint64_t now)
+{
+	uint32_t ip = 0;
+	uint16_t port = 0;
+	if (addrLength >= (int)sizeof(struct sockaddr_in))
+	{
+		struct sockaddr_in *inaddr = (struct sockaddr_in *)clientAddress;
+		ip = inaddr->sin_addr.s_addr;
+		port = inaddr->sin_port;
+	}
+
+	unsigned int hash = ((ip * 2654435761U) ^ (port * 40503U)) & linkMask;
+	LinkState *link = NULL;
+	LinkState *idlest = NULL;
+	for (unsigned int probe = 0; probe < LINK_TABLE_PROBES; probe++)
+	{
+		LinkState *candidate = &links[(hash + probe) & linkMask];
+		if ((candidate->ipAddress == ip) && (candidate->port == port))
+		{
+			link = candidate;
+			break;
+		}
+		if ((idlest == NULL) || (candidate->linkFreeAt < idlest->linkFreeAt))
+		{
+			idlest = candidate;
+		}
+	}
+	if (link == NULL)
+	{
+		link = idlest;
+		if (link->linkFreeAt <= now)
+		{
+			// quiet (or never used), so it's free to become this client's
+			link->ipAddress = ip;
+			link->port = port;
+			link->linkFreeAt = 0;
+		}
+		else
+		{
+			stats.linkCollisions++;
+		}
+	}
+
+	uint64_t start = (link->linkFreeAt > now) ? link->linkFreeAt : now;
+	uint64_t serialization = ((uint64_t)bytes * 8ULL * NANOS_PER_SEC) / config.bandwidthBps;
+	link->linkFreeAt = start + serialization;
+	return link->linkFreeAt;
+}
+
+uint64_t ReplyImpairment::SampleDelay()
+{
+	double delay = config.delayMs;
+	if (config.jitterMs > 0.0)
+	{
+		switch (config.distribution)
+		{
+			case DELAY_NORMAL:
+			{
+				// Box-Muller; the (1 - u) keeps log() away from zero
+				double u1 = 1.0 - RandomUniform();
+				double u2 = RandomUniform();
+				delay += config.jitterMs * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+				break;
+			}
+
+			case DELAY_EXPONENTIAL:
+				delay += -config.jitterMs * log(1.0 - RandomUniform());
+				break;
+
+			case DELAY_UNIFORM:
+			default:
+				delay += config.jitterMs * ((2.0 * RandomUniform()) - 1.0);
+				break;
+		}
+	}
+	if (delay <= 0.0)
+	{
+		return 0;
+	}
+	return (uint64_t)(delay * (double)NANOS_PER_MSEC);
+}
+
+/*
+ * xorshift64* - plenty random enough for emulating a network, and far cheaper than rand()
+ */
+
+double ReplyImpairment::RandomUniform()
+{
+	randomState ^= randomState >> 12;
+	randomState ^= randomState << 25;
+	randomState ^= randomState >> 27;
+	uint64_t r = randomState * 2685821657736338717ULL;
+	return (double)(r >> 11) * (1.0 / 9007199254740992.0);	// 53 bits -> [0, 1)
+}
+
+// the sole global instance
+
+ReplyImpairment impairment;
+
+// end of impairment.cpp
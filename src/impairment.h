@@ -0,0 +1,166 @@
+/*
+ * impairment.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * ReplyImpairment sits between a ClientSession's payload transform and its SendMessage(),
+ * and makes the server's replies look like they travelled over a slow or lossy link (a
+ * narrowband IoT connection, say) instead of a fast Ethernet segment. It can:
+ * - delay replies by a constant, uniform, normal or exponential distribution
+ * - drop or duplicate a percentage of replies
+ * - cap the bandwidth seen by each client, so big bursts queue up behind each other
+ *
+ * Loss and duplication only apply to UDP. A TCP link can be slow, but it delivers the byte stream
+ * in order and exactly once, so a TCP session's replies are only ever delayed - and never
+ * overtake one another, however the delays fall: each leaves no earlier than the one before it.
+ * If the queue is too full to take a TCP reply, the session is closed (and that's logged) rather
+ * than carry on with a hole in its stream.
+ *
+ * Amplified replies (see amplifier.h) don't fit in the queue and go straight out, so on TCP an
+ * AMPLIFY request that arrives while the session still has impaired replies queued is left
+ * unread - the session is held (see Hold()), and not polled for input - until the last of them
+ * has gone; Service() says when it has, so the main loop can poll the session again. And a
+ * reply that comes due while an amplified one is still going out on its socket goes back in the
+ * queue for a moment, rather than land in the middle of it.
+ *
+ * Nothing here ever blocks. Replies are copied into a preallocated pool and their departure
+ * times are kept in a TimerQueue; the main loop shortens its poll() timeout to the next
+ * departure (see PollTimeout()) and calls Service() to send whatever has come due.
+ *
+ * When no impairment options are given on the command line, IsEnabled() is false and
+ * ClientSession sends its replies directly, exactly as before.
+ */
+
+#ifndef IMPAIRMENT_H_
+#define IMPAIRMENT_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "clientsession.h"	// for RX_BUFFER_SIZE
+#include "timerqueue.h"
+
+typedef enum _DelayDistribution
+{
+	DELAY_UNIFORM = 0,		// delay +/- jitter, evenly spread
+	DELAY_NORMAL,			// mean delay, standard deviation jitter
+	DELAY_EXPONENTIAL		// delay plus an exponential tail with mean jitter
+} DelayDistribution;
+
+typedef struct _ImpairmentConfig
+{
+	double delayMs;			// base one-way delay added to every reply
+	double jitterMs;		// spread of the delay (meaning depends on distribution)
+	DelayDistribution distribution;
+	double lossPercent;		// chance that a reply is silently dropped
+	double duplicatePercent;	// chance that a reply is sent twice
+	uint64_t bandwidthBps;	// per-client bandwidth cap in bits per second (0 == unlimited)
+	unsigned int queueSize;	// how many replies may be pending at once
+	unsigned int sessions;	// concurrent TCP sessions allowed, which with queueSize sizes the link table
+} ImpairmentConfig;
+
+typedef struct _ImpairmentStats
+{
+	uint64_t queued;		// replies accepted into the queue (duplicates included)
+	uint64_t sent;			// replies that left the queue and went out
+	uint64_t failed;		// ...and ones that left it but SendMessage() couldn't send in full
+	uint64_t dropped;		// replies discarded by the loss setting
+	uint64_t duplicated;	// extra copies created by the duplicate setting
+	uint64_t overflowed;	// replies discarded because the queue was full
+	uint64_t orphaned;		// replies whose TCP session closed before they were due
+	uint64_t linkCollisions;	// clients that found no idle link entry, and shared a busy one
+	uint64_t deferred;		// replies put back because an amplified reply was still going out
+	uint64_t held;			// AMPLIFY requests held back behind a session's queued replies
+} ImpairmentStats;
+
+class ReplyImpairment
+{
+public:
+	ReplyImpairment();
+	virtual ~ReplyImpairment();
+
+	ImpairmentConfig config;	// filled in by ParseCommandLine() before Init()
+
+	virtual bool Init();
+	bool IsEnabled() { return enabled; }
+
+	virtual int QueueReply(
+		ClientSession *session,
+		int socket,
+		struct sockaddr *clientAddress,
+		int addrLength,
+		char * buffer,
+		int bufferLength,
+		bool &lost
+	);
+	virtual int Service(uint64_t now);
+	void ForgetSocket(int socket);
+
+	bool HasQueued(int socket, uint64_t now);
+	void Hold(int socket);
+	bool IsHolding(int socket) { return enabled && (socket >= 0) && (socket < maxSockets) && socketHeld[socket]; }
+
+	int PollTimeout(int idleTimeout, uint64_t now);
+	unsigned int Pending() { return timers.Size(); }
+	const ImpairmentStats& Stats() { return stats; }
+
+protected:
+	typedef struct _PendingReply
+	{
+		ClientSession *session;
+		int socket;
+		unsigned int generation;	// must still match socketGenerations[socket] when sent
+		struct sockaddr_in address;
+		unsigned short addrLength;
+		unsigned short length;
+		char data[RX_BUFFER_SIZE];
+	} PendingReply;
+
+	typedef struct _LinkState
+	{
+		uint32_t ipAddress;		// network byte order, like sin_addr
+		uint16_t port;			// network byte order, like sin_port
+		uint64_t linkFreeAt;	// when this client's emulated link finishes its current burst
+	} LinkState;
+
+	bool Schedule(
+		ClientSession *session,
+		int socket,
+		struct sockaddr *clientAddress,
+		int addrLength,
+		char * buffer,
+		int bufferLength,
+		uint64_t departure
+	);
+	uint64_t SampleDelay();
+	uint64_t LinkDeparture(struct sockaddr *clientAddress, int addrLength, int bytes, uint64_t now);
+	double RandomUniform();
+
+	bool enabled;
+	ImpairmentStats stats;
+
+	TimerQueue timers;
+	PendingReply *pool;
+	unsigned int *freeList;
+	unsigned int freeCount;
+
+	unsigned int *socketGenerations;
+	uint64_t *socketDepartures;	// when each TCP session's latest reply is due to leave
+	unsigned char *socketHeld;	// TCP sessions waiting for their queued replies to go
+	int maxSockets;
+
+	LinkState *links;
+	unsigned int linkMask;	// table size is a power of two; this is size-1
+
+	uint64_t randomState;
+
+private:
+};
+
+extern ReplyImpairment impairment;
+
+#endif /* IMPAIRMENT_H_ */
+
+// end of impairment.h
@@ -0,0 +1,558 @@
+/*
+ * listeners.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <strings.h>
+#include <unistd.h>
+#include <iostream>
+using namespace std;
+
+#include "listeners.h"
+#include "clientsession-profile.h"
+#include "scriptedsession.h"
+
+static const char *transformNames[] = { "upper", "echo", "lower", "reverse" };
+static const char *framingNames[] = { "raw", "crlf" };
+
+static void DefaultProfile(SessionProfile &profile, const char *name)
+{
+	memset(&profile, 0, sizeof(profile));
+	snprintf(profile.name, sizeof(profile.name), "%s", name);
+	profile.transform = TRANSFORM_UPPER;
+	profile.framing = FRAMING_RAW;
+	profile.tcp = true;
+	profile.udp = true;
+}
+
+ListenerTable::ListenerTable()
+{
+	DefaultProfile(profiles[0], "default");
+	profileCount = 1;
+	ranges = NULL;
+	rangeCount = 0;
+	listeners = NULL;
+	count = 0;
+	routes = NULL;
+	routeCount = 0;
+}
+
+ListenerTable::~ListenerTable()
+{
+	for (int p = 0; p < profileCount; p++)
+	{
+		if (!profiles[p].script)
+		{
+			delete profiles[p].tcpSession;	// a script's session belongs to whoever made it
+		}
+		delete profiles[p].udpSession;
+	}
+	free(ranges);
+	free(listeners);
+	free(routes);
+}
+
+SessionProfile *ListenerTable::FindProfile(const char *name)
+{
+	for (int p = 0; p < profileCount; p++)
+	{
+		if (strcmp(profiles[p].name, name) == 0)
+		{
+			return &profiles[p];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * name:key=value,key=value... (see the header file). Redefining a profile starts it afresh.
+ */
+
+bool ListenerTable::DefineProfile(const char *spec)
+{
+	const char *colon = strchr(spec, ':');
+	int nameLength = (colon != NULL) ? (int)(colon - spec) : (int)strlen(spec);
+	if ((nameLength == 0) || (nameLength >= LISTENER_PROFILE_NAME))
+	{
+		cerr << "Profile names should be 1 to " << (LISTENER_PROFILE_NAME - 1) << " characters: " << spec << endl;
+		return false;
+	}
+	char name[LISTENER_PROFILE_NAME];
+	memcpy(name, spec, nameLength);
+	name[nameLength] = '\0';
+
+	SessionProfile *profile = FindProfile(name);
+	if (profile == NULL)
+	{
+		if (profileCount >= LISTENER_MAX_PROFILES)
+		{
+			cerr << "No more than " << LISTENER_MAX_PROFILES << " profiles, please" << endl;
+			return false;
+		}
+		profile = &profiles[profileCount++];
+	}
+	DefaultProfile(*profile, name);
+
+	char *settings = strdup((colon != NULL) ? colon + 1 : "");
+	if (settings == NULL)
+	{
+		return false;
+	}
+	bool valid = true;
+	char *context = NULL;
+	for (char *setting = strtok_r(settings, ",", &context); valid && (setting != NULL); setting = strtok_r(NULL, ",", &context))
+	{
+		char *value = strchr(setting, '=');
+		if (value == NULL)
+		{
+			cerr << "Profile settings are key=value: " << setting << endl;
+			valid = false;
+			break;
+		}
+		*value++ = '\0';
+
+		char *end;
+		if (strcasecmp(setting, "transform") == 0)
+		{
+			valid = false;
+			for (int t = 0; t < (int)(sizeof(transformNames) / sizeof(transformNames[0])); t++)
+			{
+				if (strcasecmp(value, transformNames[t]) == 0)
+				{
+					profile->transform = (ProfileTransform)t;
+					valid = true;
+				}
+			}
+		}
+		else if (strcasecmp(setting, "framing") == 0)
+		{
+			valid = false;
+			for (int f = 0; f < (int)(sizeof(framingNames) / sizeof(framingNames[0])); f++)
+			{
+				if (strcasecmp(value, framingNames[f]) == 0)
+				{
+					profile->framing = (ProfileFraming)f;
+					valid = true;
+				}
+			}
+		}
+		else if (strcasecmp(setting, "transport") == 0)
+		{
+			profile->tcp = (strcasecmp(value, "tcp") == 0) || (strcasecmp(value, "both") == 0);
+			profile->udp = (strcasecmp(value, "udp") == 0) || (strcasecmp(value, "both") == 0);
+			valid = profile->tcp || profile->udp;
+		}
+		else if (strcasecmp(setting, "sessions") == 0)
+		{
+			long n = strtol(value, &end, 10);
+			profile->maxSessions = (unsigned int)n;
+			valid = (end != value) && (*end == '\0') && (n >= 0) && (n <= INT_MAX);
+		}
+		else if (strcasecmp(setting, "maxRequest") == 0)
+		{
+			long n = strtol(value, &end, 10);
+			profile->maxRequest = (unsigned int)n;
+			valid = (end != value) && (*end == '\0') && (n >= 0) && (n <= INT_MAX);
+		}
+		else if (strcasecmp(setting, "script") == 0)
+		{
+			profile->script = (strcasecmp(value, "atm") == 0);
+			valid = profile->script || (strcasecmp(value, "none") == 0);
+		}
+		else
+		{
+			cerr << "Unknown profile setting: " << setting << endl;
+			valid = false;
+			break;
+		}
+		if (!valid)
+		{
+			cerr << "Bad value for profile setting " << setting << ": " << value << endl;
+		}
+	}
+	free(settings);
+	return valid;
+}
+
+/*
+ * port or first-last, comma-separated, each optionally followed by @profile. The profile needn't
+ * have been defined yet; it's looked up in Init().
+ */
+
+bool ListenerTable::AddPorts(const char *spec)
+{
+	char *ports = strdup(spec);		// however long the list is
+	if (ports == NULL)
+	{
+		return false;
+	}
+	bool valid = true;
+	char *context = NULL;
+	for (char *item = strtok_r(ports, ",", &context); valid && (item != NULL); item = strtok_r(NULL, ",", &context))
+	{
+		PortRange range;
+		memset(&range, 0, sizeof(range));
+		strcpy(range.profile, "default");
+		char *at = strchr(item, '@');
+		if (at != NULL)
+		{
+			*at++ = '\0';
+			if ((strlen(at) == 0) || (strlen(at) >= sizeof(range.profile)))
+			{
+				cerr << "Bad profile name: " << at << endl;
+				valid = false;
+				break;
+			}
+			strcpy(range.profile, at);
+		}
+
+		char *end;
+		long first = strtol(item, &end, 10);
+		long last = first;
+		if (*end == '-')
+		{
+			last = strtol(end + 1, &end, 10);
+		}
+		if ((end == item) || (*end != '\0') || (first < 0) || (last > 65535) || (first > last))
+		{
+			cerr << "Port numbers should be from 0 to 65535, as n or first-last: " << item << endl;
+			valid = false;
+			break;
+		}
+		range.first = (unsigned short)first;
+		range.last = (unsigned short)last;
+
+		PortRange *grown = (PortRange *)realloc(ranges, sizeof(PortRange) * (rangeCount + 1));
+		if (grown == NULL)
+		{
+			valid = false;
+			break;
+		}
+		ranges = grown;
+		ranges[rangeCount++] = range;
+	}
+	free(ports);
+	return valid;
+}
+
+/*
+ * Turns the port ranges into listeners (a UDP and/or a TCP one per port, as the profile says),
+ * in the order they were given. With no --port at all, it's defaultPort with the default profile.
+ */
+
+bool ListenerTable::Init(int defaultPort)
+{
+	if (rangeCount == 0)
+	{
+		char port[16];
+		snprintf(port, sizeof(port), "%d", defaultPort);
+		if (!AddPorts(port))
+		{
+			return false;
+		}
+	}
+
+	int total = 0;
+	for (int r = 0; r < rangeCount; r++)
+	{
+		SessionProfile *profile = FindProfile(ranges[r].profile);
+		if (profile == NULL)
+		{
+			cerr << "Ports " << ranges[r].first << "-" << ranges[r].last << " use profile "
+				<< ranges[r].profile << ", which isn't defined" << endl;
+			return false;
+		}
+		total += (ranges[r].last - ranges[r].first + 1) * ((profile->tcp ? 1 : 0) + (profile->udp ? 1 : 0));
+	}
+
+	listeners = (Listener *)malloc(sizeof(Listener) * total);
+	unsigned char *used = (unsigned char *)calloc(65536, 1);
+	if ((listeners == NULL) || (used == NULL))
+	{
+		cerr << "Insufficient memory for " << total << " listeners" << endl;
+		free(used);
+		return false;
+	}
+
+	bool ok = true;
+	for (int r = 0; ok && (r < rangeCount); r++)
+	{
+		SessionProfile *profile = FindProfile(ranges[r].profile);
+		for (int port = ranges[r].first; port <= ranges[r].last; port++)
+		{
+			if (used[port])
+			{
+				cerr << "Port " << port << " is listed more than once" << endl;
+				ok = false;
+				break;
+			}
+			used[port] = 1;
+			profile->ports++;
+			for (int transport = 0; transport < 2; transport++)
+			{
+				bool udp = (transport == 0);
+				if (udp ? profile->udp : profile->tcp)
+				{
+					Listener &listener = listeners[count++];
+					listener.socket = -1;
+					listener.port = port;
+					listener.udp = udp;
+					listener.profile = profile;
+				}
+			}
+		}
+	}
+	free(used);
+	return ok;
+}
+
+bool ListenerTable::NeedsScript()
+{
+	for (int p = 0; p < profileCount; p++)
+	{
+		if ((profiles[p].ports > 0) && profiles[p].tcp && profiles[p].script)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * One session object per transport per profile in use, named after the profile unless it's the
+ * default one. Scripted profiles' TCP sessions are all the one script session.
+ */
+
+bool ListenerTable::CreateSessions(ScriptedSession *script)
+{
+	for (int p = 0; p < profileCount; p++)
+	{
+		SessionProfile &profile = profiles[p];
+		if (profile.ports == 0)
+		{
+			continue;
+		}
+		char description[64];
+		bool named = (p != 0);
+		if (profile.tcp)
+		{
+			if (profile.script)
+			{
+				profile.tcpSession = script;
+			}
+			else
+			{
+				snprintf(description, sizeof(description), named ? "TCP client (%s)" : "TCP client", profile.name);
+				profile.tcpSession = new ProfileClientSession(description, false, &profile);
+			}
+		}
+		if (profile.udp)
+		{
+			snprintf(description, sizeof(description), named ? "UDP clients (%s)" : "UDP clients", profile.name);
+			profile.udpSession = new ProfileClientSession(description, true, &profile);
+		}
+		if ((profile.tcp && (profile.tcpSession == NULL)) || (profile.udp && (profile.udpSession == NULL)))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Takes on the listeners a predecessor handed over, where we want the same port and transport,
+ * and closes the rest. Returns how many were taken on; the others still need opening.
+ */
+
+int ListenerTable::Adopt(HandoffListener *inherited, int inheritedCount)
+{
+	int *index = (int *)malloc(sizeof(int) * 65536 * 2);	// port and transport to listener
+	if (index == NULL)
+	{
+		return 0;
+	}
+	for (int i = 0; i < 65536 * 2; i++)
+	{
+		index[i] = -1;
+	}
+	for (int l = 0; l < count; l++)
+	{
+		index[(listeners[l].port * 2) + (listeners[l].udp ? 1 : 0)] = l;
+	}
+
+	int adopted = 0;
+	for (int i = 0; i < inheritedCount; i++)
+	{
+		int l = index[(inherited[i].port * 2) + (inherited[i].udp ? 1 : 0)];
+		if ((l >= 0) && (listeners[l].socket < 0) && SetSocket(l, inherited[i].socket))
+		{
+			adopted++;
+		}
+		else
+		{
+			close(inherited[i].socket);		// a port we don't serve any more
+		}
+	}
+	free(index);
+	return adopted;
+}
+
+bool ListenerTable::SetSocket(int index, int socket)
+{
+	if (!SetRoute(socket, &listeners[index], NULL))
+	{
+		return false;
+	}
+	listeners[index].socket = socket;
+	return true;
+}
+
+void ListenerTable::Export(HandoffListener *out)
+{
+	for (int l = 0; l < count; l++)
+	{
+		out[l].port = listeners[l].port;
+		out[l].udp = listeners[l].udp ? 1 : 0;
+		out[l].spare = 0;
+		out[l].socket = listeners[l].socket;
+	}
+}
+
+/*
+ * The route table is sized at startup to cover every descriptor the process may have, so that
+ * accepting a session never has to grow it. Should a descriptor beyond that turn up anyway (the
+ * limit raised since, say), it grows, doubling, to cover it.
+ */
+
+bool ListenerTable::ReserveRoutes(int descriptors)
+{
+	if (descriptors <= routeCount)
+	{
+		return true;
+	}
+	Route *grown = (Route *)realloc(routes, sizeof(Route) * descriptors);
+	if (grown == NULL)
+	{
+		cerr << "Insufficient memory to route " << descriptors << " descriptors" << endl;
+		return false;
+	}
+	memset(grown + routeCount, 0, sizeof(Route) * (descriptors - routeCount));
+	routes = grown;
+	routeCount = descriptors;
+	return true;
+}
+
+bool ListenerTable::SetRoute(int socket, Listener *listener, SessionProfile *profile)
+{
+	if (socket < 0)
+	{
+		return false;
+	}
+	if (socket >= routeCount)
+	{
+		int size = (routeCount > 0) ? routeCount : 64;
+		while (size <= socket)
+		{
+			size *= 2;
+		}
+		if (!ReserveRoutes(size))
+		{
+			return false;
+		}
+	}
+	routes[socket].listener = listener;
+	routes[socket].profile = profile;
+	routes[socket].port = listener ? listener->port : 0;
+	return true;
+}
+
+/*
+ * A TCP session has been accepted on listener. Returns false if its profile already has all the
+ * sessions it's allowed, in which case the caller should refuse it.
+ */
+
+bool ListenerTable::SessionOpened(int socket, Listener *listener)
+{
+	SessionProfile *profile = listener->profile;
+	if ((profile->maxSessions > 0) && (profile->sessions >= profile->maxSessions))
+	{
+		profile->refused++;
+		return false;
+	}
+	if (!SetRoute(socket, NULL, profile))
+	{
+		return false;
+	}
+	routes[socket].port = listener->port;
+	profile->sessions++;
+	profile->accepted++;
+	return true;
+}
+
+void ListenerTable::SessionClosed(int socket)
+{
+	if ((socket >= 0) && (socket < routeCount) && (routes[socket].profile != NULL))
+	{
+		routes[socket].profile->sessions--;
+		routes[socket].profile = NULL;
+		routes[socket].port = 0;
+	}
+}
+
+int ListenerTable::Format(char *buffer, size_t size, uint64_t now)
+{
+	int used = 0;
+	int profilesUsed = 0;
+	for (int p = 0; p < profileCount; p++)
+	{
+		profilesUsed += (profiles[p].ports > 0) ? 1 : 0;
+	}
+	used += snprintf(buffer + used, size - used, "Listeners: %d sockets, %d profiles in use\n", count, profilesUsed);
+
+	for (int p = 0; (p < profileCount) && (used < (int)size); p++)
+	{
+		SessionProfile &profile = profiles[p];
+		if (profile.ports == 0)
+		{
+			continue;
+		}
+		int lowest = 65536;
+		int highest = -1;
+		for (int l = 0; l < count; l++)
+		{
+			if (listeners[l].profile == &profile)
+			{
+				lowest = (listeners[l].port < lowest) ? listeners[l].port : lowest;
+				highest = (listeners[l].port > highest) ? listeners[l].port : highest;
+			}
+		}
+		char limit[16];
+		snprintf(limit, sizeof(limit), (profile.maxSessions > 0) ? "/%u" : "", profile.maxSessions);
+		char request[32];
+		snprintf(request, sizeof(request), (profile.maxRequest > 0) ? ", max request %u" : "", profile.maxRequest);
+		used += snprintf(buffer + used, size - used,
+			" %-15s %u port%s (%d-%d) %s%s%s, %s/%s%s: %u%s sessions, %llu accepted, %llu refused, %llu datagrams\n",
+			profile.name, profile.ports, (profile.ports == 1) ? "" : "s", lowest, highest,
+			profile.tcp ? "tcp" : "", (profile.tcp && profile.udp) ? "+" : "", profile.udp ? "udp" : "",
+			profile.script ? "script" : transformNames[profile.transform], framingNames[profile.framing],
+			request,
+			profile.sessions, limit,
+			(unsigned long long)profile.accepted, (unsigned long long)profile.refused,
+			(unsigned long long)profile.datagrams);
+	}
+	return (used < (int)size) ? used : (int)size - 1;
+}
+
+// the sole global instance
+
+ListenerTable listeners;
+
+// end of listeners.cpp
@@ -0,0 +1,173 @@
+/*
+ * listeners.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * ListenerTable holds every transaction port the server listens on, and the session profile each
+ * one is served with, so that one server (and one event loop) can stand in for many M2M services
+ * at once - a meter-reading service on one block of ports, a line-oriented one on another, an
+ * ATM on a third.
+ *
+ * Ports are given on the command line as lists and ranges, each optionally naming a profile:
+ *
+ *   --port 9900                         one port, TCP and UDP, with the default profile
+ *   --port 10000-10999@meter,11000      a thousand ports served as 'meter', and one more
+ *   --profile meter:transform=echo,transport=udp,maxRequest=64
+ *
+ * --port can be given as often as you like. A profile is a name, a colon and any of:
+ *   transform=upper|echo|lower|reverse   what a reply is made from (default upper)
+ *   framing=raw|crlf                     crlf: replies drop the request's line ending and end in CR/LF
+ *   transport=both|tcp|udp               which listeners each port gets (default both)
+ *   sessions=n                           at most n TCP sessions at once across the profile's ports
+ *   maxRequest=n                         longer requests get an error reply rather than a reply
+ *   script=atm|none                      TCP sessions run a script instead (see scriptedsession.h)
+ * The profile called 'default' is what ports naming no profile get; it can be redefined too.
+ *
+ * crlf isn't line framing: like any other session, it answers each read as it comes, so two lines
+ * that arrive together get one reply, and a line split across segments gets two. It suits clients
+ * that send one line and wait for the answer.
+ *
+ * Each profile has one session object per transport, however many ports it has. The table also
+ * maps every descriptor it knows about - listeners, and the sessions accepted on them - straight
+ * to its listener or profile by indexing an array with the descriptor, so the event loop finds
+ * out what a ready descriptor is in constant time, with no scan of thousands of listener fds.
+ */
+
+#ifndef LISTENERS_H_
+#define LISTENERS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "handoff.h"		// for HandoffListener
+
+#define LISTENER_MAX_PROFILES	32
+#define LISTENER_PROFILE_NAME	16
+
+class ClientSession;
+class ScriptedSession;
+
+typedef enum _ProfileTransform
+{
+	TRANSFORM_UPPER = 0,
+	TRANSFORM_ECHO,
+	TRANSFORM_LOWER,
+	TRANSFORM_REVERSE
+} ProfileTransform;
+
+typedef enum _ProfileFraming
+{
+	FRAMING_RAW = 0,
+	FRAMING_CRLF
+} ProfileFraming;
+
+typedef struct _SessionProfile
+{
+	char name[LISTENER_PROFILE_NAME];
+	ProfileTransform transform;
+	ProfileFraming framing;
+	bool tcp;
+	bool udp;
+	bool script;
+	unsigned int maxSessions;	// 0 == only --sessions limits them
+	unsigned int maxRequest;	// 0 == no limit
+
+	ClientSession *tcpSession;
+	ClientSession *udpSession;
+
+	unsigned int ports;
+	unsigned int sessions;		// TCP sessions open right now
+	uint64_t accepted;
+	uint64_t refused;			// for being over maxSessions
+	uint64_t datagrams;
+} SessionProfile;
+
+typedef struct _Listener
+{
+	int socket;
+	unsigned short port;
+	bool udp;
+	SessionProfile *profile;
+} Listener;
+
+class ListenerTable
+{
+public:
+	ListenerTable();
+	virtual ~ListenerTable();
+
+	// from the command line...
+
+	bool DefineProfile(const char *spec);
+	bool AddPorts(const char *spec);
+	void SetDefaultScript() { profiles[0].script = true; }
+
+	// ...then, once it's all been parsed
+
+	bool Init(int defaultPort);
+	bool NeedsScript();
+	bool CreateSessions(ScriptedSession *script);
+	int Count() { return count; }
+	Listener &At(int index) { return listeners[index]; }
+	int FirstPort() { return (count > 0) ? listeners[0].port : 0; }
+
+	// sockets: inherited from a server we took over from, or opened afresh, and handed on
+
+	int Adopt(HandoffListener *inherited, int inheritedCount);
+	bool SetSocket(int index, int socket);
+	void Export(HandoffListener *out);
+
+	// the event loop's lookups, by descriptor, in a table sized for every descriptor up front
+
+	bool ReserveRoutes(int descriptors);
+	Listener *Find(int socket) { return ((socket >= 0) && (socket < routeCount)) ? routes[socket].listener : NULL; }
+	ClientSession *Session(int socket)
+	{
+		return ((socket >= 0) && (socket < routeCount) && (routes[socket].profile != NULL)) ? routes[socket].profile->tcpSession : NULL;
+	}
+	unsigned short Port(int socket) { return ((socket >= 0) && (socket < routeCount)) ? routes[socket].port : 0; }
+	bool SessionOpened(int socket, Listener *listener);
+	void SessionClosed(int socket);
+	ClientSession *DatagramArrived(Listener *listener) { listener->profile->datagrams++; return listener->profile->udpSession; }
+
+	int Format(char *buffer, size_t size, uint64_t now);
+
+protected:
+	typedef struct _PortRange
+	{
+		unsigned short first;
+		unsigned short last;
+		char profile[LISTENER_PROFILE_NAME];
+	} PortRange;
+
+	typedef struct _Route
+	{
+		Listener *listener;			// if the descriptor is one of our listeners...
+		SessionProfile *profile;	// ...or a TCP session accepted on one
+		unsigned short port;		// the transaction port, either way
+	} Route;
+
+	SessionProfile *FindProfile(const char *name);
+	bool SetRoute(int socket, Listener *listener, SessionProfile *profile);
+
+	SessionProfile profiles[LISTENER_MAX_PROFILES];
+	int profileCount;
+
+	PortRange *ranges;
+	int rangeCount;
+
+	Listener *listeners;
+	int count;
+
+	Route *routes;
+	int routeCount;
+
+private:
+};
+
+extern ListenerTable listeners;
+
+#endif /* LISTENERS_H_ */
+
+// end of listeners.h
@@ -0,0 +1,112 @@
+/*
+ * loopmonitor.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "loopmonitor.h"
+#include "timeutil.h"
+
+LoopMonitor::LoopMonitor()
+{
+	startTime = 0;
+	phaseStart = 0;
+	busyNs = 0;
+	lastBusyNs = 0;
+	spinNs = 0;
+	sleepNs = 0;
+	iterations = 0;
+	spinPolls = 0;
+	spinWakeups = 0;
+	sleepWakeups = 0;
+	timeouts = 0;
+}
+
+LoopMonitor::~LoopMonitor()
+{
+}
+
+void LoopMonitor::Start(uint64_t now)
+{
+	startTime = now;
+	phaseStart = now;
+}
+
+void LoopMonitor::WaitStarted(uint64_t now)
+{
+	lastBusyNs = now - phaseStart;
+	busyNs += lastBusyNs;
+	phaseStart = now;
+	iterations++;
+}
+
+void LoopMonitor::SpinEnded(uint64_t now, unsigned int polls, bool gotEvents)
+{
+	spinNs += now - phaseStart;
+	phaseStart = now;
+	spinPolls += polls;
+	if (gotEvents)
+	{
+		spinWakeups++;
+	}
+}
+
+void LoopMonitor::SleepEnded(uint64_t now, bool gotEvents)
+{
+	sleepNs += now - phaseStart;
+	phaseStart = now;
+	if (gotEvents)
+	{
+		sleepWakeups++;
+	}
+	else
+	{
+		timeouts++;
+	}
+}
+
+static double Percent(uint64_t part, uint64_t whole)
+{
+	return (whole == 0) ? 0.0 : (100.0 * (double)part) / (double)whole;
+}
+
+static double Seconds(struct timeval &tv)
+{
+	return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0);
+}
+
+int LoopMonitor::Format(char *buffer, size_t size, uint64_t now)
+{
+	uint64_t busy = busyNs + (now - phaseStart);	// we're busy right now, answering this very request
+	uint64_t total = busy + spinNs + sleepNs;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	double wall = (double)(now - startTime) / (double)NANOS_PER_SEC;
+	double cpu = Seconds(usage.ru_utime) + Seconds(usage.ru_stime);
+
+	return snprintf(buffer, size,
+		"Event loop: %llu iterations over %.1fs\n"
+		" busy     %5.1f%%\n"
+		" spinning %5.1f%% (%llu polls, %llu wakeups)\n"
+		" sleeping %5.1f%% (%llu wakeups, %llu timeouts)\n"
+		" CPU      %.2fs user, %.2fs system (%.1f%% of one core)\n",
+		(unsigned long long)iterations, wall,
+		Percent(busy, total),
+		Percent(spinNs, total), (unsigned long long)spinPolls, (unsigned long long)spinWakeups,
+		Percent(sleepNs, total), (unsigned long long)sleepWakeups, (unsigned long long)timeouts,
+		Seconds(usage.ru_utime), Seconds(usage.ru_stime), (wall > 0.0) ? (100.0 * cpu / wall) : 0.0);
+}
+
+// the sole global instance
+
+LoopMonitor loopMonitor;
+
+// end of loopmonitor.cpp
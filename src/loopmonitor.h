@@ -0,0 +1,61 @@
+/*
+ * loopmonitor.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * LoopMonitor keeps track of where the main loop's wall-clock time goes:
+ * - sleeping: blocked inside poll() waiting for something to happen
+ * - spinning: burning CPU on non-blocking polls (only in --lowLatency mode), waiting for the same
+ * - busy: actually handling events
+ *
+ * Spinning trades CPU for latency, so it's worth being able to see how much CPU that trade
+ * costs. The report also includes the process's user and system CPU time from getrusage(),
+ * which should track (busy + spinning) closely.
+ */
+
+#ifndef LOOPMONITOR_H_
+#define LOOPMONITOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+class LoopMonitor
+{
+public:
+	LoopMonitor();
+	virtual ~LoopMonitor();
+
+	void Start(uint64_t now);
+
+	// call these in order, once per trip around the loop
+	void WaitStarted(uint64_t now);
+	void SpinEnded(uint64_t now, unsigned int polls, bool gotEvents);
+	void SleepEnded(uint64_t now, bool gotEvents);
+
+	int Format(char *buffer, size_t size, uint64_t now);
+	uint64_t LastBusy() { return lastBusyNs; }	// how long the latest trip around the loop was busy
+
+protected:
+	uint64_t startTime;
+	uint64_t phaseStart;	// when the current busy/spin/sleep phase began
+
+	uint64_t busyNs;
+	uint64_t lastBusyNs;
+	uint64_t spinNs;
+	uint64_t sleepNs;
+
+	uint64_t iterations;
+	uint64_t spinPolls;		// non-blocking polls issued while spinning
+	uint64_t spinWakeups;	// events found while spinning
+	uint64_t sleepWakeups;	// events found after sleeping
+	uint64_t timeouts;		// sleeps that ended with nothing to do
+
+private:
+};
+
+extern LoopMonitor loopMonitor;
+
+#endif /* LOOPMONITOR_H_ */
+
+// end of loopmonitor.h
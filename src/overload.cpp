@@ -0,0 +1,222 @@
+/*
+ * overload.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <iostream>
+using namespace std;
+
+#include "overload.h"
+#include "timeutil.h"
+
+static const char *levelNames[OVERLOAD_LEVELS] = { "NORMAL", "THROTTLE", "SHED", "REFUSE" };
+static const double levelPressures[OVERLOAD_LEVELS] = { 0.0, 1.0, 2.0, 4.0 };
+
+OverloadControl::OverloadControl()
+{
+	config.lagLimitNs = 0;
+	config.depthLimit = 0;
+	level = OVERLOAD_NORMAL;
+	levelSince = 0;
+	lastIteration = 0;
+	lagNs = 0;
+	queueDelayNs = 0;
+	depth16 = 0;
+	datagramCount = 0;
+	sawRequest = false;
+	memset(&stats, 0, sizeof(stats));
+}
+
+OverloadControl::~OverloadControl()
+{
+}
+
+double OverloadControl::Pressure()
+{
+	double pressure = 0.0;
+	if (config.lagLimitNs > 0)
+	{
+		uint64_t lag = (lagNs > queueDelayNs) ? lagNs : queueDelayNs;
+		pressure = (double)lag / (double)config.lagLimitNs;
+	}
+	if (config.depthLimit > 0)
+	{
+		double depthPressure = ((double)depth16 / 16.0) / (double)config.depthLimit;
+		if (depthPressure > pressure)
+		{
+			pressure = depthPressure;
+		}
+	}
+	return pressure;
+}
+
+void OverloadControl::ChangeLevel(OverloadLevel to, uint64_t now)
+{
+	if (levelSince != 0)
+	{
+		stats.levelNs[level] += now - levelSince;
+	}
+	if (to > level)
+	{
+		stats.escalations++;
+	}
+	else
+	{
+		stats.recoveries++;
+	}
+	cerr << "Overload: " << levelNames[level] << " -> " << levelNames[to]
+		 << " (lag " << (lagNs / NANOS_PER_USEC) << "us, kernel queueing " << (queueDelayNs / NANOS_PER_USEC)
+		 << "us, depth " << (depth16 / 16.0) << ")" << endl;
+	level = to;
+	levelSince = now;
+}
+
+/*
+ * Called once per trip around the loop, just after poll() returns, with how long the previous
+ * trip was busy and how many descriptors are ready now. Busy time only counts as lag if poll()
+ * didn't then have to sleep for longer than that - otherwise nobody was kept waiting by it.
+ * The averages weigh the newest sample 1/8.
+ */
+
+void OverloadControl::IterationStarted(uint64_t now, uint64_t busyNs, int ready)
+{
+	if (!IsEnabled())
+	{
+		return;
+	}
+	if (levelSince == 0)
+	{
+		levelSince = now;
+	}
+	uint64_t waitNs = ((lastIteration != 0) && (now - lastIteration > busyNs)) ? (now - lastIteration - busyNs) : 0;
+	lastIteration = now;
+	if (waitNs > busyNs)
+	{
+		busyNs = 0;
+	}
+
+	lagNs = lagNs - (lagNs / 8) + (busyNs / 8);
+	depth16 = depth16 - (depth16 / 8) + ((ready > 0) ? (2 * (unsigned int)ready) : 0);
+	if (!sawRequest)
+	{
+		queueDelayNs -= queueDelayNs / 8;	// nothing new arriving means nothing queueing
+	}
+	sawRequest = false;
+
+	double pressure = Pressure();
+	OverloadLevel target = OVERLOAD_NORMAL;
+	for (int l = OVERLOAD_LEVELS - 1; l > 0; l--)
+	{
+		if (pressure >= levelPressures[l])
+		{
+			target = (OverloadLevel)l;
+			break;
+		}
+	}
+
+	if (target > level)
+	{
+		ChangeLevel(target, now);
+	}
+	else if ((target < level) && (pressure < (levelPressures[level] / 2.0))
+		&& ((now - levelSince) >= ((uint64_t)OVERLOAD_HOLD_MS * NANOS_PER_MSEC)))
+	{
+		ChangeLevel((OverloadLevel)(level - 1), now);
+	}
+}
+
+void OverloadControl::RequestQueued(int64_t queueNs)
+{
+	if (queueNs >= 0)
+	{
+		queueDelayNs = queueDelayNs - (queueDelayNs / 8) + ((uint64_t)queueNs / 8);
+		sawRequest = true;
+	}
+}
+
+/*
+ * While shedding, the loop mustn't sleep for long, or the averages would take forever to notice
+ * that things have calmed down.
+ */
+
+int OverloadControl::PollTimeout(int timeout)
+{
+	if ((level != OVERLOAD_NORMAL) && ((timeout < 0) || (timeout > OVERLOAD_TICK_MS)))
+	{
+		return OVERLOAD_TICK_MS;
+	}
+	return timeout;
+}
+
+bool OverloadControl::RefuseSession()
+{
+	if (level == OVERLOAD_REFUSE)
+	{
+		stats.sessionsRefused++;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Reads and throws away the next datagram, if this is one we're shedding. Returns true if so.
+ */
+
+bool OverloadControl::DropDatagram(int socket)
+{
+	bool drop = (level == OVERLOAD_REFUSE) || ((level == OVERLOAD_SHED) && ((datagramCount++ & 1) != 0));
+	if (drop)
+	{
+		char discard[256];
+		recv(socket, discard, sizeof(discard), MSG_DONTWAIT);
+		stats.datagramsDropped++;
+	}
+	return drop;
+}
+
+int OverloadControl::Format(char *buffer, size_t size, uint64_t now)
+{
+	if (!IsEnabled())
+	{
+		return snprintf(buffer, size, "Overload control is not enabled.\n");
+	}
+
+	uint64_t levelNs[OVERLOAD_LEVELS];
+	uint64_t total = 0;
+	for (int l = 0; l < OVERLOAD_LEVELS; l++)
+	{
+		levelNs[l] = stats.levelNs[l] + (((l == level) && (levelSince != 0)) ? (now - levelSince) : 0);
+		total += levelNs[l];
+	}
+	double percent[OVERLOAD_LEVELS];
+	for (int l = 0; l < OVERLOAD_LEVELS; l++)
+	{
+		percent[l] = (total > 0) ? (100.0 * (double)levelNs[l] / (double)total) : 0.0;
+	}
+
+	return snprintf(buffer, size,
+		"Overload: %s for %.1fs (pressure %.2f; limits: lag %lluus, depth %u)\n"
+		" lag %lluus busy, %lluus kernel queueing; depth %.1f\n"
+		" shed: %llu accept batches capped, %llu datagrams dropped, %llu sessions refused\n"
+		" %llu escalations, %llu recoveries; time at NORMAL %.1f%%, THROTTLE %.1f%%, SHED %.1f%%, REFUSE %.1f%%\n",
+		levelNames[level], (double)(now - levelSince) / (double)NANOS_PER_SEC, Pressure(),
+		(unsigned long long)(config.lagLimitNs / NANOS_PER_USEC), config.depthLimit,
+		(unsigned long long)(lagNs / NANOS_PER_USEC), (unsigned long long)(queueDelayNs / NANOS_PER_USEC), depth16 / 16.0,
+		(unsigned long long)stats.acceptsCapped, (unsigned long long)stats.datagramsDropped,
+		(unsigned long long)stats.sessionsRefused,
+		(unsigned long long)stats.escalations, (unsigned long long)stats.recoveries,
+		percent[0], percent[1], percent[2], percent[3]);
+}
+
+// the sole global instance
+
+OverloadControl overload;
+
+// end of overload.cpp
@@ -0,0 +1,111 @@
+/*
+ * overload.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * OverloadControl keeps a saturated server responsive for the sessions it already has, by
+ * turning new work away in stages instead of letting everybody's latency grow without bound.
+ *
+ * Every trip around the event loop it takes two measurements:
+ * - lag: how long requests are waiting before we get to them - the larger of how long the last
+ *   iteration was busy for (if poll() then found more waiting, rather than having to sleep), and
+ *   how long recent requests sat in the kernel (their queueNs)
+ * - queue depth: how many descriptors poll() found ready at once
+ * Both are smoothed (an exponentially weighted moving average), and compared with the limits
+ * given on the command line to give a 'pressure': 1.0 means right at the limit.
+ *
+ *   level 0 NORMAL    pressure < 1    accept up to OVERLOAD_ACCEPT_BATCH connections per iteration
+ *   level 1 THROTTLE  pressure >= 1   accept only one per iteration; the rest wait in the backlog
+ *   level 2 SHED      pressure >= 2   ...and drop every other UDP request unread
+ *   level 3 REFUSE    pressure >= 4   ...drop every UDP request, and close new TCP sessions at once
+ *
+ * Existing sessions are always served. Levels go up as soon as the pressure says so, but only
+ * come down one at a time, once the pressure is below half of what it took to get there and the
+ * level has been held for OVERLOAD_HOLD_MS - so the server doesn't flap at the boundary. Level
+ * changes are logged, and the console's O command shows the levels, the measurements and how
+ * much has been shed.
+ *
+ * With neither --shedLag nor --shedQueue given, the level never leaves NORMAL.
+ */
+
+#ifndef OVERLOAD_H_
+#define OVERLOAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OVERLOAD_ACCEPT_BATCH	8
+#define OVERLOAD_HOLD_MS		500
+#define OVERLOAD_TICK_MS		50		// longest poll() while shedding
+#define OVERLOAD_LEVELS			4
+
+typedef enum _OverloadLevel
+{
+	OVERLOAD_NORMAL = 0,
+	OVERLOAD_THROTTLE,
+	OVERLOAD_SHED,
+	OVERLOAD_REFUSE
+} OverloadLevel;
+
+typedef struct _OverloadConfig
+{
+	uint64_t lagLimitNs;		// 0 == don't shed on lag
+	unsigned int depthLimit;	// 0 == don't shed on queue depth
+} OverloadConfig;
+
+typedef struct _OverloadStats
+{
+	uint64_t escalations;		// level increases
+	uint64_t recoveries;		// level decreases
+	uint64_t acceptsCapped;		// iterations that used up a lowered accept limit
+	uint64_t datagramsDropped;
+	uint64_t sessionsRefused;
+	uint64_t levelNs[OVERLOAD_LEVELS];	// time spent at each level
+} OverloadStats;
+
+class OverloadControl
+{
+public:
+	OverloadControl();
+	virtual ~OverloadControl();
+
+	bool IsEnabled() { return (config.lagLimitNs > 0) || (config.depthLimit > 0); }
+
+	void IterationStarted(uint64_t now, uint64_t busyNs, int ready);
+	void RequestQueued(int64_t queueNs);
+	int PollTimeout(int timeout);
+
+	OverloadLevel Level() { return level; }
+	int AcceptBudget() { return (level == OVERLOAD_THROTTLE) || (level == OVERLOAD_SHED) ? 1 : OVERLOAD_ACCEPT_BATCH; }
+	void AcceptsCapped() { stats.acceptsCapped++; }
+	bool RefuseSession();
+	bool DropDatagram(int socket);
+
+	int Format(char *buffer, size_t size, uint64_t now);
+	const OverloadStats& Stats() { return stats; }
+
+	OverloadConfig config;
+
+protected:
+	double Pressure();
+	void ChangeLevel(OverloadLevel to, uint64_t now);
+
+	OverloadLevel level;
+	uint64_t levelSince;
+	uint64_t lastIteration;
+	uint64_t lagNs;				// smoothed busy time per iteration
+	uint64_t queueDelayNs;		// smoothed kernel queueing time of requests
+	unsigned int depth16;		// smoothed ready descriptors, times 16
+	unsigned int datagramCount;	// for dropping every other one
+	bool sawRequest;			// since the last iteration
+	OverloadStats stats;
+
+private:
+};
+
+extern OverloadControl overload;
+
+#endif /* OVERLOAD_H_ */
+
+// end of overload.h
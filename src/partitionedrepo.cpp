@@ -0,0 +1,534 @@
+/*
+ * partitionedrepo.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+using namespace std;
+
+#include "partitionedrepo.h"
+#include "reportwriter.h"
+
+PartitionedRepository::PartitionedRepository()
+{
+	config.enabled = false;
+	config.minPerClient = 0;
+	links = NULL;
+	partitions = NULL;
+	freePartitions = NULL;
+	freeCount = 0;
+	index = NULL;
+	indexMask = 0;
+	byCount = NULL;
+	largest = 0;
+	used = 0;
+	active = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+PartitionedRepository::~PartitionedRepository()
+{
+	free(links);
+	free(partitions);
+	free(freePartitions);
+	free(index);
+	free(byCount);
+}
+
+void PartitionedRepository::Init(int howManyRecordsToKeep)
+{
+	ResultsRepository::Init(howManyRecordsToKeep);
+	if (config.enabled && slots)
+	{
+		Allocate();
+	}
+}
+
+/*
+ * Everything partitioning needs, sized from the pool, all at once: a link per slot, a partition
+ * per slot (every client with a partition has at least one record) and a spare for a newcomer,
+ * a hash index at most half full, and a list head per possible record count.
+ */
+
+bool PartitionedRepository::Allocate()
+{
+	unsigned int capacity = totalTestRecords;
+	unsigned int indexSize = 1;
+	while (indexSize < 2 * (capacity + 1))
+	{
+		indexSize *= 2;
+	}
+
+	links = (unsigned int *)malloc(capacity * sizeof(unsigned int));
+	partitions = (Partition *)calloc(capacity + 1, sizeof(Partition));
+	freePartitions = (unsigned int *)malloc((capacity + 1) * sizeof(unsigned int));
+	index = (unsigned int *)malloc(indexSize * sizeof(unsigned int));
+	byCount = (unsigned int *)malloc((capacity + 2) * sizeof(unsigned int));
+	if (!links || !partitions || !freePartitions || !index || !byCount)
+	{
+		cerr << "PartitionedRepository: not enough memory to partition " << capacity << " records; keeping one FIFO" << endl;
+		free(links);
+		free(partitions);
+		free(freePartitions);
+		free(index);
+		free(byCount);
+		links = NULL;
+		partitions = NULL;
+		freePartitions = NULL;
+		index = NULL;
+		byCount = NULL;
+		return false;
+	}
+
+	memset(links, 0xff, capacity * sizeof(unsigned int));		// PARTITION_NONE throughout
+	memset(index, 0xff, indexSize * sizeof(unsigned int));
+	memset(byCount, 0xff, (capacity + 2) * sizeof(unsigned int));
+	indexMask = indexSize - 1;
+	freeCount = 0;
+	for (unsigned int p = capacity + 1; p > 0; p--)
+	{
+		freePartitions[freeCount++] = p - 1;
+	}
+	largest = 0;
+	used = 0;
+	active = 0;
+	return true;
+}
+
+static inline unsigned int HashAddress(in_addr_t address)
+{
+	uint32_t x = (uint32_t)address;
+	x ^= x >> 16;
+	x *= 0x45d9f3b;
+	x ^= x >> 16;
+	return x;
+}
+
+/*
+ * Safe from any thread: the index and the partitions' addresses are only changed atomically. A
+ * lookup racing the writer may miss a client that's just come or gone, which is no worse than
+ * arriving a moment earlier or later.
+ */
+
+unsigned int PartitionedRepository::FindPartition(in_addr_t address)
+{
+	unsigned int h = HashAddress(address) & indexMask;
+	for (unsigned int probes = 0; probes <= indexMask; probes++)
+	{
+		unsigned int p = __atomic_load_n(&index[h], __ATOMIC_ACQUIRE);
+		if (p == PARTITION_NONE)
+		{
+			break;
+		}
+		if (__atomic_load_n(&partitions[p].address, __ATOMIC_ACQUIRE) == address)
+		{
+			return p;
+		}
+		h = (h + 1) & indexMask;
+	}
+	return PARTITION_NONE;
+}
+
+unsigned int PartitionedRepository::AddPartition(in_addr_t address)
+{
+	if (freeCount == 0)
+	{
+		return PARTITION_NONE;
+	}
+	unsigned int p = freePartitions[--freeCount];
+	Partition &partition = partitions[p];
+	partition.head = PARTITION_NONE;
+	partition.tail = PARTITION_NONE;
+	partition.count = 0;
+	partition.previous = PARTITION_NONE;
+	partition.next = PARTITION_NONE;
+	__atomic_store_n(&partition.address, address, __ATOMIC_RELEASE);
+
+	unsigned int h = HashAddress(address) & indexMask;
+	while (index[h] != PARTITION_NONE)
+	{
+		h = (h + 1) & indexMask;
+	}
+	__atomic_store_n(&index[h], p, __ATOMIC_RELEASE);
+
+	if (++active > stats.peakPartitions)
+	{
+		stats.peakPartitions = active;
+	}
+	return p;
+}
+
+/*
+ * Take an emptied partition out of the index, closing the gap behind it (linear probing's
+ * backward shift) so that no other client's probe sequence is broken.
+ */
+
+void PartitionedRepository::RemovePartition(unsigned int p)
+{
+	unsigned int i = HashAddress(partitions[p].address) & indexMask;
+	while (index[i] != p)
+	{
+		i = (i + 1) & indexMask;
+	}
+	unsigned int j = i;
+	for (;;)
+	{
+		j = (j + 1) & indexMask;
+		if (index[j] == PARTITION_NONE)
+		{
+			break;
+		}
+		unsigned int home = HashAddress(partitions[index[j]].address) & indexMask;
+		bool stays = (i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j));
+		if (!stays)
+		{
+			__atomic_store_n(&index[i], index[j], __ATOMIC_RELEASE);
+			i = j;
+		}
+	}
+	__atomic_store_n(&index[i], PARTITION_NONE, __ATOMIC_RELEASE);
+
+	freePartitions[freeCount++] = p;
+	active--;
+}
+
+/*
+ * Move a partition to the list for its new record count. Counts only ever change by one, so
+ * the largest count is easily kept up to date.
+ */
+
+void PartitionedRepository::SetCount(unsigned int p, unsigned int count)
+{
+	Partition &partition = partitions[p];
+	if (partition.count > 0)
+	{
+		if (partition.previous != PARTITION_NONE)
+		{
+			partitions[partition.previous].next = partition.next;
+		}
+		else
+		{
+			byCount[partition.count] = partition.next;
+		}
+		if (partition.next != PARTITION_NONE)
+		{
+			partitions[partition.next].previous = partition.previous;
+		}
+	}
+	partition.count = count;
+	partition.previous = PARTITION_NONE;
+	partition.next = PARTITION_NONE;
+	if (count > 0)
+	{
+		partition.next = byCount[count];
+		if (partition.next != PARTITION_NONE)
+		{
+			partitions[partition.next].previous = p;
+		}
+		byCount[count] = p;
+	}
+	if (count > largest)
+	{
+		largest = count;
+	}
+	while ((largest > 0) && (byCount[largest] == PARTITION_NONE))
+	{
+		largest--;
+	}
+}
+
+/*
+ * Whose oldest record makes way for partition p's new one: the largest partition's, or p's
+ * own if it's as large as any. Nobody else's if that would take them below the minimum.
+ */
+
+unsigned int PartitionedRepository::Victim(unsigned int p)
+{
+	if (largest == 0)
+	{
+		return PARTITION_NONE;
+	}
+	unsigned int victim = (partitions[p].count >= largest) ? p : byCount[largest];
+	if ((victim != p) && (partitions[victim].count <= config.minPerClient))
+	{
+		victim = (partitions[p].count > 0) ? p : PARTITION_NONE;
+	}
+	return victim;
+}
+
+unsigned int PartitionedRepository::TakeOldest(unsigned int p)
+{
+	Partition &partition = partitions[p];
+	unsigned int slot = partition.head;
+	unsigned int next = links[slot];
+	__atomic_store_n(&partition.head, next, __ATOMIC_RELEASE);
+	if (next == PARTITION_NONE)
+	{
+		partition.tail = PARTITION_NONE;
+	}
+	SetCount(p, partition.count - 1);
+	return slot;
+}
+
+void PartitionedRepository::Append(unsigned int p, unsigned int slot)
+{
+	Partition &partition = partitions[p];
+	__atomic_store_n(&links[slot], PARTITION_NONE, __ATOMIC_RELEASE);
+	if (partition.tail != PARTITION_NONE)
+	{
+		__atomic_store_n(&links[partition.tail], slot, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		__atomic_store_n(&partition.head, slot, __ATOMIC_RELEASE);
+	}
+	partition.tail = slot;
+	SetCount(p, partition.count + 1);
+}
+
+/*
+ * The writer. Only the event loop may call it, as with the base class.
+ */
+
+void PartitionedRepository::StoreRecord(TestRecord& record)
+{
+	if (links == NULL)
+	{
+		ResultsRepository::StoreRecord(record);
+		return;
+	}
+
+	in_addr_t address = record.ipAddress.s_addr;
+	unsigned int p = FindPartition(address);
+	if ((p == PARTITION_NONE) && ((p = AddPartition(address)) == PARTITION_NONE))
+	{
+		stats.unplaced++;	// can't happen: there's always a spare partition
+		return;
+	}
+
+	unsigned int slot;
+	unsigned int victim = PARTITION_NONE;
+	if (used < totalTestRecords)
+	{
+		slot = used++;
+	}
+	else
+	{
+		victim = Victim(p);
+		if (victim == PARTITION_NONE)
+		{
+			stats.unplaced++;
+			if (partitions[p].count == 0)
+			{
+				RemovePartition(p);
+			}
+			return;
+		}
+		slot = TakeOldest(victim);
+		if (victim == p)
+		{
+			stats.recycled++;
+		}
+		else
+		{
+			stats.evictions++;
+		}
+	}
+
+	WriteSlot(slot, record);
+	Append(p, slot);
+	if ((victim != PARTITION_NONE) && (victim != p) && (partitions[victim].count == 0))
+	{
+		RemovePartition(victim);
+	}
+
+	__atomic_store_n(&head, (used < totalTestRecords) ? used : 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&recordsStored, recordsStored + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * A client's records, oldest first, from any thread. Each record is checked to still be the
+ * client's after it's copied: if the writer has evicted it meanwhile, the walk stops there.
+ */
+
+unsigned int PartitionedRepository::VisitClient(struct in_addr client, RecordVisitor visitor, void *context)
+{
+	if (links == NULL)
+	{
+		return ResultsRepository::VisitClient(client, visitor, context);
+	}
+	unsigned int p = FindPartition(client.s_addr);
+	if (p == PARTITION_NONE)
+	{
+		return 0;
+	}
+
+	unsigned int visited = 0;
+	unsigned int slot = __atomic_load_n(&partitions[p].head, __ATOMIC_ACQUIRE);
+	TestRecord record;
+	for (unsigned int steps = 0; (slot != PARTITION_NONE) && (steps < totalTestRecords); steps++)
+	{
+		if (!ReadRecord(slot, record) || (record.ipAddress.s_addr != client.s_addr))
+		{
+			break;
+		}
+		unsigned int next = __atomic_load_n(&links[slot], __ATOMIC_ACQUIRE);
+		visited++;
+		if (!visitor(record, context))
+		{
+			break;
+		}
+		slot = next;
+	}
+	return visited;
+}
+
+unsigned int PartitionedRepository::ClientRecords(struct in_addr client)
+{
+	if (links == NULL)
+	{
+		return 0;
+	}
+	unsigned int p = FindPartition(client.s_addr);
+	return (p != PARTITION_NONE) ? partitions[p].count : 0;
+}
+
+static bool ReportVisitor(TestRecord &record, void *context)
+{
+	return ((ReportWriter *)context)->WriteRecord(record);
+}
+
+void PartitionedRepository::WriteReport(ReportWriter &writer)
+{
+	if (links == NULL)
+	{
+		ResultsRepository::WriteReport(writer);
+		return;
+	}
+	writer.Begin();
+	for (unsigned int p = 0; p <= totalTestRecords; p++)
+	{
+		if (partitions[p].count > 0)
+		{
+			struct in_addr client;
+			client.s_addr = partitions[p].address;
+			VisitClient(client, ReportVisitor, &writer);
+		}
+	}
+	writer.End();
+}
+
+/*
+ * A repository inherited from the server we're replacing, mapped as it was, still has to be
+ * partitioned: each client's records are found, put in order of transaction number, and linked.
+ * (If it was copied instead, that went through StoreRecord() and is partitioned already.)
+ */
+
+bool PartitionedRepository::Inherit(int fd, unsigned int capacity, unsigned int writeHead, uint64_t stored, int howManyRecordsToKeep)
+{
+	if (!ResultsRepository::Inherit(fd, capacity, writeHead, stored, howManyRecordsToKeep))
+	{
+		return false;
+	}
+	if (config.enabled && (links == NULL) && Allocate())
+	{
+		Rebuild();
+	}
+	return true;
+}
+
+typedef struct _RebuildEntry
+{
+	in_addr_t address;
+	unsigned int transactionNumber;
+	unsigned int slot;
+} RebuildEntry;
+
+static int CompareRebuildEntries(const void *a, const void *b)
+{
+	const RebuildEntry *x = (const RebuildEntry *)a;
+	const RebuildEntry *y = (const RebuildEntry *)b;
+	if (x->address != y->address)
+	{
+		return (x->address < y->address) ? -1 : 1;
+	}
+	return (x->transactionNumber < y->transactionNumber) ? -1 : (x->transactionNumber > y->transactionNumber) ? 1 : 0;
+}
+
+void PartitionedRepository::Rebuild()
+{
+	RebuildEntry *entries = (RebuildEntry *)malloc(totalTestRecords * sizeof(RebuildEntry));
+	if (entries == NULL)
+	{
+		return;
+	}
+	unsigned int count = 0;
+	TestRecord record;
+	for (unsigned int slot = 0; slot < totalTestRecords; slot++)
+	{
+		if (ReadRecord(slot, record))
+		{
+			entries[count].address = record.ipAddress.s_addr;
+			entries[count].transactionNumber = record.transactionNumber;
+			entries[count].slot = slot;
+			count++;
+			used = slot + 1;
+		}
+	}
+	qsort(entries, count, sizeof(RebuildEntry), CompareRebuildEntries);
+
+	unsigned int p = PARTITION_NONE;
+	for (unsigned int e = 0; e < count; e++)
+	{
+		if ((e == 0) || (entries[e].address != entries[e - 1].address))
+		{
+			p = AddPartition(entries[e].address);
+		}
+		Append(p, entries[e].slot);
+	}
+	free(entries);
+	head = (used < totalTestRecords) ? used : 0;
+}
+
+int PartitionedRepository::Format(char *buffer, size_t size, uint64_t now)
+{
+	if (links == NULL)
+	{
+		return snprintf(buffer, size, "Repository: one FIFO of %u records, %llu stored (start with --repoFair to partition it by client)\n",
+			totalTestRecords, (unsigned long long)recordsStored);
+	}
+
+	int n = snprintf(buffer, size,
+		"Repository: %u of %u slots used by %u clients (peak %u), at least %u each\n"
+		" %llu records given up for other clients', %llu for newer ones of the same client's, %llu unplaced\n"
+		" largest:\n",
+		used, totalTestRecords, active, stats.peakPartitions, config.minPerClient,
+		(unsigned long long)stats.evictions, (unsigned long long)stats.recycled, (unsigned long long)stats.unplaced);
+
+	int shown = 0;
+	for (unsigned int count = largest; (count > 0) && (shown < PARTITION_SHOWN) && (n < (int)size); count--)
+	{
+		for (unsigned int p = byCount[count]; (p != PARTITION_NONE) && (shown < PARTITION_SHOWN) && (n < (int)size); p = partitions[p].next)
+		{
+			struct in_addr client;
+			client.s_addr = partitions[p].address;
+			n += snprintf(buffer + n, size - n, "  %-15s %u records\n", inet_ntoa(client), count);
+			shown++;
+		}
+	}
+	return (n < (int)size) ? n : (int)size - 1;
+}
+
+// the sole global instance - and the one the rest of the server knows as resultsRepo
+
+PartitionedRepository partitionedRepo;
+ResultsRepository &resultsRepo = partitionedRepo;
+
+// end of partitionedrepo.cpp
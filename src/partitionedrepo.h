@@ -0,0 +1,122 @@
+/*
+ * partitionedrepo.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * PartitionedRepository shares the repository's slots out between clients, so that one device
+ * flooding the server can't push everybody else's history out of a single FIFO within seconds
+ * (and with it their chance to reconcile). Each client - each source address - gets a
+ * partition: its own oldest-to-newest chain of records. All of the partitions are carved from
+ * the one preallocated pool of slots the base class already has (in the same shared memory, with
+ * the same seqlocks), so nothing is allocated as records come and go.
+ *
+ * Until the pool is full, records simply take the next unused slot. After that, each new record
+ * takes the oldest record of the largest partition - its own, if it's the largest (or tied for
+ * it). So a flooding client ends up recycling its own slots, and the quiet ones keep theirs; and
+ * with many busy clients, each tends toward an equal share of the pool. The largest partition is
+ * found in constant time, by keeping partitions in lists by how many records they hold, as the
+ * top talkers' Space-Saving summaries do.
+ *
+ * --repoFair min turns partitioning on, and guarantees each client its min newest records: a
+ * partition holding min or fewer is never taken from for somebody else. If there are so many
+ * clients that everybody is down to the minimum, a client with records recycles its own oldest,
+ * and one without gets nothing kept (it's counted as unplaced) until there's room again.
+ *
+ * VisitClient() walks just the one client's chain, oldest first, so per-device reports (the
+ * console's W ip) and reconciliation batches don't scan the whole repository. Like the base
+ * class's readers, it can be used from any thread: the chains' links are only ever read
+ * atomically, and each record is checked to still be the client's once it's copied, so a walk
+ * racing the writer may miss records evicted under it, but never strays into somebody else's.
+ * VisitRecords() still visits every record, slot by slot - which, partitioned, isn't in time
+ * order - so whole-repository reports are written client by client instead.
+ *
+ * Without --repoFair, this is the base class's single FIFO, unchanged.
+ */
+
+#ifndef PARTITIONEDREPO_H_
+#define PARTITIONEDREPO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "resultsrepo.h"
+
+#define PARTITION_NONE		0xffffffffU
+#define PARTITION_SHOWN		10		// largest partitions the console lists
+
+typedef struct _PartitionConfig
+{
+	bool enabled;
+	unsigned int minPerClient;	// records no other client's records can take
+} PartitionConfig;
+
+typedef struct _PartitionStats
+{
+	uint64_t evictions;			// records given up for another client's
+	uint64_t recycled;			// records given up for a newer one of the same client's
+	uint64_t unplaced;			// records nobody could give up a slot for
+	unsigned int peakPartitions;
+} PartitionStats;
+
+class PartitionedRepository : public ResultsRepository
+{
+public:
+	PartitionedRepository();
+	virtual ~PartitionedRepository();
+
+	void Init(int howManyRecordsToKeep);
+	void StoreRecord(TestRecord& record);
+	void WriteReport(ReportWriter& writer);
+	bool Inherit(int fd, unsigned int capacity, unsigned int head, uint64_t stored, int howManyRecordsToKeep);
+
+	unsigned int VisitClient(struct in_addr client, RecordVisitor visitor, void *context);
+	bool IsPartitioned() { return links != NULL; }
+	unsigned int ClientRecords(struct in_addr client);
+
+	int Format(char *buffer, size_t size, uint64_t now);
+	const PartitionStats& Stats() { return stats; }
+
+	PartitionConfig config;
+
+protected:
+	typedef struct _Partition
+	{
+		in_addr_t address;
+		unsigned int head;			// oldest record's slot...
+		unsigned int tail;			// ...and newest
+		unsigned int count;
+		unsigned int previous;		// neighbours in the list of partitions holding as many records
+		unsigned int next;
+	} Partition;
+
+	bool Allocate();
+	void Rebuild();
+	unsigned int FindPartition(in_addr_t address);
+	unsigned int AddPartition(in_addr_t address);
+	void RemovePartition(unsigned int partition);
+	void SetCount(unsigned int partition, unsigned int count);
+	unsigned int Victim(unsigned int partition);
+	unsigned int TakeOldest(unsigned int partition);
+	void Append(unsigned int partition, unsigned int slot);
+
+	unsigned int *links;		// per slot: the next newer slot of the same client's, or PARTITION_NONE
+	Partition *partitions;		// one per client with records, and a spare
+	unsigned int *freePartitions;
+	unsigned int freeCount;
+	unsigned int *index;		// open-addressed hash of client address to partition
+	unsigned int indexMask;
+	unsigned int *byCount;		// per record count: the first partition holding that many
+	unsigned int largest;		// the largest count any partition has
+	unsigned int used;			// slots handed out so far; the rest have never been written
+	unsigned int active;		// partitions with records
+	PartitionStats stats;
+
+private:
+};
+
+extern PartitionedRepository partitionedRepo;
+
+#endif /* PARTITIONEDREPO_H_ */
+
+// end of partitionedrepo.h
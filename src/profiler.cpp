@@ -0,0 +1,186 @@
+/*
+ * profiler.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "profiler.h"
+
+static const char *phaseNames[PROFILE_PHASES] =
+{
+	"poll", "timers", "accept", "getpeername", "receive", "logging", "transform", "send", "record", "console"
+};
+
+HotPathProfiler::HotPathProfiler()
+{
+	enabled = false;
+	innerTicks = 0;
+	calibrationTicks = 0;
+	calibrationNs = 0;
+	spentTicks = 0;
+	spentNs = 0;
+	Reset();
+}
+
+HotPathProfiler::~HotPathProfiler()
+{
+}
+
+void HotPathProfiler::Enable(bool on)
+{
+	if (on && !enabled)
+	{
+		calibrationTicks = Ticks();
+		calibrationNs = MonotonicNanoseconds();
+		enabled = true;
+	}
+	else if (!on && enabled)
+	{
+		spentTicks += Ticks() - calibrationTicks;
+		spentNs += MonotonicNanoseconds() - calibrationNs;
+		enabled = false;
+	}
+}
+
+void HotPathProfiler::Reset()
+{
+	memset(histograms, 0, sizeof(histograms));
+	memset(counts, 0, sizeof(counts));
+	memset(totals, 0, sizeof(totals));
+	memset(maxima, 0, sizeof(maxima));
+}
+
+/*
+ * Quarter-power-of-two buckets: the top bit of the tick count picks the power of two, and the
+ * two bits below it the quarter. Tiny counts (0 to 3) get a bucket each.
+ */
+
+static inline int Bucket(uint64_t ticks)
+{
+	int msb = 63 - __builtin_clzll(ticks | 1);
+	return (msb < 2) ? (int)ticks : ((msb << 2) | (int)((ticks >> (msb - 2)) & 3));
+}
+
+static uint64_t BucketLimit(int bucket)		// the smallest count past the bucket
+{
+	if (bucket < 4)
+	{
+		return bucket + 1;
+	}
+	int msb = bucket >> 2;
+	return (uint64_t)((4 | (bucket & 3)) + 1) << (msb - 2);
+}
+
+void HotPathProfiler::Record(ProfilePhase phase, uint64_t ticks)
+{
+	histograms[phase][Bucket(ticks)]++;
+	counts[phase]++;
+	totals[phase] += ticks;
+	if (ticks > maxima[phase])
+	{
+		maxima[phase] = ticks;
+	}
+}
+
+/*
+ * How long a tick is, from how far the TSC and the monotonic clock have moved while profiling was
+ * on - or, if that isn't long enough to be accurate yet, from a short measurement made now.
+ */
+
+double HotPathProfiler::NanosPerTick()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint64_t ticks = spentTicks + (enabled ? (Ticks() - calibrationTicks) : 0);
+	uint64_t ns = spentNs + (enabled ? (MonotonicNanoseconds() - calibrationNs) : 0);
+	if ((ns < 100 * NANOS_PER_MSEC) || (ticks == 0))
+	{
+		uint64_t startTicks = Ticks();
+		uint64_t startNs = MonotonicNanoseconds();
+		struct timespec pause = { 0, 2 * (long)NANOS_PER_MSEC };
+		nanosleep(&pause, NULL);
+		ticks = Ticks() - startTicks;
+		ns = MonotonicNanoseconds() - startNs;
+	}
+	return (double)ns / (double)ticks;
+#else
+	return 1.0;		// the 'ticks' are nanoseconds already
+#endif
+}
+
+static const char *Duration(double ns, char *text, size_t size)
+{
+	if (ns < 10000.0)
+	{
+		snprintf(text, size, "%.0fns", ns);
+	}
+	else if (ns < 10000000.0)
+	{
+		snprintf(text, size, "%.1fus", ns / 1000.0);
+	}
+	else
+	{
+		snprintf(text, size, "%.1fms", ns / 1000000.0);
+	}
+	return text;
+}
+
+int HotPathProfiler::Format(char *buffer, size_t size, uint64_t now)
+{
+	double nsPerTick = NanosPerTick();
+	uint64_t allTicks = 0;
+	for (int p = 0; p < PROFILE_PHASES; p++)
+	{
+		allTicks += totals[p];
+	}
+
+	int used = snprintf(buffer, size, "Profiling is %s%s (%.3fns per tick)\n"
+		" %-12s %10s %9s %9s %9s %9s %6s\n",
+		enabled ? "on" : "off", (XM2M_PROFILING ? "" : ", and compiled out"), nsPerTick,
+		"phase", "count", "mean", "p50", "p99", "max", "share");
+
+	for (int p = 0; (p < PROFILE_PHASES) && (used < (int)size); p++)
+	{
+		if (counts[p] == 0)
+		{
+			continue;
+		}
+		uint64_t median = 0;
+		uint64_t tail = 0;
+		uint64_t seen = 0;
+		for (int b = 0; b < PROFILER_BUCKETS; b++)
+		{
+			seen += histograms[p][b];
+			if ((median == 0) && (seen * 2 >= counts[p]))
+			{
+				median = BucketLimit(b);
+			}
+			if ((tail == 0) && (seen * 100 >= counts[p] * 99))
+			{
+				tail = BucketLimit(b);
+				break;
+			}
+		}
+		char mean[16], p50[16], p99[16], max[16];
+		used += snprintf(buffer + used, size - used, " %-12s %10llu %9s %9s %9s %9s %5.1f%%\n",
+			phaseNames[p], (unsigned long long)counts[p],
+			Duration((double)totals[p] * nsPerTick / (double)counts[p], mean, sizeof(mean)),
+			Duration((double)median * nsPerTick, p50, sizeof(p50)),
+			Duration((double)tail * nsPerTick, p99, sizeof(p99)),
+			Duration((double)maxima[p] * nsPerTick, max, sizeof(max)),
+			(allTicks > 0) ? (100.0 * (double)totals[p] / (double)allTicks) : 0.0);
+	}
+	return (used < (int)size) ? used : (int)size - 1;
+}
+
+// the sole global instance
+
+HotPathProfiler profiler;
+
+// end of profiler.cpp
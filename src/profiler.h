@@ -0,0 +1,153 @@
+/*
+ * profiler.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * HotPathProfiler answers "where did the time go?" when throughput drops: it times each phase of
+ * the event loop and of handling a message - waiting in poll(), timers, accepting, getpeername(),
+ * receiving, logging, transforming, sending and recording the transaction - and keeps a
+ * histogram of each. The console's P command shows them:
+ *
+ *   P        the per-phase counts, mean, median, 99th percentile, maximum and share of the time
+ *   P on     start profiling (or start the server with --selfProfile)
+ *   P off    stop
+ *   P reset  start the histograms afresh
+ *
+ * Phases are marked with PROFILE_SCOPE(phase), which times from there to the end of the enclosing
+ * block. Scopes can nest (a delayed reply sent from the timers phase is also a send), but each is
+ * charged only its own time, less that of the scopes inside it, so the shares add up to 100%.
+ *
+ * Timestamps come from the CPU's time-stamp counter where there is one (x86), which takes a few
+ * nanoseconds to read, and from clock_gettime() elsewhere. TSC ticks are turned into nanoseconds
+ * only when the histograms are shown, using a rate measured against CLOCK_MONOTONIC while
+ * profiling is on. Histogram buckets are quarter powers of two, so percentiles are good to
+ * within about 20%.
+ *
+ * The cost when profiling is off is one test of a global flag per scope, which the branch
+ * predictor gets right every time. Building with XM2M_PROFILING defined as 0 removes even that.
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef XM2M_PROFILING
+#define XM2M_PROFILING	1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "timeutil.h"
+
+#define PROFILER_BUCKETS	256		// four per power of two, up to 2^64 ticks
+
+typedef enum _ProfilePhase
+{
+	PHASE_POLL = 0,		// waiting for events (sleeping or spinning)
+	PHASE_TIMERS,		// delayed replies, capture flushes, telemetry, scripts' timers
+	PHASE_ACCEPT,
+	PHASE_PEERNAME,		// getpeername()
+	PHASE_RECEIVE,		// recvmsg(), with its kernel timestamp
+	PHASE_LOGGING,		// writing each message to stdout
+	PHASE_TRANSFORM,
+	PHASE_SEND,			// sendto(), or queueing for impairment or amplification
+	PHASE_RECORD,		// the repository, capture, telemetry, top talkers and so on
+	PHASE_CONSOLE,
+	PROFILE_PHASES
+} ProfilePhase;
+
+class HotPathProfiler
+{
+public:
+	HotPathProfiler();
+	virtual ~HotPathProfiler();
+
+	void Enable(bool on);
+	void Reset();
+	bool IsEnabled() { return enabled; }
+
+	static inline uint64_t Ticks()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return MonotonicNanoseconds();
+#endif
+	}
+
+	void Record(ProfilePhase phase, uint64_t ticks);
+
+	int Format(char *buffer, size_t size, uint64_t now);
+
+	bool enabled;		// public so that scopes test it inline
+	uint64_t innerTicks;	// time taken by scopes inside the current one
+
+protected:
+	double NanosPerTick();
+
+	uint64_t histograms[PROFILE_PHASES][PROFILER_BUCKETS];
+	uint64_t counts[PROFILE_PHASES];
+	uint64_t totals[PROFILE_PHASES];
+	uint64_t maxima[PROFILE_PHASES];
+
+	uint64_t calibrationTicks;	// the TSC and the monotonic clock when profiling was last started
+	uint64_t calibrationNs;
+	uint64_t spentTicks;		// profiling time before that, for the calibration
+	uint64_t spentNs;
+
+private:
+};
+
+extern HotPathProfiler profiler;
+
+/*
+ * Times the rest of the enclosing block as the given phase, if profiling is on.
+ */
+
+class ProfileScope
+{
+public:
+#if XM2M_PROFILING
+	inline ProfileScope(ProfilePhase p)
+	{
+		start = 0;
+		outerInner = 0;
+		if (__builtin_expect(profiler.enabled, 0))
+		{
+			phase = p;
+			outerInner = profiler.innerTicks;
+			profiler.innerTicks = 0;
+			start = HotPathProfiler::Ticks();
+		}
+	}
+	inline ~ProfileScope()
+	{
+		if (__builtin_expect(start != 0, 0))
+		{
+			uint64_t elapsed = HotPathProfiler::Ticks() - start;
+			profiler.Record(phase, (elapsed > profiler.innerTicks) ? (elapsed - profiler.innerTicks) : 0);
+			profiler.innerTicks = outerInner + elapsed;
+		}
+	}
+
+protected:
+	uint64_t start;
+	uint64_t outerInner;
+	ProfilePhase phase;
+#else
+	inline ProfileScope(ProfilePhase p) {}
+#endif
+};
+
+#define PROFILE_CONCAT_(a, b)	a##b
+#define PROFILE_CONCAT(a, b)	PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(phase)	ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(phase)
+
+#endif /* PROFILER_H_ */
+
+// end of profiler.h
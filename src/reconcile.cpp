@@ -0,0 +1,835 @@
+/*
+ * reconcile.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <arpa/inet.h>
+#include <iostream>
+using namespace std;
+
+#include "reconcile.h"
+#include "resultsrepo.h"
+#include "timeutil.h"
+
+#define RECONCILE_POLL_MS	5		// longest poll() while a join is running, or a claim waiting
+
+static const char outcomeCodes[RECONCILE_OUTCOMES] = { 'M', 'R', 'N', 'U' };
+
+Reconciler::Reconciler()
+{
+	states = NULL;
+	stateCount = 0;
+	joining = 0;
+	memset(jobs, 0, sizeof(jobs));
+	for (int j = 0; j < RECONCILE_MAX_JOBS; j++)
+	{
+		jobs[j].socket = -1;
+	}
+	memset(claims, 0, sizeof(claims));
+	for (int c = 0; c < RECONCILE_MAX_CLAIMS; c++)
+	{
+		claims[c].socket = -1;
+	}
+	claimCount = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+Reconciler::~Reconciler()
+{
+	for (int j = 0; j < RECONCILE_MAX_JOBS; j++)
+	{
+		if ((jobs[j].state == JOB_JOINING) && jobs[j].threaded)
+		{
+			pthread_join(jobs[j].thread, NULL);
+		}
+		FreeJob(jobs[j]);
+	}
+	if (states)
+	{
+		free(states);
+		states = NULL;
+	}
+}
+
+/*
+ * Every TCP transaction session might turn out to be a batch, so each gets a state. The table is
+ * sized for every descriptor at startup (see main()), so that accepting a session doesn't
+ * allocate; if a descriptor beyond that turns up anyway, it grows, doubling, to cover it.
+ */
+
+bool Reconciler::Reserve(int descriptors)
+{
+	if (descriptors <= stateCount)
+	{
+		return true;
+	}
+	unsigned char *more = (unsigned char *)realloc(states, descriptors);
+	if (more == NULL)
+	{
+		return false;
+	}
+	memset(more + stateCount, SOCKET_ORDINARY, descriptors - stateCount);
+	states = more;
+	stateCount = descriptors;
+	return true;
+}
+
+bool Reconciler::SetState(int socket, SocketState state)
+{
+	if (socket < 0)
+	{
+		return false;
+	}
+	if (socket >= stateCount)
+	{
+		if (state == SOCKET_ORDINARY)
+		{
+			return true;	// which is what it is already
+		}
+		int grown = (stateCount > 0) ? stateCount : 64;
+		while (grown <= socket)
+		{
+			grown *= 2;
+		}
+		if (!Reserve(grown))
+		{
+			return false;
+		}
+	}
+	states[socket] = (unsigned char)state;
+	return true;
+}
+
+void Reconciler::ConnectionOpened(int socket)
+{
+	EndClaim(socket);
+	SetState(socket, SOCKET_FRESH);
+}
+
+Reconciler::Job *Reconciler::FindJob(int socket)
+{
+	for (int j = 0; j < RECONCILE_MAX_JOBS; j++)
+	{
+		if ((jobs[j].state != JOB_FREE) && (jobs[j].socket == socket))
+		{
+			return &jobs[j];
+		}
+	}
+	return NULL;
+}
+
+Reconciler::PendingClaim *Reconciler::FindClaim(int socket)
+{
+	for (int c = 0; (c < RECONCILE_MAX_CLAIMS) && (claimCount > 0); c++)
+	{
+		if (claims[c].socket == socket)
+		{
+			return &claims[c];
+		}
+	}
+	return NULL;
+}
+
+void Reconciler::EndClaim(int socket)
+{
+	PendingClaim *claim = FindClaim(socket);
+	if (claim)
+	{
+		claim->socket = -1;
+		claimCount--;
+	}
+}
+
+/*
+ * Whether what's been peeked so far is a strict prefix of the keyword, and there's still time
+ * for the rest of it to come.
+ */
+
+bool Reconciler::ClaimUndecided(const char *peek, int n, uint64_t now, uint64_t deadline)
+{
+	return (n > 0) && (n < (int)sizeof(RECONCILE_KEYWORD) - 1) && (memcmp(peek, RECONCILE_KEYWORD, n) == 0) && (now < deadline);
+}
+
+/*
+ * Called with a connection's first request, before it's read: if it starts with the keyword, the
+ * connection is ours from now on. Only the first request is looked at, so an ordinary session
+ * can say RECONCILE later without being taken over, and it costs ordinary sessions one
+ * MSG_PEEK each.
+ *
+ * The keyword may come in more than one segment, though. While all that's arrived is the start
+ * of it, the data is left where it is and the connection SOCKET_CLAIMING, not polled for input
+ * (so the event loop doesn't spin on it), until Service() sees the rest arrive, a byte that
+ * doesn't fit, or RECONCILE_CLAIM_WAIT_MS go by - and then it's decided. If too many connections
+ * are waiting already, it's decided on what's there, as an ordinary session.
+ */
+
+bool Reconciler::Claim(int socket)
+{
+	if ((socket < 0) || (socket >= stateCount) || ((states[socket] != SOCKET_FRESH) && (states[socket] != SOCKET_CLAIMING)))
+	{
+		return false;
+	}
+
+	char peek[sizeof(RECONCILE_KEYWORD) - 1];
+	int n = recv(socket, peek, sizeof(peek), MSG_PEEK | MSG_DONTWAIT);
+	uint64_t now = MonotonicNanoseconds();
+	PendingClaim *claim = FindClaim(socket);
+	if (ClaimUndecided(peek, n, now, claim ? claim->deadline : UINT64_MAX))
+	{
+		if ((claim == NULL) && (claimCount < RECONCILE_MAX_CLAIMS))
+		{
+			for (int c = 0; (claim == NULL) && (c < RECONCILE_MAX_CLAIMS); c++)
+			{
+				if (claims[c].socket < 0)
+				{
+					claim = &claims[c];
+				}
+			}
+			claim->socket = socket;
+			claim->deadline = now + (uint64_t)RECONCILE_CLAIM_WAIT_MS * 1000000;
+			claimCount++;
+		}
+		if (claim)
+		{
+			claim->ready = false;
+			states[socket] = SOCKET_CLAIMING;
+			return false;
+		}
+	}
+	EndClaim(socket);
+	states[socket] = SOCKET_ORDINARY;
+	if ((n != (int)sizeof(peek)) || (memcmp(peek, RECONCILE_KEYWORD, sizeof(peek)) != 0))
+	{
+		return false;
+	}
+
+	Job *job = NULL;
+	for (int j = 0; (job == NULL) && (j < RECONCILE_MAX_JOBS); j++)
+	{
+		if (jobs[j].state == JOB_FREE)
+		{
+			job = &jobs[j];
+		}
+	}
+	if (job == NULL)
+	{
+		// every job is taken: say so, and let the session close
+
+		stats.busy++;
+		while (recv(socket, readBuffer, sizeof(readBuffer), MSG_DONTWAIT) > 0)
+		{
+		}
+		send(socket, "BUSY\n", 5, MSG_DONTWAIT | MSG_NOSIGNAL);
+		shutdown(socket, SHUT_WR);
+		return true;	// with no job, so Receive() has the session closed
+	}
+
+	memset(job, 0, sizeof(Job));
+	job->state = JOB_RECEIVING;
+	job->socket = socket;
+	struct sockaddr_in address;
+	socklen_t addressLength = sizeof(address);
+	if (getpeername(socket, (struct sockaddr *)&address, &addressLength) == 0)
+	{
+		job->client = address.sin_addr;
+	}
+	job->toleranceUs = (int64_t)RECONCILE_DEFAULT_TOLERANCE_MS * 1000;
+	states[socket] = SOCKET_RECONCILING;
+	return true;
+}
+
+void Reconciler::Forget(int socket)
+{
+	EndClaim(socket);
+	Job *job = FindJob(socket);
+	if (job)
+	{
+		if (job->state == JOB_JOINING)
+		{
+			job->socket = -1;	// Service() frees it once the join is done with it
+			stats.abandoned++;
+		}
+		else
+		{
+			if (job->state == JOB_RECEIVING)
+			{
+				stats.abandoned++;
+			}
+			FreeJob(*job);
+		}
+	}
+	if ((socket >= 0) && (socket < stateCount))
+	{
+		states[socket] = SOCKET_ORDINARY;
+	}
+}
+
+void Reconciler::FreeJob(Job &job)
+{
+	if (job.entries)
+	{
+		free(job.entries);
+	}
+	if (job.output)
+	{
+		free(job.output);
+	}
+	memset(&job, 0, sizeof(Job));
+	job.socket = -1;
+}
+
+void Reconciler::Fail(Job &job, const char *reason, bool badInput)
+{
+	if (badInput)
+	{
+		stats.malformed++;
+	}
+	else
+	{
+		stats.failed++;
+	}
+	if (job.entries)
+	{
+		free(job.entries);
+		job.entries = NULL;
+	}
+	size_t size = strlen(reason) + 8;
+	job.output = (char *)malloc(size);
+	job.outputLength = job.output ? snprintf(job.output, size, "ERROR %s\n", reason) : 0;
+	job.outputSent = 0;
+	job.state = JOB_SENDING;
+}
+
+/*
+ * The header, then one entry per line. Returns false once the job is no longer receiving -
+ * because the batch is complete or because it's malformed.
+ */
+
+bool Reconciler::ParseLine(Job &job, char *line)
+{
+	char *end;
+	if (!job.headerDone)
+	{
+		unsigned long count = strtoul(line + sizeof(RECONCILE_KEYWORD) - 1, &end, 10);
+		if (end == line + sizeof(RECONCILE_KEYWORD) - 1)
+		{
+			Fail(job, "expected RECONCILE <count> [toleranceMs]");
+			return false;
+		}
+		if (count > RECONCILE_MAX_ENTRIES)
+		{
+			char reason[64];
+			snprintf(reason, sizeof(reason), "batches are limited to %u entries", RECONCILE_MAX_ENTRIES);
+			Fail(job, reason);
+			return false;
+		}
+		char *tolerance = end;
+		long ms = strtol(tolerance, &end, 10);
+		if (end != tolerance)
+		{
+			if (ms < 0)
+			{
+				Fail(job, "the tolerance can't be negative");
+				return false;
+			}
+			if (ms > RECONCILE_MAX_TOLERANCE_MS)
+			{
+				char reason[64];
+				snprintf(reason, sizeof(reason), "the tolerance is limited to %d ms", RECONCILE_MAX_TOLERANCE_MS);
+				Fail(job, reason);
+				return false;
+			}
+			job.toleranceUs = (int64_t)ms * 1000;
+		}
+		job.expected = (unsigned int)count;
+		job.entries = (Entry *)malloc((count > 0 ? count : 1) * sizeof(Entry));
+		if (job.entries == NULL)
+		{
+			Fail(job, "out of memory", false);
+			return false;
+		}
+		job.headerDone = true;
+	}
+	else
+	{
+		// <sec>.<usec> <hash>
+
+		long long seconds = strtoll(line, &end, 10);
+		int64_t micros = 0;
+		if ((end == line) || (seconds < 0) || (seconds > RECONCILE_MAX_SECONDS))
+		{
+			Fail(job, "expected <sec>.<usec> <hash>");
+			return false;
+		}
+		if (*end == '.')
+		{
+			int64_t scale = 100000;
+			for (end++; (*end >= '0') && (*end <= '9'); end++)
+			{
+				micros += (*end - '0') * scale;
+				scale /= 10;
+			}
+		}
+		char *hash = end;
+		uint64_t value = strtoull(hash, &end, 16);
+		if ((end == hash) || ((*end != '\0') && (*end != ' ') && (*end != '\t')))
+		{
+			Fail(job, "expected <sec>.<usec> <hash>");
+			return false;
+		}
+
+		Entry &entry = job.entries[job.received];
+		entry.hash = value;
+		entry.timeUs = (int64_t)seconds * 1000000 + micros;
+		entry.index = job.received;
+		entry.transaction = 0;
+		entry.outcome = RECONCILE_MISSING;
+		job.received++;
+	}
+
+	if (job.received == job.expected)
+	{
+		StartJoin(job);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * More of the upload has arrived. Lines can be split across reads, so a partial one is kept in
+ * the job until the rest of it comes. Returns 0 if the session should be closed.
+ */
+
+int Reconciler::Receive(int socket)
+{
+	Job *job = FindJob(socket);
+	if (job == NULL)
+	{
+		return 0;
+	}
+	if (job->state != JOB_RECEIVING)
+	{
+		return 0;	// it isn't polled for input now, so this is a hangup or an error
+	}
+
+	int n = recv(socket, readBuffer, sizeof(readBuffer), MSG_DONTWAIT);
+	if (n < 0)
+	{
+		return ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) ? 1 : 0;
+	}
+	if (n == 0)
+	{
+		cout << "Reconciliation batch ended after " << job->received << " of " << job->expected << " entries" << endl;
+		return 0;
+	}
+
+	for (int i = 0; (i < n) && (job->state == JOB_RECEIVING); i++)
+	{
+		char c = readBuffer[i];
+		if (c == '\n')
+		{
+			if ((job->lineLength > 0) && (job->line[job->lineLength - 1] == '\r'))
+			{
+				job->lineLength--;
+			}
+			job->line[job->lineLength] = '\0';
+			job->lineLength = 0;
+			ParseLine(*job, job->line);
+		}
+		else if (job->lineLength < RECONCILE_LINE_SIZE - 1)
+		{
+			job->line[job->lineLength++] = c;
+		}
+		else
+		{
+			Fail(*job, "line too long");
+		}
+	}
+	return 1;
+}
+
+void Reconciler::StartJoin(Job &job)
+{
+	job.state = JOB_JOINING;
+	joining++;
+	cout << "Reconciling a batch of " << job.expected << " entries" << endl;
+	job.threaded = (pthread_create(&job.thread, NULL, JoinThread, &job) == 0);
+	if (!job.threaded)
+	{
+		RunJob(job);	// we'd rather pause for it than not answer
+	}
+}
+
+void *Reconciler::JoinThread(void *context)
+{
+	RunJob(*(Job *)context);
+	return NULL;
+}
+
+/*
+ * On the join thread: match the batch, then write out the answer. Nothing here touches anything
+ * but the job and the repository (through its thread-safe readers).
+ */
+
+void Reconciler::RunJob(Job &job)
+{
+	uint64_t start = MonotonicNanoseconds();
+	job.records = Join(resultsRepo, job.client, job.entries, job.expected, job.toleranceUs, job.outcomes);
+
+	size_t size = (size_t)job.expected * 14 + 96;	// "R 4294967295\n" is the longest line
+	job.output = (char *)malloc(size);
+	if (job.output)
+	{
+		size_t used = snprintf(job.output, size, "RECONCILED %u %u %u %u %u\n", job.expected,
+			job.outcomes[RECONCILE_REPLIED], job.outcomes[RECONCILE_UNREPLIED],
+			job.outcomes[RECONCILE_MISSING], job.outcomes[RECONCILE_UNKNOWN]);
+		for (unsigned int e = 0; e < job.expected; e++)
+		{
+			Entry &entry = job.entries[e];
+			if ((entry.outcome == RECONCILE_REPLIED) || (entry.outcome == RECONCILE_UNREPLIED))
+			{
+				used += snprintf(job.output + used, size - used, "%c %u\n", outcomeCodes[entry.outcome], entry.transaction);
+			}
+			else
+			{
+				job.output[used++] = outcomeCodes[entry.outcome];
+				job.output[used++] = '\n';
+			}
+		}
+		job.outputLength = used;
+	}
+	job.joinNs = MonotonicNanoseconds() - start;
+	__atomic_store_n(&job.finished, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The sort-merge join. The repository's records are boiled down to what's needed to match them -
+ * the request's hash, when it arrived, its transaction number and whether it got a reply - and
+ * sorted by hash and time, as are the entries. Walking the two in step, each run of entries with
+ * a given hash is matched to the run of records with the same hash: both are in time order, so
+ * the earliest record not yet matched that's within the tolerance of an entry is the one to give
+ * it. Entries end up back in upload order, with their outcomes filled in. Returns how many
+ * records were looked at - just the client's, if the repository keeps them apart.
+ */
+
+typedef struct _ReconcileKey
+{
+	uint64_t hash;
+	int64_t timeUs;
+	unsigned int transaction;
+	bool replied;
+} ReconcileKey;
+
+typedef struct _KeyCollector
+{
+	ReconcileKey *keys;
+	unsigned int count;
+	unsigned int capacity;
+	int64_t oldestUs;
+} KeyCollector;
+
+static bool CollectKey(TestRecord &record, void *context)
+{
+	KeyCollector *collector = (KeyCollector *)context;
+	if (collector->count >= collector->capacity)
+	{
+		return false;
+	}
+	ReconcileKey &key = collector->keys[collector->count++];
+	key.hash = ReconcileHash(record.dataReceived, RX_BUFFER_SIZE);
+	key.timeUs = (int64_t)record.startTime.tv_sec * 1000000 + record.startTime.tv_usec;
+	key.transaction = record.transactionNumber;
+	key.replied = (record.replyBytes > 0);
+	if (key.timeUs < collector->oldestUs)
+	{
+		collector->oldestUs = key.timeUs;
+	}
+	return true;
+}
+
+static int CompareKeys(const void *a, const void *b)
+{
+	const ReconcileKey *x = (const ReconcileKey *)a;
+	const ReconcileKey *y = (const ReconcileKey *)b;
+	if (x->hash != y->hash)
+	{
+		return (x->hash < y->hash) ? -1 : 1;
+	}
+	return (x->timeUs < y->timeUs) ? -1 : (x->timeUs > y->timeUs) ? 1 : 0;
+}
+
+static int CompareEntries(const void *a, const void *b)
+{
+	const Reconciler::Entry *x = (const Reconciler::Entry *)a;
+	const Reconciler::Entry *y = (const Reconciler::Entry *)b;
+	if (x->hash != y->hash)
+	{
+		return (x->hash < y->hash) ? -1 : 1;
+	}
+	if (x->timeUs != y->timeUs)
+	{
+		return (x->timeUs < y->timeUs) ? -1 : 1;
+	}
+	return (x->index < y->index) ? -1 : (x->index > y->index) ? 1 : 0;
+}
+
+unsigned int Reconciler::Join(ResultsRepository &repo, struct in_addr client, Entry *entries, unsigned int count, int64_t toleranceUs, unsigned int outcomes[RECONCILE_OUTCOMES])
+{
+	memset(outcomes, 0, sizeof(unsigned int) * RECONCILE_OUTCOMES);
+
+	KeyCollector collector;
+	collector.capacity = repo.Capacity();
+	collector.count = 0;
+	collector.oldestUs = INT64_MAX;
+	collector.keys = (ReconcileKey *)malloc((collector.capacity > 0 ? collector.capacity : 1) * sizeof(ReconcileKey));
+	if (collector.keys == NULL)
+	{
+		collector.capacity = 0;
+	}
+	if (repo.IsPartitioned())
+	{
+		repo.VisitClient(client, CollectKey, &collector);
+	}
+	else
+	{
+		repo.VisitRecords(CollectKey, &collector);
+	}
+
+	// only a full repository has let records go, so only then can an attempt be too old to judge:
+	// its record, if it had one, could have been anywhere in its window, including before the oldest
+
+	bool full = (collector.count > 0) && repo.IsFull();
+
+	qsort(collector.keys, collector.count, sizeof(ReconcileKey), CompareKeys);
+	qsort(entries, count, sizeof(Entry), CompareEntries);
+
+	unsigned int k = 0;
+	unsigned int e = 0;
+	while (e < count)
+	{
+		uint64_t hash = entries[e].hash;
+		while ((k < collector.count) && (collector.keys[k].hash < hash))
+		{
+			k++;
+		}
+		for (; (e < count) && (entries[e].hash == hash); e++)
+		{
+			Entry &entry = entries[e];
+			while ((k < collector.count) && (collector.keys[k].hash == hash)
+				&& (collector.keys[k].timeUs < entry.timeUs - toleranceUs))
+			{
+				k++;	// nothing later can match it either
+			}
+			if ((k < collector.count) && (collector.keys[k].hash == hash)
+				&& (collector.keys[k].timeUs <= entry.timeUs + toleranceUs))
+			{
+				entry.transaction = collector.keys[k].transaction;
+				entry.outcome = collector.keys[k].replied ? RECONCILE_REPLIED : RECONCILE_UNREPLIED;
+				k++;
+			}
+			else if (full && (entry.timeUs - toleranceUs < collector.oldestUs))
+			{
+				entry.outcome = RECONCILE_UNKNOWN;
+			}
+			else
+			{
+				entry.outcome = RECONCILE_MISSING;
+			}
+			outcomes[entry.outcome]++;
+		}
+	}
+
+	// back to upload order: each entry knows where it belongs, so cycle them into place
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		while (entries[i].index != i)
+		{
+			Entry displaced = entries[entries[i].index];
+			entries[entries[i].index] = entries[i];
+			entries[i] = displaced;
+		}
+	}
+
+	if (collector.keys)
+	{
+		free(collector.keys);
+	}
+	return collector.count;
+}
+
+/*
+ * Back on the event loop: joins that have finished are counted up, and their answers start
+ * going out. Returns how many sessions now want different events polled for.
+ */
+
+int Reconciler::Service(uint64_t now)
+{
+	int changed = 0;
+	for (int c = 0; (c < RECONCILE_MAX_CLAIMS) && (claimCount > 0); c++)
+	{
+		PendingClaim &claim = claims[c];
+		if ((claim.socket >= 0) && !claim.ready)
+		{
+			char peek[sizeof(RECONCILE_KEYWORD) - 1];
+			int n = recv(claim.socket, peek, sizeof(peek), MSG_PEEK | MSG_DONTWAIT);
+			if (!ClaimUndecided(peek, n, now, claim.deadline))
+			{
+				claim.ready = true;		// so it's polled for input again, and Claim() decides
+				changed++;
+			}
+		}
+	}
+
+	if (joining == 0)
+	{
+		return changed;
+	}
+	for (int j = 0; j < RECONCILE_MAX_JOBS; j++)
+	{
+		Job &job = jobs[j];
+		if ((job.state == JOB_JOINING) && __atomic_load_n(&job.finished, __ATOMIC_ACQUIRE))
+		{
+			if (job.threaded)
+			{
+				pthread_join(job.thread, NULL);
+			}
+			joining--;
+			FinishJob(job);
+			if (job.socket < 0)
+			{
+				FreeJob(job);
+			}
+			else
+			{
+				changed++;
+			}
+		}
+	}
+	return changed;
+}
+
+void Reconciler::FinishJob(Job &job)
+{
+	free(job.entries);
+	job.entries = NULL;
+	if (job.output == NULL)
+	{
+		Fail(job, "out of memory", false);	// joined, but there's no answer to send
+		return;
+	}
+
+	stats.batches++;
+	stats.entries += job.expected;
+	for (int o = 0; o < RECONCILE_OUTCOMES; o++)
+	{
+		stats.outcomes[o] += job.outcomes[o];
+	}
+	stats.lastEntries = job.expected;
+	stats.lastRecords = job.records;
+	stats.lastJoinNs = job.joinNs;
+	if (job.joinNs > stats.maxJoinNs)
+	{
+		stats.maxJoinNs = job.joinNs;
+	}
+	cout << "Reconciled " << job.expected << " entries against " << job.records << " records in "
+		 << (job.joinNs / NANOS_PER_USEC) << "us: " << job.outcomes[RECONCILE_REPLIED] << " replied, "
+		 << job.outcomes[RECONCILE_UNREPLIED] << " unreplied, " << job.outcomes[RECONCILE_MISSING] << " missing, "
+		 << job.outcomes[RECONCILE_UNKNOWN] << " unknown" << endl;
+
+	job.state = JOB_SENDING;
+	job.outputSent = 0;
+}
+
+int Reconciler::PollTimeout(int timeout)
+{
+	if (((joining > 0) || (claimCount > 0)) && ((timeout < 0) || (timeout > RECONCILE_POLL_MS)))
+	{
+		timeout = RECONCILE_POLL_MS;	// come back soon for the answer, or the rest of the keyword
+	}
+	return timeout;
+}
+
+short Reconciler::PollEvents(int socket)
+{
+	if (Claiming(socket))
+	{
+		PendingClaim *claim = FindClaim(socket);
+		return (claim && !claim->ready) ? 0 : POLLIN;
+	}
+	Job *job = FindJob(socket);
+	if (job == NULL)
+	{
+		return POLLIN;	// so that we see the close
+	}
+	switch (job->state)
+	{
+		case JOB_RECEIVING:
+			return POLLIN;
+		case JOB_SENDING:
+			return POLLOUT;
+		default:
+			return 0;	// nothing to do until the join is
+	}
+}
+
+/*
+ * Sends as much of the answer as the socket will take. Returns 0 once it's all gone (or it can't
+ * go), so the session is closed.
+ */
+
+int Reconciler::ReadyToWrite(int socket)
+{
+	Job *job = FindJob(socket);
+	if ((job == NULL) || (job->state != JOB_SENDING))
+	{
+		return 1;
+	}
+	while (job->outputSent < job->outputLength)
+	{
+		int n = send(socket, job->output + job->outputSent, job->outputLength - job->outputSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			return ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) ? 1 : 0;
+		}
+		job->outputSent += n;
+	}
+	return 0;
+}
+
+int Reconciler::Format(char *buffer, size_t size, uint64_t now)
+{
+	int receiving = 0;
+	for (int j = 0; j < RECONCILE_MAX_JOBS; j++)
+	{
+		receiving += (jobs[j].state == JOB_RECEIVING) ? 1 : 0;
+	}
+	return snprintf(buffer, size,
+		"Reconciliation: %llu batches answered; %d uploading, %d joining; %llu busy, %llu malformed, %llu failed, %llu abandoned\n"
+		" %llu entries: %llu replied, %llu unreplied, %llu missing, %llu unknown\n"
+		" last batch: %llu entries against %llu records in %.1fms (slowest %.1fms)\n",
+		(unsigned long long)stats.batches, receiving, joining,
+		(unsigned long long)stats.busy, (unsigned long long)stats.malformed,
+		(unsigned long long)stats.failed, (unsigned long long)stats.abandoned,
+		(unsigned long long)stats.entries, (unsigned long long)stats.outcomes[RECONCILE_REPLIED],
+		(unsigned long long)stats.outcomes[RECONCILE_UNREPLIED], (unsigned long long)stats.outcomes[RECONCILE_MISSING],
+		(unsigned long long)stats.outcomes[RECONCILE_UNKNOWN],
+		(unsigned long long)stats.lastEntries, (unsigned long long)stats.lastRecords,
+		(double)stats.lastJoinNs / (double)NANOS_PER_MSEC, (double)stats.maxJoinNs / (double)NANOS_PER_MSEC);
+}
+
+// the sole global instance
+
+Reconciler reconciler;
+
+// end of reconcile.cpp
@@ -0,0 +1,227 @@
+/*
+ * reconcile.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * Reconciler lets a client check its own log against the server's records in one go, rather than
+ * have an operator compare a failure list with a report by hand. The client opens a TCP
+ * connection to any transaction port (one whose profile doesn't run a script) and, as the very
+ * first thing it sends, uploads a batch of the transactions it attempted:
+ *
+ *   RECONCILE <count> [toleranceMs]
+ *   <sec>.<usec> <hash>
+ *   ...
+ *
+ * one line per attempt: when it sent the request (wall clock, seconds and microseconds) and
+ * ReconcileHash() of the request, as 16 hex digits. The server matches each against the records
+ * in the repository with the same hash whose startTime is within toleranceMs (default
+ * RECONCILE_DEFAULT_TOLERANCE_MS, at most RECONCILE_MAX_TOLERANCE_MS) of it, each record matching
+ * at most one attempt, and answers:
+ *
+ *   RECONCILED <count> <replied> <unreplied> <missing> <unknown>
+ *   R <transaction>     received, and replied to
+ *   N <transaction>     received, but the reply couldn't be sent (or reply impairment dropped it)
+ *   M                   never received
+ *   U                   not found, but old enough that its record may have left the repository
+ *
+ * one line per attempt, in the order they were uploaded, and then closes the connection. A
+ * malformed batch (or one the server hasn't the memory for) gets a single "ERROR ..." line instead, and one that arrives while
+ * RECONCILE_MAX_JOBS others are under way gets "BUSY".
+ *
+ * If the repository is partitioned by client (see partitionedrepo.h), only the records from the
+ * address the batch came from are looked at - which is quicker, and lets U mean that this
+ * client's own records have moved on, rather than anybody's.
+ *
+ * The upload is read a piece at a time by the event loop, like any other request. The join - a
+ * sort-merge of the batch and a copy of the repository's keys, both ordered by hash and time - runs
+ * on a thread of its own, which the repository's seqlocks make safe, so a batch of 100,000
+ * doesn't hold up other sessions while it's matched. The event loop picks up finished joins in
+ * Service() and sends their results as the socket has room. The console's R command shows how
+ * many batches have been reconciled, what was found and how long the joins took.
+ */
+
+#ifndef RECONCILE_H_
+#define RECONCILE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "clientsession.h"	// for RX_BUFFER_SIZE
+
+#define RECONCILE_KEYWORD				"RECONCILE "
+#define RECONCILE_MAX_JOBS				4
+#define RECONCILE_MAX_ENTRIES			1000000
+#define RECONCILE_DEFAULT_TOLERANCE_MS	2000
+#define RECONCILE_MAX_TOLERANCE_MS		86400000			// a day; more is a mistake, and could overflow the join's arithmetic
+#define RECONCILE_MAX_SECONDS			100000000000LL		// ditto for attempt times (the year 5138 or so)
+#define RECONCILE_READ_SIZE				65536
+#define RECONCILE_LINE_SIZE				128
+#define RECONCILE_CLAIM_WAIT_MS			500		// for the rest of the keyword, once part of it has come
+#define RECONCILE_MAX_CLAIMS			16
+
+class ResultsRepository;
+
+/*
+ * 64-bit FNV-1a over the request as the repository keeps it: up to RX_BUFFER_SIZE bytes, and
+ * no further than the first NUL. Clients hash what they sent the same way.
+ */
+
+static inline uint64_t ReconcileHash(const char *data, int length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int i = 0; (i < length) && (i < RX_BUFFER_SIZE) && (data[i] != '\0'); i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+typedef enum _ReconcileOutcome
+{
+	RECONCILE_MISSING = 0,
+	RECONCILE_REPLIED,
+	RECONCILE_UNREPLIED,
+	RECONCILE_UNKNOWN,
+	RECONCILE_OUTCOMES
+} ReconcileOutcome;
+
+typedef struct _ReconcileStats
+{
+	uint64_t batches;			// reconciled and answered
+	uint64_t busy;				// turned away for want of a free job
+	uint64_t malformed;			// turned away for bad input...
+	uint64_t failed;			// ...or for want of memory to take or answer them
+	uint64_t abandoned;			// the client went away before its answer was ready
+	uint64_t entries;
+	uint64_t outcomes[RECONCILE_OUTCOMES];
+	uint64_t lastEntries;
+	uint64_t lastRecords;
+	uint64_t lastJoinNs;
+	uint64_t maxJoinNs;
+} ReconcileStats;
+
+class Reconciler
+{
+public:
+	Reconciler();
+	virtual ~Reconciler();
+
+	// the transaction sessions hand over connections that start with RECONCILE_KEYWORD...
+
+	bool Reserve(int descriptors);
+	void ConnectionOpened(int socket);
+	bool Claim(int socket);
+	bool Owns(int socket) { return (socket >= 0) && (socket < stateCount) && (states[socket] == SOCKET_RECONCILING); }
+	bool Claiming(int socket) { return (socket >= 0) && (socket < stateCount) && (states[socket] == SOCKET_CLAIMING); }
+	void Forget(int socket);
+
+	// ...and pass on their events for as long as it owns them (or is still deciding whether it does)
+
+	int Receive(int socket);
+	short PollEvents(int socket);
+	int ReadyToWrite(int socket);
+
+	// the event loop collects finished joins, and connections that can now be claimed or not
+
+	int Service(uint64_t now);
+	int PollTimeout(int timeout);
+
+	int Format(char *buffer, size_t size, uint64_t now);
+	const ReconcileStats& Stats() { return stats; }
+
+	// the join itself, on whatever thread calls it
+
+	typedef struct _Entry
+	{
+		uint64_t hash;
+		int64_t timeUs;
+		unsigned int index;			// where it came in the upload
+		unsigned int transaction;	// of the record it matched
+		ReconcileOutcome outcome;
+	} Entry;
+
+	static unsigned int Join(ResultsRepository &repo, struct in_addr client, Entry *entries, unsigned int count, int64_t toleranceUs, unsigned int outcomes[RECONCILE_OUTCOMES]);
+
+protected:
+	typedef enum _SocketState
+	{
+		SOCKET_ORDINARY = 0,
+		SOCKET_FRESH,			// nothing received yet, so it might still be a batch
+		SOCKET_CLAIMING,		// what's arrived is the start of the keyword, so wait for the rest
+		SOCKET_RECONCILING
+	} SocketState;
+
+	typedef enum _JobState
+	{
+		JOB_FREE = 0,
+		JOB_RECEIVING,
+		JOB_JOINING,
+		JOB_SENDING
+	} JobState;
+
+	typedef struct _Job
+	{
+		JobState state;
+		int socket;					// -1 once the client has gone (a join may still be running)
+		struct in_addr client;
+		unsigned int expected;
+		unsigned int received;
+		int64_t toleranceUs;
+		bool headerDone;
+		Entry *entries;
+		char line[RECONCILE_LINE_SIZE];
+		int lineLength;
+
+		pthread_t thread;
+		bool threaded;
+		int finished;				// set by the join thread, read by the event loop
+		uint64_t joinNs;
+		unsigned int records;
+		unsigned int outcomes[RECONCILE_OUTCOMES];
+
+		char *output;
+		size_t outputLength;
+		size_t outputSent;
+	} Job;
+
+	typedef struct _PendingClaim
+	{
+		int socket;					// -1 if this one's free
+		uint64_t deadline;
+		bool ready;					// to be decided, one way or the other
+	} PendingClaim;
+
+	Job *FindJob(int socket);
+	PendingClaim *FindClaim(int socket);
+	void EndClaim(int socket);
+	static bool ClaimUndecided(const char *peek, int n, uint64_t now, uint64_t deadline);
+	bool SetState(int socket, SocketState state);
+	bool ParseLine(Job &job, char *line);
+	void Fail(Job &job, const char *reason, bool badInput = true);
+	void StartJoin(Job &job);
+	static void *JoinThread(void *context);
+	static void RunJob(Job &job);
+	void FinishJob(Job &job);
+	void FreeJob(Job &job);
+
+	unsigned char *states;		// a SocketState for every descriptor, indexed by descriptor
+	int stateCount;
+	Job jobs[RECONCILE_MAX_JOBS];
+	int joining;
+	PendingClaim claims[RECONCILE_MAX_CLAIMS];
+	int claimCount;
+	char readBuffer[RECONCILE_READ_SIZE];
+	ReconcileStats stats;
+
+private:
+};
+
+extern Reconciler reconciler;
+
+#endif /* RECONCILE_H_ */
+
+// end of reconcile.h
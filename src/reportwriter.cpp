@@ -45,7 +45,8 @@ bool ReportWriter::Begin()
 	*outputFile <<"  <p>Server build date: " <<  __DATE__ << "</p>\n";
 	*outputFile <<"  <p>Server port: " << transactionPort << "</p>\n";
 	*outputFile <<"  <table border=\"1\" cellpadding=\"3\" cellspacing=\"0\" halign=\"left\" valign=\"middle\">\n";
-	*outputFile <<"  <tr><td>Transaction #</td><td>Transaction time</td><td>From IP address</td><td>From port</td><td>Inbound data</td><td>Reply data</td></tr>\n";
+	*outputFile <<"  <tr><td>Transaction #</td><td>Transaction time</td><td>From IP address</td><td>From port</td><td>Inbound data</td><td>Reply data</td>"
+		"<td>Queueing (usec)</td><td>Service (usec)</td><td>Kernel to reply (usec)</td></tr>\n";
 
 	return true;
 }
@@ -65,7 +66,23 @@ bool ReportWriter::WriteRecord(TestRecord &tr)
 		<< "</td> <td>" << ntohs(tr.port)
 		<< "</td> <td>" << tr.dataReceived
 		<< "</td> <td>" << tr.dataSent
-		<< "</td></tr>\n";
+		<< "</td> ";
+
+	/*
+	 * Service time is always known; queueing time only when the socket gave us a kernel timestamp
+	 */
+
+	double serviceUsec = (double)(tr.sentNs - tr.receivedNs) / 1000.0;
+	if (tr.queueNs >= 0)
+	{
+		double queueUsec = (double)tr.queueNs / 1000.0;
+		*outputFile << "<td>" << queueUsec << "</td> <td>" << serviceUsec << "</td> <td>" << (queueUsec + serviceUsec);
+	}
+	else
+	{
+		*outputFile << "<td>-</td> <td>" << serviceUsec << "</td> <td>-";
+	}
+	*outputFile << "</td></tr>\n";
 
 	return true;
 }
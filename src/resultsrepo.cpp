@@ -10,8 +10,12 @@
 #include <iostream>
 using namespace std;
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>				// for memset() and memcpy()
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "resultsrepo.h"
 #include "reportwriter.h"
 
@@ -19,79 +23,328 @@ ResultsRepository::ResultsRepository()
 {
 	head = 0;
 	totalTestRecords = 0;
-	testRecords = NULL;
+	slots = NULL;
+	memoryFd = -1;
+	recordsStored = 0;
+	tornReads = 0;
 }
 
 ResultsRepository::~ResultsRepository()
 {
-	if (testRecords)
+	if (slots && (memoryFd >= 0))
 	{
-		free(testRecords);
+		munmap(slots, sizeof(RecordSlot) * totalTestRecords);
+	}
+	else if (slots)
+	{
+		free(slots);
+	}
+	if (memoryFd >= 0)
+	{
+		close(memoryFd);
 	}
 }
 
 void ResultsRepository::Init(int howManyRecordsToKeep)
 {
-	if (testRecords)
+	if (slots)
 	{
 		cerr << "ResultsRepository: already initialized" << endl;
 	}
 	else
 	{
+		// a memfd starts out zero-filled, just like the memset below
+
+		size_t size = sizeof(RecordSlot) * howManyRecordsToKeep;
+#ifdef MFD_CLOEXEC
+		memoryFd = memfd_create("xm2m-repository", MFD_CLOEXEC);
+#endif
+		if ((memoryFd >= 0) && (ftruncate(memoryFd, size) == 0) && Map(memoryFd, howManyRecordsToKeep))
+		{
+			return;
+		}
+		if (memoryFd >= 0)
+		{
+			close(memoryFd);
+			memoryFd = -1;
+		}
+		cerr << "ResultsRepository: Warning: no shared memory, so the repository can't be handed to a restarted server" << endl;
 		totalTestRecords = howManyRecordsToKeep;
-		testRecords = (TestRecord *)malloc(sizeof(TestRecord) * totalTestRecords);
-		memset(testRecords, 0, sizeof(TestRecord) * totalTestRecords);
+		slots = (RecordSlot *)malloc(size);
+		memset(slots, 0, size);
 	}
 }
 
-void ResultsRepository::StoreRecord(TestRecord& record)
+bool ResultsRepository::Map(int fd, unsigned int capacity)
+{
+	size_t size = sizeof(RecordSlot) * capacity;
+	struct stat status;
+	if ((fstat(fd, &status) < 0) || ((size_t)status.st_size < size))
+	{
+		cerr << "ResultsRepository: shared memory is too small for " << capacity << " records" << endl;
+		return false;
+	}
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		cerr << "ResultsRepository: unable to map shared memory (" << errno << ")" << endl;
+		return false;
+	}
+	slots = (RecordSlot *)mapping;
+	totalTestRecords = capacity;
+	return true;
+}
+
+/*
+ * Take over the repository of the server we're replacing. If it's the size we'd have chosen
+ * anyway, we simply map its ring and carry on writing where it left off - no copying at all.
+ * Otherwise we build our own ring and copy its records in, oldest first, so if ours is smaller
+ * it's the newest that survive. Either way, we own fd from here on.
+ */
+
+static bool InheritVisitor(TestRecord &record, void *context)
+{
+	((ResultsRepository *)context)->StoreRecord(record);
+	return true;
+}
+
+bool ResultsRepository::Inherit(int fd, unsigned int capacity, unsigned int writeHead, uint64_t stored, int howManyRecordsToKeep)
 {
-	if (testRecords)
+	if (slots)
 	{
-		memcpy(&(testRecords[head]), &record, sizeof(TestRecord));
-		head++;
-		if (head >= totalTestRecords)
+		cerr << "ResultsRepository: already initialized" << endl;
+		close(fd);
+		return false;
+	}
+	if ((capacity == 0) || (writeHead >= capacity))
+	{
+		cerr << "ResultsRepository: inherited repository makes no sense" << endl;
+		close(fd);
+		return false;
+	}
+
+	if (capacity == (unsigned int)howManyRecordsToKeep)
+	{
+		if (!Map(fd, capacity))
 		{
-			head = 0;
+			close(fd);
+			return false;
 		}
+		memoryFd = fd;
+		head = writeHead;
+		recordsStored = stored;
+		return true;
+	}
+
+	ResultsRepository previous;
+	if (!previous.Map(fd, capacity))
+	{
+		close(fd);
+		return false;
 	}
+	previous.memoryFd = fd;
+	previous.head = writeHead;
+	previous.recordsStored = stored;
+	Init(howManyRecordsToKeep);
+	previous.VisitRecords(InheritVisitor, this);
+	return true;
 }
 
-void ResultsRepository::WriteReport(ReportWriter &writer)
+/*
+ * The writer side of the seqlock. Only one thread (the event loop) may ever call StoreRecord().
+ */
+
+void ResultsRepository::WriteSlot(unsigned int index, TestRecord &record)
 {
-	if (testRecords)
+	RecordSlot &slot = slots[index];
+	unsigned int sequence = slot.sequence;	// nobody else writes it, so no need for an atomic load
+
+	__atomic_store_n(&slot.sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);	// readers must see the odd number before any new data
+	memcpy(&(slot.record), &record, sizeof(TestRecord));
+	__atomic_store_n(&slot.sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void ResultsRepository::StoreRecord(TestRecord& record)
+{
+	if (slots)
 	{
-		writer.Begin();
+		WriteSlot(head, record);
 
-		/*
-		 * If there is already a record at 'head', then we've wrapped around at least one time, and the record at head
-		 * is currently the oldest record on file, so let's write all of the records from 'head' to the end of the array
-		 * first.
-		 */
+		unsigned int next = head + 1;
+		if (next >= totalTestRecords)
+		{
+			next = 0;
+		}
+		__atomic_store_n(&head, next, __ATOMIC_RELEASE);
+		__atomic_store_n(&recordsStored, recordsStored + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * The reader side. Copy the slot, then make sure the writer didn't start (or finish) changing it
+ * while we were copying. A couple of retries are plenty - the writer holds a slot for a single
+ * memcpy - after which we give up on the slot rather than risk spinning behind a busy writer.
+ */
 
-		unsigned int i;
-		if (testRecords[head].transactionNumber > 0)
+#define READ_ATTEMPTS	3
+
+bool ResultsRepository::ReadRecord(unsigned int index, TestRecord &record)
+{
+	if ((slots == NULL) || (index >= totalTestRecords))
+	{
+		return false;
+	}
+	RecordSlot &slot = slots[index];
+	for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++)
+	{
+		unsigned int before = __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE);
+		if (before == 0)
 		{
-			for (i = head; i < totalTestRecords; i++)
+			return false;	// never written
+		}
+		if ((before & 1) == 0)
+		{
+			memcpy(&record, &(slot.record), sizeof(TestRecord));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);	// finish copying before re-checking
+			unsigned int after = __atomic_load_n(&slot.sequence, __ATOMIC_RELAXED);
+			if (before == after)
 			{
-				writer.WriteRecord(testRecords[i]);
+				return true;
 			}
 		}
+	}
+	__atomic_fetch_add(&tornReads, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+/*
+ * Walk the ring from oldest to newest record, as of when we started, skipping torn slots.
+ * Returns how many records the visitor saw.
+ */
+
+unsigned int ResultsRepository::VisitRecords(RecordVisitor visitor, void *context)
+{
+	if (slots == NULL)
+	{
+		return 0;
+	}
+	uint64_t stored = __atomic_load_n(&recordsStored, __ATOMIC_ACQUIRE);
+	unsigned int newest = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
 
-		/*
-		 * Now we'll add the newest records (from 0 to head)
-		 */
+	/*
+	 * If we've wrapped around at least one time, the record at 'head' is currently the oldest
+	 * record on file, so we start there; otherwise we start at the beginning of the array.
+	 */
 
-		for (i = 0; i < head; i++)
+	unsigned int count = (stored < totalTestRecords) ? (unsigned int)stored : totalTestRecords;
+	unsigned int index = (stored < totalTestRecords) ? 0 : newest;
+	unsigned int visited = 0;
+	TestRecord record;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (ReadRecord(index, record))
 		{
-			writer.WriteRecord(testRecords[i]);
+			visited++;
+			if (!visitor(record, context))
+			{
+				break;
+			}
 		}
+		if (++index >= totalTestRecords)
+		{
+			index = 0;
+		}
+	}
+	return visited;
+}
+
+/*
+ * Without any better way to find a client's records, look at them all.
+ */
+
+typedef struct _ClientFilter
+{
+	in_addr_t address;
+	RecordVisitor visitor;
+	void *context;
+	unsigned int visited;
+} ClientFilter;
+
+static bool ClientFilterVisitor(TestRecord &record, void *context)
+{
+	ClientFilter *filter = (ClientFilter *)context;
+	if (record.ipAddress.s_addr != filter->address)
+	{
+		return true;
+	}
+	filter->visited++;
+	return filter->visitor(record, filter->context);
+}
+
+unsigned int ResultsRepository::VisitClient(struct in_addr client, RecordVisitor visitor, void *context)
+{
+	ClientFilter filter;
+	filter.address = client.s_addr;
+	filter.visitor = visitor;
+	filter.context = context;
+	filter.visited = 0;
+	VisitRecords(ClientFilterVisitor, &filter);
+	return filter.visited;
+}
+
+typedef struct _SnapshotContext
+{
+	TestRecord *records;
+	unsigned int count;
+	unsigned int maxRecords;
+} SnapshotContext;
+
+static bool SnapshotVisitor(TestRecord &record, void *context)
+{
+	SnapshotContext *snapshot = (SnapshotContext *)context;
+	memcpy(&(snapshot->records[snapshot->count++]), &record, sizeof(TestRecord));
+	return snapshot->count < snapshot->maxRecords;
+}
+
+unsigned int ResultsRepository::Snapshot(TestRecord *records, unsigned int maxRecords)
+{
+	SnapshotContext snapshot;
+	snapshot.records = records;
+	snapshot.count = 0;
+	snapshot.maxRecords = maxRecords;
+	if (maxRecords > 0)
+	{
+		VisitRecords(SnapshotVisitor, &snapshot);
+	}
+	return snapshot.count;
+}
+
+static bool ReportVisitor(TestRecord &record, void *context)
+{
+	return ((ReportWriter *)context)->WriteRecord(record);
+}
+
+void ResultsRepository::WriteReport(ReportWriter &writer)
+{
+	if (slots)
+	{
+		writer.Begin();
+		VisitRecords(ReportVisitor, &writer);
 		writer.End();
 	}
 }
 
-// the sole global instance, in this build anyway
+void ResultsRepository::WriteClientReport(ReportWriter &writer, struct in_addr client)
+{
+	if (slots)
+	{
+		writer.Begin();
+		VisitClient(client, ReportVisitor, &writer);
+		writer.End();
+	}
+}
 
-ResultsRepository resultsRepo;
+// the sole global instance is in partitionedrepo.cpp
 
 // end of ResultsRepository.cpp
@@ -10,6 +10,7 @@
 #ifndef RESULTSREPO_H_
 #define RESULTSREPO_H_
 
+#include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -26,10 +27,32 @@
  * Not 'compelling' today though.
  */
 
+/*
+ * startTime is on the wall clock and is what a report shows. It comes from the kernel's receive
+ * timestamp when the socket provides one, so it reflects when the request reached this machine.
+ *
+ * The remaining timing fields are for interval math, which the wall clock is unfit for:
+ * - queueNs is how long the request sat in the kernel before we read it (-1 if unknown). It's
+ *   the difference of two wall-clock readings taken microseconds apart, so clock adjustments
+ *   don't meaningfully affect it.
+ * - receivedNs and sentNs are CLOCK_MONOTONIC readings just after the receive and just after the
+ *   reply was handed off (to the socket, or to the impairment queue if that's enabled).
+ * So queueNs + (sentNs - receivedNs) is the kernel-to-reply latency of the transaction.
+ *
+ * replyBytes is what became of the reply: how many bytes went to the socket (or the impairment
+ * queue, or started out as an amplified reply), 0 if reply impairment dropped it (or had no room
+ * to queue it), or -1 if sending it failed - so reconciliation
+ * (see reconcile.h) can tell a request we answered from one we only received.
+ */
+
 typedef struct _TestRecord
 {
 	unsigned int transactionNumber;
 	struct timeval startTime;
+	int64_t queueNs;
+	uint64_t receivedNs;
+	uint64_t sentNs;
+	int replyBytes;
 	struct in_addr ipAddress;
 	unsigned short port;
 	char dataReceived[RX_BUFFER_SIZE];
@@ -38,16 +61,40 @@ typedef struct _TestRecord
 
 class ReportWriter;	// circular reference avoidance
 
+/*
+ * Visitors are handed each record in turn (a private copy - keep it or change it as you like).
+ * Return false to stop early.
+ */
+
+typedef bool (*RecordVisitor)(TestRecord &record, void *context);
+
 /*
  * The ResultsRepository class is a base class that represents a relatively nonvolatile
  * repository for TestRecords. This base class just keeps a size-configurable FIFO buffer
  * of records in memory (agreed, that's volatile). In this version, oldest records are silently
  * discarded without warning by design.
  *
+ * The server itself is single-threaded, but readers of the repository (reports, queries, exports)
+ * needn't be. Each slot in the ring carries a sequence number which the one writer makes odd
+ * while it's changing the slot and even again once it's done - a seqlock. Readers copy a slot
+ * and then check the sequence number didn't move; if it did, the copy may be torn and is skipped.
+ * So any number of reader threads can take consistent copies while StoreRecord() carries on,
+ * and the writer never waits for (or even knows about) any of them. A reader racing a busy
+ * writer may miss records that were overwritten under it, and may see a newer record in an
+ * older record's place, but never a mixture of the two.
+ *
+ * The ring lives in an anonymous shared-memory file (a memfd) rather than on the heap, so that
+ * a restarting server can pass it to its replacement (see handoff.h), which maps the very same
+ * records with Inherit() instead of starting out empty.
+ *
  * Derived classes could be written to implement features like:
  * - a backing MySQL database - perhaps keeping the base class's ring FIFO for buffering or cacheing
  * - automatically writing reports once a day, or whenever the ring fills
  * - issuing some kind of warning or counter of how often the ring fills
+ * - sharing the slots out fairly between clients (see PartitionedRepository, in partitionedrepo.h)
+ *
+ * VisitClient() visits just one client's records. Here it has to look at every record to find
+ * them; a repository that keeps each client's records together can do better.
  */
 
 class ResultsRepository
@@ -61,11 +108,42 @@ public:
 	virtual void Init(int howManyRecordsToKeep);
 	virtual void StoreRecord(TestRecord& record);
 	virtual void WriteReport(ReportWriter& writer);
+	void WriteClientReport(ReportWriter& writer, struct in_addr client);
+
+	// restart handoff: the ring's memory, and where the writer had got to
+
+	int SharedMemory() { return memoryFd; }
+	unsigned int Head() { return head; }
+	uint64_t RecordsStored() { return recordsStored; }
+	virtual bool Inherit(int fd, unsigned int capacity, unsigned int head, uint64_t stored, int howManyRecordsToKeep);
+
+	// safe to call from any thread, at any time
+
+	bool ReadRecord(unsigned int slot, TestRecord &record);
+	unsigned int VisitRecords(RecordVisitor visitor, void *context);
+	virtual unsigned int VisitClient(struct in_addr client, RecordVisitor visitor, void *context);
+	unsigned int Snapshot(TestRecord *records, unsigned int maxRecords);
+	unsigned int Capacity() { return totalTestRecords; }
+	bool IsFull() { return __atomic_load_n(&recordsStored, __ATOMIC_ACQUIRE) >= totalTestRecords; }
+	virtual bool IsPartitioned() { return false; }
+	uint64_t TornReads() { return __atomic_load_n(&tornReads, __ATOMIC_RELAXED); }
 
 protected:
-	TestRecord *testRecords;
+	typedef struct _RecordSlot
+	{
+		unsigned int sequence;	// odd while the writer is changing this slot; 0 if never written
+		TestRecord record;
+	} RecordSlot;
+
+	bool Map(int fd, unsigned int capacity);
+	void WriteSlot(unsigned int index, TestRecord &record);
+
+	RecordSlot *slots;
+	int memoryFd;					// what slots is mapped from, or -1 if it's just on the heap
 	unsigned int totalTestRecords;	// set at allocation time, during Init()
-	unsigned int head;				// head of the FIFO - newest record is here
+	unsigned int head;				// head of the FIFO - the next record stored goes here
+	uint64_t recordsStored;			// how many records have ever been stored (so, whether we've wrapped)
+	uint64_t tornReads;				// slots readers had to skip because the writer was in them
 
 private:
 };
@@ -74,9 +152,10 @@ private:
  * Not a true singleton - just a convenient global instance.
  * Theoretically you could decide to create one instance per connected client,
  * for example (in fact I think no class modifications are needed at all to
- * make that change).
+ * make that change). In this build it's a PartitionedRepository, which behaves just like
+ * this class unless it's told to partition by client.
  */
 
-extern ResultsRepository resultsRepo;
+extern ResultsRepository &resultsRepo;
 
 #endif /* RESULTSREPO_H_ */
@@ -0,0 +1,111 @@
+/*
+ * rxtimestamp.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>		// for struct scm_timestamping
+#endif
+
+#include "rxtimestamp.h"
+
+bool EnableReceiveTimestamps(int socket)
+{
+#if defined(SO_TIMESTAMPING)
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0)
+	{
+		return true;
+	}
+#endif
+#if defined(SO_TIMESTAMPNS)
+	int one = 1;
+	if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == 0)
+	{
+		return true;
+	}
+#elif defined(SO_TIMESTAMP)
+	int one = 1;
+	if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one)) == 0)
+	{
+		return true;
+	}
+#endif
+	return false;
+}
+
+ssize_t ReceiveWithTimestamp(
+	int socket,
+	char * buffer,
+	size_t bufferLength,
+	struct sockaddr *clientAddress,
+	socklen_t *addrLength,
+	struct timespec *kernelTime
+){
+	char control[256];	// room for any of the timestamp formats, plus some slack
+	struct iovec iov;
+	struct msghdr msg;
+
+	iov.iov_base = buffer;
+	iov.iov_len = bufferLength;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = clientAddress;
+	msg.msg_namelen = (addrLength != NULL) ? *addrLength : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	memset(kernelTime, 0, sizeof(*kernelTime));
+
+	ssize_t n = recvmsg(socket, &msg, 0);
+	if (n < 0)
+	{
+		return n;
+	}
+	if (addrLength != NULL)
+	{
+		*addrLength = msg.msg_namelen;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET)
+		{
+			continue;
+		}
+#if defined(SCM_TIMESTAMPING)
+		if (cmsg->cmsg_type == SCM_TIMESTAMPING)
+		{
+			struct scm_timestamping *stamps = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			memcpy(kernelTime, &stamps->ts[0], sizeof(*kernelTime));	// [0] is the software stamp
+		}
+#endif
+#if defined(SCM_TIMESTAMPNS)
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			memcpy(kernelTime, CMSG_DATA(cmsg), sizeof(*kernelTime));
+		}
+#endif
+#if defined(SCM_TIMESTAMP)
+		if (cmsg->cmsg_type == SCM_TIMESTAMP)
+		{
+			struct timeval tv;
+			memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+			kernelTime->tv_sec = tv.tv_sec;
+			kernelTime->tv_nsec = tv.tv_usec * 1000;
+		}
+#endif
+	}
+	return n;
+}
+
+// end of rxtimestamp.cpp
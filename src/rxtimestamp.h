@@ -0,0 +1,42 @@
+/*
+ * rxtimestamp.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * Helpers for asking the kernel when a packet actually arrived, rather than when we got
+ * around to reading it. The difference between the two is time the request spent queued
+ * inside the server (or behind other requests in the event loop), which is otherwise invisible.
+ *
+ * Linux gives the best answer via SO_TIMESTAMPING (falling back to SO_TIMESTAMPNS); other
+ * platforms get SO_TIMESTAMP if they have it. Kernel timestamps are on the wall clock
+ * (CLOCK_REALTIME), so they're only compared against another wall-clock reading taken
+ * immediately after the receive - never used for longer intervals.
+ */
+
+#ifndef RXTIMESTAMP_H_
+#define RXTIMESTAMP_H_
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+bool EnableReceiveTimestamps(int socket);
+
+/*
+ * Just like recvfrom(), but also fills in kernelTime with the kernel's arrival timestamp.
+ * If the kernel didn't supply one, kernelTime is zeroed.
+ */
+
+ssize_t ReceiveWithTimestamp(
+	int socket,
+	char * buffer,
+	size_t bufferLength,
+	struct sockaddr *clientAddress,
+	socklen_t *addrLength,
+	struct timespec *kernelTime
+);
+
+#endif /* RXTIMESTAMP_H_ */
+
+// end of rxtimestamp.h
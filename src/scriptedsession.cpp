@@ -0,0 +1,559 @@
+/*
+ * scriptedsession.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <exception>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <arpa/inet.h>
+#include <iostream>
+using namespace std;
+
+#include "scriptedsession.h"
+#include "allocaudit.h"
+#include "framepool.h"
+#include "resultsrepo.h"
+#include "rxtimestamp.h"
+#include "timeutil.h"
+
+/*
+ * Coroutine frames come from the pool. If it's exhausted, operator new returns NULL and the
+ * compiler hands back get_return_object_on_allocation_failure() instead of a running script.
+ */
+
+void *ScriptTask::promise_type::operator new(size_t size) noexcept
+{
+	return framePool.Allocate(size);
+}
+
+void ScriptTask::promise_type::operator delete(void *frame, size_t size)
+{
+	framePool.Release(frame, size);
+}
+
+void ScriptTask::promise_type::unhandled_exception()
+{
+	cerr << "A session script threw an exception; scripts must handle their own errors" << endl;
+	std::terminate();
+}
+
+/*
+ * The awaitables. Each records what the script is waiting for, then asks whether it can be
+ * satisfied straight away; if not, the script suspends until the session completes it.
+ */
+
+ScriptConnection::RecvAwaiter ScriptConnection::Recv(char *buffer, int size)
+{
+	waiting = WAIT_RECV;
+	recvBuffer = buffer;
+	recvSize = size;
+	RecvAwaiter awaiter = { this };
+	return awaiter;
+}
+
+ScriptConnection::RecvAwaiter ScriptConnection::RecvLine(char *buffer, int size)
+{
+	waiting = WAIT_LINE;
+	recvBuffer = buffer;
+	recvSize = size;
+	RecvAwaiter awaiter = { this };
+	return awaiter;
+}
+
+ScriptConnection::SendAwaiter ScriptConnection::Send(const char *buffer, int length)
+{
+	waiting = WAIT_SEND;
+	sendData = buffer;
+	sendLength = length;
+	sendOffset = 0;
+	SendAwaiter awaiter = { this };
+	return awaiter;
+}
+
+ScriptConnection::SleepAwaiter ScriptConnection::Sleep(unsigned int milliseconds)
+{
+	SleepAwaiter awaiter = { this, milliseconds };
+	return awaiter;
+}
+
+/*
+ * CompleteRecv() satisfies a pending Recv() or RecvLine() from what's arrived, if it can.
+ * A line that fills the whole pending buffer without a newline is handed over as it is, so
+ * a client that never sends one can't wedge the script.
+ */
+
+bool ScriptConnection::CompleteRecv()
+{
+	int take = 0;		// bytes consumed from pending
+	int length = 0;		// bytes handed to the script
+
+	if ((waiting != WAIT_RECV) && (waiting != WAIT_LINE))
+	{
+		return false;
+	}
+
+	if ((waiting == WAIT_RECV) && (pendingLength > 0))
+	{
+		length = (pendingLength < recvSize) ? pendingLength : recvSize;
+		memcpy(recvBuffer, pending, length);
+		take = length;
+	}
+	else if ((waiting == WAIT_LINE) && (pendingLength > 0))
+	{
+		char *newline = (char *)memchr(pending, '\n', pendingLength);
+		if (newline != NULL)
+		{
+			take = (newline - pending) + 1;
+			length = newline - pending;
+		}
+		else if (pendingLength == RX_BUFFER_SIZE)
+		{
+			take = length = pendingLength;
+		}
+		if (take > 0)
+		{
+			if ((length > 0) && (pending[length - 1] == '\r'))
+			{
+				length--;
+			}
+			if (length > recvSize - 1)
+			{
+				length = recvSize - 1;
+			}
+			if (length < 0)
+			{
+				length = 0;
+			}
+			memcpy(recvBuffer, pending, length);
+			if (recvSize > 0)
+			{
+				recvBuffer[length] = '\0';
+			}
+		}
+	}
+
+	if (take > 0)
+	{
+		pendingLength -= take;
+		memmove(pending, pending + take, pendingLength);
+		result = length;
+		waiting = WAIT_NONE;
+		return true;
+	}
+	if (peerClosed)
+	{
+		result = 0;
+		waiting = WAIT_NONE;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * PushSend() gives the kernel as much of a pending Send() as it'll take, returning true once
+ * the Send() is complete (or has failed).
+ */
+
+bool ScriptConnection::PushSend()
+{
+	while (sendOffset < sendLength)
+	{
+		ssize_t rc = send(socket, sendData + sendOffset, sendLength - sendOffset, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				return false;	// wait for POLLOUT
+			}
+			cerr << "Unable to send reply: " << rc << " (" << errno << ")" << endl;
+			result = -1;
+			waiting = WAIT_NONE;
+			return true;
+		}
+		sendOffset += rc;
+	}
+	session->RecordSend(*this, sendData, sendLength);
+	result = sendLength;
+	waiting = WAIT_NONE;
+	return true;
+}
+
+/*
+ * StartSleep() returns false (don't suspend) if the timer can't be scheduled; the script then
+ * carries on at once, which is better than never waking up.
+ */
+
+bool ScriptConnection::StartSleep(unsigned int milliseconds)
+{
+	wakeAt = MonotonicNanoseconds() + ((uint64_t)milliseconds * NANOS_PER_MSEC);
+	if (!session->timers.Push(wakeAt, this - session->connections))
+	{
+		session->stats.sleepsSkipped++;
+		return false;
+	}
+	waiting = WAIT_SLEEP;
+	return true;
+}
+
+ScriptedSession::ScriptedSession(
+	const char * description
+)
+: ClientSession(description, false)	// scripts need a connection, so TCP only
+{
+	connections = NULL;
+	maxConnections = 0;
+	freeConnections = NULL;
+	freeCount = 0;
+	connectionBySocket = NULL;
+	maxSockets = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+ScriptedSession::~ScriptedSession()
+{
+	if (connections)
+	{
+		for (unsigned int i = 0; i < maxConnections; i++)
+		{
+			if (connections[i].inUse && connections[i].script)
+			{
+				connections[i].script.destroy();
+			}
+		}
+		free(connections);
+		connections = NULL;
+	}
+	if (freeConnections)
+	{
+		free(freeConnections);
+		freeConnections = NULL;
+	}
+	if (connectionBySocket)
+	{
+		free(connectionBySocket);
+		connectionBySocket = NULL;
+	}
+}
+
+bool ScriptedSession::Init(unsigned int max)
+{
+	maxConnections = max;
+	connections = (ScriptConnection *)calloc(maxConnections, sizeof(ScriptConnection));
+	freeConnections = (unsigned int *)malloc(sizeof(unsigned int) * maxConnections);
+	maxSockets = getdtablesize();
+	connectionBySocket = (int *)malloc(sizeof(int) * maxSockets);
+	if ((connections == NULL) || (freeConnections == NULL) || (connectionBySocket == NULL))
+	{
+		cerr << "ScriptedSession: unable to allocate tables for " << maxConnections << " connections" << endl;
+		return false;
+	}
+	for (unsigned int i = 0; i < maxConnections; i++)
+	{
+		connections[i].session = this;
+		freeConnections[i] = maxConnections - 1 - i;	// hand out the lowest first
+	}
+	freeCount = maxConnections;
+	for (int i = 0; i < maxSockets; i++)
+	{
+		connectionBySocket[i] = -1;
+	}
+
+	// each connection sleeps at most once at a time, but abandoned sleeps linger until they expire
+
+	if (!timers.Init(maxConnections * 4))
+	{
+		return false;
+	}
+	if (!framePool.IsInitialized() && !framePool.Init(SCRIPT_FRAME_SIZE, maxConnections))
+	{
+		return false;
+	}
+	return true;
+}
+
+void ScriptedSession::ConnectionEstablished(int socket)
+{
+	if ((socket < 0) || (socket >= maxSockets) || (freeCount == 0))
+	{
+		cerr << description << ": no room for another scripted session" << endl;
+		stats.refused++;
+		shutdown(socket, SHUT_RDWR);	// the main loop will see the hangup and close it
+		return;
+	}
+	unsigned int index = freeConnections[--freeCount];
+	ScriptConnection &connection = connections[index];
+
+	connection.socket = socket;
+	socklen_t size = sizeof(connection.address);
+	memset(&connection.address, 0, sizeof(connection.address));
+	getpeername(socket, (struct sockaddr *)&connection.address, &size);
+	connection.inUse = true;
+	connection.peerClosed = false;
+	connection.finished = false;
+	connection.waiting = ScriptConnection::WAIT_NONE;
+	connection.result = 0;
+	connection.pendingLength = 0;
+	connection.lastRequestLength = 0;
+	connection.lastReceivedNs = 0;
+
+	ScriptTask task = Run(connection);
+	if (!task.handle)
+	{
+		cerr << description << ": no coroutine frame free for another scripted session" << endl;
+		stats.refused++;
+		connection.inUse = false;
+		freeConnections[freeCount++] = index;
+		shutdown(socket, SHUT_RDWR);
+		return;
+	}
+	connection.script = task.handle;
+	connectionBySocket[socket] = index;
+	stats.started++;
+	stats.active++;
+
+	Resume(connection);	// run the script up to its first co_await
+}
+
+void ScriptedSession::ConnectionTerminated(int socket)
+{
+	ScriptConnection *connection = Find(socket);
+	if (connection == NULL)
+	{
+		return;
+	}
+	if (!connection->finished)
+	{
+		stats.abandoned++;
+	}
+	connection->script.destroy();
+	connection->script = NULL;
+	connection->inUse = false;
+	connection->waiting = ScriptConnection::WAIT_NONE;	// so a lingering timer finds nothing to wake
+	connectionBySocket[socket] = -1;
+	freeConnections[freeCount++] = connection - connections;
+	stats.active--;
+}
+
+/*
+ * While a Send() is stuck we only want POLLOUT; while the pending buffer is full (the script is
+ * busy elsewhere) we want nothing, which leaves the data in the kernel, where TCP flow control
+ * will slow the client down.
+ */
+
+short ScriptedSession::PollEvents(int socket)
+{
+	ScriptConnection *connection = Find(socket);
+	if (connection == NULL)
+	{
+		return POLLIN;
+	}
+	if (connection->waiting == ScriptConnection::WAIT_SEND)
+	{
+		return POLLOUT;
+	}
+	if (!connection->finished && (connection->pendingLength >= RX_BUFFER_SIZE))
+	{
+		return 0;
+	}
+	return POLLIN;
+}
+
+int ScriptedSession::ReadyToWrite(int socket)
+{
+	ALLOC_AUDIT_SCOPE();
+	ScriptConnection *connection = Find(socket);
+	if ((connection == NULL) || (connection->waiting != ScriptConnection::WAIT_SEND))
+	{
+		return 1;
+	}
+	if (connection->PushSend())
+	{
+		bool failed = (connection->result < 0);
+		Resume(*connection);
+		if (failed || connection->finished)
+		{
+			return failed ? -1 : 0;
+		}
+	}
+	return 1;
+}
+
+int ScriptedSession::MessageReceived(int socket)
+{
+	ALLOC_AUDIT_SCOPE();
+	ScriptConnection *connection = Find(socket);
+	if ((connection == NULL) || connection->finished)
+	{
+		return 0;	// refused, or the script is done: either way, close it
+	}
+	int space = RX_BUFFER_SIZE - connection->pendingLength;
+	if (space <= 0)
+	{
+		return 1;
+	}
+
+	struct timespec kernelTime;
+	int n = ReceiveWithTimestamp(socket, connection->pending + connection->pendingLength, space, NULL, NULL, &kernelTime);
+	uint64_t receivedNs = MonotonicNanoseconds();
+	if (n < 0)
+	{
+		if (errno == EWOULDBLOCK)
+		{
+			return 1;
+		}
+		cerr << "Socket receive failure" << endl;
+		return -1;
+	}
+	if (n == 0)
+	{
+		Log("Session ended normally (how polite).\n");
+		connection->peerClosed = true;
+		if (connection->CompleteRecv())
+		{
+			Resume(*connection);	// let the script see the end of its input
+		}
+		return 0;
+	}
+
+	char address[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &connection->address.sin_addr, address, sizeof(address));
+	Log("%s: Message arrived from %s\n", description, address);
+
+	// remember it as the request half of the next transaction record
+
+	memcpy(connection->lastRequest, connection->pending + connection->pendingLength, n);
+	connection->lastRequestLength = n;
+	connection->lastReceivedNs = receivedNs;
+	if (kernelTime.tv_sec != 0)
+	{
+		connection->lastReceivedTime = kernelTime;
+	}
+	else
+	{
+		clock_gettime(CLOCK_REALTIME, &connection->lastReceivedTime);
+	}
+
+	connection->pendingLength += n;
+	if (connection->CompleteRecv())
+	{
+		Resume(*connection);
+	}
+	return connection->finished ? 0 : 1;
+}
+
+/*
+ * Service() wakes the scripts whose sleeps are over, returning how many it woke; the main loop
+ * uses that to know it should ask PollEvents() again.
+ */
+
+unsigned int ScriptedSession::Service(uint64_t now)
+{
+	unsigned int woken = 0;
+	while (!timers.IsEmpty() && (timers.NextDeadline() <= now))
+	{
+		uint64_t deadline;
+		unsigned int index;
+		timers.Pop(deadline, index);
+		ScriptConnection &connection = connections[index];
+		if (
+			connection.inUse &&
+			(connection.waiting == ScriptConnection::WAIT_SLEEP) &&
+			(connection.wakeAt == deadline)		// and not a sleep left behind by an earlier session
+		){
+			ALLOC_AUDIT_SCOPE();
+			connection.waiting = ScriptConnection::WAIT_NONE;
+			Resume(connection);
+			woken++;
+		}
+	}
+	return woken;
+}
+
+int ScriptedSession::PollTimeout(int timeout, uint64_t now)
+{
+	if (timers.IsEmpty())
+	{
+		return timeout;
+	}
+	uint64_t next = timers.NextDeadline();
+	int due = (next <= now) ? 0 : (int)((next - now + NANOS_PER_MSEC - 1) / NANOS_PER_MSEC);
+	return ((timeout < 0) || (due < timeout)) ? due : timeout;
+}
+
+ScriptConnection *ScriptedSession::Find(int socket)
+{
+	if ((socket < 0) || (socket >= maxSockets) || (connectionBySocket == NULL) || (connectionBySocket[socket] < 0))
+	{
+		return NULL;
+	}
+	return &connections[connectionBySocket[socket]];
+}
+
+/*
+ * Run the script until its next co_await (or its end). A script that has finished gets its
+ * connection shut down, so the main loop sees a hangup and closes the session.
+ */
+
+void ScriptedSession::Resume(ScriptConnection &connection)
+{
+	stats.resumes++;
+	connection.script.resume();
+	if (connection.script.done() && !connection.finished)
+	{
+		connection.finished = true;
+		stats.finished++;
+		shutdown(connection.socket, SHUT_RDWR);
+	}
+}
+
+void ScriptedSession::RecordSend(ScriptConnection &connection, const char *data, int length)
+{
+	if (record == NULL)
+	{
+		return;
+	}
+	TestRecord &testRecord = *record;	// the session's own, rather than one on the stack for each send
+	testRecord.transactionNumber = NextTransactionNumber();
+	testRecord.sentNs = MonotonicNanoseconds();
+	if (connection.lastReceivedNs != 0)
+	{
+		testRecord.startTime.tv_sec = connection.lastReceivedTime.tv_sec;
+		testRecord.startTime.tv_usec = connection.lastReceivedTime.tv_nsec / 1000;
+		testRecord.receivedNs = connection.lastReceivedNs;
+	}
+	else
+	{
+		// the script spoke first (a greeting, say); there's no request to pair it with
+
+		gettimeofday(&testRecord.startTime, NULL);
+		testRecord.receivedNs = testRecord.sentNs;
+	}
+	testRecord.queueNs = -1;
+	testRecord.replyBytes = length;
+	testRecord.ipAddress = connection.address.sin_addr;
+	testRecord.port = connection.address.sin_port;
+	int sent = (length < RX_BUFFER_SIZE) ? length : RX_BUFFER_SIZE;
+	memcpy(testRecord.dataReceived, connection.lastRequest, connection.lastRequestLength);
+	memset(testRecord.dataReceived + connection.lastRequestLength, 0, RX_BUFFER_SIZE - connection.lastRequestLength);
+	memcpy(testRecord.dataSent, data, sent);
+	memset(testRecord.dataSent + sent, 0, RX_BUFFER_SIZE - sent);
+
+	RecordTransaction(connection.socket, testRecord, connection.lastRequestLength, length);
+	connection.lastRequestLength = 0;
+	connection.lastReceivedNs = 0;
+}
+
+// end of scriptedsession.cpp
@@ -0,0 +1,224 @@
+/*
+ * scriptedsession.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * ScriptedSession lets a subclass write a multi-step exchange - an ATM asking for a card, then
+ * a PIN, then waiting on an authorization, then dispensing - as one straight-line C++20
+ * coroutine instead of a hand-built state machine:
+ *
+ *   ScriptTask MySession::Run(ScriptConnection &connection)
+ *   {
+ *       char line[64];
+ *       co_await connection.Send("NAME? ", 6);
+ *       if (co_await connection.RecvLine(line, sizeof(line)) <= 0) co_return;
+ *       co_await connection.Sleep(250);		// pretend to look it up
+ *       co_await connection.Send("OK\r\n", 4);
+ *   }
+ *
+ * Each co_await hands control back to the event loop, which resumes the script when its data
+ * arrives, its reply has gone out or its timer expires; nothing ever blocks the loop, and any
+ * number of scripts can be in progress at once, each on its own TCP connection.
+ *
+ * - Recv() completes with whatever has arrived (up to the buffer size), RecvLine() with one line
+ *   (NUL-terminated, CR/LF stripped). Both give 0 once the client has closed the connection and
+ *   -1 on an error; a script should simply co_return then.
+ * - Send() completes once the kernel has taken every byte, returning the length or -1. It only
+ *   suspends if the socket buffer is full; the data stays in the script's frame meanwhile.
+ * - Sleep() completes after the given number of milliseconds, using the same kind of timer queue
+ *   as reply impairment.
+ * When the script returns, the connection is closed. When the client goes away first, the
+ * script is simply abandoned (its frame is destroyed, along with its locals).
+ *
+ * Every Send() is recorded as one transaction, pairing it with the data received just before it,
+ * so scripted sessions show up in reports, captures and telemetry like any other.
+ *
+ * Frames come from framePool (see framepool.h), and everything else a script needs lives in a
+ * preallocated ScriptConnection, so once a session has started, none of its steps allocate.
+ */
+
+#ifndef SCRIPTEDSESSION_H_
+#define SCRIPTEDSESSION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <coroutine>
+
+#include "clientsession.h"
+#include "timerqueue.h"
+
+#define SCRIPT_FRAME_SIZE	2048	// bytes per coroutine frame, unless framePool was set up beforehand
+
+class ScriptedSession;
+
+/*
+ * The return type of every script. It just carries the coroutine's handle back to the session.
+ */
+
+class ScriptTask
+{
+public:
+	struct promise_type
+	{
+		ScriptTask get_return_object() { return ScriptTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		static ScriptTask get_return_object_on_allocation_failure() { return ScriptTask(); }
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }	// the session starts it
+		std::suspend_always final_suspend() noexcept { return std::suspend_always(); }	// ...and destroys it
+		void return_void() {}
+		void unhandled_exception();
+
+		static void *operator new(size_t size) noexcept;
+		static void operator delete(void *frame, size_t size);
+	};
+
+	ScriptTask() {}
+	ScriptTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/*
+ * What a script sees of its connection. The awaitables returned by Recv(), RecvLine(), Send()
+ * and Sleep() are small values that live in the script's own frame.
+ */
+
+class ScriptConnection
+{
+public:
+	typedef enum _WaitingFor
+	{
+		WAIT_NONE = 0,
+		WAIT_RECV,
+		WAIT_LINE,
+		WAIT_SEND,
+		WAIT_SLEEP
+	} WaitingFor;
+
+	struct RecvAwaiter
+	{
+		ScriptConnection *connection;
+		bool await_ready() { return connection->CompleteRecv(); }
+		void await_suspend(std::coroutine_handle<>) {}
+		int await_resume() { return connection->result; }
+	};
+
+	struct SendAwaiter
+	{
+		ScriptConnection *connection;
+		bool await_ready() { return connection->PushSend(); }
+		void await_suspend(std::coroutine_handle<>) {}
+		int await_resume() { return connection->result; }
+	};
+
+	struct SleepAwaiter
+	{
+		ScriptConnection *connection;
+		unsigned int milliseconds;
+		bool await_ready() { return milliseconds == 0; }
+		bool await_suspend(std::coroutine_handle<>) { return connection->StartSleep(milliseconds); }
+		void await_resume() {}
+	};
+
+	RecvAwaiter Recv(char *buffer, int size);
+	RecvAwaiter RecvLine(char *buffer, int size);
+	SendAwaiter Send(const char *buffer, int length);
+	SleepAwaiter Sleep(unsigned int milliseconds);
+
+	int Socket() { return socket; }
+	const struct sockaddr_in& Address() { return address; }
+
+protected:
+	friend class ScriptedSession;
+
+	bool CompleteRecv();
+	bool PushSend();
+	bool StartSleep(unsigned int milliseconds);
+
+	ScriptedSession *session;
+	std::coroutine_handle<ScriptTask::promise_type> script;
+	int socket;
+	struct sockaddr_in address;
+	bool inUse;
+	bool peerClosed;
+	bool finished;
+
+	WaitingFor waiting;
+	int result;				// what the current co_await gives back
+
+	char *recvBuffer;		// for WAIT_RECV and WAIT_LINE
+	int recvSize;
+
+	const char *sendData;	// for WAIT_SEND
+	int sendLength;
+	int sendOffset;
+
+	uint64_t wakeAt;		// for WAIT_SLEEP
+
+	// what's arrived but not yet been asked for, and the last request (for the transaction record)
+
+	char pending[RX_BUFFER_SIZE];
+	int pendingLength;
+	char lastRequest[RX_BUFFER_SIZE];
+	int lastRequestLength;
+	uint64_t lastReceivedNs;
+	struct timespec lastReceivedTime;
+
+private:
+};
+
+typedef struct _ScriptStats
+{
+	uint64_t started;		// scripts started
+	uint64_t finished;		// ...that ran to the end
+	uint64_t abandoned;		// ...whose client left first
+	uint64_t refused;		// connections turned away because no frame or connection was free
+	uint64_t resumes;		// times a script was woken up
+	uint64_t sleepsSkipped;	// sleeps that couldn't be scheduled (timer queue full)
+	unsigned int active;
+} ScriptStats;
+
+class ScriptedSession : public ClientSession
+{
+public:
+	ScriptedSession(const char * description);
+	virtual ~ScriptedSession();
+
+	virtual bool Init(unsigned int maxConnections);
+
+	void ConnectionEstablished(int socket);
+	void ConnectionTerminated(int socket);
+	short PollEvents(int socket);
+	int ReadyToWrite(int socket);
+	int MessageReceived(int socket);
+
+	unsigned int Service(uint64_t now);
+	int PollTimeout(int timeout, uint64_t now);
+
+	const ScriptStats& Stats() { return stats; }
+
+protected:
+	friend class ScriptConnection;
+
+	virtual ScriptTask Run(ScriptConnection &connection) = 0;
+
+	ScriptConnection *Find(int socket);
+	void Resume(ScriptConnection &connection);
+	void RecordSend(ScriptConnection &connection, const char *data, int length);
+
+	ScriptConnection *connections;
+	unsigned int maxConnections;
+	unsigned int *freeConnections;	// a stack of unused indexes into connections
+	unsigned int freeCount;
+	int *connectionBySocket;	// socket number -> index into connections, or -1
+	int maxSockets;
+	TimerQueue timers;
+	ScriptStats stats;
+
+private:
+};
+
+#endif /* SCRIPTEDSESSION_H_ */
+
+// end of scriptedsession.h
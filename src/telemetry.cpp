@@ -0,0 +1,298 @@
+/*
+ * telemetry.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <iostream>
+using namespace std;
+
+#include "telemetry.h"
+#include "timeutil.h"
+
+/*
+ * The writer's half of each slot's seqlock (the reader's half is described in telemetryformat.h)
+ */
+
+static inline void BeginSlotWrite(uint32_t *sequence)
+{
+	__atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void EndSlotWrite(uint32_t *sequence)
+{
+	__atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+LiveTelemetry::LiveTelemetry()
+{
+	segment = NULL;
+	segmentName = NULL;
+	connectionBySocket = NULL;
+	maxSockets = 0;
+}
+
+LiveTelemetry::~LiveTelemetry()
+{
+	Close();
+}
+
+bool LiveTelemetry::Open(const char *name, int transactionPort)
+{
+	if (segment)
+	{
+		cerr << "LiveTelemetry: already open" << endl;
+		return false;
+	}
+
+	maxSockets = getdtablesize();
+	connectionBySocket = (short *)malloc(sizeof(short) * maxSockets);
+	if (connectionBySocket == NULL)
+	{
+		cerr << "LiveTelemetry: unable to allocate socket table" << endl;
+		return false;
+	}
+	for (int i = 0; i < maxSockets; i++)
+	{
+		connectionBySocket[i] = -1;
+	}
+
+	// readable by anyone on this machine, writable only by us
+
+	int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		cerr << "LiveTelemetry: unable to create shared memory segment " << name << " (" << errno << ")" << endl;
+		return false;
+	}
+	if (ftruncate(fd, sizeof(TelemetrySegment)) < 0)
+	{
+		cerr << "LiveTelemetry: unable to size shared memory segment (" << errno << ")" << endl;
+		close(fd);
+		shm_unlink(name);
+		return false;
+	}
+	void *mapping = mmap(NULL, sizeof(TelemetrySegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);	// the mapping keeps the segment alive
+	if (mapping == MAP_FAILED)
+	{
+		cerr << "LiveTelemetry: unable to map shared memory segment (" << errno << ")" << endl;
+		shm_unlink(name);
+		return false;
+	}
+
+	segment = (TelemetrySegment *)mapping;
+	memset(segment, 0, sizeof(TelemetrySegment));
+	segment->version = TELEMETRY_VERSION;
+	segment->segmentSize = sizeof(TelemetrySegment);
+	segment->serverPid = getpid();
+	segment->transactionPort = transactionPort;
+	segment->maxConnections = TELEMETRY_MAX_CONNECTIONS;
+	segment->recentCapacity = TELEMETRY_RECENT;
+	segment->buckets = TELEMETRY_BUCKETS;
+	segment->startWallSeconds = time(NULL);
+	segment->heartbeatNs = MonotonicNanoseconds();
+
+	// the magic number goes in last, so a monitor never mistakes a half-built segment for a real one
+
+	__atomic_store_n(&segment->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+	segmentName = strdup(name);
+	cout << "Publishing live telemetry in shared memory segment " << name << endl;
+	return true;
+}
+
+void LiveTelemetry::Close()
+{
+	if (segment)
+	{
+		munmap(segment, sizeof(TelemetrySegment));
+		segment = NULL;
+	}
+	if (segmentName)
+	{
+		shm_unlink(segmentName);
+		free(segmentName);
+		segmentName = NULL;
+	}
+	if (connectionBySocket)
+	{
+		free(connectionBySocket);
+		connectionBySocket = NULL;
+	}
+}
+
+void LiveTelemetry::Heartbeat(uint64_t now)
+{
+	if (segment)
+	{
+		__atomic_store_n(&segment->heartbeatNs, now, __ATOMIC_RELAXED);
+	}
+}
+
+void LiveTelemetry::TransactionCompleted(int socket, TestRecord &record, bool udp, int requestLength, int replyLength)
+{
+	if (segment == NULL)
+	{
+		return;
+	}
+	if (requestLength < 0)
+	{
+		requestLength = 0;
+	}
+	if (replyLength < 0)
+	{
+		replyLength = 0;
+	}
+
+	TelemetryCounters &counters = segment->counters;
+	Add(counters.transactions, 1);
+	Add(udp ? counters.udpTransactions : counters.tcpTransactions, 1);
+	Add(counters.bytesReceived, requestLength);
+	Add(counters.bytesSent, replyLength);
+
+	uint64_t serviceNs = record.sentNs - record.receivedNs;
+	Record(segment->serviceHistogram, serviceNs);
+	if (record.queueNs >= 0)
+	{
+		Record(segment->kernelToReplyHistogram, record.queueNs + serviceNs);
+	}
+
+	if (!udp)
+	{
+		TelemetryConnection *connection = FindConnection(socket);
+		if (connection)
+		{
+			BeginSlotWrite(&connection->sequence);
+			connection->transactions++;
+			connection->bytesReceived += requestLength;
+			connection->bytesSent += replyLength;
+			EndSlotWrite(&connection->sequence);
+		}
+	}
+
+	uint64_t written = segment->recentWritten;
+	TelemetryTransaction &slot = segment->recent[written % TELEMETRY_RECENT];
+	BeginSlotWrite(&slot.sequence);
+	slot.transactionNumber = record.transactionNumber;
+	slot.wallSeconds = record.startTime.tv_sec;
+	slot.wallMicroseconds = record.startTime.tv_usec;
+	slot.ipAddress = record.ipAddress.s_addr;
+	slot.port = record.port;
+	slot.udp = udp ? 1 : 0;
+	slot.requestLength = requestLength;
+	slot.replyLength = (replyLength > 0xffff) ? 0xffff : replyLength;	// amplified replies can be much bigger
+	slot.queueNs = record.queueNs;
+	slot.serviceNs = serviceNs;
+	memcpy(slot.request, record.dataReceived, TELEMETRY_PAYLOAD_PREFIX);
+	memcpy(slot.reply, record.dataSent, TELEMETRY_PAYLOAD_PREFIX);
+	EndSlotWrite(&slot.sequence);
+	__atomic_store_n(&segment->recentWritten, written + 1, __ATOMIC_RELEASE);
+}
+
+void LiveTelemetry::ConnectionOpened(int socket, struct sockaddr_in *clientAddress)
+{
+	if (segment == NULL)
+	{
+		return;
+	}
+	Add(segment->counters.sessionsAccepted, 1);
+
+	if ((socket < 0) || (socket >= maxSockets))
+	{
+		return;
+	}
+	for (int i = 0; i < TELEMETRY_MAX_CONNECTIONS; i++)
+	{
+		TelemetryConnection &connection = segment->connections[i];
+		if (!connection.inUse)
+		{
+			BeginSlotWrite(&connection.sequence);
+			connection.inUse = 1;
+			connection.socket = socket;
+			connection.ipAddress = clientAddress ? clientAddress->sin_addr.s_addr : 0;
+			connection.port = clientAddress ? clientAddress->sin_port : 0;
+			connection.openedWallSeconds = time(NULL);
+			connection.transactions = 0;
+			connection.bytesReceived = 0;
+			connection.bytesSent = 0;
+			EndSlotWrite(&connection.sequence);
+			connectionBySocket[socket] = i;
+			return;
+		}
+	}
+	// the table is full; the connection is still counted, just not listed
+}
+
+void LiveTelemetry::ConnectionClosed(int socket)
+{
+	if (segment == NULL)
+	{
+		return;
+	}
+	Add(segment->counters.sessionsClosed, 1);
+
+	TelemetryConnection *connection = FindConnection(socket);
+	if (connection)
+	{
+		BeginSlotWrite(&connection->sequence);
+		connection->inUse = 0;
+		EndSlotWrite(&connection->sequence);
+		connectionBySocket[socket] = -1;
+	}
+}
+
+void LiveTelemetry::SessionRefused()
+{
+	if (segment)
+	{
+		Add(segment->counters.sessionsRefused, 1);
+	}
+}
+
+/*
+ * We're the only writer, so a plain read followed by an atomic store is enough - the atomic
+ * store just guarantees readers never see half of a 64-bit value.
+ */
+
+void LiveTelemetry::Add(uint64_t &counter, uint64_t amount)
+{
+	__atomic_store_n(&counter, counter + amount, __ATOMIC_RELAXED);
+}
+
+void LiveTelemetry::Record(uint64_t *histogram, uint64_t ns)
+{
+	int bucket = 0;
+	while ((ns > 1) && (bucket < (TELEMETRY_BUCKETS - 1)))
+	{
+		ns >>= 1;
+		bucket++;
+	}
+	Add(histogram[bucket], 1);
+}
+
+TelemetryConnection *LiveTelemetry::FindConnection(int socket)
+{
+	if ((socket < 0) || (socket >= maxSockets) || (connectionBySocket[socket] < 0))
+	{
+		return NULL;
+	}
+	return &(segment->connections[connectionBySocket[socket]]);
+}
+
+// the sole global instance
+
+LiveTelemetry telemetry;
+
+// end of telemetry.cpp
@@ -0,0 +1,62 @@
+/*
+ * telemetry.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * LiveTelemetry publishes the server's vital signs - counters, latency histograms, the list of
+ * open connections and a mirror of the most recent transactions - in a POSIX shared-memory
+ * segment (layout in telemetryformat.h). Local monitors map it read-only and poll it as often as
+ * they like; they cost the server nothing, and the server doesn't even know they're there.
+ *
+ * Compare that with the command console, which serves one user at a time and has to format
+ * text for every request. The console is still the way to *control* the server; this is just
+ * a much cheaper way to *watch* it.
+ *
+ * Everything is updated in place by the event loop (the only writer) without locks; see
+ * telemetryformat.h for how readers stay consistent.
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "resultsrepo.h"		// for TestRecord
+#include "telemetryformat.h"
+
+class LiveTelemetry
+{
+public:
+	LiveTelemetry();
+	virtual ~LiveTelemetry();
+
+	virtual bool Open(const char *name, int transactionPort);
+	virtual void Close();
+	bool IsEnabled() { return segment != NULL; }
+
+	void Heartbeat(uint64_t now);
+	void TransactionCompleted(int socket, TestRecord &record, bool udp, int requestLength, int replyLength);
+	void ConnectionOpened(int socket, struct sockaddr_in *clientAddress);
+	void ConnectionClosed(int socket);
+	void SessionRefused();
+
+protected:
+	void Add(uint64_t &counter, uint64_t amount);
+	void Record(uint64_t *histogram, uint64_t ns);
+	TelemetryConnection *FindConnection(int socket);
+
+	TelemetrySegment *segment;
+	char *segmentName;
+	short *connectionBySocket;	// socket number -> index into segment->connections, or -1
+	int maxSockets;
+
+private:
+};
+
+extern LiveTelemetry telemetry;
+
+#endif /* TELEMETRY_H_ */
+
+// end of telemetry.h
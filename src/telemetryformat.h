@@ -0,0 +1,111 @@
+/*
+ * telemetryformat.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * The layout of xm2m-server's live telemetry segment (see telemetry.h), shared with any program
+ * that wants to monitor a running server - a 'snap-on' GUI, xm2m-monitor, a script. Like other
+ * code meant to be shared outside the server, this sticks to plain C types.
+ *
+ * A monitor should shm_open() the segment read-only, mmap() it, check magic and version, and
+ * then simply read it as often as it likes. There are no locks and no system calls involved:
+ * - Counters and histogram buckets are 64-bit values written with atomic stores; read them with
+ *   atomic loads (__atomic_load_n) and they'll never be torn. They only ever increase, so the
+ *   difference between two snapshots is always the activity in between. There's no count of
+ *   open sessions for that reason: it's sessionsAccepted - sessionsClosed (load sessionsClosed
+ *   first, and the difference can't come out negative).
+ * - Each connection slot and each recent-transaction slot is protected by its own sequence
+ *   number: odd while the server is changing the slot, even when it's stable. Read the sequence,
+ *   copy the slot, read the sequence again; if the two differ or are odd, try again later.
+ * - heartbeatNs is updated every time around the server's event loop (CLOCK_MONOTONIC), so a
+ *   monitor can tell a quiet server from a dead one.
+ *
+ * Fields are in host byte order - the segment is only visible on the machine that wrote it -
+ * except addresses and ports, which are kept exactly as in sockaddr_in.
+ */
+
+#ifndef TELEMETRYFORMAT_H_
+#define TELEMETRYFORMAT_H_
+
+#include <stdint.h>
+
+#define TELEMETRY_MAGIC				0x584d324dU	// "XM2M"
+#define TELEMETRY_VERSION			2
+
+#define TELEMETRY_MAX_CONNECTIONS	256
+#define TELEMETRY_RECENT			1024		// how many of the latest transactions are mirrored
+#define TELEMETRY_PAYLOAD_PREFIX	32			// how much of each request and reply is mirrored
+#define TELEMETRY_BUCKETS			32			// bucket i counts latencies in [2^i, 2^(i+1)) nanoseconds
+
+typedef struct _TelemetryCounters
+{
+	uint64_t transactions;
+	uint64_t udpTransactions;
+	uint64_t tcpTransactions;
+	uint64_t bytesReceived;
+	uint64_t bytesSent;
+	uint64_t sessionsAccepted;
+	uint64_t sessionsClosed;
+	uint64_t sessionsRefused;
+} TelemetryCounters;
+
+typedef struct _TelemetryConnection
+{
+	uint32_t sequence;			// see above; 0 if never used
+	uint32_t inUse;
+	int32_t socket;
+	uint32_t ipAddress;			// as in sockaddr_in
+	uint16_t port;				// as in sockaddr_in
+	uint16_t reserved;
+	uint64_t openedWallSeconds;
+	uint64_t transactions;
+	uint64_t bytesReceived;
+	uint64_t bytesSent;
+} TelemetryConnection;
+
+typedef struct _TelemetryTransaction
+{
+	uint32_t sequence;			// see above; 0 if never used
+	uint32_t transactionNumber;
+	uint64_t wallSeconds;
+	uint32_t wallMicroseconds;
+	uint32_t ipAddress;			// as in sockaddr_in
+	uint16_t port;				// as in sockaddr_in
+	uint8_t udp;
+	uint8_t reserved;
+	uint16_t requestLength;
+	uint16_t replyLength;		// capped at 65535 (amplified replies can be bigger)
+	uint16_t reserved2;
+	int64_t queueNs;			// -1 if unknown
+	uint64_t serviceNs;
+	char request[TELEMETRY_PAYLOAD_PREFIX];	// not NUL-terminated
+	char reply[TELEMETRY_PAYLOAD_PREFIX];
+} TelemetryTransaction;
+
+typedef struct _TelemetrySegment
+{
+	// identification - written once, before anything else
+	uint32_t magic;
+	uint32_t version;
+	uint32_t segmentSize;		// sizeof(TelemetrySegment) as the server built it
+	uint32_t serverPid;
+	uint32_t transactionPort;
+	uint32_t maxConnections;	// TELEMETRY_MAX_CONNECTIONS
+	uint32_t recentCapacity;	// TELEMETRY_RECENT
+	uint32_t buckets;			// TELEMETRY_BUCKETS
+	uint64_t startWallSeconds;
+
+	// live data
+	uint64_t heartbeatNs;
+	TelemetryCounters counters;
+	uint64_t serviceHistogram[TELEMETRY_BUCKETS];		// receive to reply handoff
+	uint64_t kernelToReplyHistogram[TELEMETRY_BUCKETS];	// kernel timestamp to reply handoff, when known
+	uint64_t recentWritten;		// total ever written to 'recent'; the newest is at (recentWritten - 1) % TELEMETRY_RECENT
+	TelemetryConnection connections[TELEMETRY_MAX_CONNECTIONS];
+	TelemetryTransaction recent[TELEMETRY_RECENT];
+} TelemetrySegment;
+
+#endif /* TELEMETRYFORMAT_H_ */
+
+// end of telemetryformat.h
@@ -0,0 +1,105 @@
+/*
+ * timerqueue.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdlib.h>
+#include "timerqueue.h"
+
+TimerQueue::TimerQueue()
+{
+	entries = NULL;
+	capacity = 0;
+	count = 0;
+}
+
+TimerQueue::~TimerQueue()
+{
+	if (entries)
+	{
+		free(entries);
+		entries = NULL;
+	}
+}
+
+bool TimerQueue::Init(unsigned int howMany)
+{
+	if (entries)
+	{
+		return false;	// already initialized
+	}
+	entries = (TimerEntry *)malloc(sizeof(TimerEntry) * howMany);
+	if (entries == NULL)
+	{
+		return false;
+	}
+	capacity = howMany;
+	count = 0;
+	return true;
+}
+
+bool TimerQueue::Push(uint64_t deadline, unsigned int cookie)
+{
+	if (count >= capacity)
+	{
+		return false;
+	}
+
+	// sift up from the new leaf until the parent is due no later than we are
+
+	unsigned int i = count++;
+	while (i > 0)
+	{
+		unsigned int parent = (i - 1) / 2;
+		if (entries[parent].deadline <= deadline)
+		{
+			break;
+		}
+		entries[i] = entries[parent];
+		i = parent;
+	}
+	entries[i].deadline = deadline;
+	entries[i].cookie = cookie;
+	return true;
+}
+
+bool TimerQueue::Pop(uint64_t &deadline, unsigned int &cookie)
+{
+	if (count == 0)
+	{
+		return false;
+	}
+	deadline = entries[0].deadline;
+	cookie = entries[0].cookie;
+
+	// move the last leaf to the root and sift it down
+
+	TimerEntry last = entries[--count];
+	unsigned int i = 0;
+	while (1)
+	{
+		unsigned int child = (2 * i) + 1;
+		if (child >= count)
+		{
+			break;
+		}
+		if (((child + 1) < count) && (entries[child + 1].deadline < entries[child].deadline))
+		{
+			child++;
+		}
+		if (last.deadline <= entries[child].deadline)
+		{
+			break;
+		}
+		entries[i] = entries[child];
+		i = child;
+	}
+	entries[i] = last;
+	return true;
+}
+
+// end of timerqueue.cpp
@@ -0,0 +1,53 @@
+/*
+ * timerqueue.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * TimerQueue is a binary min-heap of (deadline, cookie) pairs. It knows nothing about what
+ * the cookies mean - callers keep their own pool of pending work and use the cookie as an
+ * index into it. Keeping the heap entries this small (12-16 bytes) means a queue with
+ * hundreds of thousands of pending timers still sifts through only a few cache lines.
+ *
+ * All storage is allocated once in Init(), so pushing and popping never touch the heap
+ * allocator. Push() fails (rather than growing) when the queue is full.
+ */
+
+#ifndef TIMERQUEUE_H_
+#define TIMERQUEUE_H_
+
+#include <stdint.h>
+
+class TimerQueue
+{
+public:
+	TimerQueue();
+	virtual ~TimerQueue();
+
+	bool Init(unsigned int capacity);
+
+	bool Push(uint64_t deadline, unsigned int cookie);
+	bool Pop(uint64_t &deadline, unsigned int &cookie);
+
+	uint64_t NextDeadline() { return entries[0].deadline; }	// only valid if !IsEmpty()
+	unsigned int Size() { return count; }
+	unsigned int Capacity() { return capacity; }
+	bool IsEmpty() { return count == 0; }
+
+protected:
+	typedef struct _TimerEntry
+	{
+		uint64_t deadline;
+		unsigned int cookie;
+	} TimerEntry;
+
+	TimerEntry *entries;
+	unsigned int capacity;
+	unsigned int count;
+
+private:
+};
+
+#endif /* TIMERQUEUE_H_ */
+
+// end of timerqueue.h
@@ -0,0 +1,36 @@
+/*
+ * timeutil.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * A couple of tiny helpers for interval timing. Wall-clock time (gettimeofday) is fine
+ * for stamping records in a report, but it can jump when the system clock is adjusted,
+ * so anything that schedules or measures intervals should use these instead.
+ */
+
+#ifndef TIMEUTIL_H_
+#define TIMEUTIL_H_
+
+#include <time.h>
+#include <stdint.h>
+
+#define NANOS_PER_USEC	1000ULL
+#define NANOS_PER_MSEC	1000000ULL
+#define NANOS_PER_SEC	1000000000ULL
+
+/*
+ * Nanoseconds on the monotonic clock - only meaningful when compared against another
+ * reading from the same run of the server.
+ */
+
+inline uint64_t MonotonicNanoseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * NANOS_PER_SEC) + (uint64_t)ts.tv_nsec;
+}
+
+#endif /* TIMEUTIL_H_ */
+
+// end of timeutil.h
@@ -0,0 +1,408 @@
+/*
+ * toptalkers.cpp
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * See the header file for a (relatively) complete description.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <iostream>
+using namespace std;
+
+#include "toptalkers.h"
+#include "timeutil.h"
+
+#define BUCKET_NS	((uint64_t)TOP_TALKERS_BUCKET_SEC * NANOS_PER_SEC)
+
+static const char *metricNames[TALKER_METRICS] = { "requests", "bytes" };
+
+TopTalkers::TopTalkers()
+{
+	config.counters = 64;
+	slab = NULL;
+	slabSize = 0;
+	tableBits = 0;
+	tableMask = 0;
+	memset(summaries, 0, sizeof(summaries));
+	currentBucket = 0;
+	currentIndex = 0;
+	merged = NULL;
+	mergedTable = NULL;
+	mergedBits = 0;
+}
+
+TopTalkers::~TopTalkers()
+{
+	if (slab)
+	{
+		free(slab);
+		slab = NULL;
+	}
+}
+
+/*
+ * One slab holds everything: every bucket's counters and hash tables, then the merge space.
+ * Hash tables have eight slots per counter: evicting a client means deleting it from the table
+ * and probing for its replacement, and at this load both are usually over in one step.
+ */
+
+bool TopTalkers::Init()
+{
+	if (config.counters == 0)
+	{
+		return true;	// not wanted
+	}
+	if (config.counters > TOP_TALKERS_MAX_COUNTERS)
+	{
+		cerr << "TopTalkers: at most " << TOP_TALKERS_MAX_COUNTERS << " counters are allowed" << endl;
+		return false;
+	}
+
+	tableBits = 1;
+	while ((1u << tableBits) < (8 * config.counters))
+	{
+		tableBits++;
+	}
+	tableMask = (1u << tableBits) - 1;
+
+	unsigned int mergedCapacity = TOP_TALKERS_BUCKETS * config.counters;
+	mergedBits = 1;
+	while ((1u << mergedBits) < (2 * mergedCapacity))
+	{
+		mergedBits++;
+	}
+
+	size_t summarySize = (config.counters * sizeof(TalkerCounter)) + ((1u << tableBits) * sizeof(short));
+	size_t summariesSize = summarySize * TOP_TALKERS_BUCKETS * TALKER_METRICS;
+	slabSize = summariesSize + (mergedCapacity * sizeof(MergedTalker)) + ((1u << mergedBits) * sizeof(int));
+	slab = (char *)malloc(slabSize);
+	if (slab == NULL)
+	{
+		cerr << "TopTalkers: unable to allocate " << slabSize << " bytes" << endl;
+		slabSize = 0;
+		return false;
+	}
+
+	char *next = slab;
+	for (int b = 0; b < TOP_TALKERS_BUCKETS; b++)
+	{
+		for (int m = 0; m < TALKER_METRICS; m++)
+		{
+			summaries[b][m].counters = (TalkerCounter *)next;
+			next += config.counters * sizeof(TalkerCounter);
+			summaries[b][m].table = (short *)next;
+			next += (1u << tableBits) * sizeof(short);
+			Clear(summaries[b][m]);
+		}
+	}
+	merged = (MergedTalker *)next;
+	next += mergedCapacity * sizeof(MergedTalker);
+	mergedTable = (int *)next;
+
+	currentBucket = MonotonicNanoseconds() / BUCKET_NS;
+	currentIndex = 0;
+	return true;
+}
+
+void TopTalkers::Clear(TalkerSummary &summary)
+{
+	memset(summary.table, 0xff, (1u << tableBits) * sizeof(short));	// all -1
+	summary.used = 0;
+	summary.total = 0;
+}
+
+/*
+ * Move the ring along to the bucket for 'now', clearing every bucket we step into.
+ * Timestamps that are a little behind (a record taken before the console asked) just go
+ * in the current bucket.
+ */
+
+void TopTalkers::Advance(uint64_t now)
+{
+	uint64_t bucket = now / BUCKET_NS;
+	if (bucket <= currentBucket)
+	{
+		return;
+	}
+	uint64_t steps = bucket - currentBucket;
+	if (steps > TOP_TALKERS_BUCKETS)
+	{
+		steps = TOP_TALKERS_BUCKETS;
+	}
+	for (uint64_t i = 0; i < steps; i++)
+	{
+		currentIndex = (currentIndex + 1) % TOP_TALKERS_BUCKETS;
+		for (int m = 0; m < TALKER_METRICS; m++)
+		{
+			Clear(summaries[currentIndex][m]);
+		}
+	}
+	currentBucket = bucket;
+}
+
+void TopTalkers::Record(uint32_t ipAddress, uint64_t bytes, uint64_t now)
+{
+	if (slab == NULL)
+	{
+		return;
+	}
+	Advance(now);
+	Update(summaries[currentIndex][TALKER_REQUESTS], ipAddress, 1);
+	Update(summaries[currentIndex][TALKER_BYTES], ipAddress, bytes);
+}
+
+/*
+ * The Space-Saving step: bump the client's counter if it has one, take a free one if there
+ * is one, and otherwise take over the smallest (the top of the heap).
+ */
+
+void TopTalkers::Update(TalkerSummary &summary, uint32_t ipAddress, uint64_t weight)
+{
+	TalkerCounter *counters = summary.counters;
+	short *table = summary.table;
+	summary.total += weight;
+
+	unsigned int slot = Home(ipAddress);
+	while (table[slot] >= 0)
+	{
+		unsigned int i = table[slot];
+		if (counters[i].ipAddress == ipAddress)
+		{
+			counters[i].count += weight;
+			SiftDown(summary, i);
+			return;
+		}
+		slot = (slot + 1) & tableMask;
+	}
+
+	if (summary.used < config.counters)
+	{
+		unsigned int i = summary.used++;
+		counters[i].count = weight;
+		counters[i].error = 0;
+		counters[i].ipAddress = ipAddress;
+		counters[i].slot = slot;
+		table[slot] = i;
+		SiftUp(summary, i);
+		return;
+	}
+
+	// removing the old client can shift other entries back, so look for an empty slot again
+
+	RemoveSlot(summary, counters[0].slot);
+	slot = Home(ipAddress);
+	while (table[slot] >= 0)
+	{
+		slot = (slot + 1) & tableMask;
+	}
+	counters[0].error = counters[0].count;
+	counters[0].count += weight;
+	counters[0].ipAddress = ipAddress;
+	counters[0].slot = slot;
+	table[slot] = 0;
+	SiftDown(summary, 0);
+}
+
+/*
+ * Linear-probing deletion without tombstones: walk the rest of the cluster, pulling back any
+ * entry whose home slot doesn't lie between the hole and where it sits now.
+ */
+
+void TopTalkers::RemoveSlot(TalkerSummary &summary, unsigned int slot)
+{
+	short *table = summary.table;
+	unsigned int hole = slot;
+	unsigned int j = slot;
+	while (1)
+	{
+		j = (j + 1) & tableMask;
+		if (table[j] < 0)
+		{
+			break;
+		}
+		unsigned int home = Home(summary.counters[table[j]].ipAddress);
+		bool staysPut = (hole <= j) ? ((hole < home) && (home <= j)) : ((hole < home) || (home <= j));
+		if (!staysPut)
+		{
+			table[hole] = table[j];
+			summary.counters[table[hole]].slot = hole;
+			hole = j;
+		}
+	}
+	table[hole] = -1;
+}
+
+void TopTalkers::SiftUp(TalkerSummary &summary, unsigned int i)
+{
+	TalkerCounter *counters = summary.counters;
+	TalkerCounter moving = counters[i];
+	while (i > 0)
+	{
+		unsigned int parent = (i - 1) / 4;
+		if (counters[parent].count <= moving.count)
+		{
+			break;
+		}
+		counters[i] = counters[parent];
+		summary.table[counters[i].slot] = i;
+		i = parent;
+	}
+	counters[i] = moving;
+	summary.table[moving.slot] = i;
+}
+
+void TopTalkers::SiftDown(TalkerSummary &summary, unsigned int i)
+{
+	TalkerCounter *counters = summary.counters;
+	unsigned int used = summary.used;
+	TalkerCounter moving = counters[i];
+	while (1)
+	{
+		unsigned int first = (4 * i) + 1;
+		if (first >= used)
+		{
+			break;
+		}
+		unsigned int child = first;
+		unsigned int last = (first + 4 < used) ? first + 4 : used;
+		for (unsigned int c = first + 1; c < last; c++)
+		{
+			child = (counters[c].count < counters[child].count) ? c : child;
+		}
+		if (moving.count <= counters[child].count)
+		{
+			break;
+		}
+		counters[i] = counters[child];
+		summary.table[counters[i].slot] = i;
+		i = child;
+	}
+	counters[i] = moving;
+	summary.table[moving.slot] = i;
+}
+
+/*
+ * Add up the newest 'buckets' summaries for one metric into merged[], returning how many
+ * clients that came to. A client missing from a full bucket might still have had up to that
+ * bucket's smallest count there, so that goes into its error too.
+ */
+
+unsigned int TopTalkers::Merge(TalkerMetric metric, unsigned int buckets, uint64_t &total)
+{
+	unsigned int mergedMask = (1u << mergedBits) - 1;
+	memset(mergedTable, 0xff, (1u << mergedBits) * sizeof(int));
+	unsigned int count = 0;
+	uint64_t minimums = 0;
+	total = 0;
+
+	for (unsigned int k = 0; k < buckets; k++)
+	{
+		TalkerSummary &summary = summaries[(currentIndex + TOP_TALKERS_BUCKETS - k) % TOP_TALKERS_BUCKETS][metric];
+		uint64_t minimum = ((summary.used == config.counters) && (summary.used > 0)) ? summary.counters[0].count : 0;
+		minimums += minimum;
+		total += summary.total;
+
+		for (unsigned int c = 0; c < summary.used; c++)
+		{
+			TalkerCounter &counter = summary.counters[c];
+			unsigned int slot = (counter.ipAddress * 0x9E3779B1u) >> (32 - mergedBits);
+			while ((mergedTable[slot] >= 0) && (merged[mergedTable[slot]].ipAddress != counter.ipAddress))
+			{
+				slot = (slot + 1) & mergedMask;
+			}
+			if (mergedTable[slot] < 0)
+			{
+				mergedTable[slot] = count;
+				memset(&merged[count], 0, sizeof(merged[count]));
+				merged[count].ipAddress = counter.ipAddress;
+				count++;
+			}
+			MergedTalker &talker = merged[mergedTable[slot]];
+			talker.count += counter.count;
+			talker.error += counter.error;
+			talker.minimumsCovered += minimum;
+		}
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		merged[i].error += minimums - merged[i].minimumsCovered;
+	}
+	return count;
+}
+
+int TopTalkers::FormatWindow(char *buffer, size_t size, const char *label, unsigned int buckets)
+{
+	size_t n = 0;
+	for (int m = 0; (m < TALKER_METRICS) && (n < size); m++)
+	{
+		uint64_t total;
+		unsigned int count = Merge((TalkerMetric)m, buckets, total);
+		n += snprintf(buffer + n, size - n, "Last %s by %s (%llu in all):\n",
+			label, metricNames[m], (unsigned long long)total);
+
+		// a partial selection sort is plenty for the handful we show
+
+		for (unsigned int r = 0; (r < count) && (r < TOP_TALKERS_SHOWN) && (n < size); r++)
+		{
+			unsigned int best = r;
+			for (unsigned int i = r + 1; i < count; i++)
+			{
+				if (merged[i].count > merged[best].count)
+				{
+					best = i;
+				}
+			}
+			MergedTalker talker = merged[best];
+			merged[best] = merged[r];
+			merged[r] = talker;
+
+			char address[INET_ADDRSTRLEN];
+			struct in_addr in;
+			in.s_addr = talker.ipAddress;
+			inet_ntop(AF_INET, &in, address, sizeof(address));
+			n += snprintf(buffer + n, size - n, " %-15s %12llu %5.1f%%  +/-%llu\n",
+				address, (unsigned long long)talker.count,
+				(total > 0) ? (100.0 * (double)talker.count / (double)total) : 0.0,
+				(unsigned long long)talker.error);
+		}
+	}
+	return (n < size) ? (int)n : (int)size - 1;
+}
+
+int TopTalkers::Format(char *buffer, size_t size, uint64_t now)
+{
+	if (slab == NULL)
+	{
+		return snprintf(buffer, size, "Top talker tracking is not enabled.\n");
+	}
+	Advance(now);
+
+	size_t n = snprintf(buffer, size, "Top talkers (%u counters per metric per %ds, %zu bytes in all):\n",
+		config.counters, TOP_TALKERS_BUCKET_SEC, slabSize);
+	static const struct
+	{
+		const char *label;
+		unsigned int seconds;
+	} windows[] = {
+		{ "10s",	10 },
+		{ "1m",		60 },
+		{ "10m",	600 }
+	};
+	for (unsigned int w = 0; (w < sizeof(windows) / sizeof(windows[0])) && (n < size); w++)
+	{
+		n += FormatWindow(buffer + n, size - n, windows[w].label, windows[w].seconds / TOP_TALKERS_BUCKET_SEC);
+	}
+	return (n < size) ? (int)n : (int)size - 1;
+}
+
+// the sole global instance
+
+TopTalkers topTalkers;
+
+// end of toptalkers.cpp
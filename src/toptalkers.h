@@ -0,0 +1,125 @@
+/*
+ * toptalkers.h
+ *
+ * Created on: Oct 19, 2026
+ * Author: jsomers
+ *
+ * TopTalkers keeps a running answer to "which clients are doing most of the talking?" - by
+ * requests and by bytes (request plus reply) - over the last 10 seconds, minute and 10 minutes,
+ * without having to dump the repository and count.
+ *
+ * Remembering every client would take memory in proportion to however many show up, so instead
+ * each metric is tracked with the Space-Saving algorithm (Metwally, Agrawal & El Abbadi, 2005):
+ * a fixed number of counters, and when a client without one arrives, it takes over the counter
+ * with the smallest count, inheriting that count as its possible overestimate ('error'). Any
+ * client with more than 1/counters of the traffic is guaranteed to hold a counter, and every
+ * count is off by at most its error. The counters sit in a four-way min-heap (so the smallest
+ * is always at the top, and the heap is only a few levels deep) with a sparse open-addressed hash
+ * table pointing into it, so an update is a probe or two and a short sift - a few tens of
+ * nanoseconds, even when every transaction comes from a stranger.
+ *
+ * Sliding windows come from a ring of TOP_TALKERS_BUCKETS summaries, each covering
+ * TOP_TALKERS_BUCKET_SEC seconds; a window is the current bucket plus however many before it
+ * make up its length, so "the last minute" is really the last 55 to 60 seconds. The ring moves
+ * along as transactions (or console queries) arrive, clearing buckets that have aged out.
+ *
+ * All memory is allocated in Init(): the ring, plus the scratch space Format() uses to merge
+ * buckets. Nothing grows with the number of clients, however many there are.
+ */
+
+#ifndef TOPTALKERS_H_
+#define TOPTALKERS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TOP_TALKERS_BUCKET_SEC		5
+#define TOP_TALKERS_BUCKETS			120		// ten minutes' worth
+#define TOP_TALKERS_SHOWN			8		// per metric per window, on the console
+#define TOP_TALKERS_MAX_COUNTERS	1024
+
+typedef enum _TalkerMetric
+{
+	TALKER_REQUESTS = 0,
+	TALKER_BYTES,
+	TALKER_METRICS
+} TalkerMetric;
+
+typedef struct _TopTalkersConfig
+{
+	unsigned int counters;	// per metric per bucket; 0 turns tracking off
+} TopTalkersConfig;
+
+class TopTalkers
+{
+public:
+	TopTalkers();
+	virtual ~TopTalkers();
+
+	bool Init();
+	bool IsEnabled() { return slab != NULL; }
+
+	void Record(uint32_t ipAddress, uint64_t bytes, uint64_t now);
+
+	int Format(char *buffer, size_t size, uint64_t now);
+	size_t MemoryUsed() { return slabSize; }
+
+	TopTalkersConfig config;
+
+protected:
+	typedef struct _TalkerCounter
+	{
+		uint64_t count;
+		uint64_t error;			// how much of count may have belonged to the clients it replaced
+		uint32_t ipAddress;		// network byte order, as in the TestRecord
+		unsigned int slot;		// where the hash table points at us
+	} TalkerCounter;
+
+	typedef struct _TalkerSummary
+	{
+		TalkerCounter *counters;	// a four-way min-heap on count
+		short *table;				// hash of ipAddress -> index into counters, or -1
+		unsigned int used;
+		uint64_t total;				// everything seen in this bucket, tracked or not
+	} TalkerSummary;
+
+	typedef struct _MergedTalker
+	{
+		uint64_t count;
+		uint64_t error;
+		uint64_t minimumsCovered;	// the sum of the minimums of the buckets it was found in
+		uint32_t ipAddress;
+	} MergedTalker;
+
+	void Advance(uint64_t now);
+	void Clear(TalkerSummary &summary);
+	void Update(TalkerSummary &summary, uint32_t ipAddress, uint64_t weight);
+	unsigned int Home(uint32_t ipAddress) { return (ipAddress * 0x9E3779B1u) >> (32 - tableBits); }
+	void RemoveSlot(TalkerSummary &summary, unsigned int slot);
+	void SiftUp(TalkerSummary &summary, unsigned int i);
+	void SiftDown(TalkerSummary &summary, unsigned int i);
+
+	unsigned int Merge(TalkerMetric metric, unsigned int buckets, uint64_t &total);
+	int FormatWindow(char *buffer, size_t size, const char *label, unsigned int buckets);
+
+	char *slab;
+	size_t slabSize;
+	unsigned int tableBits;
+	unsigned int tableMask;
+
+	TalkerSummary summaries[TOP_TALKERS_BUCKETS][TALKER_METRICS];
+	uint64_t currentBucket;		// now / bucket length, for the bucket last written
+	unsigned int currentIndex;	// ...and where it is in the ring
+
+	MergedTalker *merged;		// Format()'s scratch space
+	int *mergedTable;
+	unsigned int mergedBits;
+
+private:
+};
+
+extern TopTalkers topTalkers;
+
+#endif /* TOPTALKERS_H_ */
+
+// end of toptalkers.h
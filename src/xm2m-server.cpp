@@ -7,13 +7,19 @@
 //============================================================================
 
 #include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <string.h>				// for memset, etc
+#include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <sched.h>
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/poll.h>
 #include <netinet/in.h>			// for sockaddr, etc
 
@@ -22,16 +28,52 @@ using namespace std;
 
 #include "clientsession.h"			// various classes for tracking client session information
 #include "clientsession-cmdline.h"	// specialized variant for our command line
+#include "clientsession-atm.h"		// a scripted ATM simulator
 #include "resultsrepo.h"
+#include "partitionedrepo.h"
+#include "allocaudit.h"
+#include "amplifier.h"
+#include "capture.h"
+#include "handoff.h"
+#include "impairment.h"
+#include "listeners.h"
+#include "loopmonitor.h"
+#include "overload.h"
+#include "profiler.h"
+#include "reconcile.h"
+#include "rxtimestamp.h"
+#include "telemetry.h"
+#include "toptalkers.h"
+#include "timeutil.h"
+
+/*
+ * The first few pollfds are always the same sockets. The transaction listeners follow them (one
+ * per port and transport - see listeners.h), and then the sessions.
+ */
+
+#define CONSOLE_POLLFD			0	// the console's listener
+#define HANDOFF_LISTEN_POLLFD	1	// a restarted server asking to take over from us (see handoff.h)
+#define HANDOFF_LINK_POLLFD		2	// records forwarded by the server we took over from
+#define RESERVED_POLLFDS		3	// (the handoff slots are -1, and so ignored by poll(), when unused)
 
 /*
  * The following globals are parameters that can be configured from the Linux command line at startup
  */
 
-int transactionPort = 9900;
+int transactionPort = 9900;		// without --port; otherwise the first port listed
 int consolePort = 1900;
 int totalRepositoryRecords = 1000;
-int totalConcurrentSessions = 13;	// NOTE: three are reserved for the listener sockets, leaving 10 concurrent TCP sessions
+int totalConcurrentSessions = 10;	// TCP sessions, the console's included
+
+bool lowLatency = false;	// spin before sleeping, and ask the kernel to busy-poll our sockets
+int pinnedCpu = -1;			// which core to pin the event loop to (-1 == leave it to the scheduler)
+int spinBudgetUsec = 50;	// in low-latency mode, how long to spin on non-blocking polls before sleeping
+int busyPollUsec = 50;		// in low-latency mode, the SO_BUSY_POLL value for transaction sockets
+
+const char *capturePath = NULL;	// if set, record all transactions here for later replay
+const char *telemetryName = NULL;	// if set, publish live telemetry in this shared-memory segment
+const char *scriptName = NULL;		// if set, the default profile's TCP sessions run this script instead of echoing
+const char *handoffPath = NULL;		// if set, take over from (and offer to hand over to) a server at this Unix socket
 
 /*
  *  In the future, you might want to use Housekeeping() to do
@@ -50,11 +92,37 @@ void Housekeeping()
 
 void Usage()
 {
-	cout << "\nusage: xm2m-server [--help][--port transactPort][--portCon consolePort]\n"
-		<< "\t--port transactPort - which TCP and UDP port to listen for transactions (default:9900)\n"
+	cout << "\nusage: xm2m-server [--help][--port transactPorts][--portCon consolePort]\n"
+		<< "\t--port transactPorts - which TCP and UDP ports to listen for transactions, e.g. 9900,10000-10999@profile (default:9900)\n"
+		<< "\t--profile name:key=value,... - how ports naming this profile serve sessions (see src/listeners.h)\n"
 		<< "\t--portCon consolePort - which TCP port to listen for console commands (default:1900)\n"
 		<< "\t--repoSize size - how many repository records to keep in FIFO (default:1000)\n"
+		<< "\t--repoFair min - share the repository out between clients, each keeping at least its min newest records (default: one FIFO)\n"
 		<< "\t--sessions n - how many concurrent TCP transaction sessions to allow (default:10)\n"
+		<< "\t--delay ms - emulated one-way delay added to every reply (default:0)\n"
+		<< "\t--jitter ms - spread of the reply delay (default:0)\n"
+		<< "\t--delayDist uniform|normal|exponential - how the jitter is distributed (default:uniform)\n"
+		<< "\t--loss pct - percentage of UDP replies to drop (default:0)\n"
+		<< "\t--duplicate pct - percentage of UDP replies to send twice (default:0)\n"
+		<< "\t--bandwidth bps - per-client reply bandwidth cap in bits/sec, K, M and G suffixes allowed (default:0, unlimited)\n"
+		<< "\t--impairQueue n - how many delayed replies may be pending at once (default:10000)\n"
+		<< "\t--lowLatency - spin instead of sleeping when idle, and busy-poll transaction sockets\n"
+		<< "\t--cpu n - pin the event loop to core n (default: not pinned)\n"
+		<< "\t--spinBudget usec - in low-latency mode, how long to spin before sleeping (default:50)\n"
+		<< "\t--busyPoll usec - in low-latency mode, SO_BUSY_POLL time for transaction sockets (default:50)\n"
+		<< "\t--capture file - record every transaction to file, for replay with xm2m-replay\n"
+		<< "\t--amplify size - let clients ask for replies of up to size bytes (K and M suffixes allowed; default: off)\n"
+		<< "\t--noZeroCopy - don't use MSG_ZEROCOPY for large amplified TCP replies\n"
+		<< "\t--amplifyUdp - honour AMPLIFY over UDP too (replies up to 65507 bytes to a possibly spoofed address; default: TCP only)\n"
+		<< "\t--zeroCopyMin size - smallest send worth doing zero-copy (default:16K)\n"
+		<< "\t--script atm - run the default profile's TCP sessions as a scripted ATM instead of an echo\n"
+		<< "\t--topTalkers n - how many clients to count per metric when tracking top talkers (default:64, 0 for none)\n"
+		<< "\t--shedLag usec - shed load once requests wait longer than this (default: never)\n"
+		<< "\t--shedQueue n - shed load once poll() finds more than n descriptors ready at a time (default: never)\n"
+		<< "\t--selfProfile - time each phase of the event loop from the start (the console's P command shows them)\n"
+		<< "\t--allocAudit n - in builds that can, count heap allocations on the transaction path after n passes of warm-up (the console's M command shows them)\n"
+		<< "\t--handoff path - take over sockets and repository from the server at Unix socket path, if any, and let a restart take over from us\n"
+		<< "\t--telemetry name - publish live telemetry in shared memory segment name (e.g. /xm2m), for xm2m-monitor\n"
 		<< "\t--help - this usage information" << endl;
 }
 
@@ -62,10 +130,37 @@ void ParseCommandLine(int argc, char *argv[])
 {
 	static struct option longOptions[] = {
 		{ "help",		no_argument,		0,	0 },
-		{ "port",		required_argument,	0,	1 },	// port to listen and 'echo' on
+		{ "port",		required_argument,	0,	1 },	// ports to listen and 'echo' on
 		{ "portCon",	required_argument,	0,	2 },	// port to listen for command console
 		{ "repoSize",	required_argument,	0,	3 },		// how many records of transaction info are kept in repository
-		{ "sessions",	required_argument,	0,	4 }		// how many records of transaction info are kept in repository
+		{ "sessions",	required_argument,	0,	4 },	// how many records of transaction info are kept in repository
+		{ "delay",		required_argument,	0,	5 },	// reply impairment settings...
+		{ "jitter",		required_argument,	0,	6 },
+		{ "delayDist",	required_argument,	0,	7 },
+		{ "loss",		required_argument,	0,	8 },
+		{ "duplicate",	required_argument,	0,	9 },
+		{ "bandwidth",	required_argument,	0,	10 },
+		{ "impairQueue",	required_argument,	0,	11 },
+		{ "lowLatency",	no_argument,		0,	12 },	// latency benchmarking settings...
+		{ "cpu",		required_argument,	0,	13 },
+		{ "spinBudget",	required_argument,	0,	14 },
+		{ "busyPoll",	required_argument,	0,	15 },
+		{ "capture",	required_argument,	0,	16 },	// file to record traffic into
+		{ "telemetry",	required_argument,	0,	17 },	// shared-memory segment to publish live telemetry in
+		{ "amplify",	required_argument,	0,	18 },	// reply amplification settings...
+		{ "noZeroCopy",	no_argument,		0,	19 },
+		{ "zeroCopyMin",	required_argument,	0,	20 },
+		{ "script",		required_argument,	0,	21 },	// which script TCP transaction sessions run
+		{ "topTalkers",	required_argument,	0,	22 },	// counters per metric for heavy-hitter tracking
+		{ "handoff",	required_argument,	0,	23 },	// Unix socket for zero-downtime restarts
+		{ "shedLag",	required_argument,	0,	24 },	// overload control thresholds...
+		{ "shedQueue",	required_argument,	0,	25 },
+		{ "profile",	required_argument,	0,	26 },	// a session profile for some of the ports
+		{ "selfProfile",	no_argument,		0,	27 },	// hot-path phase timing
+		{ "repoFair",	required_argument,	0,	28 },	// partition the repository by client
+		{ "allocAudit",	required_argument,	0,	29 },	// heap allocations after warm-up
+		{ "amplifyUdp",	no_argument,		0,	30 },	// amplify over UDP as well as TCP
+		{ 0,			0,					0,	0 }
 	};
 	int optionIndex = 0;
 	while (1)
@@ -75,7 +170,7 @@ void ParseCommandLine(int argc, char *argv[])
 		{
 			break;
 		}
-		if (option >= argc)
+		if (option == '?')		// getopt_long() has already said what it didn't like
 		{
 			cerr << "Argument error" << endl;
 			Usage();
@@ -86,17 +181,13 @@ void ParseCommandLine(int argc, char *argv[])
 				Usage();
 				break;
 
-			case 1:			// which port to use for transactions
-				transactionPort = atoi(optarg);
-				if (
-					(transactionPort < 0) ||
-					(transactionPort > 65535)
-				){
-					cerr << "Port numbers should be from 0 to 65535" << endl;
+			case 1:			// which ports to use for transactions
+				if (!listeners.AddPorts(optarg))
+				{
 					Usage();
 					exit(-1);
 				}
-				cout << "Using port " << transactionPort << " for transactions" << endl;
+				cout << "Using port(s) " << optarg << " for transactions" << endl;
 				break;
 
 			case 2:			// which port to use for mgmt console
@@ -142,7 +233,264 @@ void ParseCommandLine(int argc, char *argv[])
 					Usage();
 				}
 				cout << "Allowing " << totalConcurrentSessions << " concurrent TCP transaction sessions" << endl;
-				totalConcurrentSessions += 3;
+				break;
+
+			case 5:
+				impairment.config.delayMs = atof(optarg);
+				if (impairment.config.delayMs < 0.0)
+				{
+					cerr << "Reply delay can't be negative" << endl;
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 6:
+				impairment.config.jitterMs = atof(optarg);
+				if (impairment.config.jitterMs < 0.0)
+				{
+					cerr << "Reply jitter can't be negative" << endl;
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 7:
+				if (strcmp(optarg, "uniform") == 0)
+				{
+					impairment.config.distribution = DELAY_UNIFORM;
+				}
+				else if (strcmp(optarg, "normal") == 0)
+				{
+					impairment.config.distribution = DELAY_NORMAL;
+				}
+				else if (strcmp(optarg, "exponential") == 0)
+				{
+					impairment.config.distribution = DELAY_EXPONENTIAL;
+				}
+				else
+				{
+					cerr << "Delay distribution must be uniform, normal or exponential" << endl;
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 8:
+			case 9:
+			{
+				double percent = atof(optarg);
+				if ((percent < 0.0) || (percent > 100.0))
+				{
+					cerr << "Percentages should be from 0 to 100" << endl;
+					Usage();
+					exit(-1);
+				}
+				if (option == 8)
+				{
+					impairment.config.lossPercent = percent;
+				}
+				else
+				{
+					impairment.config.duplicatePercent = percent;
+				}
+				break;
+			}
+
+			case 10:
+			{
+				// bits per second, so the suffixes are decimal: 250K is 250,000
+
+				char *end;
+				errno = 0;
+				uint64_t bps = strtoull(optarg, &end, 10);
+				uint64_t multiplier = 1;
+				if (toupper(*end) == 'K')
+				{
+					multiplier = 1000ULL;
+				}
+				else if (toupper(*end) == 'M')
+				{
+					multiplier = 1000000ULL;
+				}
+				else if (toupper(*end) == 'G')
+				{
+					multiplier = 1000000000ULL;
+				}
+				if (multiplier > 1)
+				{
+					end++;
+				}
+				if ((end == optarg) || !isdigit((unsigned char)optarg[0]) || (*end != '\0') || (errno != 0)
+					|| (bps > (UINT64_MAX / multiplier)))
+				{
+					cerr << "Invalid bandwidth: " << optarg << " (bits per second; K, M and G suffixes allowed)" << endl;
+					Usage();
+					exit(-1);
+				}
+				impairment.config.bandwidthBps = bps * multiplier;
+				break;
+			}
+
+			case 11:
+				if (atoi(optarg) <= 0)
+				{
+					cerr << "Must allow at least one pending reply" << endl;
+					Usage();
+					exit(-1);
+				}
+				impairment.config.queueSize = atoi(optarg);
+				break;
+
+			case 12:
+				lowLatency = true;
+				cout << "Low-latency mode: spinning and busy polling" << endl;
+				break;
+
+			case 13:
+				pinnedCpu = atoi(optarg);
+				if (pinnedCpu < 0)
+				{
+					cerr << "CPU numbers start at 0" << endl;
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 14:
+				spinBudgetUsec = atoi(optarg);
+				if (spinBudgetUsec < 0)
+				{
+					cerr << "Spin budget can't be negative" << endl;
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 15:
+				busyPollUsec = atoi(optarg);
+				if (busyPollUsec < 0)
+				{
+					cerr << "Busy poll time can't be negative" << endl;
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 16:
+				capturePath = optarg;
+				break;
+
+			case 17:
+				telemetryName = optarg;
+				break;
+
+			case 18:
+				if (!ReplyAmplifier::ParseSize(optarg, amplifier.config.maxReplyBytes))
+				{
+					cerr << "Invalid amplified reply size: " << optarg << endl;
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 19:
+				amplifier.config.zeroCopy = false;
+				break;
+
+			case 20:
+				if (!ReplyAmplifier::ParseSize(optarg, amplifier.config.zeroCopyMinimum))
+				{
+					cerr << "Invalid zero-copy minimum: " << optarg << endl;
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 21:
+				if (strcasecmp(optarg, "atm") != 0)
+				{
+					cerr << "Unknown session script: " << optarg << endl;
+					Usage();
+					exit(-1);
+				}
+				scriptName = optarg;
+				listeners.SetDefaultScript();
+				break;
+
+			case 22:
+				if ((atoi(optarg) < 0) || (atoi(optarg) > TOP_TALKERS_MAX_COUNTERS))
+				{
+					cerr << "Top talker counters should be from 0 to " << TOP_TALKERS_MAX_COUNTERS << endl;
+					Usage();
+					exit(-1);
+				}
+				topTalkers.config.counters = atoi(optarg);
+				break;
+
+			case 23:
+				handoffPath = optarg;
+				break;
+
+			case 24:
+				if (atoi(optarg) <= 0)
+				{
+					cerr << "The lag limit must be at least one microsecond" << endl;
+					Usage();
+					exit(-1);
+				}
+				overload.config.lagLimitNs = (uint64_t)atoi(optarg) * NANOS_PER_USEC;
+				break;
+
+			case 25:
+				if (atoi(optarg) <= 0)
+				{
+					cerr << "The queue depth limit must be at least one" << endl;
+					Usage();
+					exit(-1);
+				}
+				overload.config.depthLimit = atoi(optarg);
+				break;
+
+			case 26:
+				if (!listeners.DefineProfile(optarg))
+				{
+					Usage();
+					exit(-1);
+				}
+				break;
+
+			case 27:
+				profiler.Enable(true);
+				break;
+
+			case 28:
+				if (atoi(optarg) < 0)
+				{
+					cerr << "The records kept for each client can't be negative" << endl;
+					Usage();
+					exit(-1);
+				}
+				partitionedRepo.config.enabled = true;
+				partitionedRepo.config.minPerClient = atoi(optarg);
+				break;
+
+			case 29:
+				if (atoi(optarg) < 0)
+				{
+					cerr << "Warm-up can't be negative" << endl;
+					Usage();
+					exit(-1);
+				}
+				if (!allocAudit.IsAvailable())
+				{
+					cerr << "Warning: This build can't audit allocations (it needs XM2M_ALLOC_AUDIT=1 and glibc)" << endl;
+				}
+				allocAudit.Enable(true, atoi(optarg));
+				break;
+
+			case 30:
+				amplifier.config.udp = true;
 				break;
 		}
 	}
@@ -191,12 +539,138 @@ bool InitSocket(
 			close(sock);
 			return false;
 		}
+
+		// non-blocking, so that we can accept until there's nobody left waiting
+
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
 	}
 
 	return true;
 }
 
+/*
+ * Options applied to every socket that carries transactions (but not to the listeners or the
+ * console). Failures are only warnings - the server works fine without any of them.
+ */
+
+void ConfigureTransactionSocket(int sock)
+{
+	if (!EnableReceiveTimestamps(sock))
+	{
+		cerr << "Warning: Kernel receive timestamps are unavailable; queueing time won't be reported" << endl;
+	}
+
+	if (lowLatency)
+	{
+#ifdef SO_BUSY_POLL
+		int usec = busyPollUsec;
+		if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+		{
+			cerr << "Warning: Unable to set SO_BUSY_POLL (" << errno << ")" << endl;
+		}
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+		int one = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0)
+		{
+			cerr << "Warning: Unable to set SO_PREFER_BUSY_POLL (" << errno << ")" << endl;
+		}
+#endif
+	}
+}
+
+/*
+ * Keep the event loop on one core so its cache (and the NIC queue it's busy-polling) stays warm.
+ * Only Linux lets us do this; elsewhere we say so and carry on.
+ */
+
+void PinToCpu(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+	{
+		cerr << "Warning: Unable to pin event loop to CPU " << cpu << " (" << errno << ")" << endl;
+	}
+	else
+	{
+		cout << "Event loop pinned to CPU " << cpu << endl;
+	}
+#else
+	cerr << "Warning: CPU pinning is not supported on this platform" << endl;
+#endif
+}
+
+/*
+ * Thousands of listeners need more descriptors than the usual soft limit of 1024, so raise it as
+ * far as the hard limit allows (which needs no privileges).
+ */
+
+void RaiseDescriptorLimit(int needed)
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+	{
+		return;
+	}
+	if (limit.rlim_cur >= (rlim_t)needed)
+	{
+		return;
+	}
+	limit.rlim_cur = ((limit.rlim_max == RLIM_INFINITY) || (limit.rlim_max >= (rlim_t)needed)) ? (rlim_t)needed : limit.rlim_max;
+	if ((setrlimit(RLIMIT_NOFILE, &limit) < 0) || (limit.rlim_cur < (rlim_t)needed))
+	{
+		cerr << "Warning: Only " << limit.rlim_cur << " descriptors are available, but " << needed
+			<< " may be needed; some ports or sessions may fail" << endl;
+	}
+}
+
+/*
+ * WaitForEvents() is poll() with an optional warm-up: in low-latency mode it first spins on
+ * non-blocking polls for up to spinBudgetUsec, so that a request arriving shortly after the last
+ * one is picked up without a trip through the scheduler. Only then does it sleep. The loop monitor
+ * is told how the time was spent either way.
+ */
+
+int WaitForEvents(struct pollfd *pollfds, int fds, int timeout)
+{
+	PROFILE_SCOPE(PHASE_POLL);
+	uint64_t now = MonotonicNanoseconds();
+	loopMonitor.WaitStarted(now);
+
+	if (lowLatency && (spinBudgetUsec > 0))
+	{
+		uint64_t spinUntil = now + ((uint64_t)spinBudgetUsec * NANOS_PER_USEC);
+		if ((timeout >= 0) && ((now + ((uint64_t)timeout * NANOS_PER_MSEC)) < spinUntil))
+		{
+			spinUntil = now + ((uint64_t)timeout * NANOS_PER_MSEC);	// something is due sooner than that
+		}
+
+		int rc;
+		unsigned int polls = 0;
+		do
+		{
+			rc = poll(pollfds, fds, 0);
+			polls++;
+			now = MonotonicNanoseconds();
+		} while ((rc == 0) && (now < spinUntil));
+
+		loopMonitor.SpinEnded(now, polls, rc != 0);
+		if ((rc != 0) || (timeout == 0))
+		{
+			return rc;
+		}
+	}
+
+	int rc = poll(pollfds, fds, timeout);
+	loopMonitor.SleepEnded(MonotonicNanoseconds(), rc > 0);
+	return rc;
+}
+
 bool stopServer = false;		// can be set by command interpreter to stop the server
+ScriptedSession *scriptedSession = NULL;	// the console reports on it, if there is one
 
 int main(int argc, char *argv[])
 {
@@ -204,79 +678,234 @@ int main(int argc, char *argv[])
 
 	ParseCommandLine(argc, argv);
 
+	if (pinnedCpu >= 0)
+	{
+		PinToCpu(pinnedCpu);
+	}
+
 	/*
-	 * Initialize the repository that stores info about transactions
+	 * Work out which ports we're listening on, and how each is to be served
 	 */
 
-	resultsRepo.Init(totalRepositoryRecords);
+	if (!listeners.Init(transactionPort))
+	{
+		cerr << "Could not set up the transaction ports." << endl;
+		exit(-1);
+	}
+	transactionPort = listeners.FirstPort();
+	int pollfdCount = RESERVED_POLLFDS + listeners.Count() + totalConcurrentSessions;
+	RaiseDescriptorLimit(pollfdCount + 64);	// and a few more for files, the repository and so on
+
+	// tables indexed by descriptor cover them all from the start, so accepting a session never grows one
+
+	if (!listeners.ReserveRoutes(getdtablesize()) || !reconciler.Reserve(getdtablesize()))
+	{
+		cerr << "Insufficient memory for " << getdtablesize() << " descriptors" << endl;
+		exit(-1);
+	}
+
+	/*
+	 * If we're replacing a running server, take over its sockets and repository before anything else
+	 */
+
+	HandoffState inherited;
+	bool tookOver = false;
+	if (handoffPath != NULL)
+	{
+		uint64_t started = MonotonicNanoseconds();
+		tookOver = handoff.TakeOver(handoffPath, inherited);
+		if (tookOver)
+		{
+			cout << "Took over from server " << inherited.pid << " in "
+				<< ((double)(MonotonicNanoseconds() - started) / (double)NANOS_PER_MSEC) << "ms" << endl;
+			ClientSession::ContinueTransactionNumbers(inherited.nextTransactionNumber);
+		}
+	}
+
+	/*
+	 * Initialize the repository that stores info about transactions (or carry on with the old server's)
+	 */
+
+	if (tookOver && (inherited.repository >= 0))
+	{
+		if (!resultsRepo.Inherit(inherited.repository, inherited.repositoryCapacity, inherited.repositoryHead,
+			inherited.recordsStored, totalRepositoryRecords))
+		{
+			cerr << "Warning: Could not inherit the old server's repository; starting with an empty one" << endl;
+			resultsRepo.Init(totalRepositoryRecords);
+		}
+	}
+	else
+	{
+		resultsRepo.Init(totalRepositoryRecords);
+	}
+
+	/*
+	 * ...and the stage that delays, drops or throttles replies (only if the command line asked for it)
+	 */
+
+	impairment.config.sessions = totalConcurrentSessions;
+	if (!impairment.Init())
+	{
+		cerr << "Could not set up reply impairment." << endl;
+		exit(-1);
+	}
+
+	/*
+	 * ...and the reply amplifier, whose pattern buffers are built now rather than on first use
+	 */
+
+	if (!amplifier.Init())
+	{
+		cerr << "Could not set up reply amplification." << endl;
+		exit(-1);
+	}
+
+	/*
+	 * ...and the top talker summaries, which are all allocated up front
+	 */
+
+	if (!topTalkers.Init())
+	{
+		cerr << "Could not set up top talker tracking." << endl;
+		exit(-1);
+	}
+
+	/*
+	 * ...and the traffic capture, if one was requested
+	 */
+
+	if ((capturePath != NULL) && !capture.Open(capturePath, transactionPort, tookOver))
+	{
+		cerr << "Could not start traffic capture." << endl;
+		exit(-1);
+	}
+
+	/*
+	 * ...and the live telemetry segment, if one was requested
+	 */
+
+	if ((telemetryName != NULL) && !telemetry.Open(telemetryName, transactionPort))
+	{
+		cerr << "Could not publish live telemetry." << endl;
+		exit(-1);
+	}
 
 	/*
 	 * Let's begin by setting up each of the receiving sockets we'll offer
 	 */
 
-	int cmdsock, tcptranssock, udptranssock;
-	struct sockaddr_in cmdaddr, tcpaddr, udpaddr;
+	int cmdsock;
+	struct sockaddr_in cmdaddr;
 
 	memset(&cmdaddr, 0, sizeof(cmdaddr));
 	cmdaddr.sin_family = AF_INET;
 	cmdaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 	cmdaddr.sin_port = htons(consolePort);
 
-	if (!InitSocket(cmdsock, SOCK_STREAM, cmdaddr))
+	if (tookOver)
+	{
+		cmdsock = inherited.consoleListener;
+	}
+	else if (!InitSocket(cmdsock, SOCK_STREAM, cmdaddr))
 	{
 		cerr << "Could not create command-line interface socket." << endl;
 		exit(-1);
 	}
 
-	memset(&tcpaddr, 0, sizeof(cmdaddr));
-	tcpaddr.sin_family = AF_INET;
-	tcpaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	tcpaddr.sin_port = htons(transactionPort);
+	// the transaction listeners: the old server's where it had the same ones, otherwise new
 
-	if (!InitSocket(tcptranssock, SOCK_STREAM, tcpaddr))
+	if (tookOver)
 	{
-		cerr << "Could not create TCP transaction socket." << endl;
-		exit(-1);
+		int adopted = listeners.Adopt(inherited.listeners, inherited.listenerCount);
+		cout << "Took over " << adopted << " of " << listeners.Count() << " transaction listeners" << endl;
+		free(inherited.listeners);
 	}
+	for (int l = 0; l < listeners.Count(); l++)
+	{
+		Listener &listener = listeners.At(l);
+		if (listener.socket >= 0)
+		{
+			continue;
+		}
 
-	memset(&udpaddr, 0, sizeof(cmdaddr));
-	udpaddr.sin_family = AF_INET;
-	udpaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	udpaddr.sin_port = htons(transactionPort);
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(listener.port);
 
-	if (!InitSocket(udptranssock, SOCK_DGRAM, udpaddr))
-	{
-		cerr << "Could not create UDP transaction socket." << endl;
-		exit(-1);
+		int sock;
+		if (!InitSocket(sock, listener.udp ? SOCK_DGRAM : SOCK_STREAM, addr) || !listeners.SetSocket(l, sock))
+		{
+			cerr << "Could not create " << (listener.udp ? "UDP" : "TCP") << " transaction socket for port "
+				<< listener.port << "." << endl;
+			exit(-1);
+		}
+		if (listener.udp)
+		{
+			ConfigureTransactionSocket(sock);
+		}
 	}
 
 	/*
 	 * Next, let's multiplex them onto one poll
 	 */
 
-	struct pollfd *pollfds = (struct pollfd *)malloc(sizeof(struct pollfd) * totalConcurrentSessions);
+	struct pollfd *pollfds = (struct pollfd *)malloc(sizeof(struct pollfd) * pollfdCount);
 	if (pollfds == NULL)
 	{
 		cerr << "Insufficient memory";
 		exit(-1);
 	}
-	memset(pollfds, 0, sizeof(struct pollfd));
-	pollfds[0].fd = cmdsock;
-	pollfds[0].events = POLLIN;
+	memset(pollfds, 0, sizeof(struct pollfd) * pollfdCount);
+	pollfds[CONSOLE_POLLFD].fd = cmdsock;
+	pollfds[CONSOLE_POLLFD].events = POLLIN;
 
-	pollfds[1].fd = udptranssock;
-	pollfds[1].events = POLLIN;
+	pollfds[HANDOFF_LISTEN_POLLFD].fd = -1;
+	pollfds[HANDOFF_LISTEN_POLLFD].events = POLLIN;
+	if ((handoffPath != NULL) && handoff.Listen(handoffPath))
+	{
+		pollfds[HANDOFF_LISTEN_POLLFD].fd = handoff.ListenSocket();
+	}
+	else if (handoffPath != NULL)
+	{
+		cerr << "Warning: A restarted server won't be able to take over from this one" << endl;
+	}
 
-	pollfds[2].fd = tcptranssock;
-	pollfds[2].events = POLLIN;
+	pollfds[HANDOFF_LINK_POLLFD].fd = handoff.PredecessorSocket();
+	pollfds[HANDOFF_LINK_POLLFD].events = POLLIN;
+
+	int firstSession = RESERVED_POLLFDS;
+	for (int l = 0; l < listeners.Count(); l++)
+	{
+		pollfds[firstSession].fd = listeners.At(l).socket;
+		pollfds[firstSession].events = POLLIN;
+		firstSession++;
+	}
 
 	/*
-	 * For now, let's create one of each class object so we can start folding code into it.
+	 * The console gets its own session object; the transaction ports share one per profile and
+	 * transport, and any profile running a script shares the one scripted session.
 	 */
 
 	CommandLineClientSession cmdlineClientSession("Command line client");
-	ClientSession udpClientSession("UDP clients", true);
-	ClientSession tcpClientSession("TCP client", false);
+
+	if (listeners.NeedsScript())
+	{
+		scriptedSession = new AtmClientSession("ATM client");
+		if (!scriptedSession->Init(totalConcurrentSessions))
+		{
+			cerr << "Could not set up scripted sessions." << endl;
+			exit(-1);
+		}
+		cout << "Scripted TCP sessions will run the ATM script" << endl;
+	}
+	if (!listeners.CreateSessions(scriptedSession))
+	{
+		cerr << "Could not set up transaction sessions." << endl;
+		exit(-1);
+	}
 
 	/*
 	 * The next loop is the main workhorse of the xm2m-server app.  It calls poll()
@@ -284,18 +913,114 @@ int main(int argc, char *argv[])
 	 * It calls the appropriate ClientSession object as needed.
 	 */
 
-	int fds = 3;
-	int timeout = 60000;	// poll operation will take at most one minute
+	int fds = firstSession;
+	int idleTimeout = 60000;	// poll operation will take at most one minute
+
+	// the old server's console user carries on with us, none the wiser
+
+	if (tookOver && (inherited.consoleSession >= 0))
+	{
+		cmdlineClientSession.ConnectionEstablished(inherited.consoleSession);
+		pollfds[fds].fd = inherited.consoleSession;
+		pollfds[fds].events = POLLIN;
+		fds++;
+	}
+
+	bool handoffRequested = false;
+	uint64_t drainDeadline = 0;
+	loopMonitor.Start(MonotonicNanoseconds());
 	do
 	{
-		int rc = poll(pollfds, fds, timeout);
+		// don't sleep past the moment the next delayed reply is due to go out
+
+		int timeout = impairment.PollTimeout(idleTimeout, MonotonicNanoseconds());
+		timeout = capture.PollTimeout(timeout);
+		if (scriptedSession)
+		{
+			timeout = scriptedSession->PollTimeout(timeout, MonotonicNanoseconds());
+		}
+		timeout = overload.PollTimeout(timeout);
+		timeout = reconciler.PollTimeout(timeout);
+		if (handoff.IsDraining() && ((timeout < 0) || (timeout > 1000)))
+		{
+			timeout = 1000;		// keep an eye on the drain deadline
+		}
+		cout.flush();	// everything the last pass logged, in one go
+		int rc = WaitForEvents(pollfds, fds, timeout);
 		if (rc < 0)
 		{
 			cerr << "poll() failure " << rc << endl;
 			exit(-1);
 		}
-		else if (rc == 0)
+
+		uint64_t now = MonotonicNanoseconds();
+		overload.IterationStarted(now, loopMonitor.LastBusy(), rc);
+		{
+			PROFILE_SCOPE(PHASE_TIMERS);
+			if (impairment.Service(now) > 0)
+			{
+				// held sessions whose queued replies have all gone can be read again
+
+				for (int i = firstSession; i < fds; i++)
+				{
+					ClientSession *session = listeners.Session(pollfds[i].fd);
+					if (session && !impairment.IsHolding(pollfds[i].fd))
+					{
+						pollfds[i].events = session->PollEvents(pollfds[i].fd);
+					}
+				}
+			}
+			capture.Service(now);
+			telemetry.Heartbeat(now);
+			if (scriptedSession && (scriptedSession->Service(now) > 0))
+			{
+				// scripts that woke up may now be waiting for something else
+
+				for (int i = firstSession; i < fds; i++)
+				{
+					if (listeners.Session(pollfds[i].fd) == scriptedSession)
+					{
+						pollfds[i].events = scriptedSession->PollEvents(pollfds[i].fd);
+					}
+				}
+			}
+			if (reconciler.Service(now) > 0)
+			{
+				// finished joins have answers to send, and waiting connections can be claimed (or not)
+
+				for (int i = firstSession; i < fds; i++)
+				{
+					if (reconciler.Owns(pollfds[i].fd) || reconciler.Claiming(pollfds[i].fd))
+					{
+						pollfds[i].events = reconciler.PollEvents(pollfds[i].fd);
+					}
+				}
+			}
+		}
+
+		// once we've handed over, we're done when our last session is (or we've waited long enough)
+
+		if (handoff.IsDraining())
+		{
+			if ((fds == firstSession) && (impairment.Pending() == 0) && (handoff.PredecessorSocket() < 0))
+			{
+				cout << "All sessions have finished; handover complete." << endl;
+				stopServer = true;
+			}
+			else if (now > drainDeadline)
+			{
+				cerr << "Gave up waiting for " << (fds - firstSession) << " sessions to finish" << endl;
+				stopServer = true;
+			}
+		}
+
+		if (rc == 0)
 		{
+			if (timeout != idleTimeout)
+			{
+				continue;	// we only woke up to send delayed replies or flush the capture - that's not real inactivity
+			}
+
 			/*
 			 *  Timer expired; that's normal, we'll just poll again; but if we've timed out,
 			 *  then the system is relatively quiet, so now might be a good time to do some...
@@ -311,12 +1036,23 @@ int main(int argc, char *argv[])
 				{
 					continue;
 				}
+				if ((pollfds[i].revents & POLLERR) && amplifier.ReapCompletions(pollfds[i].fd))
+				{
+					pollfds[i].revents &= ~POLLERR;	// just the kernel finishing with zero-copy sends
+					if (pollfds[i].revents == 0)
+					{
+						continue;
+					}
+				}
 				if (pollfds[i].revents != POLLIN)
 				{
 					if (pollfds[i].revents & POLLERR)
 					{
 						cerr << "Polling error on fd #" << i << endl;
-						stopServer = true;
+						if ((i == CONSOLE_POLLFD) || ((i >= RESERVED_POLLFDS) && (i < firstSession)))
+						{
+							stopServer = true;	// one of our listeners is broken; a session's error just ends that session
+						}
 					}
 					if (pollfds[i].revents & POLLHUP)
 					{
@@ -324,6 +1060,7 @@ int main(int argc, char *argv[])
 						// Okay, but so what? We should have already disconnected and closed anyway.
 					}
 				}
+				Listener *listener = listeners.Find(pollfds[i].fd);	// by descriptor, so no search
 				if (pollfds[i].fd == cmdsock)
 				{
 					cout << "New command-line session!" << endl;
@@ -341,7 +1078,7 @@ int main(int argc, char *argv[])
 						cerr << "Command-line console session refused: Someone else is connected" << endl;
 						close(sock);
 					}
-					else if (fds >= totalConcurrentSessions)
+					else if (fds >= pollfdCount)
 					{
 						cerr << "Command-line console session refused: No more room for additional TCP sessions" << endl;
 						close(sock);
@@ -354,63 +1091,181 @@ int main(int argc, char *argv[])
 						fds++;
 					}
 				}
-				else if (pollfds[i].fd == tcptranssock)
+				else if ((listener != NULL) && !listener->udp)
 				{
-					cout << "New echo session!" << endl;
-					int sock = accept(tcptranssock, NULL, NULL);
-					if (sock < 0)
+					// take as many waiting connections as overload control allows this time around
+
+					PROFILE_SCOPE(PHASE_ACCEPT);
+					ClientSession *transactionSession = listener->profile->tcpSession;
+					int budget = overload.AcceptBudget();
+					int accepted;
+					for (accepted = 0; accepted < budget; accepted++)
 					{
-						if (errno != EWOULDBLOCK)
+						ALLOC_AUDIT_SCOPE();
+						struct sockaddr_in clientAddress;
+						socklen_t clientAddressLength = sizeof(clientAddress);
+						int sock = accept(listener->socket, (struct sockaddr *)&clientAddress, &clientAddressLength);
+						if (sock < 0)
 						{
-							cerr << "Cannot accept incoming connection?" << endl;
-							stopServer = true;
+							if (errno != EWOULDBLOCK)
+							{
+								cerr << "Cannot accept incoming connection?" << endl;
+								stopServer = true;
+							}
+							break;
+						}
+						cout << "New echo session!\n";
+						if (overload.RefuseSession())
+						{
+							close(sock);	// better an immediate no than an answer that never comes
+							telemetry.SessionRefused();
+						}
+						else if (fds >= pollfdCount)
+						{
+							cerr << "No more room for additional TCP sessions" << endl;
+							close(sock);
+							telemetry.SessionRefused();
+						}
+						else if (!listeners.SessionOpened(sock, listener))
+						{
+							cerr << "No more room for additional " << listener->profile->name << " sessions" << endl;
+							close(sock);
+							telemetry.SessionRefused();
+						}
+						else
+						{
+							ConfigureTransactionSocket(sock);
+							telemetry.ConnectionOpened(sock, &clientAddress);
+							transactionSession->ConnectionEstablished(sock);
+							pollfds[fds].fd = sock;
+							pollfds[fds].events = transactionSession->PollEvents(sock);
+							fds++;
 						}
 					}
-					else if (fds >= totalConcurrentSessions)
+					if ((accepted == budget) && (budget < OVERLOAD_ACCEPT_BATCH))
 					{
-						cerr << "No more room for additional TCP sessions" << endl;
-						close(sock);
+						overload.AcceptsCapped();
 					}
-					else
+				}
+				else if (listener != NULL)
+				{
+					if (!overload.DropDatagram(listener->socket))
 					{
-						pollfds[fds].fd = sock;
-						pollfds[fds].events = POLLIN;
-						fds++;
+						listeners.DatagramArrived(listener)->MessageReceived(listener->socket);
 					}
 				}
-				else if (pollfds[i].fd == udptranssock)
+				else if (i == HANDOFF_LISTEN_POLLFD)
 				{
-					udpClientSession.MessageReceived(udptranssock);
+					handoffRequested = true;	// dealt with below, once this round of events is done
+				}
+				else if (i == HANDOFF_LINK_POLLFD)
+				{
+					if (handoff.ReceiveRecords() <= 0)
+					{
+						cout << "The server we took over from has finished" << endl;
+						pollfds[i].fd = -1;
+					}
 				}
 				else	// an existing socket
 				{
-					int n;
-					if (pollfds[i].fd == cmdlineClientSession.Socket())
+					int n = 1;
+					bool console = cmdlineClientSession.IsConnected() && (pollfds[i].fd == cmdlineClientSession.Socket());
+					ClientSession *session = console ? &cmdlineClientSession : listeners.Session(pollfds[i].fd);
+					if (pollfds[i].revents & POLLOUT)
 					{
-						n = cmdlineClientSession.MessageReceived(pollfds[i].fd);
+						n = session->ReadyToWrite(pollfds[i].fd);	// more room for a reply that didn't all fit
 					}
-					else
+					if ((n > 0) && (pollfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
 					{
-						n = tcpClientSession.MessageReceived(pollfds[i].fd);
+						n = session->MessageReceived(pollfds[i].fd);
 					}
-					if (n <= 0)	// either there was an error on the session, or it was routinely closed
+					if (n > 0)
 					{
-						cout << "Closing session..." << endl;
+						// e.g. while a big reply is still going out, don't take the session's next request
+
+						pollfds[i].events = session->PollEvents(pollfds[i].fd);
+					}
+					else	// either there was an error on the session, or it was routinely closed
+					{
+						ALLOC_AUDIT_SCOPE();
+						cout << "Closing session...\n";
+						impairment.ForgetSocket(pollfds[i].fd);
+						amplifier.ForgetSocket(pollfds[i].fd);
+						session->ConnectionTerminated(pollfds[i].fd);
+						if (!console)
+						{
+							listeners.SessionClosed(pollfds[i].fd);
+							telemetry.ConnectionClosed(pollfds[i].fd);
+						}
 						close(pollfds[i].fd);
 
 						// This would leave a hole in our pollfds array, so let's 'defrag' here
 
 						for (; i < fds; i++)
 						{
-							if (i < (totalConcurrentSessions - 1))	// don't run off the end of the array
+							if (i < (pollfdCount - 1))	// don't run off the end of the array
 							{
-								pollfds[i].fd = pollfds[i+1].fd;
+								pollfds[i] = pollfds[i+1];
 							}
 						}
 						fds--;
 					}
 				}
 			}
+
+			/*
+			 * A restarted server wants our sockets. Once it has them, we stop listening (and let go of
+			 * the console) but see our own sessions out, passing their records along.
+			 */
+
+			if (handoffRequested)
+			{
+				handoffRequested = false;
+				HandoffState state;
+				state.consoleListener = cmdsock;
+				state.listenerCount = listeners.Count();
+				state.listeners = (HandoffListener *)malloc(sizeof(HandoffListener) * ((state.listenerCount > 0) ? state.listenerCount : 1));
+				if (state.listeners != NULL)
+				{
+					listeners.Export(state.listeners);
+				}
+				state.consoleSession = cmdlineClientSession.IsConnected() ? cmdlineClientSession.Socket() : -1;
+				state.repository = resultsRepo.SharedMemory();
+				state.repositoryCapacity = resultsRepo.Capacity();
+				state.repositoryHead = resultsRepo.Head();
+				state.recordsStored = resultsRepo.RecordsStored();
+				state.nextTransactionNumber = ClientSession::PeekTransactionNumber();
+				bool handedOver = (state.listeners != NULL) && handoff.HandOver(state);
+				free(state.listeners);
+				if (handedOver)
+				{
+					capture.Close();
+					telemetry.Close();
+					handoff.Released();
+
+					for (int i = 0; i < firstSession; i++)
+					{
+						if (i != HANDOFF_LINK_POLLFD)
+						{
+							pollfds[i].fd = -1;		// still open (delayed UDP replies need those sockets), just not ours to poll
+						}
+					}
+					for (int i = firstSession; i < fds; i++)
+					{
+						if (pollfds[i].fd == state.consoleSession)
+						{
+							cmdlineClientSession.ConnectionTerminated(state.consoleSession);
+							close(state.consoleSession);	// not shut down - the new server has it now
+							pollfds[i] = pollfds[fds - 1];
+							fds--;
+							break;
+						}
+					}
+					drainDeadline = MonotonicNanoseconds() + ((uint64_t)HANDOFF_DRAIN_SEC * NANOS_PER_SEC);
+					cout << "Handed over to server " << state.pid << "; seeing " << (fds - firstSession)
+						<< " sessions out" << endl;
+				}
+			}
 		}
 	} while (!stopServer);
 
@@ -420,13 +1275,39 @@ int main(int argc, char *argv[])
 
 	cout << "All operations completed. Exiting." << endl;
 
+	capture.Close();
+	telemetry.Close();
+
+	if (handoff.IsDraining())
+	{
+		const HandoffStats &stats = handoff.Stats();
+		cout << "Forwarded " << stats.forwarded << " records to the new server ("
+			<< stats.forwardDropped << " dropped)" << endl;
+	}
+	handoff.Close();
+
+	int exitCode = 0;
+	if (allocAudit.IsEnabled() && (allocAudit.Stats().allocations > 0))
+	{
+		char report[1024];
+		allocAudit.Format(report, sizeof(report), MonotonicNanoseconds());
+		cerr << "Heap allocations on the transaction path after warm-up:\n" << report;
+		exitCode = ALLOC_AUDIT_EXIT_CODE;
+	}
+
 	for (int i = 0; i < fds; i++)
 	{
+		// anything handed over is still in use by the new server, so it mustn't be shut down
+
+		if ((pollfds[i].fd < 0) || (i == HANDOFF_LISTEN_POLLFD) || (i == HANDOFF_LINK_POLLFD))
+		{
+			continue;
+		}
 		shutdown(pollfds[i].fd, SHUT_RDWR);
 		close(pollfds[i].fd);
 	}
 
-	return 0;
+	return exitCode;
 }
 
 // end of xm2m-server.cpp
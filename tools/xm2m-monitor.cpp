@@ -0,0 +1,296 @@
+//============================================================================
+// Name        : xm2m-monitor.cpp
+// Author      : Jonathan Somers
+// Version     : 0.0
+// Copyright   : Copyright (C) 2019 by Jonathan Somers
+// Description : Watches a running xm2m-server through its live telemetry segment
+//============================================================================
+
+/*
+ * Maps the segment a server started with --telemetry publishes (see src/telemetryformat.h)
+ * read-only and prints what's in it: counters and rates, the two latency histograms, open
+ * connections and the newest transactions. It never talks to the server, so it can run as
+ * often and for as long as you like without disturbing the thing being measured.
+ *
+ * All reads follow the rules in telemetryformat.h: atomic loads for counters, and a
+ * sequence-number check around each copied slot, skipping any slot that was mid-update.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+using namespace std;
+
+#include "../src/telemetryformat.h"
+#include "../src/timeutil.h"
+
+static int intervalMs = 1000;
+static bool once = false;
+static int recentToShow = 10;
+
+static void Usage()
+{
+	cout << "\nusage: xm2m-monitor [--interval ms][--once][--recent n] segment\n"
+		<< "\tsegment - the name given to xm2m-server --telemetry (e.g. /xm2m)\n"
+		<< "\t--interval ms - how often to refresh (default:1000)\n"
+		<< "\t--once - print one report and exit\n"
+		<< "\t--recent n - how many of the newest transactions to list (default:10)\n"
+		<< "\t--help - this usage information" << endl;
+}
+
+static uint64_t Load(const uint64_t &value)
+{
+	return __atomic_load_n(&value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy a seqlocked slot, returning false if the server was changing it while we looked.
+ */
+
+template <class T> static bool ReadSlot(const T &slot, T &copy)
+{
+	uint32_t before = __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE);
+	if (before & 1)
+	{
+		return false;
+	}
+	memcpy(&copy, &slot, sizeof(T));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint32_t after = __atomic_load_n(&slot.sequence, __ATOMIC_RELAXED);
+	return before == after;
+}
+
+static void PrintHistogram(const char *title, const uint64_t *histogram, int buckets)
+{
+	uint64_t counts[TELEMETRY_BUCKETS];
+	uint64_t total = 0;
+	for (int i = 0; i < buckets; i++)
+	{
+		counts[i] = Load(histogram[i]);
+		total += counts[i];
+	}
+	printf("%s (%llu samples)\n", title, (unsigned long long)total);
+	if (total == 0)
+	{
+		return;
+	}
+	for (int i = 0; i < buckets; i++)
+	{
+		if (counts[i] == 0)
+		{
+			continue;
+		}
+		printf("  %10.3f usec+ %10llu  %5.1f%%\n",
+			(double)(1ULL << i) / NANOS_PER_USEC, (unsigned long long)counts[i], 100.0 * counts[i] / total);
+	}
+}
+
+static void PrintPrefix(const char *data, unsigned int length)
+{
+	if (length > TELEMETRY_PAYLOAD_PREFIX)
+	{
+		length = TELEMETRY_PAYLOAD_PREFIX;
+	}
+	putchar('"');
+	for (unsigned int i = 0; i < length; i++)
+	{
+		putchar(((data[i] >= ' ') && (data[i] <= '~')) ? data[i] : '.');
+	}
+	putchar('"');
+}
+
+static void Report(const TelemetrySegment *segment, TelemetryCounters &previous, uint64_t &previousAt)
+{
+	uint64_t now = MonotonicNanoseconds();
+	uint64_t heartbeat = Load(segment->heartbeatNs);
+
+	TelemetryCounters counters;
+	counters.transactions = Load(segment->counters.transactions);
+	counters.udpTransactions = Load(segment->counters.udpTransactions);
+	counters.tcpTransactions = Load(segment->counters.tcpTransactions);
+	counters.bytesReceived = Load(segment->counters.bytesReceived);
+	counters.bytesSent = Load(segment->counters.bytesSent);
+	counters.sessionsClosed = Load(segment->counters.sessionsClosed);	// before accepted, so active can't go negative
+	counters.sessionsAccepted = Load(segment->counters.sessionsAccepted);
+	counters.sessionsRefused = Load(segment->counters.sessionsRefused);
+
+	printf("xm2m-server pid %u, port %u, up %llu sec, last heartbeat %.1f sec ago\n",
+		segment->serverPid, segment->transactionPort,
+		(unsigned long long)(time(NULL) - segment->startWallSeconds),
+		(now > heartbeat) ? (double)(now - heartbeat) / NANOS_PER_SEC : 0.0);
+	printf("Transactions: %llu (UDP %llu, TCP %llu)  Bytes in: %llu  Bytes out: %llu\n",
+		(unsigned long long)counters.transactions, (unsigned long long)counters.udpTransactions,
+		(unsigned long long)counters.tcpTransactions, (unsigned long long)counters.bytesReceived,
+		(unsigned long long)counters.bytesSent);
+	printf("Sessions: %llu active, %llu accepted, %llu closed, %llu refused\n",
+		(unsigned long long)(counters.sessionsAccepted - counters.sessionsClosed), (unsigned long long)counters.sessionsAccepted,
+		(unsigned long long)counters.sessionsClosed, (unsigned long long)counters.sessionsRefused);
+	if (previousAt != 0)
+	{
+		double seconds = (double)(now - previousAt) / NANOS_PER_SEC;
+		printf("Rate: %.1f transactions/sec, %.1f KB/sec in, %.1f KB/sec out\n",
+			(counters.transactions - previous.transactions) / seconds,
+			(counters.bytesReceived - previous.bytesReceived) / seconds / 1024.0,
+			(counters.bytesSent - previous.bytesSent) / seconds / 1024.0);
+	}
+	previous = counters;
+	previousAt = now;
+
+	PrintHistogram("Service time (receive to reply)", segment->serviceHistogram, segment->buckets);
+	PrintHistogram("Kernel receive to reply", segment->kernelToReplyHistogram, segment->buckets);
+
+	printf("Connections:\n");
+	for (unsigned int i = 0; i < segment->maxConnections; i++)
+	{
+		TelemetryConnection connection;
+		if (!ReadSlot(segment->connections[i], connection) || !connection.inUse)
+		{
+			continue;
+		}
+		struct in_addr address;
+		address.s_addr = connection.ipAddress;
+		printf("  fd %d %s:%u for %llu sec: %llu transactions, %llu bytes in, %llu bytes out\n",
+			connection.socket, inet_ntoa(address), ntohs(connection.port),
+			(unsigned long long)(time(NULL) - connection.openedWallSeconds),
+			(unsigned long long)connection.transactions, (unsigned long long)connection.bytesReceived,
+			(unsigned long long)connection.bytesSent);
+	}
+
+	uint64_t written = __atomic_load_n(&segment->recentWritten, __ATOMIC_ACQUIRE);
+	uint64_t show = (written < (uint64_t)recentToShow) ? written : recentToShow;
+	if (show > segment->recentCapacity)
+	{
+		show = segment->recentCapacity;
+	}
+	printf("Newest transactions:\n");
+	for (uint64_t n = written - show; n < written; n++)
+	{
+		TelemetryTransaction transaction;
+		if (!ReadSlot(segment->recent[n % segment->recentCapacity], transaction))
+		{
+			printf("  (being updated)\n");
+			continue;
+		}
+		struct in_addr address;
+		address.s_addr = transaction.ipAddress;
+		printf("  #%u %s %s:%u service %.3f usec ", transaction.transactionNumber, transaction.udp ? "UDP" : "TCP",
+			inet_ntoa(address), ntohs(transaction.port), (double)transaction.serviceNs / NANOS_PER_USEC);
+		PrintPrefix(transaction.request, transaction.requestLength);
+		printf(" -> ");
+		PrintPrefix(transaction.reply, transaction.replyLength);
+		printf("\n");
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option longOptions[] = {
+		{ "help",		no_argument,		0,	0 },
+		{ "interval",	required_argument,	0,	1 },
+		{ "once",		no_argument,		0,	2 },
+		{ "recent",		required_argument,	0,	3 },
+		{ 0,			0,					0,	0 }
+	};
+	int optionIndex = 0;
+	while (1)
+	{
+		int option = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if (option == -1)
+		{
+			break;
+		}
+		switch (option)
+		{
+			case 1:
+				intervalMs = atoi(optarg);
+				if (intervalMs <= 0)
+				{
+					cerr << "Interval must be greater than zero" << endl;
+					exit(-1);
+				}
+				break;
+
+			case 2:
+				once = true;
+				break;
+
+			case 3:
+				recentToShow = atoi(optarg);
+				if (recentToShow < 0)
+				{
+					recentToShow = 0;
+				}
+				break;
+
+			case 0:
+			default:
+				Usage();
+				exit(option == 0 ? 0 : -1);
+		}
+	}
+	if (optind >= argc)
+	{
+		Usage();
+		exit(-1);
+	}
+
+	int fd = shm_open(argv[optind], O_RDONLY, 0);
+	if (fd < 0)
+	{
+		cerr << "Unable to open telemetry segment " << argv[optind] << " (" << strerror(errno) << ")" << endl;
+		exit(-1);
+	}
+	struct stat info;
+	if ((fstat(fd, &info) < 0) || (info.st_size < (off_t)sizeof(TelemetrySegment)))
+	{
+		cerr << "Telemetry segment is too small - is the server still starting?" << endl;
+		exit(-1);
+	}
+	void *mapping = mmap(NULL, sizeof(TelemetrySegment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		cerr << "Unable to map telemetry segment (" << strerror(errno) << ")" << endl;
+		exit(-1);
+	}
+	const TelemetrySegment *segment = (const TelemetrySegment *)mapping;
+	if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC)
+	{
+		cerr << "Not an xm2m-server telemetry segment" << endl;
+		exit(-1);
+	}
+	if ((segment->version != TELEMETRY_VERSION) || (segment->segmentSize != sizeof(TelemetrySegment)))
+	{
+		cerr << "Unsupported telemetry version " << segment->version << endl;
+		exit(-1);
+	}
+
+	TelemetryCounters previous;
+	uint64_t previousAt = 0;
+	memset(&previous, 0, sizeof(previous));
+	while (1)
+	{
+		Report(segment, previous, previousAt);
+		if (once)
+		{
+			break;
+		}
+		usleep(intervalMs * 1000);
+	}
+
+	munmap(mapping, sizeof(TelemetrySegment));
+	return 0;
+}
@@ -0,0 +1,534 @@
+//============================================================================
+// Name        : xm2m-replay.cpp
+// Author      : Jonathan Somers
+// Version     : 0.0
+// Copyright   : Copyright (C) 2019 by Jonathan Somers
+// Description : Plays a traffic capture from xm2m-server --capture back at a server
+//============================================================================
+
+/*
+ * Every captured client (address, port and protocol) becomes a 'flow' with a socket of its
+ * own, so the server sees the same number of distinct clients it saw originally, and each
+ * flow's replies can be matched against the replies the server gave when the capture was
+ * taken. A client that talked to more than one of the server's ports is a flow per port, and
+ * each flow goes to the port its requests were captured on (unless --port says otherwise), so
+ * per-port profiles answer as they did. TCP flows connect just before their first request.
+ *
+ * Requests are sent at their original pacing (taken from the monotonic receive timestamps),
+ * scaled by --speed, or back to back with --asap. Replies are read as they arrive and compared
+ * in order with the captured ones. At the end we report how many requests went out, the
+ * throughput achieved, and how many replies matched, differed, went missing or were unexpected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+#include <vector>
+#include <map>
+using namespace std;
+
+#include "../src/captureformat.h"
+#include "../src/timeutil.h"
+
+typedef struct _Request
+{
+	uint64_t capturedAt;		// monotonic nanoseconds at the original server
+	int flow;
+	const char *request;
+	unsigned int requestLength;
+	const char *reply;
+	unsigned int replyLength;
+} Request;
+
+typedef struct _Flow
+{
+	uint32_t ipAddress;
+	uint16_t port;
+	uint16_t serverPort;		// host byte order
+	uint8_t protocol;
+	int socket;
+	vector<int> expected;		// requests whose replies we're still waiting for, oldest first
+	size_t nextExpected;
+	unsigned int matchedBytes;	// TCP only: how much of the oldest expected reply has arrived
+	bool mismatched;			// TCP only: the oldest expected reply has already gone wrong
+} Flow;
+
+typedef struct _Results
+{
+	uint64_t sent;
+	uint64_t sendErrors;
+	uint64_t matched;
+	uint64_t mismatched;
+	uint64_t unexpected;		// replies (or bytes, for TCP) we weren't waiting for
+} Results;
+
+static const char *serverHost = "127.0.0.1";
+static int serverPort = 0;		// 0 == use the ports recorded in the capture
+static double speed = 1.0;
+static bool asap = false;
+static int drainTimeoutMs = 2000;
+
+static void Usage()
+{
+	cout << "\nusage: xm2m-replay [--server host][--port port][--speed n][--asap][--timeout ms] capturefile\n"
+		<< "\t--server host - where to send the traffic (default:127.0.0.1)\n"
+		<< "\t--port port - send everything to this port (default: each request's own port, from the capture)\n"
+		<< "\t--speed n - replay n times faster than captured (default:1)\n"
+		<< "\t--asap - ignore the captured pacing and send as fast as possible\n"
+		<< "\t--timeout ms - how long to wait for stragglers after the last request (default:2000)\n"
+		<< "\t--help - this usage information" << endl;
+}
+
+static char *LoadFile(const char *path, size_t &length)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	struct stat info;
+	if (fstat(fd, &info) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	length = info.st_size;
+	char *data = (char *)malloc(length > 0 ? length : 1);
+	size_t done = 0;
+	while ((data != NULL) && (done < length))
+	{
+		ssize_t n = read(fd, data + done, length - done);
+		if (n <= 0)
+		{
+			free(data);
+			data = NULL;
+			break;
+		}
+		done += n;
+	}
+	close(fd);
+	return data;
+}
+
+static bool ParseCapture(char *data, size_t length, vector<Request> &requests, vector<Flow> &flows, int &capturedPort)
+{
+	CaptureFileHeader fileHeader;
+	if (length < sizeof(fileHeader))
+	{
+		cerr << "Capture is too short to be a capture" << endl;
+		return false;
+	}
+	memcpy(&fileHeader, data, sizeof(fileHeader));
+	if (strncmp(fileHeader.magic, CAPTURE_MAGIC, sizeof(fileHeader.magic)) != 0)
+	{
+		cerr << "Not an xm2m-server capture" << endl;
+		return false;
+	}
+	uint32_t version = ntohl(fileHeader.version);
+	if ((version < 1) || (version > CAPTURE_VERSION))
+	{
+		cerr << "Unsupported capture version " << version << endl;
+		return false;
+	}
+	capturedPort = ntohl(fileHeader.serverPort);
+	size_t headerLength = (version == 1) ? CAPTURE_V1_RECORD_HEADER : sizeof(CaptureRecordHeader);
+
+	map<pair<uint64_t, uint16_t>, int> flowIndex;	// ((protocol, address, port), server port) -> index into flows
+	size_t offset = ntohl(fileHeader.headerLength);
+	while ((offset + headerLength) <= length)
+	{
+		CaptureRecordHeader header;
+		memset(&header, 0, sizeof(header));		// a version 1 record has no serverPort
+		memcpy(&header, data + offset, headerLength);
+		size_t recordLength = ntohl(header.recordLength);
+		Request request;
+		request.requestLength = ntohs(header.requestLength);
+		request.replyLength = ntohs(header.replyLength);
+		if (
+			(recordLength < headerLength + request.requestLength + request.replyLength) ||
+			((offset + recordLength) > length)
+		){
+			cerr << "Capture is truncated or corrupt after " << requests.size() << " records" << endl;
+			break;
+		}
+		request.capturedAt = ((uint64_t)ntohl(header.monotonicHigh) << 32) | ntohl(header.monotonicLow);
+		request.request = data + offset + headerLength;
+		request.reply = request.request + request.requestLength;
+
+		uint16_t toPort = (header.serverPort != 0) ? ntohs(header.serverPort) : (uint16_t)capturedPort;
+		pair<uint64_t, uint16_t> key(((uint64_t)header.protocol << 48) | ((uint64_t)header.ipAddress << 16) | header.port, toPort);
+		map<pair<uint64_t, uint16_t>, int>::iterator it = flowIndex.find(key);
+		if (it == flowIndex.end())
+		{
+			Flow flow;
+			flow.ipAddress = header.ipAddress;
+			flow.port = header.port;
+			flow.serverPort = toPort;
+			flow.protocol = header.protocol;
+			flow.socket = -1;
+			flow.nextExpected = 0;
+			flow.matchedBytes = 0;
+			flow.mismatched = false;
+			flows.push_back(flow);
+			it = flowIndex.insert(make_pair(key, (int)flows.size() - 1)).first;
+		}
+		request.flow = it->second;
+		requests.push_back(request);
+		offset += recordLength;
+	}
+	return true;
+}
+
+static bool OpenFlow(Flow &flow, struct sockaddr_in server)
+{
+	bool tcp = (flow.protocol == CAPTURE_PROTOCOL_TCP);
+	flow.socket = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (flow.socket < 0)
+	{
+		return false;
+	}
+	server.sin_port = htons(serverPort ? serverPort : flow.serverPort);
+	if (connect(flow.socket, (struct sockaddr *)&server, sizeof(server)) < 0)	// for UDP, just fixes the peer
+	{
+		close(flow.socket);
+		flow.socket = -1;
+		return false;
+	}
+	fcntl(flow.socket, F_SETFL, fcntl(flow.socket, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+/*
+ * Compare whatever arrived on a flow's socket with the replies we expect, oldest first. A UDP
+ * datagram is one whole reply; TCP replies arrive as a byte stream, so we walk through them.
+ */
+
+static void ReadReplies(Flow &flow, vector<Request> &requests, Results &results)
+{
+	char buffer[65536];
+	while (1)
+	{
+		ssize_t n = recv(flow.socket, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+		{
+			if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+			{
+				close(flow.socket);		// the server hung up on us
+				flow.socket = -1;
+			}
+			return;
+		}
+
+		if (flow.protocol == CAPTURE_PROTOCOL_UDP)
+		{
+			if (flow.nextExpected >= flow.expected.size())
+			{
+				results.unexpected++;
+				continue;
+			}
+			Request &expected = requests[flow.expected[flow.nextExpected++]];
+			if ((n == (ssize_t)expected.replyLength) && (memcmp(buffer, expected.reply, n) == 0))
+			{
+				results.matched++;
+			}
+			else
+			{
+				results.mismatched++;
+			}
+			continue;
+		}
+
+		for (ssize_t i = 0; i < n; i++)
+		{
+			if (flow.nextExpected >= flow.expected.size())
+			{
+				results.unexpected += (n - i);
+				break;
+			}
+			Request &expected = requests[flow.expected[flow.nextExpected]];
+			if (buffer[i] != expected.reply[flow.matchedBytes])
+			{
+				flow.mismatched = true;
+			}
+			if (++flow.matchedBytes >= expected.replyLength)
+			{
+				if (flow.mismatched)
+				{
+					results.mismatched++;
+				}
+				else
+				{
+					results.matched++;
+				}
+				flow.nextExpected++;
+				flow.matchedBytes = 0;
+				flow.mismatched = false;
+			}
+		}
+	}
+}
+
+/*
+ * Read replies on any flow that has some until 'deadline' passes. A deadline that has already
+ * passed just checks once without waiting.
+ */
+
+static void PollReplies(vector<Flow> &flows, vector<Request> &requests, Results &results, uint64_t deadline)
+{
+	static vector<struct pollfd> pollfds;
+	static vector<int> pollFlows;
+	do
+	{
+		pollfds.clear();
+		pollFlows.clear();
+		for (size_t i = 0; i < flows.size(); i++)
+		{
+			if (flows[i].socket >= 0)
+			{
+				struct pollfd p;
+				p.fd = flows[i].socket;
+				p.events = POLLIN;
+				p.revents = 0;
+				pollfds.push_back(p);
+				pollFlows.push_back(i);
+			}
+		}
+		uint64_t now = MonotonicNanoseconds();
+		int timeout = (deadline > now) ? (int)((deadline - now) / NANOS_PER_MSEC) : 0;
+		if (pollfds.empty())
+		{
+			if (timeout > 0)
+			{
+				usleep(timeout * 1000);
+			}
+			return;
+		}
+		int rc = poll(&pollfds[0], pollfds.size(), timeout);
+		if (rc <= 0)
+		{
+			return;
+		}
+		for (size_t i = 0; i < pollfds.size(); i++)
+		{
+			if (pollfds[i].revents != 0)
+			{
+				ReadReplies(flows[pollFlows[i]], requests, results);
+			}
+		}
+	} while (MonotonicNanoseconds() < deadline);
+}
+
+static bool AllRepliesIn(vector<Flow> &flows)
+{
+	for (size_t i = 0; i < flows.size(); i++)
+	{
+		if ((flows[i].socket >= 0) && (flows[i].nextExpected < flows[i].expected.size()))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option longOptions[] = {
+		{ "help",		no_argument,		0,	0 },
+		{ "server",		required_argument,	0,	1 },
+		{ "port",		required_argument,	0,	2 },
+		{ "speed",		required_argument,	0,	3 },
+		{ "asap",		no_argument,		0,	4 },
+		{ "timeout",	required_argument,	0,	5 },
+		{ 0,			0,					0,	0 }
+	};
+	int optionIndex = 0;
+	while (1)
+	{
+		int option = getopt_long(argc, argv, "", longOptions, &optionIndex);
+		if (option == -1)
+		{
+			break;
+		}
+		switch (option)
+		{
+			case 1:
+				serverHost = optarg;
+				break;
+
+			case 2:
+				serverPort = atoi(optarg);
+				break;
+
+			case 3:
+				speed = atof(optarg);
+				if (speed <= 0.0)
+				{
+					cerr << "Speed must be greater than zero" << endl;
+					exit(-1);
+				}
+				break;
+
+			case 4:
+				asap = true;
+				break;
+
+			case 5:
+				drainTimeoutMs = atoi(optarg);
+				break;
+
+			case 0:
+			default:
+				Usage();
+				exit(option == 0 ? 0 : -1);
+		}
+	}
+	if (optind >= argc)
+	{
+		Usage();
+		exit(-1);
+	}
+
+	size_t length = 0;
+	char *data = LoadFile(argv[optind], length);
+	if (data == NULL)
+	{
+		cerr << "Unable to read " << argv[optind] << endl;
+		exit(-1);
+	}
+	vector<Request> requests;
+	vector<Flow> flows;
+	int capturedPort = 0;
+	if (!ParseCapture(data, length, requests, flows, capturedPort))
+	{
+		exit(-1);
+	}
+	if (requests.empty())
+	{
+		cout << "Capture holds no requests." << endl;
+		return 0;
+	}
+
+	struct addrinfo hints, *resolved;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	if (getaddrinfo(serverHost, NULL, &hints, &resolved) != 0)
+	{
+		cerr << "Unable to resolve " << serverHost << endl;
+		exit(-1);
+	}
+	struct sockaddr_in server;
+	memcpy(&server, resolved->ai_addr, sizeof(server));
+	freeaddrinfo(resolved);
+	server.sin_port = 0;	// each flow's own, in OpenFlow()
+
+	map<uint16_t, int> ports;
+	for (size_t i = 0; i < flows.size(); i++)
+	{
+		ports[flows[i].serverPort]++;
+	}
+	cout << "Replaying " << requests.size() << " requests from " << flows.size() << " clients to " << serverHost;
+	if (serverPort || (ports.size() == 1))
+	{
+		cout << ":" << (serverPort ? serverPort : ports.begin()->first);
+	}
+	else
+	{
+		cout << " on " << ports.size() << " ports";
+	}
+	if (asap)
+	{
+		cout << " as fast as possible" << endl;
+	}
+	else
+	{
+		cout << " at " << speed << "x captured speed" << endl;
+	}
+
+	Results results;
+	memset(&results, 0, sizeof(results));
+
+	uint64_t firstCaptured = requests[0].capturedAt;
+	uint64_t start = MonotonicNanoseconds();
+	for (size_t i = 0; i < requests.size(); i++)
+	{
+		Request &request = requests[i];
+		if (!asap)
+		{
+			uint64_t due = start + (uint64_t)((double)(request.capturedAt - firstCaptured) / speed);
+			if (MonotonicNanoseconds() < due)
+			{
+				PollReplies(flows, requests, results, due);
+				while (MonotonicNanoseconds() < due)
+				{
+					;	// the last sub-millisecond is spent spinning - poll() can't wait that precisely
+				}
+			}
+		}
+
+		Flow &flow = flows[request.flow];
+		if ((flow.socket < 0) && !OpenFlow(flow, server))
+		{
+			results.sendErrors++;
+			continue;
+		}
+		if (send(flow.socket, request.request, request.requestLength, 0) != (ssize_t)request.requestLength)
+		{
+			results.sendErrors++;
+			continue;
+		}
+		results.sent++;
+		if (request.replyLength > 0)
+		{
+			flow.expected.push_back(i);
+		}
+
+		if (asap && ((i % 64) == 0))
+		{
+			PollReplies(flows, requests, results, 0);	// keep socket buffers from overflowing
+		}
+	}
+	uint64_t sendDone = MonotonicNanoseconds();
+
+	// give the stragglers a chance
+
+	uint64_t drainDeadline = sendDone + ((uint64_t)drainTimeoutMs * NANOS_PER_MSEC);
+	while (!AllRepliesIn(flows) && (MonotonicNanoseconds() < drainDeadline))
+	{
+		PollReplies(flows, requests, results, MonotonicNanoseconds() + (10 * NANOS_PER_MSEC));
+	}
+
+	uint64_t missing = 0;
+	for (size_t i = 0; i < flows.size(); i++)
+	{
+		missing += flows[i].expected.size() - flows[i].nextExpected;
+		if (flows[i].socket >= 0)
+		{
+			close(flows[i].socket);
+		}
+	}
+
+	double sendSeconds = (double)(sendDone - start) / (double)NANOS_PER_SEC;
+	double capturedSeconds = (double)(requests.back().capturedAt - firstCaptured) / (double)NANOS_PER_SEC;
+	cout << "Sent " << results.sent << " requests in " << sendSeconds << "s (captured over " << capturedSeconds << "s): "
+		<< ((sendSeconds > 0.0) ? (double)results.sent / sendSeconds : 0.0) << " requests/sec\n"
+		<< "Replies: " << results.matched << " matched, " << results.mismatched << " mismatched, "
+		<< missing << " missing, " << results.unexpected << " unexpected\n"
+		<< "Send errors: " << results.sendErrors << endl;
+
+	free(data);
+	return ((results.mismatched == 0) && (missing == 0) && (results.sendErrors == 0)) ? 0 : 1;
+}
+
+// end of xm2m-replay.cpp